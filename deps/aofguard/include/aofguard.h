@@ -3,8 +3,19 @@
 
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 
+/* Bytes written to the file between two fsyncs of the writer thread. */
+#define AOFGUARD_DEFAULT_BLOCK_SIZE (1 << 20)
+
+/* Appends are durable once copied to the NVM ring. They may come from several
+ * threads: each one reserves its range of the ring under 'writer.lock', copies
+ * its data without holding it and publishes it in reservation order. The
+ * writer thread then writes the published data to the file and fsyncs it
+ * every 'writer.block_size' bytes, which frees the ring space.
+ *
+ * writer.reserved, published, written and synced are offsets in the file:
+ * synced <= written <= published <= reserved, and the ring holds the bytes
+ * from file.fsync_len (at buffer.start) to reserved. */
 struct aofguard
 {
     struct
@@ -29,17 +40,30 @@ struct aofguard
     meta;
     struct
     {
-        size_t block_count;
         pthread_t thread;
-        sem_t sem_start, sem_done;
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;
+        pthread_cond_t progress;
+        size_t block_size;
+        size_t reserved;
+        size_t published;
+        size_t written;
+        size_t synced;
+        int flush;
+        int stop;
+        int error;
     }
-    afsync;
+    writer;
 };
 
-int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char* nvm_file, size_t nvm_size, int reset);
+int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char* nvm_file, size_t nvm_size, size_t block_size, int reset);
 
 int aofguard_write(struct aofguard* aofguard, const void* data, size_t len);
 
+int aofguard_flush(struct aofguard* aofguard);
+
+int aofguard_set_block_size(struct aofguard* aofguard, size_t block_size);
+
 int aofguard_deinit(struct aofguard* aofguard);
 
 #endif
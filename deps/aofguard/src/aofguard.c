@@ -8,17 +8,18 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
-#define BLOCK_SIZE      (1 << 20)
+/* The ring start is kept in the meta in units of START_UNIT bytes. */
+#define START_UNIT      (1 << 20)
 
 #define FSYNC(fd)       syscall_fdatasync(fd)
 
 #define MAKE_MIXED_META(fsync_len, buf_start)                           \
     (((fsync_len) & (size_t)0xffffffffffff) |                           \
-    ((((buf_start) / BLOCK_SIZE) << 48) & (size_t)0xffff000000000000))  \
+    ((((buf_start) / START_UNIT) << 48) & (size_t)0xffff000000000000))  \
 
 #define GET_FSYNC_LEN(mixed_meta)   ((mixed_meta) & (size_t)0xffffffffffff)
 
-#define GET_BUF_START(mixed_meta)   ((((mixed_meta) >> 48) & 0xffff) * BLOCK_SIZE)
+#define GET_BUF_START(mixed_meta)   ((((mixed_meta) >> 48) & 0xffff) * START_UNIT)
 
 static void nvm_set_64(void* ptr, long long val)
 {
@@ -26,6 +27,18 @@ static void nvm_set_64(void* ptr, long long val)
     __builtin_ia32_movnti64(ptr, val);
 }
 
+/* Stores the bytes that only partly cover an aligned word one by one and
+ * flushes their line: another producer may be copying to the rest of the
+ * word at the same time, so it cannot be read, merged and stored back. */
+static void nvm_memcpy_unaligned(void* dst, const void* src, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+        ((volatile char*)dst)[i] = ((const char*)src)[i];
+    __builtin_ia32_clflush(dst);
+    if((((size_t)dst + len - 1) & ~(size_t)63) != ((size_t)dst & ~(size_t)63))
+        __builtin_ia32_clflush(dst + len - 1);
+}
+
 static void nvm_memcpy(void* dst, const void* src, size_t len)
 {
     if(!len)
@@ -34,26 +47,18 @@ static void nvm_memcpy(void* dst, const void* src, size_t len)
     assert(align <= dst);
     if(align < dst)
     {
-        long long head = *((long long*)align);
         size_t front_sz = dst - align;
         assert(front_sz < 8);
         size_t back_sz = 8 - front_sz;
         if(len <= back_sz)
         {
-            for(size_t i = 0; i < len; i++)
-                ((char*)&head)[front_sz + i] = ((char*)src)[i];
-            __builtin_ia32_movnti64(align, head);
+            nvm_memcpy_unaligned(dst, src, len);
             return;
         }
-        else
-        {
-            for(size_t i = 0; i < back_sz; i++)
-                ((char*)&head)[front_sz + i] = ((char*)src)[i];
-            __builtin_ia32_movnti64(align, head);
-            dst += back_sz;
-            src += back_sz;
-            len -= back_sz;
-        }
+        nvm_memcpy_unaligned(dst, src, back_sz);
+        dst += back_sz;
+        src += back_sz;
+        len -= back_sz;
     }
     assert(len);
     assert(((size_t)dst & 7) == 0);
@@ -65,40 +70,128 @@ static void nvm_memcpy(void* dst, const void* src, size_t len)
         len -= 8;
     }
     if(len)
-    {
-        long long tail = *((long long*)dst);
-        for(size_t i = 0; i < len; i++)
-            ((char*)&tail)[i] = ((char*)src)[i];
-        __builtin_ia32_movnti64(dst, tail);
-    }
+        nvm_memcpy_unaligned(dst, src, len);
 }
 
-static void* afsync_thread(void* arg)
+#define RING_BUF_FORWARD(val, addition, capacity)       \
+({                                                      \
+    (val) += (addition);                                \
+    if((val) >= (capacity))                             \
+        (val) -= (capacity);                            \
+    assert((val) < (capacity));                         \
+})
+
+#define RING_BUF_END(start, len, capacity)              \
+({                                                      \
+    typeof(start) _end = (start);                       \
+    RING_BUF_FORWARD(_end, len, capacity);              \
+    _end;                                               \
+})
+
+/* Position in the ring of the byte at file offset 'offset'. */
+#define RING_POS(aofguard, offset)                                              \
+    RING_BUF_END((aofguard)->buffer.start, (offset) - (aofguard)->file.fsync_len, \
+        (aofguard)->buffer.capacity)
+
+#define LOCK(aofguard)      pthread_mutex_lock(&((aofguard)->writer.lock))
+#define UNLOCK(aofguard)    pthread_mutex_unlock(&((aofguard)->writer.lock))
+
+/* Gives back to the ring the whole units already synced to the file. Called
+ * with the lock held, returns the number of bytes freed. */
+static size_t update_after_fsync(struct aofguard* aofguard)
+{
+    size_t fsync_size = (aofguard->writer.synced - aofguard->file.fsync_len) / START_UNIT * START_UNIT;
+    if(fsync_size == 0)
+        return 0;
+    RING_BUF_FORWARD(aofguard->buffer.start, fsync_size, aofguard->buffer.capacity);
+    assert(aofguard->buffer.start % START_UNIT == 0);
+    assert(fsync_size <= aofguard->buffer.len);
+    aofguard->buffer.len -= fsync_size;
+    aofguard->file.fsync_len += fsync_size;
+    size_t mixed_meta = MAKE_MIXED_META(aofguard->file.fsync_len, aofguard->buffer.start);
+    nvm_set_64(aofguard->meta.fsync_len_and_start_block, mixed_meta);
+    __builtin_ia32_sfence();
+    return fsync_size;
+}
+
+static int write_ring(struct aofguard* aofguard, size_t pos, size_t len)
+{
+    int fd = aofguard->file.fd;
+    size_t front_sz = len;
+    if(pos + len > aofguard->buffer.capacity)
+        front_sz = aofguard->buffer.capacity - pos;
+    if(syscall_write(fd, aofguard->buffer.data + pos, front_sz) != front_sz)
+        ERROR(0, 1, "write(%d, aofguard->buffer.data + %lu, %lu) failed: ", fd, pos, front_sz);
+    size_t back_sz = len - front_sz;
+    if(back_sz && syscall_write(fd, aofguard->buffer.data, back_sz) != back_sz)
+        ERROR(0, 1, "write(%d, aofguard->buffer.data, %lu) failed: ", fd, back_sz);
+    return 1;
+}
+
+/* Writes the published data to the file as soon as there is some, so that
+ * the producers never wait for write(2), and fsyncs it every block_size
+ * bytes or when a producer asks for a flush. */
+static void* writer_thread(void* arg)
 {
     struct aofguard* aofguard = arg;
-    while(1)
+    LOCK(aofguard);
+    while(!aofguard->writer.stop)
     {
-        if(sem_wait(&(aofguard->afsync.sem_start)) != 0)
-            ERROR((void*)0, 1, "sem_wait(&(aofguard->afsync.sem_start)) failed: ");
-        if(FSYNC(aofguard->file.fd) != 0)
-            ERROR((void*)0, 1, "FSYNC(%d) failed: ", aofguard->file.fd);
-        if(sem_post(&(aofguard->afsync.sem_done)) != 0)
-            ERROR((void*)0, 1, "sem_post(&(aofguard->afsync.sem_done)) failed: ");
+        if(aofguard->writer.written < aofguard->writer.published)
+        {
+            size_t from = aofguard->writer.written, to = aofguard->writer.published;
+            size_t pos = RING_POS(aofguard, from);
+            UNLOCK(aofguard);
+            int ok = write_ring(aofguard, pos, to - from);
+            LOCK(aofguard);
+            if(!ok)
+                break;
+            aofguard->writer.written = to;
+        }
+        else if(aofguard->writer.synced < aofguard->writer.written &&
+            (aofguard->writer.flush || aofguard->writer.written - aofguard->writer.synced >= aofguard->writer.block_size))
+        {
+            size_t to = aofguard->writer.written;
+            UNLOCK(aofguard);
+            int ok = FSYNC(aofguard->file.fd) == 0;
+            LOCK(aofguard);
+            if(!ok)
+            {
+                fprintf(stderr, "[<%s> @ %s: %d]: ", __FUNCTION__, __FILE__, __LINE__);
+                perror("FSYNC failed");
+                break;
+            }
+            aofguard->writer.synced = to;
+            if(aofguard->writer.synced == aofguard->writer.published)
+                aofguard->writer.flush = 0;
+            pthread_cond_broadcast(&(aofguard->writer.progress));
+        }
+        else
+            pthread_cond_wait(&(aofguard->writer.wakeup), &(aofguard->writer.lock));
+    }
+    if(!aofguard->writer.stop)
+    {
+        aofguard->writer.error = 1;
+        pthread_cond_broadcast(&(aofguard->writer.progress));
     }
+    UNLOCK(aofguard);
+    return 0;
 }
 
-int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char* nvm_file, size_t nvm_size, int reset)
+int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char* nvm_file, size_t nvm_size, size_t block_size, int reset)
 {
     assert(aofguard);
     assert(nvm_file);
     if(fd < 0)
         ERROR(0, 0, "param <fd = %d> is invaild!", fd);
-    size_t block_count = nvm_size / BLOCK_SIZE;
+    if(block_size == 0)
+        ERROR(0, 0, "param <block_size = %lu> is invaild!", block_size);
+    size_t block_count = nvm_size / START_UNIT;
     if(block_count < 2)
         ERROR(0, 0, "param <nvm_size = %lu> is too small!", nvm_size);
     if(block_count > 65536)
         ERROR(0, 0, "param <nvm_size = %lu> is too big!", nvm_size);
-    size_t nvm_file_size = 2 * sizeof(size_t) + block_count * BLOCK_SIZE;
+    size_t nvm_file_size = 2 * sizeof(size_t) + block_count * START_UNIT;
     int nvm_file_exist = syscall_faccessat(nvm_dir_fd, nvm_file, F_OK, 0) == 0;
     int nvm_fd;
     if(nvm_file_exist)
@@ -127,7 +220,7 @@ int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char*
         ERROR(0, 1, "fstat(%d, &stat) failed: ", fd);
     aofguard->file.fd = fd;
     aofguard->buffer.data = (char*)nvm_buf + 2 * sizeof(size_t);
-    aofguard->buffer.capacity = block_count * BLOCK_SIZE;
+    aofguard->buffer.capacity = block_count * START_UNIT;
     aofguard->meta.fsync_len_and_start_block = (size_t*)nvm_buf;
     aofguard->meta.buf_end = (size_t*)nvm_buf + 1;
     if(nvm_file_exist && !reset)
@@ -172,102 +265,57 @@ int aofguard_init(struct aofguard* aofguard, int fd, int nvm_dir_fd, const char*
         nvm_set_64(aofguard->meta.fsync_len_and_start_block, aofguard->file.fsync_len);
         nvm_set_64(aofguard->meta.buf_end, 0);
     }
-    aofguard->afsync.block_count = 0;
-    if(sem_init(&(aofguard->afsync.sem_start), 0, 0) != 0)
-        ERROR(0, 1, "sem_init(&(aofguard->afsync.sem_start), 0, 0) failed: ");
-    if(sem_init(&(aofguard->afsync.sem_done), 0, 0) != 0)
-        ERROR(0, 1, "sem_init(&(aofguard->afsync.sem_done), 0, 0) failed: ");
-    if(pthread_create(&(aofguard->afsync.thread), 0, afsync_thread, aofguard) != 0)
-        ERROR(0, 1, "pthread_create(&(aofguard->afsync.thread), 0, afsync_thread, aofguard) failed!");
+    __builtin_ia32_sfence();
+    aofguard->writer.block_size = block_size;
+    aofguard->writer.synced = aofguard->file.fsync_len;
+    aofguard->writer.written = aofguard->writer.published = aofguard->writer.reserved =
+        aofguard->file.fsync_len + aofguard->buffer.len;
+    aofguard->writer.flush = 0;
+    aofguard->writer.stop = 0;
+    aofguard->writer.error = 0;
+    if(pthread_mutex_init(&(aofguard->writer.lock), 0) != 0)
+        ERROR(0, 1, "pthread_mutex_init(&(aofguard->writer.lock), 0) failed: ");
+    if(pthread_cond_init(&(aofguard->writer.wakeup), 0) != 0)
+        ERROR(0, 1, "pthread_cond_init(&(aofguard->writer.wakeup), 0) failed: ");
+    if(pthread_cond_init(&(aofguard->writer.progress), 0) != 0)
+        ERROR(0, 1, "pthread_cond_init(&(aofguard->writer.progress), 0) failed: ");
+    if(pthread_create(&(aofguard->writer.thread), 0, writer_thread, aofguard) != 0)
+        ERROR(0, 1, "pthread_create(&(aofguard->writer.thread), 0, writer_thread, aofguard) failed!");
     return 1;
 }
 
-#define RING_BUF_FORWARD(val, addition, capacity)       \
-({                                                      \
-    (val) += (addition);                                \
-    if((val) >= (capacity))                             \
-        (val) -= (capacity);                            \
-    assert((val) < (capacity));                         \
-})
-
-#define RING_BUF_END(start, len, capacity)              \
-({                                                      \
-    typeof(start) _end = (start);                       \
-    RING_BUF_FORWARD(_end, len, capacity);              \
-    _end;                                               \
-})
-
-static void update_after_fsync(struct aofguard* aofguard, size_t block_count)
-{
-    if(block_count == 0)
-        return;
-    size_t fsync_size = block_count * BLOCK_SIZE;
-    RING_BUF_FORWARD(aofguard->buffer.start, fsync_size, aofguard->buffer.capacity);
-    assert(aofguard->buffer.start % BLOCK_SIZE == 0);
-    assert(fsync_size <= aofguard->buffer.len);
-    aofguard->buffer.len -= fsync_size;
-    aofguard->file.fsync_len += fsync_size;
-    size_t mixed_meta = MAKE_MIXED_META(aofguard->file.fsync_len, aofguard->buffer.start);
-    nvm_set_64(aofguard->meta.fsync_len_and_start_block, mixed_meta);
-}
-
-static int handle_afsync_if_finish(struct aofguard* aofguard)
+/* Appends 'data' to the file, durable once this returns. Safe to call from
+ * several threads: appends are ordered as they reserve their ring space. */
+int aofguard_write(struct aofguard* aofguard, const void* data, size_t len)
 {
-    if(aofguard->afsync.block_count == 0)
+    assert(aofguard);
+    assert(data);
+    if(len == 0)
         return 1;
-    int ret = sem_trywait(&(aofguard->afsync.sem_done));
-    if(ret == 0)
+    /* A full ring would look empty to the recovery, and the ring start only
+     * moves by whole units. */
+    if(len > aofguard->buffer.capacity - START_UNIT)
+        ERROR(0, 0, "param <len = %lu> is too big to write atomicly!", len);
+    LOCK(aofguard);
+    while(!aofguard->writer.error &&
+        aofguard->writer.reserved + len - aofguard->file.fsync_len >= aofguard->buffer.capacity)
     {
-        update_after_fsync(aofguard, aofguard->afsync.block_count);
-        aofguard->afsync.block_count = 0;
-        return 1;
+        if(update_after_fsync(aofguard))
+            continue;
+        aofguard->writer.flush = 1;
+        pthread_cond_signal(&(aofguard->writer.wakeup));
+        pthread_cond_wait(&(aofguard->writer.progress), &(aofguard->writer.lock));
     }
-    else
+    if(aofguard->writer.error)
     {
-        if(errno == EAGAIN)
-            return 1;
-        ERROR(0, 1, "sem_trywait(&(aofguard->afsync.sem_done)) failed: ");
+        UNLOCK(aofguard);
+        ERROR(0, 0, "the writer thread of fd = %d failed!", aofguard->file.fd);
     }
-}
+    size_t offset = aofguard->writer.reserved;
+    size_t write_pos = RING_POS(aofguard, offset);
+    aofguard->writer.reserved += len;
+    UNLOCK(aofguard);
 
-static int do_fsync(struct aofguard* aofguard)
-{
-    if(FSYNC(aofguard->file.fd) != 0)
-        ERROR(0, 1, "FSYNC(%d) failed: ", aofguard->file.fd);
-    update_after_fsync(aofguard, aofguard->buffer.len / BLOCK_SIZE);
-    return 1;
-}
-
-static int wait_afsync_done(struct aofguard* aofguard)
-{
-    if(aofguard->afsync.block_count == 0)
-        return 1;
-    if(sem_wait(&((aofguard)->afsync.sem_done)) != 0)
-        ERROR(0, 1, "sem_wait(&((aofguard)->afsync.sem_done)) failed: ");
-    update_after_fsync(aofguard, aofguard->afsync.block_count);
-    aofguard->afsync.block_count = 0;
-    return 1;
-}
-
-int aofguard_write(struct aofguard* aofguard, const void* data, size_t len)
-{
-    assert(aofguard);
-    assert(data);
-    if(!handle_afsync_if_finish(aofguard))
-        ERROR(0, 0, "handle_afsync_if_finish(aofguard) failed!");
-    if(aofguard->buffer.len + len > aofguard->buffer.capacity)
-    {
-        if((aofguard->buffer.len % BLOCK_SIZE) + len > aofguard->buffer.capacity)
-            ERROR(0, 1, "param <len = %lu> is too big to write atomicly!", len);
-        if(!wait_afsync_done(aofguard))
-            ERROR(0, 0, "wait_afsyc_done(aofguard) failed!");
-        if(aofguard->buffer.len + len > aofguard->buffer.capacity && !do_fsync(aofguard))
-            ERROR(0, 0, "do_fsync(aofguard) failed!");
-    }
-    assert(aofguard->buffer.len + len <= aofguard->buffer.capacity);
-    if(syscall_write(aofguard->file.fd, data, len) != len)
-        ERROR(0, 1, "write(%d, data, %lu) failed: ", aofguard->file.fd, len);
-    size_t write_pos = RING_BUF_END(aofguard->buffer.start, aofguard->buffer.len, aofguard->buffer.capacity);
     if(write_pos + len <= aofguard->buffer.capacity)
         nvm_memcpy(aofguard->buffer.data + write_pos, data, len);
     else
@@ -277,28 +325,74 @@ int aofguard_write(struct aofguard* aofguard, const void* data, size_t len)
         size_t back_sz = len - front_sz;
         nvm_memcpy(aofguard->buffer.data, data + front_sz, back_sz);
     }
-    aofguard->buffer.len += len;
-    assert(aofguard->buffer.len <= aofguard->buffer.capacity);
-    size_t buf_end = RING_BUF_END(aofguard->buffer.start, aofguard->buffer.len, aofguard->buffer.capacity);
-    nvm_set_64(aofguard->meta.buf_end, buf_end);
-    if(aofguard->buffer.len >= BLOCK_SIZE && aofguard->afsync.block_count == 0)
+    __builtin_ia32_sfence();
+
+    /* Publish in reservation order: buf_end must never cover a range that
+     * an earlier producer is still copying. */
+    LOCK(aofguard);
+    while(aofguard->writer.published != offset)
+        pthread_cond_wait(&(aofguard->writer.progress), &(aofguard->writer.lock));
+    aofguard->writer.published = offset + len;
+    aofguard->buffer.len = aofguard->writer.published - aofguard->file.fsync_len;
+    assert(aofguard->buffer.len < aofguard->buffer.capacity);
+    nvm_set_64(aofguard->meta.buf_end, RING_POS(aofguard, aofguard->writer.published));
+    __builtin_ia32_sfence();
+    update_after_fsync(aofguard);
+    pthread_cond_signal(&(aofguard->writer.wakeup));
+    pthread_cond_broadcast(&(aofguard->writer.progress));
+    UNLOCK(aofguard);
+    return 1;
+}
+
+/* Waits until everything appended so far is written and synced to the file. */
+int aofguard_flush(struct aofguard* aofguard)
+{
+    assert(aofguard);
+    LOCK(aofguard);
+    size_t target = aofguard->writer.published;
+    while(!aofguard->writer.error && aofguard->writer.synced < target)
     {
-        aofguard->afsync.block_count = aofguard->buffer.len / BLOCK_SIZE;
-        if(sem_post(&(aofguard->afsync.sem_start)) != 0)
-            ERROR(0, 1, "sem_post(&(aofguard->afsync.sem_start)) failed: ");
+        aofguard->writer.flush = 1;
+        pthread_cond_signal(&(aofguard->writer.wakeup));
+        pthread_cond_wait(&(aofguard->writer.progress), &(aofguard->writer.lock));
     }
+    int error = aofguard->writer.error;
+    if(!error)
+        update_after_fsync(aofguard);
+    UNLOCK(aofguard);
+    if(error)
+        ERROR(0, 0, "the writer thread of fd = %d failed!", aofguard->file.fd);
+    return 1;
+}
+
+/* Changes the bytes written to the file between two fsyncs. A smaller size
+ * may ask for an fsync right away, so the writer thread is woken up. */
+int aofguard_set_block_size(struct aofguard* aofguard, size_t block_size)
+{
+    assert(aofguard);
+    if(block_size == 0)
+        ERROR(0, 0, "param <block_size = %lu> is invaild!", block_size);
+    LOCK(aofguard);
+    aofguard->writer.block_size = block_size;
+    pthread_cond_signal(&(aofguard->writer.wakeup));
+    UNLOCK(aofguard);
     return 1;
 }
 
+/* Stops the writer thread without waiting for the pending data: it is still
+ * in the ring, and is written back by the next aofguard_init() without reset. */
 int aofguard_deinit(struct aofguard* aofguard)
 {
     assert(aofguard);
-    if(pthread_cancel(aofguard->afsync.thread) != 0)
-        ERROR(0, 1, "pthread_cancel(%lu) failed: ", aofguard->afsync.thread);
-    void* ret_val;
-    if(pthread_join(aofguard->afsync.thread, &ret_val) != 0)
-        ERROR(0, 1, "pthread_join(%lu, &ret_val) failed: ", aofguard->afsync.thread);
-    assert(ret_val == PTHREAD_CANCELED);
+    LOCK(aofguard);
+    aofguard->writer.stop = 1;
+    pthread_cond_signal(&(aofguard->writer.wakeup));
+    UNLOCK(aofguard);
+    if(pthread_join(aofguard->writer.thread, 0) != 0)
+        ERROR(0, 1, "pthread_join(%lu, 0) failed: ", aofguard->writer.thread);
+    pthread_cond_destroy(&(aofguard->writer.progress));
+    pthread_cond_destroy(&(aofguard->writer.wakeup));
+    pthread_mutex_destroy(&(aofguard->writer.lock));
     void* map_addr = aofguard->meta.fsync_len_and_start_block;
     size_t map_size = aofguard->buffer.capacity + 2 * sizeof(size_t);
     if(munmap(map_addr, map_size) != 0)
@@ -24,6 +24,7 @@ static int debug;
 static int disable_sync;
 static int nvm_dir_fd;
 static size_t nvm_size;
+static size_t block_size;
 static regex_t fname_regex;
 static struct filedes* fd_table;
 static size_t fd_table_capacity;
@@ -48,6 +49,15 @@ static int init()
             ERROR(0, 0, "wrong AOFGUARD_NVM_SIZE_MB = '%s'!", nvm_size_mb);
         nvm_size <<= 20;
     }
+    const char* block_size_kb = getenv("AOFGUARD_BLOCK_SIZE_KB");
+    if(!block_size_kb)
+        block_size = AOFGUARD_DEFAULT_BLOCK_SIZE;
+    else
+    {
+        if(sscanf(block_size_kb, "%lu", &block_size) != 1 || block_size == 0)
+            ERROR(0, 0, "wrong AOFGUARD_BLOCK_SIZE_KB = '%s'!", block_size_kb);
+        block_size <<= 10;
+    }
     const char *pattern = getenv("AOFGUARD_FILENAME_PATTERN");
     if(!pattern)
         pattern = ".*";
@@ -93,8 +103,8 @@ static int handle_open(const char* file, int fd)
             ERROR(0, 1, "malloc(sizeof(struct aofguard)) failed: ");
         char nvm_file[PATH_MAX];
         get_nvm_file_name(nvm_file, file);
-        if(!aofguard_init(aofguard, fd, nvm_dir_fd, nvm_file, nvm_size, 0))
-            ERROR(0, 0, "aofguard_init(aofguard, %d, %d, '%s', %lu, 0) failed!", fd, nvm_dir_fd, nvm_file, nvm_size);
+        if(!aofguard_init(aofguard, fd, nvm_dir_fd, nvm_file, nvm_size, block_size, 0))
+            ERROR(0, 0, "aofguard_init(aofguard, %d, %d, '%s', %lu, %lu, 0) failed!", fd, nvm_dir_fd, nvm_file, nvm_size, block_size);
     }
     if(fd >= fd_table_capacity)
     {
@@ -194,13 +204,16 @@ int fsync(int fd)
 {
     if(debug)
         DEBUG("fsync(%d)", fd);
-    if(disable_sync)
+    if(0 <= fd && fd < fd_table_capacity)
     {
-        if(0 <= fd && fd < fd_table_capacity)
+        struct aofguard* aofguard = fd_table[fd].aofguard;
+        if(aofguard)
         {
-            struct aofguard* aofguard = fd_table[fd].aofguard;
-            if(aofguard)
+            /* The data still in the ring may not be in the file yet. */
+            if(disable_sync || aofguard_flush(aofguard))
                 return 0;
+            else
+                ERROR(-1, 0, "aofguard_flush(aofguard) failed!");
         }
     }
     return syscall_fsync(fd);
@@ -210,13 +223,16 @@ int fdatasync(int fd)
 {
     if(debug)
         DEBUG("fdatasync(%d)", fd);
-    if(disable_sync)
+    if(0 <= fd && fd < fd_table_capacity)
     {
-        if(0 <= fd && fd < fd_table_capacity)
+        struct aofguard* aofguard = fd_table[fd].aofguard;
+        if(aofguard)
         {
-            struct aofguard* aofguard = fd_table[fd].aofguard;
-            if(aofguard)
+            /* The data still in the ring may not be in the file yet. */
+            if(disable_sync || aofguard_flush(aofguard))
                 return 0;
+            else
+                ERROR(-1, 0, "aofguard_flush(aofguard) failed!");
         }
     }
     return syscall_fdatasync(fd);
@@ -236,6 +252,8 @@ int close(int fd)
         }
         if(filedes->aofguard)
         {
+            if(!aofguard_flush(filedes->aofguard))
+                ERROR(-1, 0, "aofguard_flush(filedes->aofguard) failed!");
             if(!aofguard_deinit(filedes->aofguard))
                 ERROR(-1, 0, "aofguard_deinit(filedes->aofguard) failed!");
             free(filedes->aofguard);
@@ -305,8 +323,8 @@ int rename(const char* oldpath, const char* newpath)
                         assert(!filedes->aofguard);
                         if(!(filedes->aofguard = malloc(sizeof(struct aofguard))))
                             ERROR(0, 1, "malloc(sizeof(struct aofguard)) failed: ");
-                        if(!aofguard_init(filedes->aofguard, i, nvm_dir_fd, nvm_file_new, nvm_size, 1))
-                            ERROR(0, 0, "aofguard_init(fildes->aofguard, %lu, %d, '%s', %lu, 1) failed!", i, nvm_dir_fd, nvm_file_new, nvm_size);
+                        if(!aofguard_init(filedes->aofguard, i, nvm_dir_fd, nvm_file_new, nvm_size, block_size, 1))
+                            ERROR(0, 0, "aofguard_init(fildes->aofguard, %lu, %d, '%s', %lu, %lu, 1) failed!", i, nvm_dir_fd, nvm_file_new, nvm_size, block_size);
                     }
                 } 
             }
@@ -0,0 +1,339 @@
+/* Tests of the NVM ring and of its writer thread. The NVM file is a plain
+ * file in the current directory. The syscall layer of the library is
+ * replaced by the one below, that counts the bytes written to the AOF and
+ * synced, and can stall or fail the writes of the writer thread. */
+#include "common.h"
+#include "syscall.h"
+#include "aofguard.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define UNIT            (1 << 20)
+#define RING_SIZE       (2 * UNIT)
+#define AOF_FILE        "aofguard-test.aof"
+#define NVM_FILE        "aofguard-test.nvm"
+
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static int io_stalled;          /* Writes wait until it is cleared. */
+static int io_failing;          /* Writes fail with EIO. */
+static size_t io_written;       /* Bytes written to the AOF. */
+static size_t io_synced;        /* io_written at the last fdatasync(). */
+static int aof_fd = -1;
+static int nvm_dir_fd = -1;
+
+int syscall_faccessat(int dirfd, const char* file, int mode, int flags)
+{
+    return syscall(SYS_faccessat, dirfd, file, mode, flags);
+}
+
+int syscall_openat(int dirfd, const char* file, int flags, ...)
+{
+    return syscall(SYS_openat, dirfd, file, flags, GET_OPEN_MODE(flags));
+}
+
+int syscall_fstat(int fd, struct stat* stat)
+{
+    return syscall(SYS_fstat, fd, stat);
+}
+
+int syscall_ftruncate(int fd, size_t size)
+{
+    int ret = syscall(SYS_ftruncate, fd, size);
+    if(fd == aof_fd && ret == 0)
+    {
+        pthread_mutex_lock(&io_lock);
+        io_written = io_synced = size;
+        pthread_mutex_unlock(&io_lock);
+    }
+    return ret;
+}
+
+void* syscall_mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+int syscall_close(int fd)
+{
+    return syscall(SYS_close, fd);
+}
+
+ssize_t syscall_write(int fd, const void* data, size_t len)
+{
+    pthread_mutex_lock(&io_lock);
+    while(io_stalled)
+        pthread_cond_wait(&io_cond, &io_lock);
+    int failing = io_failing;
+    pthread_mutex_unlock(&io_lock);
+    if(failing)
+    {
+        errno = EIO;
+        return -1;
+    }
+    ssize_t ret = syscall(SYS_write, fd, data, len);
+    if(fd == aof_fd && ret > 0)
+    {
+        pthread_mutex_lock(&io_lock);
+        io_written += ret;
+        pthread_mutex_unlock(&io_lock);
+    }
+    return ret;
+}
+
+int syscall_fdatasync(int fd)
+{
+    int ret = syscall(SYS_fdatasync, fd);
+    if(fd == aof_fd && ret == 0)
+    {
+        pthread_mutex_lock(&io_lock);
+        io_synced = io_written;
+        pthread_mutex_unlock(&io_lock);
+    }
+    return ret;
+}
+
+static void set_stalled(int stalled)
+{
+    pthread_mutex_lock(&io_lock);
+    io_stalled = stalled;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_lock);
+}
+
+static size_t get_synced()
+{
+    pthread_mutex_lock(&io_lock);
+    size_t synced = io_synced;
+    pthread_mutex_unlock(&io_lock);
+    return synced;
+}
+
+/* The byte at 'offset' of the stream appended by append_stream(). */
+static unsigned char stream_byte(size_t offset)
+{
+    return (offset * 31 + (offset >> 12)) % 251;
+}
+
+/* Appends the bytes of the stream from 'offset' to 'offset + len'. */
+static int append_stream(struct aofguard* aofguard, size_t offset, size_t len)
+{
+    unsigned char* buf = malloc(len);
+    for(size_t i = 0; i < len; i++)
+        buf[i] = stream_byte(offset + i);
+    int ok = aofguard_write(aofguard, buf, len);
+    free(buf);
+    return ok;
+}
+
+/* Checks that the AOF holds exactly the first 'len' bytes of the stream. */
+static int check_stream(size_t len)
+{
+    struct stat stat;
+    if(fstat(aof_fd, &stat) != 0 || (size_t)stat.st_size != len)
+        return 0;
+    unsigned char buf[4096];
+    for(size_t offset = 0; offset < len; offset += sizeof(buf))
+    {
+        size_t n = len - offset < sizeof(buf) ? len - offset : sizeof(buf);
+        if(pread(aof_fd, buf, n, offset) != (ssize_t)n)
+            return 0;
+        for(size_t i = 0; i < n; i++)
+            if(buf[i] != stream_byte(offset + i))
+                return 0;
+    }
+    return 1;
+}
+
+/* Opens an empty AOF and an NVM ring of RING_SIZE bytes. */
+static int start(struct aofguard* aofguard, size_t block_size)
+{
+    unlink(AOF_FILE);
+    unlink(NVM_FILE);
+    if((aof_fd = open(AOF_FILE, O_RDWR | O_APPEND | O_CREAT, 0644)) < 0)
+        ERROR(0, 1, "cannot create '%s': ", AOF_FILE);
+    io_written = io_synced = 0;
+    return aofguard_init(aofguard, aof_fd, nvm_dir_fd, NVM_FILE, RING_SIZE, block_size, 0);
+}
+
+static void stop(struct aofguard* aofguard)
+{
+    aofguard_deinit(aofguard);
+    close(aof_fd);
+    aof_fd = -1;
+}
+
+static void test_wraparound()
+{
+    struct aofguard aofguard;
+    size_t total = 0;
+    int ok = start(&aofguard, 64 << 10);
+
+    test("Appends wrap around the ring many times: ");
+    for(size_t j = 0; ok && total < 8 * RING_SIZE; j++)
+    {
+        size_t len = 1 + (j * 7919) % (64 << 10);
+        ok = append_stream(&aofguard, total, len);
+        total += len;
+    }
+    ok = ok && aofguard_flush(&aofguard);
+    test_cond(ok && get_synced() == total && check_stream(total));
+    stop(&aofguard);
+}
+
+struct producer
+{
+    struct aofguard* aofguard;
+    size_t total;
+    int done;
+    int ok;
+};
+
+static void* producer_main(void* arg)
+{
+    struct producer* producer = arg;
+    size_t offset = 0;
+
+    producer->ok = 1;
+    while(producer->ok && offset < producer->total)
+    {
+        producer->ok = append_stream(producer->aofguard, offset, 64 << 10);
+        offset += 64 << 10;
+    }
+    __atomic_store_n(&(producer->done), 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static void test_stall()
+{
+    struct aofguard aofguard;
+    struct producer producer = {&aofguard, 4 * RING_SIZE, 0, 0};
+    pthread_t thread;
+    int ok = start(&aofguard, 64 << 10);
+
+    /* The ring fills up while the file is stalled: the producer waits
+     * instead of overwriting the bytes not written yet. */
+    test("Appends wait for ring space while the file is stalled: ");
+    set_stalled(1);
+    ok = ok && pthread_create(&thread, 0, producer_main, &producer) == 0;
+    usleep(200000);
+    pthread_mutex_lock(&(aofguard.writer.lock));
+    size_t ring_used = aofguard.writer.reserved - aofguard.file.fsync_len;
+    pthread_mutex_unlock(&(aofguard.writer.lock));
+    test_cond(ok && !__atomic_load_n(&producer.done, __ATOMIC_SEQ_CST) &&
+        ring_used < RING_SIZE && get_synced() == 0);
+
+    test("The writer catches up once the file is back: ");
+    set_stalled(0);
+    if(ok)
+        pthread_join(thread, 0);
+    ok = ok && producer.ok && aofguard_flush(&aofguard);
+    test_cond(ok && get_synced() == producer.total && check_stream(producer.total));
+    stop(&aofguard);
+}
+
+static void test_flush()
+{
+    struct aofguard aofguard;
+    size_t total = 0;
+    int ok = start(&aofguard, UNIT / 2);
+
+    /* The block size is larger than what is appended between two flushes,
+     * so every fsync comes from aofguard_flush(). */
+    test("Flush returns once everything appended is synced: ");
+    for(int j = 0; ok && j < 200; j++)
+    {
+        size_t len = 1 + (j * 104729) % 50000;
+        ok = append_stream(&aofguard, total, len) && aofguard_flush(&aofguard);
+        total += len;
+        ok = ok && get_synced() == total;
+    }
+    test_cond(ok && check_stream(total));
+
+    test("A smaller block size makes the writer sync right away: ");
+    ok = ok && aofguard_set_block_size(&aofguard, 1 << 20) &&
+        append_stream(&aofguard, total, 100000);
+    total += 100000;
+    usleep(100000);
+    int not_synced = get_synced() < total;
+    ok = ok && aofguard_set_block_size(&aofguard, 4096);
+    for(int j = 0; ok && j < 100 && get_synced() < total; j++)
+        usleep(10000);
+    test_cond(ok && not_synced && get_synced() == total && check_stream(total));
+    stop(&aofguard);
+}
+
+static void test_recovery()
+{
+    struct aofguard aofguard;
+    size_t total = 0;
+    int ok = start(&aofguard, 64 << 10), running = ok;
+
+    /* The first unit and a half of the ring are synced, then appends that
+     * wrap around the ring never reach the file: they are written back by
+     * the next init. */
+    test("Appends left in the ring are written back on restart: ");
+    while(ok && total < UNIT + UNIT / 2)
+    {
+        ok = append_stream(&aofguard, total, 64 << 10);
+        total += 64 << 10;
+    }
+    ok = ok && aofguard_flush(&aofguard);
+    set_stalled(1);
+    for(int j = 0; ok && j < 10; j++)
+    {
+        ok = append_stream(&aofguard, total, 70000);
+        total += 70000;
+    }
+    io_failing = 1;
+    set_stalled(0);
+    if(running)
+        aofguard_deinit(&aofguard);
+    io_failing = 0;
+    int lost = get_synced() < total;
+    running = aofguard_init(&aofguard, aof_fd, nvm_dir_fd, NVM_FILE, RING_SIZE, 64 << 10, 0);
+    ok = ok && running && aofguard_flush(&aofguard);
+    test_cond(ok && lost && check_stream(total));
+
+    test("Appends after the recovery follow the recovered ones: ");
+    for(int j = 0; ok && j < 20; j++)
+    {
+        ok = append_stream(&aofguard, total, 100000);
+        total += 100000;
+    }
+    ok = ok && aofguard_flush(&aofguard);
+    test_cond(ok && check_stream(total));
+    if(running)
+        stop(&aofguard);
+}
+
+int main()
+{
+    if((nvm_dir_fd = open(".", O_DIRECTORY)) < 0)
+    {
+        perror("open('.', O_DIRECTORY)");
+        return 1;
+    }
+    test_wraparound();
+    test_stall();
+    test_flush();
+    test_recovery();
+    unlink(AOF_FILE);
+    unlink(NVM_FILE);
+    if(fails)
+    {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
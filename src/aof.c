@@ -30,6 +30,7 @@
 #include "server.h"
 #include "bio.h"
 #include "rio.h"
+#include "atomicvar.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -213,6 +214,13 @@ void aof_background_fsync(int fd) {
 void stopAppendOnly(void) {
     serverAssert(server.aof_state != AOF_OFF);
     flushAppendOnlyFile(1);
+#ifdef USE_AOFGUARD
+    if(server.aofguard.enable && !aofguard_flush(server.aofguard.aofguard))
+    {
+        serverLog(LL_WARNING, "aofguard_flush() failed!");
+        exit(1);
+    }
+#endif
     aof_fsync(server.aof_fd);
     close(server.aof_fd);
 
@@ -327,6 +335,14 @@ void flushAppendOnlyFile(int force) {
      * there is much to do about the whole server stopping for power problems
      * or alike */
 
+#ifdef SUPPORT_PBA
+    /* Commit point of the NVM pool: the payloads referenced by the records
+     * in this buffer were flushed when written, drain them before the
+     * records become durable so a restart never resolves a torn value. */
+    if(server.pba.enable && server.nvm_base)
+        pmem_drain();
+#endif
+
     latencyStartMonitor(latency);
 #ifdef USE_AOFGUARD
     if(server.aofguard.enable)
@@ -445,6 +461,13 @@ void flushAppendOnlyFile(int force) {
         server.aof_buf = sdsempty();
     }
 
+#ifdef USE_AOFGUARD
+    /* The data is durable once in the NVM ring, the aofguard writer thread
+     * syncs the file every aof-write-turbo-block-size bytes by itself. */
+    if(server.aofguard.enable)
+        return;
+#endif
+
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
     if (server.aof_no_fsync_on_rewrite &&
@@ -467,6 +490,226 @@ void flushAppendOnlyFile(int force) {
     }
 }
 
+/* ----------------------------------------------------------------------------
+ * Binary records of the pointer based AOF, see AOF_PBA_RECORD in server.h
+ * ------------------------------------------------------------------------- */
+
+/* Command ids of the binary records. Ids are stored in the AOF: only append
+ * new commands to this table. */
+static const char *aofPBACommands[] = {
+    NULL, /* 0: the command name follows. */
+    "set", "setnx", "append", "setrange", "incrby", "decrby", "incrbyfloat",
+    "getset", "mset", "del", "pexpireat", "persist", "rename",
+    "sadd", "srem", "smove",
+    "hset", "hsetnx", "hmset", "hdel", "hincrby", "hincrbyfloat",
+    "lpush", "rpush", "lpushx", "rpushx", "linsert", "lset", "lrem",
+    "ltrim", "lpop", "rpop", "rpoplpush",
+    "zadd", "zincrby", "zrem", "zremrangebyscore", "zremrangebyrank",
+    "zremrangebylex",
+    "multi", "exec", "select", "flushdb", "flushall"
+};
+
+#define AOF_PBA_COMMANDS (sizeof(aofPBACommands)/sizeof(aofPBACommands[0]))
+
+/* Check that every command of the table exists. Called at startup, before
+ * the configuration may rename commands. */
+void aofCheckPBACommands(void) {
+    size_t j;
+
+    for (j = 1; j < AOF_PBA_COMMANDS; j++) {
+        if (lookupCommandByCString((char*)aofPBACommands[j]) == NULL)
+            serverPanic("Unknown command '%s' in the AOF binary records table",
+                aofPBACommands[j]);
+    }
+}
+
+/* Read a varint. Returns 1 on success, 0 on short read, -1 if malformed. */
+static int aofReadVarint(FILE *fp, uint64_t *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    do {
+        if ((c = getc(fp)) == EOF) return 0;
+        if (shift > 63) return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/* Read the body of a binary record, the AOF_PBA_RECORD byte being already
+ * consumed. On success 1 is returned, and '*argv' is set to an array of
+ * '*argc' sds strings, the command name first, that the caller releases.
+ * NVM references are returned as AOF_PBA_REF_LEN bytes strings. Returns 0
+ * on short read and -1 if the record is malformed. */
+int aofReadPBARecord(FILE *fp, int *dbid, int *argc, sds **argv) {
+    uint64_t id, db, count, len;
+    sds *v = NULL;
+    int j = 0, ret, type;
+
+    if ((ret = aofReadVarint(fp,&id)) != 1) return ret;
+    if (id >= AOF_PBA_COMMANDS) return -1;
+    if ((ret = aofReadVarint(fp,&db)) != 1) return ret;
+    if ((ret = aofReadVarint(fp,&count)) != 1) return ret;
+    if (db > INT_MAX || count >= AOF_PBA_MAX_ARGC) return -1;
+
+    v = zmalloc(sizeof(sds)*(count+1));
+    if (id) {
+        v[j++] = sdsnew(aofPBACommands[id]);
+    } else {
+        count++; /* The name is read as an argument. */
+    }
+    while ((uint64_t)j < count+(id != 0)) {
+        if ((type = getc(fp)) == EOF) {
+            ret = 0;
+            goto err;
+        }
+        if (type == AOF_PBA_ARG_BYTES) {
+            if ((ret = aofReadVarint(fp,&len)) != 1) goto err;
+            if (len > AOF_PBA_MAX_ARG_LEN) {
+                ret = -1;
+                goto err;
+            }
+            v[j] = sdsnewlen(SDS_NOINIT,len);
+            if (len && fread(v[j],len,1,fp) == 0) {
+                sdsfree(v[j]);
+                ret = 0;
+                goto err;
+            }
+        } else if (type == AOF_PBA_ARG_NVM && !(j == 0 && !id)) {
+            unsigned char ref[AOF_PBA_REF_LEN] = {'@','\0'};
+
+            if (fread(ref+2,8,1,fp) == 0) {
+                ret = 0;
+                goto err;
+            }
+            if ((ret = aofReadVarint(fp,&len)) != 1) goto err;
+            memrev64ifbe(&len);
+            memcpy(ref+10,&len,8);
+            v[j] = sdsnewlen(ref,sizeof(ref));
+        } else {
+            ret = -1;
+            goto err;
+        }
+        j++;
+    }
+    *dbid = db;
+    *argc = j;
+    *argv = v;
+    return 1;
+
+err:
+    while (j--) sdsfree(v[j]);
+    zfree(v);
+    return ret;
+}
+
+#ifdef SUPPORT_PBA
+static unsigned char *aofWriteVarint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/* Append a command to 'dst' in the text format, escaping the values like
+ * rioWriteBulkStringPBA() does. Text records don't carry their db, so a
+ * SELECT is always emitted first. */
+static sds catAppendOnlyPBAText(sds dst, int argc, robj **argv, unsigned char *is_value) {
+    char seldb[32];
+    int j;
+
+    ll2string(seldb,sizeof(seldb),server.aof_selected_db);
+    dst = sdscatprintf(dst,"*2\r\n$6\r\nSELECT\r\n$%zu\r\n%s\r\n",
+        strlen(seldb),seldb);
+    dst = sdscatprintf(dst,"*%d\r\n",argc);
+    for (j = 0; j < argc; j++) {
+        robj *o = getDecodedObject(argv[j]);
+        sds s = o->ptr;
+        int escape = is_value[j] && (s[0] == '@' || s[0] == '#');
+
+        dst = sdscatprintf(dst,"$%zu\r\n%s",sdslen(s)+escape,escape ? "#" : "");
+        dst = sdscatlen(dst,s,sdslen(s));
+        dst = sdscatlen(dst,"\r\n",2);
+        decrRefCount(o);
+    }
+    return dst;
+}
+
+/* Append the binary record of a command to 'dst'. Like the text format,
+ * values starting with '@' or '#' are escaped with a '#'. */
+static sds catAppendOnlyPBARecord(sds dst, int argc, robj **argv, unsigned char *is_value) {
+    static dict *ids = NULL;
+    unsigned char buf[32], *p = buf;
+    dictEntry *de;
+    robj *o;
+    int j;
+
+    /* aofReadPBARecord() rejects larger records as corrupt. Arguments this
+     * large are only possible with proto-max-bulk-len above 512mb: such
+     * commands are written as text. */
+    if (argc-1 >= AOF_PBA_MAX_ARGC)
+        return catAppendOnlyPBAText(dst,argc,argv,is_value);
+    for (j = 0; j < argc; j++) {
+        if (sdsEncodedObject(argv[j]) &&
+            sdslen(argv[j]->ptr) >= AOF_PBA_MAX_ARG_LEN)
+            return catAppendOnlyPBAText(dst,argc,argv,is_value);
+    }
+
+    if (ids == NULL) {
+        ids = dictCreate(&commandTableDictType,NULL);
+        for (j = 1; j < (int)AOF_PBA_COMMANDS; j++)
+            dictAdd(ids,sdsnew(aofPBACommands[j]),(void*)(long)j);
+    }
+
+    o = getDecodedObject(argv[0]);
+    de = dictFind(ids,o->ptr);
+    *p++ = AOF_PBA_RECORD;
+    p = aofWriteVarint(p,de ? (long)dictGetVal(de) : 0);
+    p = aofWriteVarint(p,server.aof_selected_db);
+    p = aofWriteVarint(p,argc-1);
+    if (!de) {
+        *p++ = AOF_PBA_ARG_BYTES;
+        p = aofWriteVarint(p,sdslen(o->ptr));
+        dst = sdscatlen(dst,buf,p-buf);
+        dst = sdscatlen(dst,o->ptr,sdslen(o->ptr));
+        p = buf;
+    }
+    decrRefCount(o);
+
+    for (j = 1; j < argc; j++) {
+        o = argv[j];
+        if (is_value[j] && o->encoding == OBJ_ENCODING_RAW && is_nvm_addr(o->ptr) &&
+            sdslen(o->ptr) <= PBA_SDS_MAX_LEN)
+        {
+            uint64_t offset = (char*)o->ptr - (char*)server.nvm_base;
+
+            memrev64ifbe(&offset);
+            *p++ = AOF_PBA_ARG_NVM;
+            memcpy(p,&offset,8);
+            p = aofWriteVarint(p+8,sdslen(o->ptr));
+            dst = sdscatlen(dst,buf,p-buf);
+            p = buf;
+            continue;
+        }
+        o = getDecodedObject(o);
+        sds s = o->ptr;
+        int escape = is_value[j] && (s[0] == '@' || s[0] == '#');
+        *p++ = AOF_PBA_ARG_BYTES;
+        p = aofWriteVarint(p,sdslen(s)+escape);
+        if (escape) *p++ = '#';
+        dst = sdscatlen(dst,buf,p-buf);
+        dst = sdscatlen(dst,s,sdslen(s));
+        p = buf;
+        decrRefCount(o);
+    }
+    if (p != buf) dst = sdscatlen(dst,buf,p-buf);
+    return dst;
+}
+#endif
+
 #ifdef SUPPORT_PBA
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv, struct redisCommand* cmd) {
 #else
@@ -476,12 +719,6 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
     int len, j;
     robj *o;
 
-    buf[0] = '*';
-    len = 1+ll2string(buf+1,sizeof(buf)-1,argc);
-    buf[len++] = '\r';
-    buf[len++] = '\n';
-    dst = sdscatlen(dst,buf,len);
-
 #ifdef SUPPORT_PBA
     unsigned char is_value[argc];
     memset(is_value, 1, argc);
@@ -506,52 +743,18 @@ sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
         for(int i = cmd->firstkey; i <= lastkey; i += cmd->keystep)
             is_value[i] = 0;
     }
+    if(server.pba.enable)
+        return catAppendOnlyPBARecord(dst, argc, argv, is_value);
 #endif
 
+    buf[0] = '*';
+    len = 1+ll2string(buf+1,sizeof(buf)-1,argc);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    dst = sdscatlen(dst,buf,len);
+
     for (j = 0; j < argc; j++) {
-#ifdef SUPPORT_PBA
-        o = NULL;
-        if(server.pba.enable && is_value[j])
-        {
-            o = argv[j];
-            /* if is on NVM, format is "@<offset>"*/
-            if(o->encoding == OBJ_ENCODING_RAW && is_nvm_addr(o->ptr) && sdslen(o->ptr) <= PBA_SDS_MAX_LEN)
-            {
-                size_t offset = (char*)o->ptr - (char*)server.nvm_base;
-                char offset_buf[32];
-                offset_buf[0] = '@';
-                sprintf(offset_buf + 1, "%lx", offset);
-                size_t offset_buf_len = strlen(offset_buf);
-                buf[0] = '$';
-                len = 1 + ll2string(buf + 1, sizeof(buf) - 1, offset_buf_len);
-                buf[len++] = '\r';
-                buf[len++] = '\n';
-                dst = sdscatlen(dst, buf, len);
-                dst = sdscatlen(dst, offset_buf, offset_buf_len);
-                dst = sdscatlen(dst, "\r\n", 2);
-                continue;
-            }
-            o = getDecodedObject(argv[j]);
-            sds s = o->ptr;
-            if(s[0] == '@' || s[0] == '#')
-            {
-                buf[0] = '$';
-                len = 1 + ll2string(buf + 1, sizeof(buf) - 1, 1 + sdslen(s));
-                buf[len++] = '\r';
-                buf[len++] = '\n';
-                buf[len++] = '#';
-                dst = sdscatlen(dst, buf, len);
-                dst = sdscatlen(dst, s, sdslen(s));
-                dst = sdscatlen(dst, "\r\n", 2);
-                decrRefCount(o);
-                continue;
-            }
-        }
-        if(!o)
-            o = getDecodedObject(argv[j]);
-#else
         o = getDecodedObject(argv[j]);
-#endif
         buf[0] = '$';
         len = 1+ll2string(buf+1,sizeof(buf)-1,sdslen(o->ptr));
         buf[len++] = '\r';
@@ -614,9 +817,16 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
     if (dictid != server.aof_selected_db) {
         char seldb[64];
 
+#ifdef SUPPORT_PBA
+        /* Binary records carry their db. */
+        if (!server.pba.enable) {
+#endif
         snprintf(seldb,sizeof(seldb),"%d",dictid);
         buf = sdscatprintf(buf,"*2\r\n$6\r\nSELECT\r\n$%lu\r\n%s\r\n",
             (unsigned long)strlen(seldb),seldb);
+#ifdef SUPPORT_PBA
+        }
+#endif
         server.aof_selected_db = dictid;
     }
 
@@ -696,9 +906,11 @@ struct client *createFakeClient(void) {
     c->fd = -1;
     c->name = NULL;
     c->querybuf = sdsempty();
+    c->qb_pos = 0;
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
     c->bufpos = 0;
     c->flags = 0;
     c->btype = BLOCKED_NONE;
@@ -733,7 +945,52 @@ void freeFakeClient(struct client *c) {
 }
 
 #ifdef SUPPORT_PBA
-void addSdsToMoveListPBA(sds* psds)
+/* resolvePBA() runs on server.pba.resolve_threads threads, each one taking
+ * ranges of PBA_RESOLVE_UNIT_BUCKETS buckets of the keyspace dicts. As
+ * jemallocat is not thread safe, every thread collects in its job the NVM
+ * regions referenced by the AOF and the values to move to NVM: the regions
+ * are handed to jemallocat by the main thread once all the threads are done,
+ * then every thread copies its own move list to NVM. */
+#define PBA_RESOLVE_UNIT_BUCKETS 1024
+#define PBA_RESOLVE_POLL_US 1000
+
+struct pbaRegion
+{
+    size_t offset;
+    size_t size;
+};
+
+typedef struct pbaResolveJob
+{
+    pthread_t thread;
+    struct pbaRegion* regions;  /* NVM regions referenced by the AOF. */
+    size_t numregions;
+    size_t maxregions;
+    struct move_list* move_list;
+    unsigned long long moves;   /* Length of move_list. */
+} pbaResolveJob;
+
+static struct
+{
+    unsigned long* db_first_unit;   /* First bucket range of every db. */
+    unsigned long units;
+    unsigned long next_unit;
+    pthread_mutex_t next_unit_mutex;
+    int running;                    /* Threads not done yet. */
+    pthread_mutex_t running_mutex;
+} pbaResolve = {NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static void addToMoveListPBA(pbaResolveJob* job, void* ptr, size_t offset)
+{
+    struct move_list* node = zmalloc(sizeof(struct move_list));
+    node->ptr = ptr;
+    node->offset = offset;
+    node->next = job->move_list;
+    job->move_list = node;
+    job->moves++;
+}
+
+void addSdsToMoveListPBA(pbaResolveJob* job, sds* psds)
 {
     if(!server.nvm_base)
         return;
@@ -744,14 +1001,10 @@ void addSdsToMoveListPBA(sds* psds)
     size_t total_size = header_size + sdsalloc(s) + 1;
     if(total_size < server.sdsmv_threshold)
         return;
-    struct move_list* node = zmalloc(sizeof(struct move_list));
-    node->ptr = psds;
-    node->offset = header_size;
-    node->next = server.pba.move_list;
-    server.pba.move_list = node;
+    addToMoveListPBA(job, psds, header_size);
 }
 
-void addZiplistToMoveListPBA(unsigned char** pzl)
+void addZiplistToMoveListPBA(pbaResolveJob* job, unsigned char** pzl)
 {
     if(!server.nvm_base)
         return;
@@ -761,14 +1014,10 @@ void addZiplistToMoveListPBA(unsigned char** pzl)
     size_t len = ziplistBlobLen(zl);
     if(len < server.sdsmv_threshold)
         return;
-    struct move_list* node = zmalloc(sizeof(struct move_list));
-    node->ptr = pzl;
-    node->offset = 0;
-    node->next = server.pba.move_list;
-    server.pba.move_list = node;
+    addToMoveListPBA(job, pzl, 0);
 }
 
-sds resolvePBASds(sds raw)
+sds resolvePBASds(pbaResolveJob* job, sds raw)
 {
     size_t len = sdslen(raw);
     if(!len)
@@ -785,48 +1034,75 @@ sds resolvePBASds(sds raw)
         serverLog(LL_WARNING, "PBA need NVM enabled!");
         exit(1);
     }
+    if(!server.pba.pool_valid)
+    {
+        serverLog(LL_WARNING, "The AOF references the NVM pool but the pool root is '%s': "
+            "the pool was not left by a pointer based AOF run and can't be trusted!",
+            nvm_root_state_name(nvm_root_state()));
+        exit(1);
+    }
     size_t offset;
-    if(sscanf(raw + 1, "%lx", &offset) != 1)
+    uint64_t ref_offset = 0, ref_len = 0;
+    int binary = len == AOF_PBA_REF_LEN && raw[1] == '\0';
+    if(binary)
+    {
+        /* Reference of a binary record: offset and length. */
+        memcpy(&ref_offset, raw + 2, 8);
+        memcpy(&ref_len, raw + 10, 8);
+        memrev64ifbe(&ref_offset);
+        memrev64ifbe(&ref_len);
+        offset = ref_offset;
+    }
+    else if(sscanf(raw + 1, "%lx", &offset) != 1)
     {
         serverLog(LL_WARNING, "wrong NVM pointer: '%s'", raw);
         exit(1);
     }
     if(offset >= server.nvm_size)
     {
-        serverLog(LL_WARNING, "NVM pointer is out of range: '%s'", raw);
+        serverLog(LL_WARNING, "NVM pointer is out of range: %lx", offset);
         exit(1);
     }
     /* point to NVM */
     sds s = (char*)server.nvm_base + offset;
+    if(binary && sdslen(s) != ref_len)
+    {
+        serverLog(LL_WARNING, "NVM pointer %lx references %lu bytes instead of %llu",
+            offset, sdslen(s), (unsigned long long)ref_len);
+        exit(1);
+    }
     size_t header_size = sdsheadersize(s);
     size_t total_size = header_size + sdsalloc(s) + 1;
     serverAssert(offset >= header_size);
     size_t sh_offset = offset - header_size;
-    if(!jemallocat_add(server.pba.jemallocat, sh_offset, total_size))
+    if(job->numregions == job->maxregions)
     {
-        serverLog(LL_WARNING, "jemallocat_add(server.pba.jemallocat, %lu, %lu) failed!", sh_offset, total_size);
-        exit(1);
+        job->maxregions = job->maxregions ? job->maxregions * 2 : 1024;
+        job->regions = zrealloc(job->regions, sizeof(struct pbaRegion) * job->maxregions);
     }
+    job->regions[job->numregions].offset = sh_offset;
+    job->regions[job->numregions].size = total_size;
+    job->numregions++;
     return s;
 }
 
-robj* resolvePBAString(robj* o)
+robj* resolvePBAString(pbaResolveJob* job, robj* o)
 {
     if(!(o->encoding == OBJ_ENCODING_RAW || o->encoding == OBJ_ENCODING_EMBSTR))
         return o;
     sds raw = o->ptr;
-    sds s = resolvePBASds(raw);
+    sds s = resolvePBASds(job, raw);
     if(s != raw)
     {
         decrRefCount(o);
         o = createObject(OBJ_STRING, s);
     }
     if(o->encoding == OBJ_ENCODING_RAW)
-        addSdsToMoveListPBA((void*)(&(o->ptr)));
+        addSdsToMoveListPBA(job, (void*)(&(o->ptr)));
     return o;
 }
 
-robj* resolvePBASet(robj* o)
+robj* resolvePBASet(pbaResolveJob* job, robj* o)
 {
     if(o->encoding == OBJ_ENCODING_INTSET)
         return o;
@@ -840,7 +1116,7 @@ robj* resolvePBASet(robj* o)
     while((entry = dictNext(iter)))
     {
         sds raw = dictGetKey(entry);
-        sds s = resolvePBASds(raw);
+        sds s = resolvePBASds(job, raw);
         dictAdd(new_dict, s, NULL);
         if(s == raw)
             dictSetKey(old_dict, entry, NULL);
@@ -851,18 +1127,18 @@ robj* resolvePBASet(robj* o)
     return o;
 }
 
-robj* resolvePBAHash(robj* o)
+robj* resolvePBAHash(pbaResolveJob* job, robj* o)
 {
     dict* new_dict = dictCreate(&hashDictType, NULL);
     hashTypeIterator* iter = hashTypeInitIterator(o);
     while(hashTypeNext(iter) != C_ERR)
     {
         sds raw = hashTypeCurrentObjectNewSds(iter, OBJ_HASH_KEY);
-        sds field = resolvePBASds(raw);
+        sds field = resolvePBASds(job, raw);
         if(field != raw)
             sdsfree(raw);
         raw = hashTypeCurrentObjectNewSds(iter, OBJ_HASH_VALUE);
-        sds value = resolvePBASds(raw);
+        sds value = resolvePBASds(job, raw);
         if(value != raw)
             sdsfree(raw);
         dictAdd(new_dict, field, value);
@@ -874,7 +1150,7 @@ robj* resolvePBAHash(robj* o)
     return o;
 }
 
-robj* resolvePBAList(robj* o)
+robj* resolvePBAList(pbaResolveJob* job, robj* o)
 {
     robj* new_list = createQuicklistObject();
     quicklistSetOptions(new_list->ptr, server.list_max_ziplist_size,
@@ -886,7 +1162,7 @@ robj* resolvePBAList(robj* o)
         if(entry.entry.value)
         {
             sds raw = sdsnewlen((char*)entry.entry.value, entry.entry.sz);
-            sds s = resolvePBASds(raw);
+            sds s = resolvePBASds(job, raw);
             if(s != raw)
                 sdsfree(raw);
             quicklistPush(new_list->ptr, s, sdslen(s), QUICKLIST_TAIL);
@@ -905,13 +1181,13 @@ robj* resolvePBAList(robj* o)
     quicklistNode *node = ((quicklist*)new_list->ptr)->head;
     while(node)
     {
-        addZiplistToMoveListPBA((void*)(&(node->zl)));
+        addZiplistToMoveListPBA(job, (void*)(&(node->zl)));
         node = node->next;
     }
     return new_list;
 }
 
-robj* resolvePBAZset(robj* o)
+robj* resolvePBAZset(pbaResolveJob* job, robj* o)
 {
     robj* new_zset = createZsetObject();
     struct zset* z = new_zset->ptr;
@@ -930,31 +1206,30 @@ robj* resolvePBAZset(robj* o)
             if(vstr)
             {
                 sds raw = sdsnewlen((char*)vstr, vlen);
-                ele = resolvePBASds(raw);
+                ele = resolvePBASds(job, raw);
                 if(ele != raw)
                     sdsfree(raw);
             }
             else
                 ele = sdsfromlonglong(vlong);
             double score = zzlGetScore(sptr);
-            zskiplistNode* znode = zslInsert(z->zsl, score, ele);
-            dictAdd(z->dict, ele, &(znode->score));
+            zsetInsertElement(z, score, ele);
             zzlNext(zl,&eptr,&sptr);
         }
     }
-    else if(o->encoding == OBJ_ENCODING_SKIPLIST)
+    else if(o->encoding == OBJ_ENCODING_SKIPLIST ||
+            o->encoding == OBJ_ENCODING_BTREE)
     {
         dictIterator* iter = dictGetIterator(((struct zset*)(o->ptr))->dict);
         dictEntry* entry;
         while((entry = dictNext(iter)))
         {
             sds raw = dictGetKey(entry);
-            sds ele = resolvePBASds(raw);
+            sds ele = resolvePBASds(job, raw);
             if(ele == raw)
                 ele = sdsdup(raw);
-            double score = (*((double*)dictGetVal(entry)));
-            zskiplistNode* znode = zslInsert(z->zsl, score, ele);
-            dictAdd(z->dict, ele, &(znode->score));
+            double score = zsetDictGetScore(o, entry);
+            zsetInsertElement(z, score, ele);
         }
         dictReleaseIterator(iter);
     }
@@ -1007,11 +1282,132 @@ int jemallocat_memkind_is_page_allocatable(void* udata, size_t index)
     return 1;
 }
 
+static void resolvePBAEntry(pbaResolveJob* job, dict* dict, dictEntry* entry)
+{
+    addSdsToMoveListPBA(job, (void*)(&(entry->key)));
+    robj* obj = dictGetVal(entry);
+    robj* resolved_obj = NULL;
+    switch(obj->type)
+    {
+        case OBJ_STRING:
+            resolved_obj = resolvePBAString(job, obj);
+            break;
+        case OBJ_SET:
+            resolved_obj = resolvePBASet(job, obj);
+            break;
+        case OBJ_HASH:
+            resolved_obj = resolvePBAHash(job, obj);
+            break;
+        case OBJ_LIST:
+            resolved_obj = resolvePBAList(job, obj);
+            break;
+        case OBJ_ZSET:
+            resolved_obj = resolvePBAZset(job, obj);
+            break;
+        default:
+            resolved_obj = obj;
+    }
+    serverAssert(resolved_obj);
+    if(resolved_obj != obj)
+        dictSetVal(dict, entry, resolved_obj);
+}
+
+static void* resolvePBAThread(void* arg)
+{
+    pbaResolveJob* job = arg;
+    unsigned long unit;
+
+    while(1)
+    {
+        atomicGetIncr(pbaResolve.next_unit, unit, 1);
+        if(unit >= pbaResolve.units)
+            break;
+        int dbid = 0;
+        while(unit >= pbaResolve.db_first_unit[dbid + 1])
+            dbid++;
+        dict* dict = server.db[dbid].dict;
+        unsigned long idx = (unit - pbaResolve.db_first_unit[dbid]) * PBA_RESOLVE_UNIT_BUCKETS;
+        unsigned long end = idx + PBA_RESOLVE_UNIT_BUCKETS;
+        unsigned long long keys = 0;
+        if(end > dict->ht[0].size)
+            end = dict->ht[0].size;
+        for(; idx < end; idx++)
+        {
+            dictEntry* entry = dictBucketEntry(dict, 0, idx);
+            while(entry)
+            {
+                /* resolvePBAEntry() never touches the chain. */
+                resolvePBAEntry(job, dict, entry);
+                entry = dictBucketNext(dict, entry);
+                keys++;
+            }
+        }
+        atomicIncr(server.pba.resolve_done, keys);
+    }
+    atomicDecr(pbaResolve.running, 1);
+    return NULL;
+}
+
+static void* movePBAThread(void* arg)
+{
+    pbaResolveJob* job = arg;
+
+    while(job->move_list)
+    {
+        struct move_list* node = job->move_list;
+        job->move_list = node->next;
+        char* addr = (*((char**)node->ptr)) - node->offset;
+        size_t size = zmalloc_size(addr);
+        char* ptr = nvm_malloc(size);
+        if(ptr)
+        {
+            nvm_bulk_copy(ptr, addr, size);
+            (*((char**)node->ptr)) = ptr + node->offset;
+            zfree(addr);
+        }
+        zfree(node);
+        atomicIncr(server.pba.resolve_done, 1);
+    }
+    nvm_bulk_drain();
+    atomicDecr(pbaResolve.running, 1);
+    return NULL;
+}
+
+/* Run 'fn' on every job, one thread each, serving clients asking for INFO
+ * until all of them are done. */
+static void runPBAThreads(pbaResolveJob* jobs, int numjobs, void* (*fn)(void*))
+{
+    int running, err;
+
+    pbaResolve.running = numjobs;
+    for(int j = 0; j < numjobs; j++)
+    {
+        if((err = pthread_create(&jobs[j].thread, NULL, fn, jobs + j)) != 0)
+        {
+            serverLog(LL_WARNING, "Can't create the PBA resolve threads: %s", strerror(err));
+            exit(1);
+        }
+    }
+    while(1)
+    {
+        atomicGet(pbaResolve.running, running);
+        if(!running)
+            break;
+        processEventsWhileBlocked();
+        usleep(PBA_RESOLVE_POLL_US);
+    }
+    for(int j = 0; j < numjobs; j++)
+        pthread_join(jobs[j].thread, NULL);
+}
+
 void resolvePBA()
 {
+    struct jemallocat jemallocat;
+    int numjobs = server.pba.resolve_threads;
+    pbaResolveJob* jobs = zcalloc(sizeof(pbaResolveJob) * numjobs);
+
     if(server.nvm_base)
     {
-        struct jemallocat jemallocat;
         server.pba.jemallocat = &jemallocat;
         if(!jemallocat_init(&jemallocat, server.nvm_size, MEMKIND_PAGE_SIZE, MEMKIND_MAX_SMALL_SIZE,
             server.pmem_kind,
@@ -1024,60 +1420,54 @@ void resolvePBA()
     }
     else
         server.pba.jemallocat = 0;
+
+    /* Threads only walk the main table of every dict: finish rehashing, and
+     * split the tables in ranges of buckets. */
+    pbaResolve.db_first_unit = zmalloc(sizeof(unsigned long) * (server.dbnum + 1));
+    pbaResolve.units = 0;
+    pbaResolve.next_unit = 0;
+    server.pba.resolve_total = 0;
     for(int i = 0; i < server.dbnum; i++)
     {
         dict* dict = server.db[i].dict;
-        dictIterator* iter = dictGetIterator(dict);
-        dictEntry* entry;
-        while((entry = dictNext(iter)))
+        while(dictIsRehashing(dict))
+            dictRehash(dict, 100);
+        pbaResolve.db_first_unit[i] = pbaResolve.units;
+        pbaResolve.units += (dict->ht[0].size + PBA_RESOLVE_UNIT_BUCKETS - 1) / PBA_RESOLVE_UNIT_BUCKETS;
+        server.pba.resolve_total += dictSize(dict);
+    }
+    pbaResolve.db_first_unit[server.dbnum] = pbaResolve.units;
+    server.pba.resolve_done = 0;
+    server.pba.resolve_phase = PBA_RESOLVE_KEYS;
+    runPBAThreads(jobs, numjobs, resolvePBAThread);
+    zfree(pbaResolve.db_first_unit);
+    pbaResolve.db_first_unit = NULL;
+
+    server.pba.loading = 0;
+    server.pba.resolve_total = 0;
+    for(int j = 0; j < numjobs; j++)
+    {
+        for(size_t k = 0; k < jobs[j].numregions; k++)
         {
-            addSdsToMoveListPBA((void*)(&(entry->key)));
-            robj* obj = dictGetVal(entry);
-            robj* resolved_obj = NULL;
-            switch(obj->type)
+            struct pbaRegion* region = jobs[j].regions + k;
+            if(!jemallocat_add(server.pba.jemallocat, region->offset, region->size))
             {
-                case OBJ_STRING:
-                    resolved_obj = resolvePBAString(obj);
-                    break;
-                case OBJ_SET:
-                    resolved_obj = resolvePBASet(obj);
-                    break;
-                case OBJ_HASH:
-                    resolved_obj = resolvePBAHash(obj);
-                    break;
-                case OBJ_LIST:
-                    resolved_obj = resolvePBAList(obj);
-                    break;
-                case OBJ_ZSET:
-                    resolved_obj = resolvePBAZset(obj);
-                    break;
-                default:
-                    resolved_obj = obj;
+                serverLog(LL_WARNING, "jemallocat_add(server.pba.jemallocat, %lu, %lu) failed!", region->offset, region->size);
+                exit(1);
             }
-            serverAssert(resolved_obj);
-            if(resolved_obj != obj)
-                dictSetVal(dict, entry, resolved_obj);
         }
-        dictReleaseIterator(iter);
+        zfree(jobs[j].regions);
+        server.pba.resolve_total += jobs[j].moves;
     }
-    server.pba.loading = 0;
     if(server.pba.jemallocat && !jemallocat_finish(server.pba.jemallocat))
         serverPanic("jemalloc_finish() failed");
-    while(server.pba.move_list)
-    {
-        struct move_list* node = server.pba.move_list;
-        server.pba.move_list = node->next;
-        char* addr = (*((char**)node->ptr)) - node->offset;
-        size_t size = zmalloc_size(addr);
-        char* ptr = nvm_malloc(size);
-        if(ptr)
-        {
-            pmem_memcpy_persist(ptr, addr, size);
-            (*((char**)node->ptr)) = ptr + node->offset;
-            zfree(addr);
-        }
-        zfree(node);
-    }
+    server.pba.jemallocat = 0;
+
+    server.pba.resolve_done = 0;
+    server.pba.resolve_phase = PBA_RESOLVE_MOVE;
+    runPBAThreads(jobs, numjobs, movePBAThread);
+    server.pba.resolve_phase = PBA_RESOLVE_NONE;
+    zfree(jobs);
 }
 #endif
 
@@ -1116,7 +1506,15 @@ int loadAppendOnlyFile(char *filename) {
 
 #ifdef SUPPORT_PBA
     if(server.pba.enable)
+    {
+        int state = nvm_root_state();
         server.pba.loading = 1;
+        /* '@' references can only be resolved against a pool whose root says
+         * it was left there by a previous pointer based AOF run. */
+        server.pba.pool_valid = server.nvm_base &&
+            (state == NVM_ROOT_VALID || state == NVM_ROOT_VALID_DIRTY) &&
+            (nvm_root_flags() & NVM_ROOT_F_PBA);
+    }
 #endif
 
     /* Check if this AOF file has an RDB preamble. In that case we need to
@@ -1142,7 +1540,10 @@ int loadAppendOnlyFile(char *filename) {
 
     /* Read the actual AOF file, in REPL format, command by command. */
     while(1) {
-        int argc, j;
+        int argc, j, c;
+#ifdef SUPPORT_PBA
+        int ret;
+#endif
         unsigned long len;
         robj **argv;
         char buf[128];
@@ -1155,12 +1556,31 @@ int loadAppendOnlyFile(char *filename) {
             processEventsWhileBlocked();
         }
 
-        if (fgets(buf,sizeof(buf),fp) == NULL) {
+        if ((c = getc(fp)) == EOF) {
             if (feof(fp))
                 break;
             else
                 goto readerr;
         }
+#ifdef SUPPORT_PBA
+        if (c == AOF_PBA_RECORD) {
+            int dbid;
+            sds *args;
+
+            ret = aofReadPBARecord(fp,&dbid,&argc,&args);
+            if (ret == 0) goto readerr;
+            if (ret == -1 || selectDb(fakeClient,dbid) == C_ERR) goto fmterr;
+            argv = zmalloc(sizeof(robj*)*argc);
+            for (j = 0; j < argc; j++)
+                argv[j] = createObject(OBJ_STRING,args[j]);
+            zfree(args);
+            fakeClient->argc = argc;
+            fakeClient->argv = argv;
+            goto execcmd;
+        }
+#endif
+        buf[0] = c;
+        if (fgets(buf+1,sizeof(buf)-1,fp) == NULL) goto readerr;
         if (buf[0] != '*') goto fmterr;
         if (buf[1] == '\0') goto readerr;
         argc = atoi(buf+1);
@@ -1193,6 +1613,9 @@ int loadAppendOnlyFile(char *filename) {
             }
         }
 
+#ifdef SUPPORT_PBA
+execcmd:
+#endif
         /* Command lookup */
         cmd = lookupCommand(argv[0]->ptr);
         if (!cmd) {
@@ -1226,13 +1649,15 @@ loaded_ok: /* DB loaded, cleanup and return C_OK to the caller. */
     fclose(fp);
     freeFakeClient(fakeClient);
     server.aof_state = old_aof_state;
-    stopLoading();
-    aofUpdateCurrentSize();
-    server.aof_rewrite_base_size = server.aof_current_size;
 #ifdef SUPPORT_PBA
+    /* Still part of the load: the move list copies are batched with the
+     * rest of the NVM writes and accounted in the load stats. */
     if(server.pba.enable)
         resolvePBA();
 #endif
+    stopLoading();
+    aofUpdateCurrentSize();
+    server.aof_rewrite_base_size = server.aof_current_size;
     return C_OK;
 
 readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
@@ -1448,14 +1873,15 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = o->ptr;
         dictIterator *di = dictGetIterator(zs->dict);
         dictEntry *de;
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = zsetDictGetScore(o,de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -1465,7 +1891,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
                 if (rioWriteBulkObject(r,key) == 0) return 0;
             }
-            if (rioWriteBulkDouble(r,*score) == 0) return 0;
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
 #ifdef SUPPORT_PBA
             if (rioWriteBulkStringPBA(r,ele,sdslen(ele)) == 0) return 0;
 #else
@@ -2072,10 +2498,13 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
 #ifdef USE_AOFGUARD
         if(server.aofguard.enable)
         {
-            bioCreateBackgroundJob(BIO_DEINIT_AOFGUARD, (void*)server.aofguard.aofguard, NULL, NULL);
+            /* The writer thread of the old guard may still be writing to
+             * the old AOF: it is closed after the thread is joined. */
+            bioCreateBackgroundJob(BIO_DEINIT_AOFGUARD, (void*)server.aofguard.aofguard, (void*)(long)oldfd, NULL);
+            oldfd = -1;
             server.aofguard.aofguard = zmalloc(sizeof(struct aofguard));
             if(!aofguard_init(server.aofguard.aofguard, server.aof_fd, server.aofguard.nvm_dir_fd,
-                server.aofguard.nvm_file_name, AOFGUARD_NVM_SIZE, 1))
+                server.aofguard.nvm_file_name, AOFGUARD_NVM_SIZE, server.aofguard.block_size, 1))
             {
                 serverLog(LL_WARNING, "aofguard_init() for '%s/%s' failed!", server.nvm_dir, server.aofguard.nvm_file_name);
                 exit(1);
@@ -199,6 +199,8 @@ void *bioProcessBackgroundJobs(void *arg) {
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+        } else if (type == BIO_RDB_SAVE) {
+            rdbThreadedSaveFromBioThread(job->arg1,(long)job->arg2);
         }
 #ifdef USE_AOFGUARD
         else if(type == BIO_DEINIT_AOFGUARD)
@@ -210,6 +212,8 @@ void *bioProcessBackgroundJobs(void *arg) {
                 exit(1);
             }
             zfree(aofguard);
+            if((long)job->arg2 != -1)
+                close((long)job->arg2);
         }
 #endif
         else {
@@ -217,14 +221,16 @@ void *bioProcessBackgroundJobs(void *arg) {
         }
         zfree(job);
 
-        /* Unblock threads blocked on bioWaitStepOfType() if any. */
-        pthread_cond_broadcast(&bio_step_cond[type]);
-
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
         listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
+
+        /* Unblock threads blocked on bioWaitStepOfType() if any. This is
+         * done after updating the pending count, otherwise the waiter may
+         * still see the job we just processed and wait forever. */
+        pthread_cond_broadcast(&bio_step_cond[type]);
     }
 }
 
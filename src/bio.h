@@ -39,10 +39,11 @@ void bioKillThreads(void);
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
+#define BIO_RDB_SAVE      3 /* BGSAVE THREADED writes. */
 
 #ifdef USE_AOFGUARD
-#define BIO_DEINIT_AOFGUARD 3
-#define BIO_NUM_OPS         4
+#define BIO_DEINIT_AOFGUARD 4
+#define BIO_NUM_OPS         5
 #else
-#define BIO_NUM_OPS       3
+#define BIO_NUM_OPS       4
 #endif
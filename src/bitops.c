@@ -29,20 +29,42 @@
  */
 
 #include "server.h"
+#include "cpudispatch.h"
 
 #ifdef USE_NVM
 #include "nvm.h"
 #endif
 /* -----------------------------------------------------------------------------
- * Helpers and low level bit functions.
+ * Vectorized kernels.
+ *
+ * BITCOUNT, BITPOS and BITOP scan whole bitmaps, that can be several MB.
+ * The inner loops are implemented by a portable scalar kernel and by AVX2
+ * and AVX-512 ones on x86_64, selected at runtime according to the CPU
+ * features.
  * -------------------------------------------------------------------------- */
 
-/* Count number of bits set in the binary array pointed by 's' and long
- * 'count' bytes. The implementation of this function is required to
- * work with a input string length up to 512 MB. */
-size_t redisPopcount(void *s, long count) {
+#define BITOP_AND   0
+#define BITOP_OR    1
+#define BITOP_XOR   2
+#define BITOP_NOT   3
+
+struct bitopsKernel {
+    char *name;
+    unsigned int features;  /* CPU_* features the kernel needs. */
+    /* Number of bits set in the 'count' bytes at 'p'. */
+    size_t (*popcount)(unsigned char *p, long count);
+    /* Number of leading bytes at 'p' equal to 'skipval'. The kernels may
+     * stop up to sizeof(unsigned long)-1 bytes before the first different
+     * byte, but never after it. */
+    long (*skip)(unsigned char *p, long count, int skipval);
+    /* Store 'src[0] op src[1] op ... src[numkeys-1]' into the 'len' bytes
+     * at 'res', or the negation of src[0] for BITOP_NOT. */
+    void (*bitop)(int op, unsigned char *res, unsigned char **src,
+                  unsigned long numkeys, unsigned long len);
+};
+
+static size_t bitopsPopcountScalar(unsigned char *p, long count) {
     size_t bits = 0;
-    unsigned char *p = s;
     uint32_t *p4;
     static const unsigned char bitsinbyte[256] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,1,2,2,3,2,3,3,4,2,3,3,4,3,4,4,5,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,2,3,3,4,3,4,4,5,3,4,4,5,4,5,5,6,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,3,4,4,5,4,5,5,6,4,5,5,6,5,6,6,7,4,5,5,6,5,6,6,7,5,6,6,7,6,7,7,8};
 
@@ -94,6 +116,327 @@ size_t redisPopcount(void *s, long count) {
     return bits;
 }
 
+static long bitopsSkipScalar(unsigned char *p, long count, int skipval) {
+    unsigned char *c = p;
+    unsigned long *l, lskip = skipval ? ULONG_MAX : 0;
+
+    /* Skip initial bytes not aligned to sizeof(unsigned long). */
+    while((unsigned long)c & (sizeof(*l)-1) && count) {
+        if (*c != skipval) return c-p;
+        c++;
+        count--;
+    }
+
+    /* Skip bits with full word step. */
+    l = (unsigned long*) c;
+    while (count >= (long)sizeof(*l)) {
+        if (*l != lskip) break;
+        l++;
+        count -= sizeof(*l);
+    }
+    return (unsigned char*)l-p;
+}
+
+/* Compute the bytes from 'start' to 'len' of a BITOP one byte at a time. */
+static void bitopsBitopBytes(int op, unsigned char *res, unsigned char **src,
+                             unsigned long numkeys, unsigned long start,
+                             unsigned long len)
+{
+    unsigned long i, j;
+
+    for (j = start; j < len; j++) {
+        unsigned char output = src[0][j];
+        if (op == BITOP_NOT) output = ~output;
+        for (i = 1; i < numkeys; i++) {
+            switch(op) {
+            case BITOP_AND: output &= src[i][j]; break;
+            case BITOP_OR:  output |= src[i][j]; break;
+            case BITOP_XOR: output ^= src[i][j]; break;
+            }
+        }
+        res[j] = output;
+    }
+}
+
+static void bitopsBitopScalar(int op, unsigned char *res, unsigned char **src,
+                              unsigned long numkeys, unsigned long len)
+{
+    unsigned long i, j = 0;
+
+    /* On ARM we skip the word at a time loop since it will result in GCC
+     * compiling the code using multiple-words load/store operations that
+     * are not supported even in ARM >= v6. */
+#ifndef USE_ALIGNED_ACCESS
+    for (; j+sizeof(unsigned long)*4 <= len; j += sizeof(unsigned long)*4) {
+        unsigned long *lres = (unsigned long*)(res+j);
+        unsigned long *lp = (unsigned long*)(src[0]+j);
+
+        lres[0] = lp[0];
+        lres[1] = lp[1];
+        lres[2] = lp[2];
+        lres[3] = lp[3];
+        if (op == BITOP_NOT) {
+            lres[0] = ~lres[0];
+            lres[1] = ~lres[1];
+            lres[2] = ~lres[2];
+            lres[3] = ~lres[3];
+        }
+        for (i = 1; i < numkeys; i++) {
+            lp = (unsigned long*)(src[i]+j);
+            switch(op) {
+            case BITOP_AND:
+                lres[0] &= lp[0]; lres[1] &= lp[1];
+                lres[2] &= lp[2]; lres[3] &= lp[3];
+                break;
+            case BITOP_OR:
+                lres[0] |= lp[0]; lres[1] |= lp[1];
+                lres[2] |= lp[2]; lres[3] |= lp[3];
+                break;
+            case BITOP_XOR:
+                lres[0] ^= lp[0]; lres[1] ^= lp[1];
+                lres[2] ^= lp[2]; lres[3] ^= lp[3];
+                break;
+            }
+        }
+    }
+#endif
+    bitopsBitopBytes(op,res,src,numkeys,j,len);
+}
+
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#define BITOPS_SIMD 1
+
+#define BITOPS_LOAD256(p) _mm256_loadu_si256((__m256i*)(p))
+
+/* Nibble lookup popcount: the bytes counts are added for up to 31 vectors
+ * before they could overflow, then summed into 64 bit lanes. */
+__attribute__((target("avx2")))
+static size_t bitopsPopcountAVX2(unsigned char *p, long count) {
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t bits = 0;
+
+    while (count >= 32) {
+        __m256i acc = _mm256_setzero_si256();
+        long j, blocks = count/32 < 31 ? count/32 : 31;
+
+        for (j = 0; j < blocks; j++, p += 32) {
+            __m256i v = BITOPS_LOAD256(p);
+            __m256i lo = _mm256_and_si256(v,low);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),low);
+            acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lookup,lo));
+            acc = _mm256_add_epi8(acc,_mm256_shuffle_epi8(lookup,hi));
+        }
+        total = _mm256_add_epi64(total,
+            _mm256_sad_epu8(acc,_mm256_setzero_si256()));
+        count -= blocks*32;
+    }
+    bits += (size_t)_mm256_extract_epi64(total,0) +
+            (size_t)_mm256_extract_epi64(total,1) +
+            (size_t)_mm256_extract_epi64(total,2) +
+            (size_t)_mm256_extract_epi64(total,3);
+    return bits + bitopsPopcountScalar(p,count);
+}
+
+__attribute__((target("avx2")))
+static long bitopsSkipAVX2(unsigned char *p, long count, int skipval) {
+    const __m256i skip = _mm256_set1_epi8(skipval);
+    unsigned char *c = p;
+
+    /* Check 128 bytes per iteration while they are all equal to 'skipval'. */
+    while (count >= 128) {
+        __m256i x0 = _mm256_xor_si256(BITOPS_LOAD256(c),skip);
+        __m256i x1 = _mm256_xor_si256(BITOPS_LOAD256(c+32),skip);
+        __m256i x2 = _mm256_xor_si256(BITOPS_LOAD256(c+64),skip);
+        __m256i x3 = _mm256_xor_si256(BITOPS_LOAD256(c+96),skip);
+        __m256i x = _mm256_or_si256(_mm256_or_si256(x0,x1),
+                                    _mm256_or_si256(x2,x3));
+        if (!_mm256_testz_si256(x,x)) break;
+        c += 128;
+        count -= 128;
+    }
+    while (count >= 32) {
+        __m256i x = _mm256_xor_si256(BITOPS_LOAD256(c),skip);
+        if (!_mm256_testz_si256(x,x)) break;
+        c += 32;
+        count -= 32;
+    }
+    return (c-p) + bitopsSkipScalar(c,count,skipval);
+}
+
+__attribute__((target("avx2")))
+static void bitopsBitopAVX2(int op, unsigned char *res, unsigned char **src,
+                            unsigned long numkeys, unsigned long len)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    unsigned long i, j = 0;
+
+    for (; j+128 <= len; j += 128) {
+        __m256i r0 = BITOPS_LOAD256(src[0]+j);
+        __m256i r1 = BITOPS_LOAD256(src[0]+j+32);
+        __m256i r2 = BITOPS_LOAD256(src[0]+j+64);
+        __m256i r3 = BITOPS_LOAD256(src[0]+j+96);
+
+        if (op == BITOP_NOT) {
+            r0 = _mm256_xor_si256(r0,ones);
+            r1 = _mm256_xor_si256(r1,ones);
+            r2 = _mm256_xor_si256(r2,ones);
+            r3 = _mm256_xor_si256(r3,ones);
+        }
+        for (i = 1; i < numkeys; i++) {
+            __m256i a0 = BITOPS_LOAD256(src[i]+j);
+            __m256i a1 = BITOPS_LOAD256(src[i]+j+32);
+            __m256i a2 = BITOPS_LOAD256(src[i]+j+64);
+            __m256i a3 = BITOPS_LOAD256(src[i]+j+96);
+
+            switch(op) {
+            case BITOP_AND:
+                r0 = _mm256_and_si256(r0,a0); r1 = _mm256_and_si256(r1,a1);
+                r2 = _mm256_and_si256(r2,a2); r3 = _mm256_and_si256(r3,a3);
+                break;
+            case BITOP_OR:
+                r0 = _mm256_or_si256(r0,a0); r1 = _mm256_or_si256(r1,a1);
+                r2 = _mm256_or_si256(r2,a2); r3 = _mm256_or_si256(r3,a3);
+                break;
+            case BITOP_XOR:
+                r0 = _mm256_xor_si256(r0,a0); r1 = _mm256_xor_si256(r1,a1);
+                r2 = _mm256_xor_si256(r2,a2); r3 = _mm256_xor_si256(r3,a3);
+                break;
+            }
+        }
+        _mm256_storeu_si256((__m256i*)(res+j),r0);
+        _mm256_storeu_si256((__m256i*)(res+j+32),r1);
+        _mm256_storeu_si256((__m256i*)(res+j+64),r2);
+        _mm256_storeu_si256((__m256i*)(res+j+96),r3);
+    }
+    bitopsBitopBytes(op,res,src,numkeys,j,len);
+}
+
+#define BITOPS_LOAD512(p) _mm512_loadu_si512((void*)(p))
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t bitopsPopcountAVX512(unsigned char *p, long count) {
+    __m512i t0 = _mm512_setzero_si512(), t1 = _mm512_setzero_si512();
+    size_t bits = 0;
+
+    for (; count >= 128; count -= 128, p += 128) {
+        t0 = _mm512_add_epi64(t0,_mm512_popcnt_epi64(BITOPS_LOAD512(p)));
+        t1 = _mm512_add_epi64(t1,
+                _mm512_popcnt_epi64(BITOPS_LOAD512(p+64)));
+    }
+    if (count >= 64) {
+        t0 = _mm512_add_epi64(t0,_mm512_popcnt_epi64(BITOPS_LOAD512(p)));
+        count -= 64;
+        p += 64;
+    }
+    bits += _mm512_reduce_add_epi64(_mm512_add_epi64(t0,t1));
+    return bits + bitopsPopcountScalar(p,count);
+}
+
+__attribute__((target("avx512f")))
+static long bitopsSkipAVX512(unsigned char *p, long count, int skipval) {
+    const __m512i skip = _mm512_set1_epi8(skipval);
+    unsigned char *c = p;
+
+    while (count >= 256) {
+        __m512i x0 = _mm512_xor_si512(BITOPS_LOAD512(c),skip);
+        __m512i x1 = _mm512_xor_si512(BITOPS_LOAD512(c+64),skip);
+        __m512i x2 = _mm512_xor_si512(BITOPS_LOAD512(c+128),skip);
+        __m512i x3 = _mm512_xor_si512(BITOPS_LOAD512(c+192),skip);
+        __m512i x = _mm512_or_si512(_mm512_or_si512(x0,x1),
+                                    _mm512_or_si512(x2,x3));
+        if (_mm512_test_epi64_mask(x,x)) break;
+        c += 256;
+        count -= 256;
+    }
+    while (count >= 64) {
+        __m512i x = _mm512_xor_si512(BITOPS_LOAD512(c),skip);
+        if (_mm512_test_epi64_mask(x,x)) break;
+        c += 64;
+        count -= 64;
+    }
+    return (c-p) + bitopsSkipScalar(c,count,skipval);
+}
+
+__attribute__((target("avx512f")))
+static void bitopsBitopAVX512(int op, unsigned char *res, unsigned char **src,
+                              unsigned long numkeys, unsigned long len)
+{
+    const __m512i ones = _mm512_set1_epi8(-1);
+    unsigned long i, j = 0;
+
+    for (; j+256 <= len; j += 256) {
+        __m512i r0 = BITOPS_LOAD512(src[0]+j);
+        __m512i r1 = BITOPS_LOAD512(src[0]+j+64);
+        __m512i r2 = BITOPS_LOAD512(src[0]+j+128);
+        __m512i r3 = BITOPS_LOAD512(src[0]+j+192);
+
+        if (op == BITOP_NOT) {
+            r0 = _mm512_xor_si512(r0,ones);
+            r1 = _mm512_xor_si512(r1,ones);
+            r2 = _mm512_xor_si512(r2,ones);
+            r3 = _mm512_xor_si512(r3,ones);
+        }
+        for (i = 1; i < numkeys; i++) {
+            __m512i a0 = BITOPS_LOAD512(src[i]+j);
+            __m512i a1 = BITOPS_LOAD512(src[i]+j+64);
+            __m512i a2 = BITOPS_LOAD512(src[i]+j+128);
+            __m512i a3 = BITOPS_LOAD512(src[i]+j+192);
+
+            switch(op) {
+            case BITOP_AND:
+                r0 = _mm512_and_si512(r0,a0); r1 = _mm512_and_si512(r1,a1);
+                r2 = _mm512_and_si512(r2,a2); r3 = _mm512_and_si512(r3,a3);
+                break;
+            case BITOP_OR:
+                r0 = _mm512_or_si512(r0,a0); r1 = _mm512_or_si512(r1,a1);
+                r2 = _mm512_or_si512(r2,a2); r3 = _mm512_or_si512(r3,a3);
+                break;
+            case BITOP_XOR:
+                r0 = _mm512_xor_si512(r0,a0); r1 = _mm512_xor_si512(r1,a1);
+                r2 = _mm512_xor_si512(r2,a2); r3 = _mm512_xor_si512(r3,a3);
+                break;
+            }
+        }
+        _mm512_storeu_si512((void*)(res+j),r0);
+        _mm512_storeu_si512((void*)(res+j+64),r1);
+        _mm512_storeu_si512((void*)(res+j+128),r2);
+        _mm512_storeu_si512((void*)(res+j+192),r3);
+    }
+    bitopsBitopBytes(op,res,src,numkeys,j,len);
+}
+#endif
+
+/* Kernels in order of preference, see cpudispatch.h. */
+static struct bitopsKernel bitopsKernels[] = {
+#ifdef BITOPS_SIMD
+    {"avx512",CPU_AVX512F|CPU_AVX512VPOPCNTDQ,
+     bitopsPopcountAVX512,bitopsSkipAVX512,bitopsBitopAVX512},
+    {"avx2",CPU_AVX2,bitopsPopcountAVX2,bitopsSkipAVX2,bitopsBitopAVX2},
+#endif
+    {"scalar",0,bitopsPopcountScalar,bitopsSkipScalar,bitopsBitopScalar}
+};
+
+static struct bitopsKernel *bitopsGetKernel(void) {
+    static struct bitopsKernel *kernel = NULL;
+    CPU_DISPATCH(kernel,bitopsKernels);
+    return kernel;
+}
+
+/* -----------------------------------------------------------------------------
+ * Helpers and low level bit functions.
+ * -------------------------------------------------------------------------- */
+
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. The implementation of this function is required to
+ * work with a input string length up to 512 MB. */
+size_t redisPopcount(void *s, long count) {
+    return bitopsGetKernel()->popcount(s,count);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -107,42 +450,19 @@ long redisBitpos(void *s, unsigned long count, int bit) {
     unsigned long skipval, word = 0, one;
     long pos = 0; /* Position of bit, to return to the caller. */
     unsigned long j;
-    int found;
+    long skipped;
 
     /* Process whole words first, seeking for first word that is not
      * all ones or all zeros respectively if we are lookig for zeros
      * or ones. This is much faster with large strings having contiguous
      * blocks of 1 or 0 bits compared to the vanilla bit per bit processing.
-     *
-     * Note that if we start from an address that is not aligned
-     * to sizeof(unsigned long) we consume it byte by byte until it is
-     * aligned. */
-
-    /* Skip initial bits not aligned to sizeof(unsigned long) byte by byte. */
+     * The skip kernel stops less than a word before the first byte that
+     * is not all ones or all zeros. */
     skipval = bit ? 0 : UCHAR_MAX;
-    c = (unsigned char*) s;
-    found = 0;
-    while((unsigned long)c & (sizeof(*l)-1) && count) {
-        if (*c != skipval) {
-            found = 1;
-            break;
-        }
-        c++;
-        count--;
-        pos += 8;
-    }
-
-    /* Skip bits with full word step. */
-    l = (unsigned long*) c;
-    if (!found) {
-        skipval = bit ? 0 : ULONG_MAX;
-        while (count >= sizeof(*l)) {
-            if (*l != skipval) break;
-            l++;
-            count -= sizeof(*l);
-            pos += sizeof(*l)*8;
-        }
-    }
+    skipped = bitopsGetKernel()->skip(s,count,skipval);
+    l = (unsigned long*) ((unsigned char*)s + skipped);
+    count -= skipped;
+    pos += skipped*8;
 
     /* Load bytes into "word" considering the first byte as the most significant
      * (we basically consider it as written in big endian, since we consider the
@@ -395,11 +715,6 @@ void printBits(unsigned char *p, unsigned long count) {
  * Bits related string commands: GETBIT, SETBIT, BITCOUNT, BITOP.
  * -------------------------------------------------------------------------- */
 
-#define BITOP_AND   0
-#define BITOP_OR    1
-#define BITOP_XOR   2
-#define BITOP_NOT   3
-
 #define BITFIELDOP_GET 0
 #define BITFIELDOP_SET 1
 #define BITFIELDOP_INCRBY 2
@@ -566,7 +881,7 @@ void setbitCommand(client *c) {
 
 #ifdef USE_NVM
     if(o->encoding == OBJ_ENCODING_RAW && !is_nvm_addr(o->ptr)) {
-        o->ptr = sdsmvtonvm(o->ptr);
+        o->ptr = sdsmvtonvmplaced(o->ptr,NVM_CLASS_STRING);
     }
 #endif
 #ifdef SUPPORT_PBA
@@ -684,73 +999,13 @@ void bitopCommand(client *c) {
         unsigned long i;
 
         /* Fast path: as far as we have data for all the input bitmaps we
-         * can take a fast path that performs much better than the
-         * vanilla algorithm. On ARM we skip the fast path since it will
-         * result in GCC compiling the code using multiple-words load/store
-         * operations that are not supported even in ARM >= v6. */
+         * can use the vectorized kernel, that performs much better than
+         * the vanilla algorithm. */
         j = 0;
-        #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
-            unsigned long *lp[16];
-            unsigned long *lres = (unsigned long*) res;
-
-            /* Note: sds pointer is always aligned to 8 byte boundary. */
-            memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
-
-            /* Different branches per different operations for speed (sorry). */
-            if (op == BITOP_AND) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] &= lp[i][0];
-                        lres[1] &= lp[i][1];
-                        lres[2] &= lp[i][2];
-                        lres[3] &= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_OR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] |= lp[i][0];
-                        lres[1] |= lp[i][1];
-                        lres[2] |= lp[i][2];
-                        lres[3] |= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_XOR) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    for (i = 1; i < numkeys; i++) {
-                        lres[0] ^= lp[i][0];
-                        lres[1] ^= lp[i][1];
-                        lres[2] ^= lp[i][2];
-                        lres[3] ^= lp[i][3];
-                        lp[i]+=4;
-                    }
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            } else if (op == BITOP_NOT) {
-                while(minlen >= sizeof(unsigned long)*4) {
-                    lres[0] = ~lres[0];
-                    lres[1] = ~lres[1];
-                    lres[2] = ~lres[2];
-                    lres[3] = ~lres[3];
-                    lres+=4;
-                    j += sizeof(unsigned long)*4;
-                    minlen -= sizeof(unsigned long)*4;
-                }
-            }
+        if (minlen) {
+            bitopsGetKernel()->bitop(op,res,src,numkeys,minlen);
+            j = minlen;
         }
-        #endif
 
         /* j is set to the next byte to process by the previous loop. */
         for (; j < maxlen; j++) {
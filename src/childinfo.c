@@ -28,6 +28,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <unistd.h>
 
 /* Open a child-parent channel used in order to move information about the
@@ -42,6 +43,12 @@ void openChildInfoPipe(void) {
         closeChildInfoPipe();
     } else {
         memset(&server.child_info_data,0,sizeof(server.child_info_data));
+#ifdef USE_NVM
+        atomicGet(server.stat_rdb_nvm_bytes_streamed,
+                  server.child_info_data.nvm_bytes_streamed);
+        atomicGet(server.stat_rdb_nvm_bytes_materialized,
+                  server.child_info_data.nvm_bytes_materialized);
+#endif
     }
 }
 
@@ -63,6 +70,15 @@ void sendChildInfo(int ptype) {
     if (server.child_info_pipe[1] == -1) return;
     server.child_info_data.magic = CHILD_INFO_MAGIC;
     server.child_info_data.process_type = ptype;
+#ifdef USE_NVM
+    /* Send what the child added to the counters since the fork. */
+    server.child_info_data.nvm_bytes_streamed =
+        server.stat_rdb_nvm_bytes_streamed -
+        server.child_info_data.nvm_bytes_streamed;
+    server.child_info_data.nvm_bytes_materialized =
+        server.stat_rdb_nvm_bytes_materialized -
+        server.child_info_data.nvm_bytes_materialized;
+#endif
     ssize_t wlen = sizeof(server.child_info_data);
     if (write(server.child_info_pipe[1],&server.child_info_data,wlen) != wlen) {
         /* Nothing to do on error, this will be detected by the other side. */
@@ -81,5 +97,11 @@ void receiveChildInfo(void) {
         } else if (server.child_info_data.process_type == CHILD_INFO_TYPE_AOF) {
             server.stat_aof_cow_bytes = server.child_info_data.cow_size;
         }
+#ifdef USE_NVM
+        atomicIncr(server.stat_rdb_nvm_bytes_streamed,
+                   server.child_info_data.nvm_bytes_streamed);
+        atomicIncr(server.stat_rdb_nvm_bytes_materialized,
+                   server.child_info_data.nvm_bytes_materialized);
+#endif
     }
 }
@@ -31,6 +31,9 @@
 
 #include "server.h"
 #include "cluster.h"
+#ifdef USE_NVM
+#include "nvm.h"
+#endif
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -85,6 +88,18 @@ configEnum supervised_mode_enum[] = {
     {NULL, 0}
 };
 
+configEnum list_compress_codec_enum[] = {
+    {"lzf", QUICKLIST_CODEC_LZF},
+    {"lz4", QUICKLIST_CODEC_LZ4},
+    {NULL, 0}
+};
+
+configEnum zset_encoding_enum[] = {
+    {"skiplist", OBJ_ENCODING_SKIPLIST},
+    {"btree", OBJ_ENCODING_BTREE},
+    {NULL, 0}
+};
+
 configEnum aof_fsync_enum[] = {
     {"everysec", AOF_FSYNC_EVERYSEC},
     {"always", AOF_FSYNC_ALWAYS},
@@ -170,6 +185,21 @@ void queueLoadModule(sds path, sds *argv, int argc) {
     listAddNodeTail(server.loadmodule_queue,loadmod);
 }
 
+#ifdef USE_NVM
+/* Parse the threshold of an nvm-placement class, that is either 'default'
+ * (follow nvm-threshold) or a size in bytes. */
+static int nvmPlacementThresholdFromString(char *s, long long *threshold) {
+    int err;
+
+    if (!strcasecmp(s,"default")) {
+        *threshold = NVM_THRESHOLD_DEFAULT;
+        return C_OK;
+    }
+    *threshold = memtoll(s,&err);
+    return (err || *threshold < 0) ? C_ERR : C_OK;
+}
+#endif
+
 void loadServerConfigFromString(char *config) {
     char *err = NULL;
     int linenum = 0, totlines, i;
@@ -307,6 +337,13 @@ void loadServerConfigFromString(char *config) {
             if (server.dbnum < 1) {
                 err = "Invalid number of databases"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > IO_THREADS_MAX_NUM)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"include") && argc == 2) {
             loadServerConfig(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"maxclients") && argc == 2) {
@@ -546,12 +583,36 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-codec") && argc == 2) {
+            server.list_compress_codec =
+                configEnumGetValue(list_compress_codec_enum,argv[1]);
+            if (server.list_compress_codec == INT_MIN) {
+                err = "argument must be 'lzf' or 'lz4'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"list-compress-cache-size") && argc == 2) {
+            server.list_compress_cache_size = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
             server.zset_max_ziplist_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2) {
             server.zset_max_ziplist_value = memtoll(argv[1], NULL);
+        } else if (!strcasecmp(argv[0],"ziplist-index-cache-size") && argc == 2) {
+            server.ziplist_index_cache_size = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"ziplist-index-min-entries") && argc == 2) {
+            server.ziplist_index_min_entries = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"embed-string-keys") && argc == 2) {
+            if ((server.embed_string_keys = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"zset-encoding") && argc == 2) {
+            server.zset_encoding =
+                configEnumGetValue(zset_encoding_enum,argv[1]);
+            if (server.zset_encoding == INT_MIN) {
+                err = "argument must be 'skiplist' or 'btree'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2) {
             server.hll_sparse_max_bytes = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"rename-command") && argc == 3) {
@@ -766,6 +827,58 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
         }
+        else if(!strcasecmp(argv[0],"nvm-placement") && argc == 4) {
+            int class = nvm_placement_class_by_name(argv[1]);
+            int pin = nvm_placement_pin_by_name(argv[3]);
+            long long threshold;
+
+            if (class == -1) {
+                err = "Unrecognized nvm-placement class"; goto loaderr;
+            }
+            if (nvmPlacementThresholdFromString(argv[2],&threshold) == C_ERR) {
+                err = "nvm-placement threshold must be 'default' or a size";
+                goto loaderr;
+            }
+            if (pin == -1) {
+                err = "nvm-placement pin must be 'auto', 'dram' or 'nvm'";
+                goto loaderr;
+            }
+            server.nvm_placement[class].threshold = threshold;
+            server.nvm_placement[class].pin = pin;
+        }
+        else if(!strcasecmp(argv[0],"nvm-tiering") && argc == 2) {
+            if ((server.nvm_tiering_enabled = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        }
+        else if(!strcasecmp(argv[0],"nvm-tiering-dram-budget") && argc == 2) {
+            server.nvm_tiering_dram_budget = memtoll(argv[1],NULL);
+        }
+        else if(!strcasecmp(argv[0],"nvm-tiering-max-bandwidth") && argc == 2) {
+            server.nvm_tiering_max_bandwidth = memtoll(argv[1],NULL);
+            if (server.nvm_tiering_max_bandwidth == 0) {
+                err = "nvm-tiering-max-bandwidth must be above 0";
+                goto loaderr;
+            }
+        }
+        else if(!strcasecmp(argv[0],"nvm-tiering-promote-freq") && argc == 2) {
+            server.nvm_tiering_promote_freq = atoi(argv[1]);
+            if (server.nvm_tiering_promote_freq < 0 ||
+                server.nvm_tiering_promote_freq > 255)
+            {
+                err = "nvm-tiering-promote-freq must be between 0 and 255";
+                goto loaderr;
+            }
+        }
+        else if(!strcasecmp(argv[0],"nvm-tiering-demote-freq") && argc == 2) {
+            server.nvm_tiering_demote_freq = atoi(argv[1]);
+            if (server.nvm_tiering_demote_freq < 0 ||
+                server.nvm_tiering_demote_freq > 255)
+            {
+                err = "nvm-tiering-demote-freq must be between 0 and 255";
+                goto loaderr;
+            }
+        }
 #endif
 
 #ifdef SUPPORT_PBA
@@ -778,6 +891,15 @@ void loadServerConfigFromString(char *config) {
             }
             server.pba.enable = strcasecmp(argv[1], "yes") == 0;
         }
+        else if(strcasecmp(argv[0], "pointer-based-aof-resolve-threads") == 0 && argc == 2)
+        {
+            server.pba.resolve_threads = atoi(argv[1]);
+            if(server.pba.resolve_threads < 1 || server.pba.resolve_threads > 128)
+            {
+                err = "pointer-based-aof-resolve-threads must be between 1 and 128";
+                goto loaderr;
+            }
+        }
 #endif
 
 #ifdef USE_AOFGUARD
@@ -790,6 +912,16 @@ void loadServerConfigFromString(char *config) {
             }
             server.aofguard.enable = strcasecmp(argv[1], "yes") == 0;
         }
+        else if(strcasecmp(argv[0], "aof-write-turbo-block-size") == 0 && argc == 2)
+        {
+            long long block_size = memtoll(argv[1], NULL);
+            if(block_size < 4096 || block_size > AOFGUARD_NVM_SIZE / 2)
+            {
+                err = "Invalid aof-write-turbo-block-size";
+                goto loaderr;
+            }
+            server.aofguard.block_size = block_size;
+        }
 #endif
 
          else {
@@ -807,6 +939,17 @@ void loadServerConfigFromString(char *config) {
     }
     sdsfreesplitres(lines,totlines);
 
+#ifdef USE_NVM
+    /* Values between the two thresholds would move back and forth between
+     * DRAM and NVM at every tiering cycle otherwise. */
+    if (server.nvm_tiering_demote_freq >= server.nvm_tiering_promote_freq) {
+        fprintf(stderr, "\n*** FATAL CONFIG FILE ERROR ***\n");
+        fprintf(stderr, "nvm-tiering-demote-freq must be below "
+                        "nvm-tiering-promote-freq\n");
+        exit(1);
+    }
+#endif
+
 #if defined(USE_AOFGUARD) && defined(SUPPORT_PBA)
     if(server.nvm_dir && server.aof_state == AOF_ON && server.pba.enable)
         server.aofguard.enable = 1;
@@ -1065,6 +1208,67 @@ void configSetCommand(client *c) {
             server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
         }
         sdsfreesplitres(v,vlen);
+#ifdef USE_NVM
+    } config_set_special_field("nvm-placement") {
+        int vlen, j;
+        sds *v = sdssplitlen(o->ptr,sdslen(o->ptr)," ",1,&vlen);
+        long long threshold;
+
+        /* We need a multiple of 3: <class> <threshold> <pin> */
+        if (vlen % 3) {
+            sdsfreesplitres(v,vlen);
+            goto badfmt;
+        }
+
+        /* Accept all the classes or none of them. */
+        for (j = 0; j < vlen; j += 3) {
+            if (nvm_placement_class_by_name(v[j]) == -1 ||
+                nvmPlacementThresholdFromString(v[j+1],&threshold) == C_ERR ||
+                nvm_placement_pin_by_name(v[j+2]) == -1)
+            {
+                sdsfreesplitres(v,vlen);
+                goto badfmt;
+            }
+        }
+        for (j = 0; j < vlen; j += 3) {
+            int class = nvm_placement_class_by_name(v[j]);
+
+            nvmPlacementThresholdFromString(v[j+1],&threshold);
+            server.nvm_placement[class].threshold = threshold;
+            server.nvm_placement[class].pin = nvm_placement_pin_by_name(v[j+2]);
+        }
+        sdsfreesplitres(v,vlen);
+    } config_set_special_field("nvm-tiering-promote-freq") {
+        if (getLongLongFromObject(o,&ll) == C_ERR || ll < 0 || ll > 255)
+            goto badfmt;
+        if (ll <= server.nvm_tiering_demote_freq) {
+            addReplyError(c,"nvm-tiering-promote-freq must be above "
+                            "nvm-tiering-demote-freq");
+            return;
+        }
+        server.nvm_tiering_promote_freq = ll;
+    } config_set_special_field("nvm-tiering-demote-freq") {
+        if (getLongLongFromObject(o,&ll) == C_ERR || ll < 0 || ll > 255)
+            goto badfmt;
+        if (ll >= server.nvm_tiering_promote_freq) {
+            addReplyError(c,"nvm-tiering-demote-freq must be below "
+                            "nvm-tiering-promote-freq");
+            return;
+        }
+        server.nvm_tiering_demote_freq = ll;
+#endif
+#ifdef USE_AOFGUARD
+    } config_set_special_field("aof-write-turbo-block-size") {
+        ll = memtoll(o->ptr,&err);
+        if (err || ll < 4096 || ll > AOFGUARD_NVM_SIZE/2) goto badfmt;
+        if (server.aofguard.aofguard &&
+            !aofguard_set_block_size(server.aofguard.aofguard,ll))
+        {
+            addReplyError(c,"Unable to change the AOF write turbo block size");
+            return;
+        }
+        server.aofguard.block_size = ll;
+#endif
     } config_set_special_field("notify-keyspace-events") {
         int flags = keyspaceEventsStringToFlags(o->ptr);
 
@@ -1118,10 +1322,16 @@ void configSetCommand(client *c) {
       "lazyfree-lazy-expire",server.lazyfree_lazy_expire) {
     } config_set_bool_field(
       "lazyfree-lazy-server-del",server.lazyfree_lazy_server_del) {
+    } config_set_bool_field(
+      "embed-string-keys",server.embed_string_keys) {
     } config_set_bool_field(
       "slave-lazy-flush",server.repl_slave_lazy_flush) {
     } config_set_bool_field(
       "no-appendfsync-on-rewrite",server.aof_no_fsync_on_rewrite) {
+#ifdef USE_NVM
+    } config_set_bool_field(
+      "nvm-tiering",server.nvm_tiering_enabled) {
+#endif
 
     /* Numerical fields.
      * config_set_numerical_field(name,var,min,max) */
@@ -1141,10 +1351,23 @@ void configSetCommand(client *c) {
       "active-defrag-threshold-upper",server.active_defrag_threshold_upper,0,1000) {
     } config_set_memory_field(
       "active-defrag-ignore-bytes",server.active_defrag_ignore_bytes) {
+    } config_set_memory_field(
+      "list-compress-cache-size",server.list_compress_cache_size) {
+        quicklistCacheTrim();
+    } config_set_memory_field(
+      "ziplist-index-cache-size",server.ziplist_index_cache_size) {
+        ziplistIndexSetLimits(server.ziplist_index_cache_size,
+                              server.ziplist_index_min_entries);
     } config_set_numerical_field(
       "active-defrag-cycle-min",server.active_defrag_cycle_min,1,99) {
     } config_set_numerical_field(
       "active-defrag-cycle-max",server.active_defrag_cycle_max,1,99) {
+#ifdef USE_NVM
+    } config_set_memory_field(
+      "nvm-tiering-dram-budget",server.nvm_tiering_dram_budget) {
+    } config_set_numerical_field(
+      "nvm-tiering-max-bandwidth",server.nvm_tiering_max_bandwidth,1,LLONG_MAX) {
+#endif
     } config_set_numerical_field(
       "auto-aof-rewrite-percentage",server.aof_rewrite_perc,0,LLONG_MAX){
     } config_set_numerical_field(
@@ -1163,6 +1386,10 @@ void configSetCommand(client *c) {
       "zset-max-ziplist-entries",server.zset_max_ziplist_entries,0,LLONG_MAX) {
     } config_set_numerical_field(
       "zset-max-ziplist-value",server.zset_max_ziplist_value,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "ziplist-index-min-entries",server.ziplist_index_min_entries,0,UINT_MAX) {
+        ziplistIndexSetLimits(server.ziplist_index_cache_size,
+                              server.ziplist_index_min_entries);
     } config_set_numerical_field(
       "hll-sparse-max-bytes",server.hll_sparse_max_bytes,0,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1237,6 +1464,10 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "list-compress-codec",server.list_compress_codec,list_compress_codec_enum) {
+    } config_set_enum_field(
+      "zset-encoding",server.zset_encoding,zset_encoding_enum) {
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1324,6 +1555,12 @@ void configGetCommand(client *c) {
     config_get_numerical_field("active-defrag-ignore-bytes",server.active_defrag_ignore_bytes);
     config_get_numerical_field("active-defrag-cycle-min",server.active_defrag_cycle_min);
     config_get_numerical_field("active-defrag-cycle-max",server.active_defrag_cycle_max);
+#ifdef USE_NVM
+    config_get_numerical_field("nvm-tiering-dram-budget",server.nvm_tiering_dram_budget);
+    config_get_numerical_field("nvm-tiering-max-bandwidth",server.nvm_tiering_max_bandwidth);
+    config_get_numerical_field("nvm-tiering-promote-freq",server.nvm_tiering_promote_freq);
+    config_get_numerical_field("nvm-tiering-demote-freq",server.nvm_tiering_demote_freq);
+#endif
     config_get_numerical_field("auto-aof-rewrite-percentage",
             server.aof_rewrite_perc);
     config_get_numerical_field("auto-aof-rewrite-min-size",
@@ -1336,10 +1573,16 @@ void configGetCommand(client *c) {
             server.list_max_ziplist_size);
     config_get_numerical_field("list-compress-depth",
             server.list_compress_depth);
+    config_get_numerical_field("list-compress-cache-size",
+            server.list_compress_cache_size);
     config_get_numerical_field("set-max-intset-entries",
             server.set_max_intset_entries);
     config_get_numerical_field("zset-max-ziplist-entries",
             server.zset_max_ziplist_entries);
+    config_get_numerical_field("ziplist-index-cache-size",
+            server.ziplist_index_cache_size);
+    config_get_numerical_field("ziplist-index-min-entries",
+            server.ziplist_index_min_entries);
     config_get_numerical_field("zset-max-ziplist-value",
             server.zset_max_ziplist_value);
     config_get_numerical_field("hll-sparse-max-bytes",
@@ -1356,6 +1599,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
+    config_get_numerical_field("io-threads",server.io_threads_num);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
     config_get_numerical_field("repl-backlog-size",server.repl_backlog_size);
@@ -1389,6 +1633,9 @@ void configGetCommand(client *c) {
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
     config_get_bool_field("activerehashing", server.activerehashing);
     config_get_bool_field("activedefrag", server.active_defrag_enabled);
+#ifdef USE_NVM
+    config_get_bool_field("nvm-tiering", server.nvm_tiering_enabled);
+#endif
     config_get_bool_field("protected-mode", server.protected_mode);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
@@ -1406,6 +1653,8 @@ void configGetCommand(client *c) {
             server.lazyfree_lazy_expire);
     config_get_bool_field("lazyfree-lazy-server-del",
             server.lazyfree_lazy_server_del);
+    config_get_bool_field("embed-string-keys",
+            server.embed_string_keys);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
 
@@ -1416,6 +1665,10 @@ void configGetCommand(client *c) {
             server.verbosity,loglevel_enum);
     config_get_enum_field("supervised",
             server.supervised_mode,supervised_mode_enum);
+    config_get_enum_field("list-compress-codec",
+            server.list_compress_codec,list_compress_codec_enum);
+    config_get_enum_field("zset-encoding",
+            server.zset_encoding,zset_encoding_enum);
 #ifdef USE_AOFGUARD
     if(stringmatch(pattern, "appendfsync", 1))
     {
@@ -1426,6 +1679,8 @@ void configGetCommand(client *c) {
             addReplyBulkCString(c, configEnumGetNameOrUnknown(aof_fsync_enum, server.aof_fsync));
         matches++;
     }
+    config_get_numerical_field("aof-write-turbo-block-size",
+            server.aofguard.block_size);
 #else
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
@@ -1484,6 +1739,29 @@ void configGetCommand(client *c) {
         sdsfree(buf);
         matches++;
     }
+#ifdef USE_NVM
+    if (stringmatch(pattern,"nvm-placement",1)) {
+        sds buf = sdsempty();
+        int j;
+
+        for (j = 0; j < NVM_CLASS_COUNT; j++) {
+            nvmPlacementPolicy *policy = server.nvm_placement+j;
+
+            buf = sdscatprintf(buf,"%s ",nvm_placement_class_name(j));
+            if (policy->threshold == NVM_THRESHOLD_DEFAULT)
+                buf = sdscat(buf,"default");
+            else
+                buf = sdscatprintf(buf,"%lld",policy->threshold);
+            buf = sdscatprintf(buf," %s",nvm_placement_pin_name(policy->pin));
+            if (j != NVM_CLASS_COUNT-1)
+                buf = sdscatlen(buf," ",1);
+        }
+        addReplyBulkCString(c,"nvm-placement");
+        addReplyBulkCString(c,buf);
+        sdsfree(buf);
+        matches++;
+    }
+#endif
     if (stringmatch(pattern,"unixsocketperm",1)) {
         char buf[32];
         snprintf(buf,sizeof(buf),"%o",server.unixsocketperm);
@@ -1895,6 +2173,32 @@ void rewriteConfigClientoutputbufferlimitOption(struct rewriteConfigState *state
     }
 }
 
+#ifdef USE_NVM
+/* Rewrite the nvm-placement option. */
+void rewriteConfigNvmPlacementOption(struct rewriteConfigState *state) {
+    int j;
+    char *option = "nvm-placement";
+
+    for (j = 0; j < NVM_CLASS_COUNT; j++) {
+        nvmPlacementPolicy *policy = server.nvm_placement+j;
+        int force = policy->threshold != NVM_THRESHOLD_DEFAULT ||
+                    policy->pin != NVM_PIN_NONE;
+        char threshold[64];
+        sds line;
+
+        if (policy->threshold == NVM_THRESHOLD_DEFAULT)
+            snprintf(threshold,sizeof(threshold),"default");
+        else
+            rewriteConfigFormatMemory(threshold,sizeof(threshold),
+                policy->threshold);
+        line = sdscatprintf(sdsempty(),"%s %s %s %s",
+                option, nvm_placement_class_name(j), threshold,
+                nvm_placement_pin_name(policy->pin));
+        rewriteConfigRewriteLine(state,option,line,force);
+    }
+}
+#endif
+
 /* Rewrite the bind option. */
 void rewriteConfigBindOption(struct rewriteConfigState *state) {
     int force = 1;
@@ -2075,6 +2379,7 @@ int rewriteConfig(char *path) {
     rewriteConfigSyslogfacilityOption(state);
     rewriteConfigSaveOption(state);
     rewriteConfigNumericalOption(state,"databases",server.dbnum,CONFIG_DEFAULT_DBNUM);
+    rewriteConfigNumericalOption(state,"io-threads",server.io_threads_num,CONFIG_DEFAULT_IO_THREADS_NUM);
     rewriteConfigYesNoOption(state,"stop-writes-on-bgsave-error",server.stop_writes_on_bgsave_err,CONFIG_DEFAULT_STOP_WRITES_ON_BGSAVE_ERROR);
     rewriteConfigYesNoOption(state,"rdbcompression",server.rdb_compression,CONFIG_DEFAULT_RDB_COMPRESSION);
     rewriteConfigYesNoOption(state,"rdbchecksum",server.rdb_checksum,CONFIG_DEFAULT_RDB_CHECKSUM);
@@ -2127,9 +2432,15 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-compress-codec",server.list_compress_codec,list_compress_codec_enum,OBJ_LIST_COMPRESS_CODEC);
+    rewriteConfigBytesOption(state,"list-compress-cache-size",server.list_compress_cache_size,OBJ_LIST_COMPRESS_CACHE_SIZE);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
+    rewriteConfigEnumOption(state,"zset-encoding",server.zset_encoding,zset_encoding_enum,OBJ_ZSET_ENCODING);
+    rewriteConfigBytesOption(state,"ziplist-index-cache-size",server.ziplist_index_cache_size,OBJ_ZIPLIST_INDEX_CACHE_SIZE);
+    rewriteConfigNumericalOption(state,"ziplist-index-min-entries",server.ziplist_index_min_entries,OBJ_ZIPLIST_INDEX_MIN_ENTRIES);
+    rewriteConfigYesNoOption(state,"embed-string-keys",server.embed_string_keys,OBJ_EMBED_STRING_KEYS);
     rewriteConfigNumericalOption(state,"hll-sparse-max-bytes",server.hll_sparse_max_bytes,CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES);
     rewriteConfigYesNoOption(state,"activerehashing",server.activerehashing,CONFIG_DEFAULT_ACTIVE_REHASHING);
     rewriteConfigYesNoOption(state,"activedefrag",server.active_defrag_enabled,CONFIG_DEFAULT_ACTIVE_DEFRAG);
@@ -2144,6 +2455,17 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
     rewriteConfigYesNoOption(state,"slave-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
+#ifdef USE_NVM
+    rewriteConfigNvmPlacementOption(state);
+    rewriteConfigYesNoOption(state,"nvm-tiering",server.nvm_tiering_enabled,CONFIG_DEFAULT_NVM_TIERING);
+    rewriteConfigBytesOption(state,"nvm-tiering-dram-budget",server.nvm_tiering_dram_budget,CONFIG_DEFAULT_NVM_TIERING_DRAM_BUDGET);
+    rewriteConfigBytesOption(state,"nvm-tiering-max-bandwidth",server.nvm_tiering_max_bandwidth,CONFIG_DEFAULT_NVM_TIERING_MAX_BANDWIDTH);
+    rewriteConfigNumericalOption(state,"nvm-tiering-promote-freq",server.nvm_tiering_promote_freq,CONFIG_DEFAULT_NVM_TIERING_PROMOTE_FREQ);
+    rewriteConfigNumericalOption(state,"nvm-tiering-demote-freq",server.nvm_tiering_demote_freq,CONFIG_DEFAULT_NVM_TIERING_DEMOTE_FREQ);
+#endif
+#ifdef USE_AOFGUARD
+    rewriteConfigBytesOption(state,"aof-write-turbo-block-size",server.aofguard.block_size,CONFIG_DEFAULT_AOFGUARD_BLOCK_SIZE);
+#endif
 
     /* Rewrite Sentinel config if in Sentinel mode. */
     if (server.sentinel_mode) rewriteConfigSentinelOption(state);
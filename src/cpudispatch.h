@@ -0,0 +1,99 @@
+/* Runtime selection of SIMD kernels.
+ *
+ * The SIMD kernels of intset.c, hyperloglog.c and bitops.c are compiled
+ * with __attribute__((target(...))), so the binary runs on any x86_64 CPU,
+ * and one of them is selected at runtime. Every file keeps a table of
+ * kernels in order of preference, each one declaring the CPU_* features it
+ * needs, the last one being the portable C kernel that needs none:
+ *
+ *  static struct fooKernel fooKernels[] = {
+ *      {"avx2",CPU_AVX2,fooAVX2},
+ *      {"scalar",0,fooScalar}
+ *  };
+ *
+ *  static struct fooKernel *fooGetKernel(void) {
+ *      static struct fooKernel *kernel = NULL;
+ *      CPU_DISPATCH(kernel,fooKernels);
+ *      return kernel;
+ *  }
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2018, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CPUDISPATCH_H
+#define __CPUDISPATCH_H
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_CPU_DISPATCH 1
+#endif
+
+#define CPU_SSSE3               (1<<0)
+#define CPU_SSE4_1              (1<<1)
+#define CPU_AVX2                (1<<2)
+#define CPU_AVX512F             (1<<3)
+#define CPU_AVX512VPOPCNTDQ     (1<<4)
+
+/* Return the CPU_* features of the running CPU. They are probed the first
+ * time, concurrent callers just probe them twice. */
+static inline unsigned int cpuFeatures(void) {
+    static int features = -1;
+
+    if (features == -1) {
+        int f = 0;
+#ifdef HAVE_CPU_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3")) f |= CPU_SSSE3;
+        if (__builtin_cpu_supports("sse4.1")) f |= CPU_SSE4_1;
+        if (__builtin_cpu_supports("avx2")) f |= CPU_AVX2;
+        if (__builtin_cpu_supports("avx512f")) f |= CPU_AVX512F;
+        if (__builtin_cpu_supports("avx512vpopcntdq"))
+            f |= CPU_AVX512VPOPCNTDQ;
+#endif
+        features = f;
+    }
+    return features;
+}
+
+/* Return non zero if the CPU has all the 'features'. */
+static inline int cpuSupports(unsigned int features) {
+    return (cpuFeatures() & features) == features;
+}
+
+/* Set 'kernel', if still NULL, to the first entry of the array 'kernels'
+ * whose 'features' the CPU has. */
+#define CPU_DISPATCH(kernel,kernels) do { \
+    if ((kernel) == NULL) { \
+        unsigned long _j = 0; \
+        while (!cpuSupports((kernels)[_j].features)) _j++; \
+        (kernel) = &(kernels)[_j]; \
+    } \
+} while(0)
+
+#endif
@@ -31,6 +31,9 @@
 #include "server.h"
 #include "cluster.h"
 #include "atomicvar.h"
+#ifdef USE_NVM
+#include "nvm.h"
+#endif
 
 #include <signal.h>
 #include <ctype.h>
@@ -140,6 +143,7 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
  * does not exist in the specified DB. */
 robj *lookupKeyWrite(redisDb *db, robj *key) {
     expireIfNeeded(db,key);
+    rdbThreadedSaveTouchKey(db,key);
     return lookupKey(db,key,LOOKUP_NONE);
 }
 
@@ -160,11 +164,19 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
+    sds copy;
+
+    rdbThreadedSaveTouchKey(db,key);
+    if (val->keyed && sdscmp(keyedObjectKey(val),key->ptr) == 0) {
+        /* The value carries the key name: no need for a copy. */
+        copy = keyedObjectKey(val);
+    } else {
 #ifdef USE_NVM
-    sds copy = sdsdupnvm(key->ptr);
+        copy = sdsdupplaced(key->ptr,NVM_CLASS_KEY);
 #else
-    sds copy = sdsdup(key->ptr);
+        copy = sdsdup(key->ptr);
 #endif
+    }
     
     int retval = dictAdd(db->dict, copy, val);
 
@@ -173,15 +185,68 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
     if (server.cluster_enabled) slotToKeyAdd(key);
  }
 
+/* The key of 'de' lives inside its current value, that is going to be
+ * replaced by 'val' (see createKeyedStringObject()). Move it inside 'val'
+ * if it carries the same key name, or to a copy of its own otherwise. The
+ * expires dict shares the key pointer, so it is updated as well. */
+void dbRehomeKey(redisDb *db, dictEntry *de, robj *val) {
+    sds oldkey = dictGetKey(de), newkey;
+    dictEntry *ede = NULL;
+
+    if (val->keyed && sdscmp(keyedObjectKey(val),oldkey) == 0) {
+        newkey = keyedObjectKey(val);
+    } else {
+#ifdef USE_NVM
+        newkey = sdsdupplaced(oldkey,NVM_CLASS_KEY);
+#else
+        newkey = sdsdup(oldkey);
+#endif
+    }
+    if (dictSize(db->expires)) ede = dictFind(db->expires,oldkey);
+    dictSetKey(db->dict,de,newkey);
+    if (ede) dictSetKey(db->expires,ede,newkey);
+}
+
+/* Return a copy of 'val' that also carries the name of 'key', so that
+ * the pair takes a single allocation (see createKeyedStringObject()), or
+ * NULL if 'val' is not a small string or the key doesn't stay in DRAM. */
+robj *dbKeyedValue(robj *key, robj *val) {
+    size_t len, keylen = sdslen(key->ptr);
+
+    if (!server.embed_string_keys || val->type != OBJ_STRING ||
+        val->encoding != OBJ_ENCODING_EMBSTR) return NULL;
+#ifdef SUPPORT_PBA
+    /* The pointer based AOF references keyspace values by address. */
+    if (server.pba.enable) return NULL;
+#endif
+    len = sdslen(val->ptr);
+    if (sizeof(robj)+sizeof(struct sdshdr8)*2+len+keylen+2 >
+        OBJ_KEYED_SIZE_LIMIT) return NULL;
+#ifdef USE_NVM
+    if (nvm_place(NVM_CLASS_KEY,sizeof(struct sdshdr8)+keylen+1))
+        return NULL;
+#endif
+    robj *keyed = createKeyedStringObject(key->ptr,val->ptr,len);
+#ifdef USE_NVM
+    nvm_placed(NVM_CLASS_KEY,keyedObjectKey(keyed),
+               sizeof(struct sdshdr8)+keylen+1);
+#endif
+    return keyed;
+}
+
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
  *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(redisDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    dictEntry *de;
+
+    rdbThreadedSaveTouchKey(db,key);
+    de = dictFind(db->dict,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
+    if (sdsIsHosted(dictGetKey(de))) dbRehomeKey(db,de,val);
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         robj *old = dictGetVal(de);
         int saved_lru = old->lru;
@@ -195,18 +260,23 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
 /* High level Set operation. This function can be used in order to set
  * a key, whatever it was existing or not, to a new object.
  *
- * 1) The ref count of the value object is incremented.
+ * 1) The ref count of the value object is incremented, unless it is a small
+ *    string stored as a keyed copy (see dbKeyedValue()).
  * 2) clients WATCHing for the destination key notified.
  * 3) The expire time of the key is reset (the key is made persistent).
  *
  * All the new keys in the database should be craeted via this interface. */
 void setKey(redisDb *db, robj *key, robj *val) {
+    robj *keyed = dbKeyedValue(key,val);
+
+    /* A keyed copy is stored in place of 'val', and is referenced by the
+     * keyspace only. */
+    if (keyed) val = keyed; else incrRefCount(val);
     if (lookupKeyWrite(db,key) == NULL) {
         dbAdd(db,key,val);
     } else {
         dbOverwrite(db,key,val);
     }
-    incrRefCount(val);
     removeExpire(db,key);
     signalModifiedKey(db,key);
 }
@@ -243,6 +313,7 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
+    rdbThreadedSaveTouchKey(db,key);
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
@@ -322,6 +393,12 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
         return -1;
     }
 
+    /* A threaded BGSAVE can't outlive the dictionaries it is reading. */
+    rdbThreadedSaveAbort();
+    /* Nor can pending replies reference the values the lazy free thread
+     * is going to release. */
+    if (async) copyReplyRefs();
+
     for (j = 0; j < server.dbnum; j++) {
         if (dbnum != -1 && dbnum != j) continue;
         removed += dictSize(server.db[j].dict);
@@ -548,7 +625,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(zsetDictGetScore(o,de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -652,7 +729,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
@@ -964,6 +1042,7 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    rdbThreadedSaveAbort();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1028,6 +1107,7 @@ void swapdbCommand(client *c) {
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
+    rdbThreadedSaveTouchKey(db,key);
     serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
@@ -1040,6 +1120,7 @@ void setExpire(client *c, redisDb *db, robj *key, long long when) {
     dictEntry *kde, *de;
 
     /* Reuse the sds from the main dict in the expire dict */
+    rdbThreadedSaveTouchKey(db,key);
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
     de = dictAddOrFind(db->expires,dictGetKey(kde));
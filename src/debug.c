@@ -41,6 +41,9 @@
 #include <ucontext.h>
 #include <fcntl.h>
 #include "bio.h"
+#ifdef USE_NVM
+#include "nvm.h"
+#endif
 #include <unistd.h>
 #endif /* HAVE_BACKTRACE */
 
@@ -205,16 +208,17 @@ void computeDatasetDigest(unsigned char *final) {
                         xorDigest(digest,eledigest,20);
                         zzlNext(zl,&eptr,&sptr);
                     }
-                } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+                } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                           o->encoding == OBJ_ENCODING_BTREE) {
                     zset *zs = o->ptr;
                     dictIterator *di = dictGetIterator(zs->dict);
                     dictEntry *de;
 
                     while((de = dictNext(di)) != NULL) {
                         sds sdsele = dictGetKey(de);
-                        double *score = dictGetVal(de);
+                        double score = zsetDictGetScore(o,de);
 
-                        snprintf(buf,sizeof(buf),"%.17g",*score);
+                        snprintf(buf,sizeof(buf),"%.17g",score);
                         memset(eledigest,0,20);
                         mixDigest(eledigest,sdsele,sdslen(sdsele));
                         mixDigest(eledigest,buf,strlen(buf));
@@ -359,6 +363,16 @@ void debugCommand(client *c) {
         addReply(c,shared.ok);
     }else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
         if (server.aof_state == AOF_ON) flushAppendOnlyFile(1);
+#ifdef USE_AOFGUARD
+        /* The file is loaded back, so it must not miss what is still in
+         * the NVM ring. */
+        if (server.aofguard.enable &&
+            !aofguard_flush(server.aofguard.aofguard))
+        {
+            addReplyError(c,"Error flushing the AOF guard");
+            return;
+        }
+#endif
         emptyDb(-1,EMPTYDB_NO_FLAGS,NULL);
         if (loadAppendOnlyFile(server.aof_filename) != C_OK) {
             addReply(c,shared.err);
@@ -411,6 +425,13 @@ void debugCommand(client *c) {
             nextra += used;
             remaining -= used;
         }
+#ifdef USE_NVM
+        if (sdsEncodedObject(val)) {
+            size_t used = strlen(extra);
+            snprintf(extra+used,sizeof(extra)-used," nvm:%d",
+                is_nvm_addr(val->ptr) ? 1 : 0);
+        }
+#endif
 
         addReplyStatusFormat(c,
             "Value at:%p refcount:%d "
@@ -485,6 +506,11 @@ void debugCommand(client *c) {
                 val = createStringObject(NULL,valsize);
                 memcpy(val->ptr, buf, valsize<=buflen? valsize: buflen);
             }
+            robj *keyed = dbKeyedValue(key,val);
+            if (keyed) {
+                decrRefCount(val);
+                val = keyed;
+            }
             dbAdd(c->db,key,val);
             signalModifiedKey(c->db,key);
             decrRefCount(key);
@@ -640,6 +666,8 @@ void serverLogObjectDebugInfo(const robj *o) {
         serverLog(LL_WARNING,"Sorted set size: %d", (int) zsetLength(o));
         if (o->encoding == OBJ_ENCODING_SKIPLIST)
             serverLog(LL_WARNING,"Skiplist level: %d", (int) ((const zset*)o->ptr)->zsl->level);
+        else if (o->encoding == OBJ_ENCODING_BTREE)
+            serverLog(LL_WARNING,"B+tree height: %d", ((const zset*)o->ptr)->zbt->height);
     }
 }
 
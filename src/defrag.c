@@ -148,7 +148,8 @@ sds activeDefragSds(sds sdsptr) {
  * and should NOT be accessed. */
 robj *activeDefragStringOb(robj* ob, int *defragged) {
     robj *ret = NULL;
-    if (ob->refcount!=1)
+    /* A keyed string is pointed by its own key, which lives inside it. */
+    if (ob->refcount!=1 || ob->keyed)
         return NULL;
 
     /* try to defrag robj (only if not an EMBSTR type (handled below). */
@@ -469,6 +470,7 @@ int activeDefragZiplistZset(robj* o)
         new_zl = ziplistPush(new_zl, (unsigned char*)buffer, buf_sz, ZIPLIST_TAIL);
         zzlNext(zl, &eptr, &sptr);
     }
+    ziplistIndexDrop(zl);
     zfree(zl);
     o->ptr = new_zl;
     return defragged;
@@ -535,6 +537,7 @@ int activeDefragZiplistHash(robj* o)
 #endif
         ptr = ziplistNext(zl, ptr);
     }
+    ziplistIndexDrop(zl);
     zfree(zl);
     o->ptr = new_zl;
     return defragged;
@@ -627,8 +630,8 @@ int defragKey(redisDb *db, dictEntry *de) {
     int defragged = 0;
     sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
+    /* Try to defrag the key name, unless it is embedded in the value. */
+    newsds = sdsIsHosted(keysds) ? NULL : activeDefragSds(keysds);
     if (newsds)
         defragged++, de->key = newsds;
     if (dictSize(db->expires)) {
@@ -686,6 +689,8 @@ int defragKey(redisDb *db, dictEntry *de) {
 #endif
             while (node) {
                 if ((newnode = activeDefragAlloc(node))) {
+                    if (newnode->cached)
+                        quicklistCacheNodeMoved(node, newnode);
                     if (newnode->prev)
                         newnode->prev->next = newnode;
                     else
@@ -750,6 +755,7 @@ int defragKey(redisDb *db, dictEntry *de) {
             defragged += activeDefragZiplistZset(ob);
 #endif
 #endif
+            ziplistIndexDrop(ob->ptr);
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -786,6 +792,30 @@ int defragKey(redisDb *db, dictEntry *de) {
             }
             dictReleaseIterator(di);
             dictDefragTables(&zs->dict);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = (zset*)ob->ptr;
+            zset *newzs;
+            zbtree *newzbt;
+            if ((newzs = activeDefragAlloc(zs)))
+                defragged++, ob->ptr = zs = newzs;
+            if ((newzbt = activeDefragAlloc(zs->zbt)))
+                defragged++, zs->zbt = newzbt;
+            d = zs->dict;
+            di = dictGetIterator(d);
+            while((de = dictNext(di)) != NULL) {
+                sds sdsele = dictGetKey(de);
+                if ((newsds = activeDefragSds(sdsele))) {
+#ifdef SUPPORT_PBA
+                    defragZsetPBA(db->id, keyobj, sdsele, newsds, dictGetDoubleVal(de));
+#endif
+                    defragged++, de->key = newsds;
+                    zbtReplaceEle(zs->zbt, dictGetDoubleVal(de), sdsele, newsds);
+                }
+                defragged += dictIterDefragEntry(di);
+            }
+            dictReleaseIterator(di);
+            defragged += zbtDefragNodes(zs->zbt, activeDefragAlloc);
+            dictDefragTables(&zs->dict);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -798,6 +828,7 @@ int defragKey(redisDb *db, dictEntry *de) {
             defragged += activeDefragZiplistHash(ob);
 #endif
 #endif
+            ziplistIndexDrop(ob->ptr);
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -937,7 +968,8 @@ void activeDefragCycle(void) {
     unsigned long long defragged = server.stat_active_defrag_hits;
     long long start, timelimit;
 
-    if (server.aof_child_pid!=-1 || server.rdb_child_pid!=-1)
+    if (server.aof_child_pid!=-1 || server.rdb_child_pid!=-1 ||
+        server.rdb_threaded_in_progress)
         return; /* Defragging memory while there's a fork will just do damage. */
 
     /* Once a second, check if we the fragmentation justfies starting a scan
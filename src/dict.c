@@ -42,6 +42,9 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <sys/time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "dict.h"
 #include "zmalloc.h"
@@ -68,6 +71,16 @@ static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
 static int _dictKeyIndex(dict *ht, const void *key, unsigned int hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static unsigned long rev(unsigned long v);
+static int dictOaRehash(dict *d, int n);
+static int _dictOaExpandIfNeeded(dict *d);
+static void dictOaGrowTarget(dict *d);
+static dictEntry *dictOaAddRaw(dict *d, void *key, dictEntry **existing);
+static dictEntry *dictOaGenericDelete(dict *d, const void *key, int nofree);
+static dictEntry *dictOaFind(dict *d, const void *key);
+static void _dictOaClear(dict *d, dictht *ht, void(callback)(void *));
+static dictEntry *dictOaNext(dictIterator *iter);
+static unsigned long dictOaScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -95,6 +108,113 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, int len) {
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* ---------------------------- open addressing -----------------------------
+ *
+ * Dicts whose type sets 'openAddressing' don't chain separately allocated
+ * dictEntry structures: the key and the value are stored in the table
+ * itself, so a successful lookup touches a tag and a slot instead of the
+ * bucket, the entry, and the entries before it in the chain, and every
+ * element costs 17 bytes of table instead of a 32 bytes allocation plus a
+ * bucket pointer.
+ *
+ * The layout follows SwissTable. Slots are grouped 16 by 16, and a parallel
+ * array holds a one byte tag for every slot: 7 bits of the hash of the key
+ * for a full slot, or a marker for empty and deleted slots. A key lives in
+ * the first group with a free slot starting from its home group, given by
+ * the low bits of the hash like a bucket, so a lookup compares the 16 tags
+ * of a group with the tag of the key at once (with SSE2 when available),
+ * compares the keys of the matching slots, and goes on with the next group
+ * only if the group has no empty slot. A deleted slot is marked empty when
+ * its group already has an empty slot, otherwise it is marked as deleted so
+ * that the probes crossing the group don't stop there: deleted slots are
+ * reused by insertions, and purged when the table is rehashed.
+ *
+ * Rehashing is incremental like for chained tables: rehashidx is the next
+ * group of ht[0] to move to ht[1], moved groups are left empty, and lookups
+ * in ht[0] skip them. The position of an element in a table is still given
+ * by the low bits of its hash, so dictScan() visits home groups with the
+ * reversed cursor exactly like buckets, with the same guarantees, see
+ * dictOaScan().
+ *
+ * Elements are returned as pointers to their slot, that has the layout of a
+ * dictEntry without the 'next' field. These pointers stay valid until the
+ * element is deleted or the table is rehashed: for this reason lookups never
+ * perform rehashing steps in open addressing dicts, only insertions and
+ * deletions do, and callers must not keep an entry across an insertion or
+ * a deletion. */
+
+#define DICT_OA_GROUP 16            /* Slots probed at once. */
+#define DICT_OA_EMPTY 0x80          /* Tag of empty slots. */
+#define DICT_OA_DELETED 0xfe        /* Tag of deleted slots. */
+#define dictOaIsFull(tag) (!((tag) & 0x80))
+#define dictOaTag(h) ((uint8_t)((h) >> 57))
+
+typedef struct dictOaSlot {
+    void *key;
+    union {
+        void *val;
+        uint64_t u64;
+        int64_t s64;
+        double d;
+    } v;
+} dictOaSlot;
+
+/* A table is a single allocation: this header, 'size' slots, and 'size'
+ * tags. ht->table points to the header. */
+typedef struct dictOaTable {
+    unsigned long deleted;      /* Slots tagged DICT_OA_DELETED. */
+    dictOaSlot slots[];
+} dictOaTable;
+
+#define dictOaTab(ht) ((dictOaTable*)(ht)->table)
+#define dictOaSlots(ht) (dictOaTab(ht)->slots)
+#define dictOaTags(ht) ((uint8_t*)(dictOaSlots(ht)+(ht)->size))
+#define dictOaGroupMask(ht) ((ht)->sizemask/DICT_OA_GROUP)
+
+/* Number of buckets (or slots) at the start of ht[0] already rehashed, so
+ * known to be empty. */
+#define dictRehashedBuckets(d) ((unsigned long)(d)->rehashidx * \
+    (dictIsOpenAddressing(d) ? DICT_OA_GROUP : 1))
+
+/* Return a bitmap of the slots of the group starting at 'tags' tagged
+ * 'tag'. */
+static inline unsigned int dictOaMatch(const uint8_t *tags, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8((char)tag)));
+#else
+    unsigned int mask = 0, j;
+
+    for (j = 0; j < DICT_OA_GROUP; j++)
+        if (tags[j] == tag) mask |= 1<<j;
+    return mask;
+#endif
+}
+
+/* Return a bitmap of the free (empty or deleted) slots of the group
+ * starting at 'tags'. */
+static inline unsigned int dictOaMatchFree(const uint8_t *tags) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)tags));
+#else
+    unsigned int mask = 0, j;
+
+    for (j = 0; j < DICT_OA_GROUP; j++)
+        if (!dictOaIsFull(tags[j])) mask |= 1<<j;
+    return mask;
+#endif
+}
+
+#define dictOaMatchFull(tags) (~dictOaMatchFree(tags) & 0xffff)
+
+static dictOaTable *dictOaCreateTable(unsigned long size) {
+    dictOaTable *t = zmalloc(sizeof(*t)+size*(sizeof(dictOaSlot)+1));
+
+    t->deleted = 0;
+    memset(t->slots+size,DICT_OA_EMPTY,size);
+    return t;
+}
+
 /* ----------------------------- API implementation ------------------------- */
 
 /* Reset a hash table already initialized with ht_init().
@@ -147,20 +267,35 @@ int dictResize(dict *d)
 int dictExpand(dict *d, unsigned long size)
 {
     dictht n; /* the new hash table */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize;
+
+    /* Open addressing tables hold 'size' elements at a 7/8 load, and are
+     * made of whole groups. */
+    if (dictIsOpenAddressing(d)) {
+        realsize = _dictNextPower(size+size/7);
+        if (realsize < DICT_OA_GROUP) realsize = DICT_OA_GROUP;
+    } else {
+        realsize = _dictNextPower(size);
+    }
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hash table */
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    /* Rehashing to the same table size is not useful. */
-    if (realsize == d->ht[0].size) return DICT_ERR;
+    /* Rehashing to the same table size is not useful, unless it purges the
+     * deleted slots of an open addressing table. */
+    if (realsize == d->ht[0].size &&
+        !(dictIsOpenAddressing(d) && d->ht[0].table &&
+          dictOaTab(&d->ht[0])->deleted)) return DICT_ERR;
 
     /* Allocate the new hash table and initialize all pointers to NULL */
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+    if (dictIsOpenAddressing(d))
+        n.table = (dictEntry**)dictOaCreateTable(realsize);
+    else
+        n.table = zcalloc(realsize*sizeof(dictEntry*));
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -188,6 +323,7 @@ int dictExpand(dict *d, unsigned long size)
 int dictRehash(dict *d, int n) {
     int empty_visits = n*10; /* Max number of empty buckets to visit. */
     if (!dictIsRehashing(d)) return 0;
+    if (dictIsOpenAddressing(d)) return dictOaRehash(d,n);
 
     while(n-- && d->ht[0].used != 0) {
         dictEntry *de, *nextde;
@@ -295,6 +431,7 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     dictEntry *entry;
     dictht *ht;
 
+    if (dictIsOpenAddressing(d)) return dictOaAddRaw(d,key,existing);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
@@ -339,7 +476,7 @@ int dictReplace(dict *d, void *key, void *val)
      * as the previous one. In this context, think to reference counting,
      * you want to increment (set), and then decrement (free), and not the
      * reverse. */
-    auxentry = *existing;
+    auxentry.v = existing->v;
     dictSetVal(d, existing, val);
     dictFreeVal(d, &auxentry);
     return 0;
@@ -366,6 +503,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
     dictEntry *he, *prevHe;
     int table;
 
+    if (dictIsOpenAddressing(d)) return dictOaGenericDelete(d,key,nofree);
     if (d->ht[0].used == 0 && d->ht[1].used == 0) return NULL;
 
     if (dictIsRehashing(d)) _dictRehashStep(d);
@@ -442,6 +580,11 @@ void dictFreeUnlinkedEntry(dict *d, dictEntry *he) {
 int _dictClear(dict *d, dictht *ht, void(callback)(void *)) {
     unsigned long i;
 
+    if (dictIsOpenAddressing(d)) {
+        _dictOaClear(d,ht,callback);
+        return DICT_OK;
+    }
+
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
         dictEntry *he, *nextHe;
@@ -478,6 +621,7 @@ dictEntry *dictFind(dict *d, const void *key)
     dictEntry *he;
     unsigned int h, idx, table;
 
+    if (dictIsOpenAddressing(d)) return dictOaFind(d,key);
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
@@ -561,6 +705,7 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (dictIsOpenAddressing(iter->d)) return dictOaNext(iter);
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -616,19 +761,22 @@ dictEntry *dictGetRandomKey(dict *d)
     if (dictSize(d) == 0) return NULL;
     if (dictIsRehashing(d)) _dictRehashStep(d);
     if (dictIsRehashing(d)) {
+        unsigned long first = dictRehashedBuckets(d);
+
         do {
             /* We are sure there are no elements in indexes from 0
              * to rehashidx-1 */
-            h = d->rehashidx + (random() % (d->ht[0].size +
-                                            d->ht[1].size -
-                                            d->rehashidx));
-            he = (h >= d->ht[0].size) ? d->ht[1].table[h - d->ht[0].size] :
-                                      d->ht[0].table[h];
+            h = first + (random() % (d->ht[0].size +
+                                     d->ht[1].size -
+                                     first));
+            he = (h >= d->ht[0].size) ?
+                dictBucketEntry(d,1,h - d->ht[0].size) :
+                dictBucketEntry(d,0,h);
         } while(he == NULL);
     } else {
         do {
             h = random() & d->ht[0].sizemask;
-            he = d->ht[0].table[h];
+            he = dictBucketEntry(d,0,h);
         } while(he == NULL);
     }
 
@@ -639,12 +787,12 @@ dictEntry *dictGetRandomKey(dict *d)
     listlen = 0;
     orighe = he;
     while(he) {
-        he = he->next;
+        he = dictBucketNext(d,he);
         listlen++;
     }
     listele = random() % listlen;
     he = orighe;
-    while(listele--) he = he->next;
+    while(listele--) he = dictBucketNext(d,he);
     return he;
 }
 
@@ -700,16 +848,16 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
             /* Invariant of the dict.c rehashing: up to the indexes already
              * visited in ht[0] during the rehashing, there are no populated
              * buckets, so we can skip ht[0] for indexes between 0 and idx-1. */
-            if (tables == 2 && j == 0 && i < (unsigned long) d->rehashidx) {
+            if (tables == 2 && j == 0 && i < dictRehashedBuckets(d)) {
                 /* Moreover, if we are currently out of range in the second
                  * table, there will be no elements in both tables up to
                  * the current rehashing index, so we jump if possible.
                  * (this happens when going from big to small table). */
-                if (i >= d->ht[1].size) i = d->rehashidx;
+                if (i >= d->ht[1].size) i = dictRehashedBuckets(d);
                 continue;
             }
             if (i >= d->ht[j].size) continue; /* Out of range for this table. */
-            dictEntry *he = d->ht[j].table[i];
+            dictEntry *he = dictBucketEntry(d,j,i);
 
             /* Count contiguous empty buckets, and jump to other
              * locations if they reach 'count' (with a minimum of 5). */
@@ -726,7 +874,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
                      * empty while iterating. */
                     *des = he;
                     des++;
-                    he = he->next;
+                    he = dictBucketNext(d,he);
                     stored++;
                     if (stored == count) return stored;
                 }
@@ -844,6 +992,7 @@ unsigned long dictScan(dict *d,
     unsigned long m0, m1;
 
     if (dictSize(d) == 0) return 0;
+    if (dictIsOpenAddressing(d)) return dictOaScan(d,v,fn,privdata);
 
     if (!dictIsRehashing(d)) {
         t0 = &(d->ht[0]);
@@ -911,6 +1060,375 @@ unsigned long dictScan(dict *d,
     return v;
 }
 
+/* Return the slot holding 'key' (with hash 'h') in table 'table', or NULL
+ * if the key is not there. */
+static dictOaSlot *dictOaLookup(dict *d, int table, const void *key, uint64_t h) {
+    dictht *ht = &d->ht[table];
+    unsigned long gmask, g, probes;
+    dictOaSlot *slots;
+    uint8_t *tags, tag = dictOaTag(h);
+
+    if (ht->used == 0) return NULL;
+    gmask = dictOaGroupMask(ht);
+    slots = dictOaSlots(ht);
+    tags = dictOaTags(ht);
+    g = h & gmask;
+    for (probes = 0; probes <= gmask; probes++) {
+        unsigned int match;
+
+        /* Groups of ht[0] before rehashidx were moved and are empty. */
+        if (table == 0 && (long)g < d->rehashidx) g = d->rehashidx;
+        match = dictOaMatch(tags+g*DICT_OA_GROUP,tag);
+        while (match) {
+            dictOaSlot *s = slots+g*DICT_OA_GROUP+__builtin_ctz(match);
+            if (key == s->key || dictCompareKeys(d, key, s->key)) return s;
+            match &= match-1;
+        }
+        if (dictOaMatch(tags+g*DICT_OA_GROUP,DICT_OA_EMPTY)) break;
+        g = (g+1) & gmask;
+    }
+    return NULL;
+}
+
+/* Take a free slot for a key with hash 'h' in table 'table', without
+ * checking if the key is already there. The caller fills the slot.
+ * NULL is returned if the table is full. */
+static dictOaSlot *dictOaInsert(dict *d, int table, uint64_t h) {
+    dictht *ht = &d->ht[table];
+    unsigned long gmask = dictOaGroupMask(ht), g = h & gmask;
+    uint8_t *tags = dictOaTags(ht);
+
+    if (ht->used == ht->size) return NULL;
+    while (1) {
+        unsigned int free = dictOaMatchFree(tags+g*DICT_OA_GROUP);
+
+        if (free) {
+            unsigned long idx = g*DICT_OA_GROUP+__builtin_ctz(free);
+
+            if (tags[idx] == DICT_OA_DELETED) dictOaTab(ht)->deleted--;
+            tags[idx] = dictOaTag(h);
+            ht->used++;
+            return dictOaSlots(ht)+idx;
+        }
+        g = (g+1) & gmask;
+    }
+}
+
+/* Release slot 's' of table 'ht'. A probe sequence stops at the first group
+ * with an empty slot, so the slot can be marked as empty only if its group
+ * already stops the probes crossing it. */
+static void dictOaRemove(dictht *ht, dictOaSlot *s) {
+    unsigned long idx = s-dictOaSlots(ht);
+    uint8_t *tags = dictOaTags(ht);
+
+    if (dictOaMatch(tags+(idx & ~(unsigned long)(DICT_OA_GROUP-1)),
+                    DICT_OA_EMPTY))
+    {
+        tags[idx] = DICT_OA_EMPTY;
+    } else {
+        tags[idx] = DICT_OA_DELETED;
+        dictOaTab(ht)->deleted++;
+    }
+    ht->used--;
+}
+
+/* Move N groups of ht[0] to ht[1], see dictRehash(). */
+static int dictOaRehash(dict *d, int n) {
+    int empty_visits = n*10; /* Max number of empty groups to visit. */
+    dictht *t0 = &d->ht[0];
+    dictOaSlot *slots = dictOaSlots(t0);
+    uint8_t *tags = dictOaTags(t0);
+
+    while(n-- && t0->used != 0) {
+        unsigned long base;
+        unsigned int full;
+
+        /* Note that rehashidx can't overflow as we are sure there are more
+         * elements because ht[0].used != 0 */
+        assert(dictOaGroupMask(t0) >= (unsigned long)d->rehashidx);
+        while(!(full = dictOaMatchFull(tags+d->rehashidx*DICT_OA_GROUP))) {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        base = d->rehashidx*DICT_OA_GROUP;
+        while(full) {
+            dictOaSlot *s = slots+base+__builtin_ctz(full);
+            dictOaSlot *t = dictOaInsert(d,1,dictHashKey(d,s->key));
+
+            /* ht[1] always has room for all the elements, see
+             * _dictOaExpandIfNeeded(). */
+            assert(t != NULL);
+            *t = *s;
+            t0->used--;
+            full &= full-1;
+        }
+        memset(tags+base,DICT_OA_EMPTY,DICT_OA_GROUP);
+        d->rehashidx++;
+    }
+
+    /* Check if we already rehashed the whole table... */
+    if (t0->used == 0) {
+        zfree(t0->table);
+        d->ht[0] = d->ht[1];
+        _dictReset(&d->ht[1]);
+        d->rehashidx = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Move the elements of ht[1] to a table twice as large, while the rehashing
+ * is paused by a safe iterator. Elements of ht[0] don't move, so iterators
+ * still walking ht[0] return every element once, but iterators that already
+ * reached ht[1] may return some of its elements again or skip them. */
+static void dictOaGrowTarget(dict *d) {
+    dictht old = d->ht[1];
+    dictOaSlot *slots = dictOaSlots(&old);
+    uint8_t *tags = dictOaTags(&old);
+    unsigned long j;
+
+    d->ht[1].size = old.size*2;
+    d->ht[1].sizemask = d->ht[1].size-1;
+    d->ht[1].table = (dictEntry**)dictOaCreateTable(d->ht[1].size);
+    d->ht[1].used = 0;
+    for (j = 0; j < old.size; j++) {
+        if (dictOaIsFull(tags[j]))
+            *dictOaInsert(d,1,dictHashKey(d,slots[j].key)) = slots[j];
+    }
+    zfree(old.table);
+}
+
+/* Expand the table if needed. Tables grow at a 7/8 load, counting the
+ * deleted slots as they lengthen probes as much as full ones: when most of
+ * them are deleted the table is rehashed to the same size, or shrunk. */
+static int _dictOaExpandIfNeeded(dict *d)
+{
+    dictht *ht = &d->ht[0];
+    unsigned long filled;
+
+    /* Insertions go to ht[1] while rehashing, and ht[1] can't grow before
+     * the rehashing is done, so it must never hold more elements than the
+     * 15/16 load allowed when resizing is disabled. Every insertion already
+     * moves a group of ht[0]: when there are more groups left than free
+     * slots, move enough groups that the rehashing ends before ht[1] is
+     * full. Each insertion still does a bounded amount of work, that only
+     * exceeds one group when the rehashing was paused for a long time.
+     *
+     * If the rehashing is paused by a safe iterator ht[1] fills up instead,
+     * up to its 7/8 load, then it is replaced by a table twice as large, see
+     * dictOaGrowTarget(). */
+    if (dictIsRehashing(d)) {
+        unsigned long size1 = d->ht[1].size, total = dictSize(d)+1;
+        unsigned long groups, room;
+
+        if (d->iterators) {
+            if (total*8 > size1*7) dictOaGrowTarget(d);
+            return DICT_OK;
+        }
+        groups = (ht->size/DICT_OA_GROUP) - d->rehashidx;
+        room = total < size1-size1/16 ? size1-size1/16-total : 0;
+        if (groups > room) dictOaRehash(d,room ? groups/room+1 : groups);
+        if (dictIsRehashing(d)) return DICT_OK;
+    }
+
+    if (ht->size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+
+    /* Like for chained tables, when resizing is disabled we wait longer,
+     * up to a 15/16 load. */
+    filled = ht->used + dictOaTab(ht)->deleted;
+    if ((filled+1)*8 > ht->size*7 &&
+        (dict_can_resize || (filled+1)*16 > ht->size*15))
+    {
+        return dictExpand(d, ht->used*2);
+    }
+    return DICT_OK;
+}
+
+static dictEntry *dictOaAddRaw(dict *d, void *key, dictEntry **existing)
+{
+    dictOaSlot *s;
+    uint64_t h;
+    int table;
+
+    if (existing) *existing = NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (_dictOaExpandIfNeeded(d) == DICT_ERR) return NULL;
+
+    h = dictHashKey(d,key);
+    for (table = 0; table <= 1; table++) {
+        if ((s = dictOaLookup(d,table,key,h)) != NULL) {
+            if (existing) *existing = (dictEntry*)s;
+            return NULL;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    s = dictOaInsert(d,dictIsRehashing(d) ? 1 : 0,h);
+    if (s == NULL) return NULL;
+    dictSetKey(d, s, key);
+    return (dictEntry*)s;
+}
+
+static dictEntry *dictOaGenericDelete(dict *d, const void *key, int nofree) {
+    dictEntry *he;
+    dictOaSlot *s;
+    uint64_t h;
+    int table;
+
+    if (dictSize(d) == 0) return NULL;
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        if ((s = dictOaLookup(d,table,key,h)) != NULL) {
+            if (nofree) {
+                /* The slot may be reused by the next insertion: the caller
+                 * gets a copy, released by dictFreeUnlinkedEntry(). */
+                he = zmalloc(sizeof(*he));
+                he->key = s->key;
+                memcpy(&he->v,&s->v,sizeof(he->v));
+                he->next = NULL;
+            } else {
+                dictFreeKey(d, s);
+                dictFreeVal(d, s);
+                he = (dictEntry*)s;
+            }
+            dictOaRemove(&d->ht[table],s);
+            return he;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL; /* not found */
+}
+
+static dictEntry *dictOaFind(dict *d, const void *key)
+{
+    dictOaSlot *s;
+    uint64_t h;
+
+    if (dictSize(d) == 0) return NULL; /* dict is empty */
+    h = dictHashKey(d, key);
+    s = dictOaLookup(d,0,key,h);
+    if (s == NULL && dictIsRehashing(d)) s = dictOaLookup(d,1,key,h);
+    return (dictEntry*)s;
+}
+
+static void _dictOaClear(dict *d, dictht *ht, void(callback)(void *)) {
+    unsigned long i;
+
+    if (ht->table) {
+        dictOaSlot *slots = dictOaSlots(ht);
+        uint8_t *tags = dictOaTags(ht);
+
+        for (i = 0; i < ht->size && ht->used > 0; i++) {
+            if (callback && (i & 65535) == 0) callback(d->privdata);
+            if (!dictOaIsFull(tags[i])) continue;
+            dictFreeKey(d, slots+i);
+            dictFreeVal(d, slots+i);
+            ht->used--;
+        }
+        zfree(ht->table);
+    }
+    _dictReset(ht);
+}
+
+static dictEntry *dictOaNext(dictIterator *iter)
+{
+    dictht *ht = &iter->d->ht[iter->table];
+
+    if (iter->index == -1 && iter->table == 0) {
+        if (iter->safe)
+            iter->d->iterators++;
+        else
+            iter->fingerprint = dictFingerprint(iter->d);
+    }
+    while (1) {
+        iter->index++;
+        if (iter->index >= (long) ht->size) {
+            if (dictIsRehashing(iter->d) && iter->table == 0) {
+                iter->table++;
+                iter->index = 0;
+                ht = &iter->d->ht[1];
+            } else {
+                break;
+            }
+        }
+        /* The user may delete the returned element: slots never move
+         * while iterating, unlike the entries of a chain there is no
+         * 'next' to save. */
+        if (dictOaIsFull(dictOaTags(ht)[iter->index]))
+            return (dictEntry*)(dictOaSlots(ht)+iter->index);
+    }
+    return NULL;
+}
+
+/* Call 'fn' for the elements of table 'table' whose home group is 'home':
+ * they are in the groups from 'home' to the first group with an empty
+ * slot. */
+static void dictOaScanGroup(dict *d, int table, unsigned long home,
+                            dictScanFunction *fn, void *privdata)
+{
+    dictht *ht = &d->ht[table];
+    unsigned long gmask, g = home, probes;
+    dictOaSlot *slots;
+    uint8_t *tags;
+
+    if (ht->used == 0) return;
+    gmask = dictOaGroupMask(ht);
+    slots = dictOaSlots(ht);
+    tags = dictOaTags(ht);
+    for (probes = 0; probes <= gmask; probes++) {
+        unsigned int full;
+
+        if (table == 0 && (long)g < d->rehashidx) g = d->rehashidx;
+        full = dictOaMatchFull(tags+g*DICT_OA_GROUP);
+        while (full) {
+            dictOaSlot *s = slots+g*DICT_OA_GROUP+__builtin_ctz(full);
+            if ((dictHashKey(d, s->key) & gmask) == home)
+                fn(privdata, (dictEntry*)s);
+            full &= full-1;
+        }
+        if (dictOaMatch(tags+g*DICT_OA_GROUP,DICT_OA_EMPTY)) break;
+        g = (g+1) & gmask;
+    }
+}
+
+/* dictScan() for open addressing dicts. The cursor is over home groups
+ * instead of buckets: an element is found from its home group in ht[0]
+ * or ht[1] exactly like a chained element is found in its bucket, so
+ * everything said in the dictScan() comment applies. Visiting a home group
+ * costs a few groups, as the elements of a group may be displaced in the
+ * following ones, and every element there is hashed to check its home.
+ * There are no buckets to pass to the 'bucketfn' callback of dictScan(). */
+static unsigned long dictOaScan(dict *d, unsigned long v,
+                                dictScanFunction *fn, void *privdata)
+{
+    unsigned long m0, m1;
+    int t0, t1;
+
+    if (!dictIsRehashing(d)) {
+        m0 = dictOaGroupMask(&d->ht[0]);
+        dictOaScanGroup(d,0,v & m0,fn,privdata);
+    } else {
+        /* Make sure t0 is the smaller and t1 is the bigger table */
+        t0 = d->ht[0].size > d->ht[1].size;
+        t1 = !t0;
+        m0 = dictOaGroupMask(&d->ht[t0]);
+        m1 = dictOaGroupMask(&d->ht[t1]);
+
+        dictOaScanGroup(d,t0,v & m0,fn,privdata);
+        do {
+            dictOaScanGroup(d,t1,v & m1,fn,privdata);
+            v = (((v | m0) + 1) & ~m0) | (v & m0);
+        } while (v & (m0 ^ m1));
+    }
+
+    v |= ~m0;
+    v = rev(v);
+    v++;
+    v = rev(v);
+    return v;
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
@@ -1008,6 +1526,8 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, unsigned i
     dictEntry *he, **heref;
     unsigned int idx, table;
 
+    /* Only chained dicts have references to entries. */
+    assert(!dictIsOpenAddressing(d));
     if (d->ht[0].used + d->ht[1].used == 0) return NULL; /* dict is empty */
     for (table = 0; table <= 1; table++) {
         idx = hash & d->ht[table].sizemask;
@@ -1024,6 +1544,36 @@ dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, unsigned i
     return NULL;
 }
 
+/* Return the first entry of bucket 'idx' of table 'table', or NULL if the
+ * bucket is empty. The other entries of the bucket are reached calling
+ * dictBucketNext(): in open addressing dicts buckets are single slots, and
+ * entries have no 'next' field. */
+dictEntry *dictBucketEntry(dict *d, int table, unsigned long idx) {
+    dictht *ht = &d->ht[table];
+
+    if (!dictIsOpenAddressing(d)) return ht->table[idx];
+    return dictOaIsFull(dictOaTags(ht)[idx]) ?
+        (dictEntry*)(dictOaSlots(ht)+idx) : NULL;
+}
+
+dictEntry *dictBucketNext(dict *d, dictEntry *de) {
+    return dictIsOpenAddressing(d) ? NULL : de->next;
+}
+
+/* Return the memory used by the tables and the entries of 'd', without
+ * the keys and the values they point to. */
+size_t dictMemUsage(dict *d) {
+    if (dictIsOpenAddressing(d))
+        return dictSlots(d)*(sizeof(dictOaSlot)+1);
+    return dictSlots(d)*sizeof(dictEntry*) + dictSize(d)*sizeof(dictEntry);
+}
+
+/* Return the memory every element of 'd' costs, without its key and value:
+ * the entry, or the slot and its tag. */
+size_t dictEntryMemUsage(dict *d) {
+    return dictIsOpenAddressing(d) ? sizeof(dictOaSlot)+1 : sizeof(dictEntry);
+}
+
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
@@ -1088,16 +1638,77 @@ size_t _dictGetStatsHt(char *buf, size_t bufsize, dictht *ht, int tableid) {
     return strlen(buf);
 }
 
+/* Open addressing tables report how many groups the lookup of every
+ * element probes, instead of the length of chains. */
+size_t _dictOaGetStatsHt(char *buf, size_t bufsize, dict *d, int tableid) {
+    dictht *ht = &d->ht[tableid];
+    unsigned long i, probes, maxprobes = 0, totprobes = 0, gmask;
+    unsigned long plvector[DICT_STATS_VECTLEN];
+    uint8_t *tags;
+    size_t l = 0;
+
+    if (ht->used == 0) {
+        return snprintf(buf,bufsize,
+            "No stats available for empty dictionaries\n");
+    }
+
+    /* Compute stats. */
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) plvector[i] = 0;
+    gmask = dictOaGroupMask(ht);
+    tags = dictOaTags(ht);
+    for (i = 0; i < ht->size; i++) {
+        unsigned long home;
+
+        if (!dictOaIsFull(tags[i])) continue;
+        home = dictHashKey(d, dictOaSlots(ht)[i].key) & gmask;
+        probes = ((i/DICT_OA_GROUP - home) & gmask) + 1;
+        plvector[(probes < DICT_STATS_VECTLEN) ? probes : (DICT_STATS_VECTLEN-1)]++;
+        if (probes > maxprobes) maxprobes = probes;
+        totprobes += probes;
+    }
+
+    /* Generate human readable stats. */
+    l += snprintf(buf+l,bufsize-l,
+        "Hash table %d stats (%s):\n"
+        " table size: %ld\n"
+        " number of elements: %ld\n"
+        " deleted slots: %ld\n"
+        " max probe length: %ld\n"
+        " avg probe length: %.02f\n"
+        " Probe length distribution:\n",
+        tableid, (tableid == 0) ? "main hash table" : "rehashing target",
+        ht->size, ht->used, dictOaTab(ht)->deleted, maxprobes,
+        (float)totprobes/ht->used);
+
+    for (i = 0; i < DICT_STATS_VECTLEN; i++) {
+        if (plvector[i] == 0) continue;
+        if (l >= bufsize) break;
+        l += snprintf(buf+l,bufsize-l,
+            "   %s%ld: %ld (%.02f%%)\n",
+            (i == DICT_STATS_VECTLEN-1)?">= ":"",
+            i, plvector[i], ((float)plvector[i]/ht->used)*100);
+    }
+
+    if (bufsize) buf[bufsize-1] = '\0';
+    return strlen(buf);
+}
+
 void dictGetStats(char *buf, size_t bufsize, dict *d) {
     size_t l;
     char *orig_buf = buf;
     size_t orig_bufsize = bufsize;
 
-    l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
+    if (dictIsOpenAddressing(d))
+        l = _dictOaGetStatsHt(buf,bufsize,d,0);
+    else
+        l = _dictGetStatsHt(buf,bufsize,&d->ht[0],0);
     buf += l;
     bufsize -= l;
     if (dictIsRehashing(d) && bufsize > 0) {
-        _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
+        if (dictIsOpenAddressing(d))
+            _dictOaGetStatsHt(buf,bufsize,d,1);
+        else
+            _dictGetStatsHt(buf,bufsize,&d->ht[1],1);
     }
     /* Make sure there is a NULL term at the end. */
     if (orig_bufsize) orig_buf[orig_bufsize-1] = '\0';
@@ -1138,24 +1749,49 @@ dictType BenchmarkDictType = {
     NULL
 };
 
+dictType BenchmarkOaDictType = {
+    hashCallback,
+    NULL,
+    NULL,
+    compareCallback,
+    freeCallback,
+    NULL,
+    1
+};
+
 #define start_benchmark() start = timeInMilliseconds()
 #define end_benchmark(msg) do { \
     elapsed = timeInMilliseconds()-start; \
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0);
 
-/* dict-benchmark [count] */
-int main(int argc, char **argv) {
+void scanCallback(void *privdata, const dictEntry *de) {
+    unsigned char *seen = privdata;
+    long j = (long)dictGetVal(de);
+
+    seen[j] = 1;
+}
+
+/* Check that a SCAN started before the table is resized in the middle of
+ * the iteration returns every element. */
+void checkScan(dict *dict, long count) {
+    unsigned char *seen = zcalloc(count);
+    unsigned long cursor = 0;
+    long j, calls = 0;
+
+    do {
+        cursor = dictScan(dict,cursor,scanCallback,NULL,seen);
+        if (++calls == 10) dictExpand(dict,dictSize(dict)*4);
+        if (calls % 10 == 0) dictRehash(dict,10);
+    } while (cursor);
+    for (j = 0; j < count; j++) assert(seen[j]);
+    zfree(seen);
+}
+
+void benchmarkDict(dictType *type, long count) {
     long j;
     long long start, elapsed;
-    dict *dict = dictCreate(&BenchmarkDictType,NULL);
-    long count = 0;
-
-    if (argc == 2) {
-        count = strtol(argv[1],NULL,10);
-    } else {
-        count = 5000000;
-    }
+    dict *dict = dictCreate(type,NULL);
 
     start_benchmark();
     for (j = 0; j < count; j++) {
@@ -1217,5 +1853,102 @@ int main(int argc, char **argv) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+    assert((long)dictSize(dict) == count);
+
+    printf("Table memory: %zu bytes per element\n",
+        dictMemUsage(dict)/dictSize(dict));
+
+    start_benchmark();
+    checkScan(dict,count);
+    end_benchmark("Scanning while rehashing");
+    printf("\n");
+    dictRelease(dict);
+}
+
+/* dict-benchmark [count] */
+int main(int argc, char **argv) {
+    long count = 0;
+
+    if (argc == 2) {
+        count = strtol(argv[1],NULL,10);
+    } else {
+        count = 5000000;
+    }
+
+    printf("Chained dict:\n");
+    benchmarkDict(&BenchmarkDictType,count);
+    printf("Open addressing dict:\n");
+    benchmarkDict(&BenchmarkOaDictType,count);
+    return 0;
+}
+#endif
+
+/* ---------------------------------- Tests ----------------------------------*/
+
+#ifdef REDIS_TEST
+
+static uint64_t testHashCallback(const void *key) {
+    return dictGenHashFunction(&key,sizeof(key));
+}
+
+static int testCompareCallback(void *privdata, const void *key1,
+                               const void *key2)
+{
+    DICT_NOTUSED(privdata);
+    return key1 == key2;
+}
+
+static dictType testOaDictType = {
+    testHashCallback, NULL, NULL, testCompareCallback, NULL, NULL, 1
+};
+
+int dictTest(int argc, char **argv) {
+    dict *d = dictCreate(&testOaDictType,NULL);
+    dictIterator *di;
+    dictEntry *de;
+    unsigned char *seen;
+    unsigned long size1;
+    long j, paused;
+
+    DICT_NOTUSED(argc);
+    DICT_NOTUSED(argv);
+
+    printf("Open addressing growth with a safe iterator: ");
+    fflush(stdout);
+    for (j = 0; !dictIsRehashing(d) || j < 10000; j++)
+        assert(dictAdd(d,(void*)j,NULL) == DICT_OK);
+
+    /* With rehashing paused insertions fill ht[1] up to its 7/8 load, then
+     * ht[1] grows. The iterator is still walking ht[0], so it returns every
+     * element that was there before it started once. */
+    paused = j;
+    seen = zcalloc(paused);
+    di = dictGetSafeIterator(d);
+    assert((de = dictNext(di)) != NULL);
+    seen[(long)dictGetKey(de)]++;
+    size1 = d->ht[1].size;
+    while (d->ht[1].size < size1*4)
+        assert(dictAdd(d,(void*)j++,NULL) == DICT_OK);
+    assert(dictIsRehashing(d));
+    while ((de = dictNext(di)) != NULL)
+        if ((long)dictGetKey(de) < paused) seen[(long)dictGetKey(de)]++;
+    dictReleaseIterator(di);
+    for (j = 0; j < paused; j++) assert(seen[j] == 1);
+    zfree(seen);
+    paused = j = dictSize(d);
+
+    /* Once released, no single insertion completes the rehashing. */
+    assert(dictAdd(d,(void*)j++,NULL) == DICT_OK);
+    assert(dictIsRehashing(d));
+    for (; j < paused*4; j++) {
+        assert(dictAdd(d,(void*)j,NULL) == DICT_OK);
+        assert(!dictIsRehashing(d) ||
+               d->ht[1].used*16 <= d->ht[1].size*15);
+    }
+    for (j = 0; j < paused*4; j++) assert(dictFind(d,(void*)j) != NULL);
+    assert((long)dictSize(d) == paused*4);
+    dictRelease(d);
+    printf("OK\n");
+    return 0;
 }
 #endif
@@ -62,6 +62,7 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2);
     void (*keyDestructor)(void *privdata, void *key);
     void (*valDestructor)(void *privdata, void *obj);
+    int openAddressing; /* Store entries in the table, see dict.c. */
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
@@ -146,6 +147,11 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+#define dictIsOpenAddressing(d) ((d)->type->openAddressing)
+/* Pausing works like holding a safe iterator: entries stay in the bucket
+ * they are in until rehashing is resumed. */
+#define dictPauseRehashing(d) ((d)->iterators++)
+#define dictResumeRehashing(d) ((d)->iterators--)
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
@@ -180,10 +186,18 @@ uint8_t *dictGetHashFunctionSeed(void);
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, dictScanBucketFunction *bucketfn, void *privdata);
 unsigned int dictGetHash(dict *d, const void *key);
 dictEntry **dictFindEntryRefByPtrAndHash(dict *d, const void *oldptr, unsigned int hash);
+dictEntry *dictBucketEntry(dict *d, int table, unsigned long idx);
+dictEntry *dictBucketNext(dict *d, dictEntry *de);
+size_t dictMemUsage(dict *d);
+size_t dictEntryMemUsage(dict *d);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
 extern dictType dictTypeHeapStrings;
 extern dictType dictTypeHeapStringCopyKeyValue;
 
+#ifdef REDIS_TEST
+int dictTest(int argc, char *argv[]);
+#endif
+
 #endif /* __DICT_H */
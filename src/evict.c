@@ -64,8 +64,6 @@ struct evictionPoolEntry {
 
 static struct evictionPoolEntry *EvictionPoolLRU;
 
-unsigned long LFUDecrAndReturn(robj *o);
-
 /* ----------------------------------------------------------------------------
  * Implementation of eviction, aging and LRU
  * --------------------------------------------------------------------------*/
@@ -218,7 +216,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
         if(!mv_nvm_done){
             if (o && o->need_mv_to_nvm)
             {
-                o->ptr = sdsmvtonvm(o->ptr);
+                o->ptr = sdsmvtonvmplaced(o->ptr,NVM_CLASS_STRING);
                 if (is_nvm_addr(o->ptr)) {
                     o->need_mv_to_nvm = 0;
                     mv_nvm_done = 1;
@@ -279,6 +279,26 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
                 == C_ERR) sdsfree(ele);
             ln = ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+
+        if (!zbtFirstInRange(zs->zbt, &range, &it)) {
+            /* Nothing exists starting at our min.  No results. */
+            return 0;
+        }
+
+        do {
+            double score = zbtIterScore(&it);
+            sds ele;
+            /* Abort when the element is no longer in range. */
+            if (!zslValueLteMax(score, &range))
+                break;
+
+            ele = sdsdup(zbtIterEle(&it));
+            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,ele)
+                == C_ERR) sdsfree(ele);
+        } while (zbtNext(&it));
     }
     return ga->used - origincount;
 }
@@ -643,15 +663,13 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
             gp->dist /= conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            zsetInsertElement(zs,score,gp->member);
             gp->member = NULL;
         }
 
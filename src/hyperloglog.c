@@ -30,6 +30,7 @@
  */
 
 #include "server.h"
+#include "cpudispatch.h"
 
 #include <stdint.h>
 #include <math.h>
@@ -501,64 +502,424 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     }
 }
 
-/* Compute SUM(2^-reg) in the dense representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-double hllDenseSum(uint8_t *registers, double *PE, int *ezp) {
-    double E = 0;
-    int j, ez = 0;
-
-    /* Redis default is to use 16384 registers 6 bits each. The code works
-     * with other values by modifying the defines, but for our target value
-     * we take a faster path with unrolled loops. */
-    if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
-        uint8_t *r = registers;
-        unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
-                      r10, r11, r12, r13, r14, r15;
-        for (j = 0; j < 1024; j++) {
-            /* Handle 16 registers per iteration. */
-            r0 = r[0] & 63; if (r0 == 0) ez++;
-            r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-            r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-            r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-            r4 = r[3] & 63; if (r4 == 0) ez++;
-            r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-            r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-            r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-            r8 = r[6] & 63; if (r8 == 0) ez++;
-            r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-            r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-            r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-            r12 = r[9] & 63; if (r12 == 0) ez++;
-            r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-            r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-            r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-            /* Additional parens will allow the compiler to optimize the
-             * code more with a loss of precision that is not very relevant
-             * here (floating point math is not commutative!). */
-            E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-                 (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-                 (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
-            r += 12;
+/* ========================= Register kernels ===============================
+ * Multi key PFCOUNT, PFMERGE and the sparse to dense conversion spend most
+ * of their time moving registers between the dense 6 bit representation
+ * and a raw array of HLL_REGISTERS bytes, while every cardinality estimate
+ * needs the histogram of the register values. These loops are implemented
+ * by a set of kernels: a portable scalar one, and SSE4 and AVX2 ones on
+ * x86_64 that are selected at runtime according to the CPU features.
+ *
+ * All the kernels give bit exact results: PFSELFTEST checks them against
+ * the HLL_DENSE_GET_REGISTER() / HLL_DENSE_SET_REGISTER() macros. */
+
+struct hllKernel {
+    char *name;
+    unsigned int features;  /* CPU_* features the kernel needs. */
+    /* Store the 6 bit registers of 'dense' into the bytes of 'raw'. */
+    void (*unpack)(uint8_t *raw, uint8_t *dense);
+    /* Store the raw registers 'raw' (values <= 63) into 'dense'. */
+    void (*pack)(uint8_t *dense, uint8_t *raw);
+    /* Set max[i] = MAX(max[i],dense register i). */
+    void (*merge)(uint8_t *max, uint8_t *dense);
+    /* Add the histogram of the dense registers to 'reghisto'. */
+    void (*densehisto)(uint8_t *dense, int *reghisto);
+    /* Add the histogram of the raw registers to 'reghisto'. */
+    void (*rawhisto)(uint8_t *raw, int *reghisto);
+};
+
+/* The histogram kernels count into four partial histograms, this avoids
+ * a store to load dependency when consecutive registers have the same
+ * value, which is the common case. */
+typedef int hllHisto[4][HLL_REGISTER_MAX+1];
+
+/* Add 'len' raw registers to the partial histograms 'h'. */
+static inline void hllHistoBytes(uint8_t *raw, long len, hllHisto h) {
+    long j;
+
+    for (j = 0; j+4 <= len; j += 4) {
+        h[0][raw[j]]++;
+        h[1][raw[j+1]]++;
+        h[2][raw[j+2]]++;
+        h[3][raw[j+3]]++;
+    }
+    for (; j < len; j++) h[0][raw[j]]++;
+}
+
+/* Add the partial histograms 'h' to 'reghisto'. */
+static void hllHistoSum(hllHisto h, int *reghisto) {
+    int j;
+
+    for (j = 0; j <= HLL_REGISTER_MAX; j++)
+        reghisto[j] += h[0][j]+h[1][j]+h[2][j]+h[3][j];
+}
+
+/* Unpack the four registers stored in the three bytes at 'p'. */
+#define HLL_UNPACK4(out,p) do { \
+    (out)[0] = (p)[0] & 63; \
+    (out)[1] = ((p)[0] >> 6 | (p)[1] << 2) & 63; \
+    (out)[2] = ((p)[1] >> 4 | (p)[2] << 4) & 63; \
+    (out)[3] = ((p)[2] >> 2) & 63; \
+} while(0)
+
+#define HLL_PACK4(p,in) do { \
+    (p)[0] = (in)[0] | (in)[1] << 6; \
+    (p)[1] = (in)[1] >> 2 | (in)[2] << 4; \
+    (p)[2] = (in)[2] >> 4 | (in)[3] << 2; \
+} while(0)
+
+/* The scalar helpers process the 'count' registers starting at register
+ * 'first', so the SIMD kernels can use them for the tail of the array.
+ * 'raw' and 'max' point to the byte of register 'first'. */
+static void hllUnpackRange(uint8_t *raw, uint8_t *dense, long first,
+                           long count)
+{
+    long j;
+
+    if (HLL_BITS == 6 && first % 4 == 0 && count % 4 == 0) {
+        uint8_t *p = dense+first/4*3;
+        for (j = 0; j < count; j += 4, p += 3)
+            HLL_UNPACK4(raw+j,p);
+    } else {
+        for (j = 0; j < count; j++)
+            HLL_DENSE_GET_REGISTER(raw[j],dense,(first+j));
+    }
+}
+
+static void hllPackRange(uint8_t *dense, uint8_t *raw, long first,
+                         long count)
+{
+    long j;
+
+    if (HLL_BITS == 6 && first % 4 == 0 && count % 4 == 0) {
+        uint8_t *p = dense+first/4*3;
+        for (j = 0; j < count; j += 4, p += 3)
+            HLL_PACK4(p,raw+j);
+    } else {
+        for (j = 0; j < count; j++)
+            HLL_DENSE_SET_REGISTER(dense,(first+j),raw[j]);
+    }
+}
+
+static void hllMergeRange(uint8_t *max, uint8_t *dense, long first,
+                          long count)
+{
+    uint8_t val;
+    long j;
+
+    for (j = 0; j < count; j++) {
+        HLL_DENSE_GET_REGISTER(val,dense,(first+j));
+        if (val > max[j]) max[j] = val;
+    }
+}
+
+static void hllUnpackScalar(uint8_t *raw, uint8_t *dense) {
+    hllUnpackRange(raw,dense,0,HLL_REGISTERS);
+}
+
+static void hllPackScalar(uint8_t *dense, uint8_t *raw) {
+    hllPackRange(dense,raw,0,HLL_REGISTERS);
+}
+
+static void hllMergeScalar(uint8_t *max, uint8_t *dense) {
+    if (HLL_BITS == 6 && HLL_REGISTERS % 16 == 0) {
+        uint8_t raw[16], *p = dense;
+        long j, k;
+
+        for (j = 0; j < HLL_REGISTERS; j += 16, p += 12) {
+            HLL_UNPACK4(raw,p);
+            HLL_UNPACK4(raw+4,p+3);
+            HLL_UNPACK4(raw+8,p+6);
+            HLL_UNPACK4(raw+12,p+9);
+            for (k = 0; k < 16; k++)
+                if (raw[k] > max[j+k]) max[j+k] = raw[k];
         }
     } else {
-        for (j = 0; j < HLL_REGISTERS; j++) {
-            unsigned long reg;
+        hllMergeRange(max,dense,0,HLL_REGISTERS);
+    }
+}
 
-            HLL_DENSE_GET_REGISTER(reg,registers,j);
-            if (reg == 0) {
-                ez++;
-                /* Increment E at the end of the loop. */
-            } else {
-                E += PE[reg]; /* Precomputed 2^(-reg[j]). */
-            }
+static void hllDenseHistoScalar(uint8_t *dense, int *reghisto) {
+    uint8_t raw[256];
+    long j;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    for (j = 0; j < HLL_REGISTERS; j += 256) {
+        long count = HLL_REGISTERS-j < 256 ? HLL_REGISTERS-j : 256;
+        hllUnpackRange(raw,dense,j,count);
+        hllHistoBytes(raw,count,h);
+    }
+    hllHistoSum(h,reghisto);
+}
+
+static void hllRawHistoScalar(uint8_t *raw, int *reghisto) {
+    uint64_t *word = (uint64_t*) raw;
+    long j, zeroes = 0;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    /* Skip the runs of zero registers 8 at a time, like the sparse
+     * representation most of a merged HLL is zero at low cardinalities. */
+    for (j = 0; j < HLL_REGISTERS/8; j++) {
+        if (word[j] == 0) {
+            zeroes += 8;
+        } else {
+            hllHistoBytes(raw+j*8,8,h);
         }
-        E += ez; /* Add 2^0 'ez' times. */
     }
-    *ezp = ez;
-    return E;
+    hllHistoBytes(raw+j*8,HLL_REGISTERS%8,h);
+    reghisto[0] += zeroes;
+    hllHistoSum(h,reghisto);
+}
+
+/* The SIMD kernels assume the default layout of 6 bit registers. */
+#if defined(HAVE_CPU_DISPATCH) && HLL_BITS == 6 && HLL_REGISTERS >= 64
+#include <immintrin.h>
+#define HLL_SIMD 1
+
+/* Spread the 16 registers held in the low 12 bytes of 'v' over 16 bytes.
+ * Every group of three bytes b0,b1,b2 is shuffled into a 32 bit lane as
+ * the 16 bit words b0|b1<<8 and b1|b2<<8: the four registers are then at
+ * bits 0, 6, 16+4 and 16+10, and are moved into place with two 16 bit
+ * shifts and four masks. */
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i hllUnpack16(__m128i v) {
+    const __m128i shuffle = _mm_setr_epi8(0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11);
+    __m128i a, b, c, d;
+
+    v = _mm_shuffle_epi8(v,shuffle);
+    a = _mm_and_si128(v,_mm_set1_epi32(0x0000003f));
+    b = _mm_and_si128(_mm_slli_epi16(v,2),_mm_set1_epi32(0x00003f00));
+    c = _mm_and_si128(_mm_srli_epi16(v,4),_mm_set1_epi32(0x003f0000));
+    d = _mm_and_si128(_mm_srli_epi16(v,2),_mm_set1_epi32(0x3f000000));
+    return _mm_or_si128(_mm_or_si128(a,b),_mm_or_si128(c,d));
+}
+
+/* The reverse of hllUnpack16(): the registers of every 32 bit lane are
+ * combined into 24 bits with two multiply-add steps, the 12 significant
+ * bytes end in the low part of the result, the upper 4 are zero. */
+__attribute__((target("ssse3,sse4.1")))
+static inline __m128i hllPack16(__m128i v) {
+    const __m128i shuffle = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,
+                                          -1,-1,-1,-1);
+
+    v = _mm_maddubs_epi16(v,_mm_set1_epi16(0x4001));
+    v = _mm_madd_epi16(v,_mm_set1_epi32(0x10000001));
+    return _mm_shuffle_epi8(v,shuffle);
+}
+
+/* The SSE4 kernels load 16 bytes to use 12 of them: they stop 16 bytes
+ * before the end of the dense registers and leave the tail to the scalar
+ * code. */
+#define HLL_SSE_BLOCKS ((HLL_REGISTERS*HLL_BITS/8-16)/12+1)
+
+__attribute__((target("ssse3,sse4.1")))
+static void hllUnpackSSE4(uint8_t *raw, uint8_t *dense) {
+    long j;
+
+    for (j = 0; j < HLL_SSE_BLOCKS; j++) {
+        __m128i v = _mm_loadu_si128((__m128i*)(dense+j*12));
+        _mm_storeu_si128((__m128i*)(raw+j*16),hllUnpack16(v));
+    }
+    hllUnpackRange(raw+j*16,dense,j*16,HLL_REGISTERS-j*16);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static void hllPackSSE4(uint8_t *dense, uint8_t *raw) {
+    long j;
+
+    /* Every store writes 4 zero bytes past the block, they are overwritten
+     * by the next one, and the scalar code takes care of the last block. */
+    for (j = 0; j < HLL_SSE_BLOCKS; j++) {
+        __m128i v = _mm_loadu_si128((__m128i*)(raw+j*16));
+        _mm_storeu_si128((__m128i*)(dense+j*12),hllPack16(v));
+    }
+    hllPackRange(dense,raw+j*16,j*16,HLL_REGISTERS-j*16);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static void hllMergeSSE4(uint8_t *max, uint8_t *dense) {
+    long j;
+
+    for (j = 0; j < HLL_SSE_BLOCKS; j++) {
+        __m128i v = hllUnpack16(_mm_loadu_si128((__m128i*)(dense+j*12)));
+        __m128i m = _mm_loadu_si128((__m128i*)(max+j*16));
+        _mm_storeu_si128((__m128i*)(max+j*16),_mm_max_epu8(m,v));
+    }
+    hllMergeRange(max+j*16,dense,j*16,HLL_REGISTERS-j*16);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static void hllDenseHistoSSE4(uint8_t *dense, int *reghisto) {
+    uint8_t raw[256];
+    long j = 0, k;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    while (j < HLL_SSE_BLOCKS) {
+        for (k = 0; k < 16 && j < HLL_SSE_BLOCKS; k++, j++) {
+            __m128i v = _mm_loadu_si128((__m128i*)(dense+j*12));
+            _mm_storeu_si128((__m128i*)(raw+k*16),hllUnpack16(v));
+        }
+        hllHistoBytes(raw,k*16,h);
+    }
+    hllUnpackRange(raw,dense,j*16,HLL_REGISTERS-j*16);
+    hllHistoBytes(raw,HLL_REGISTERS-j*16,h);
+    hllHistoSum(h,reghisto);
+}
+
+__attribute__((target("ssse3,sse4.1")))
+static void hllRawHistoSSE4(uint8_t *raw, int *reghisto) {
+    long j, zeroes = 0;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    for (j = 0; j+16 <= HLL_REGISTERS; j += 16) {
+        __m128i v = _mm_loadu_si128((__m128i*)(raw+j));
+        if (_mm_testz_si128(v,v)) {
+            zeroes += 16;
+        } else {
+            hllHistoBytes(raw+j,16,h);
+        }
+    }
+    hllHistoBytes(raw+j,HLL_REGISTERS-j,h);
+    reghisto[0] += zeroes;
+    hllHistoSum(h,reghisto);
+}
+
+/* The AVX2 kernels handle 32 registers at a time, the two 128 bit lanes
+ * are loaded from 12 bytes apart. */
+#define HLL_AVX2_BLOCKS ((HLL_REGISTERS*HLL_BITS/8-28)/24+1)
+
+__attribute__((target("avx2")))
+static inline __m256i hllLoad24(uint8_t *p) {
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((__m128i*)p)),
+        _mm_loadu_si128((__m128i*)(p+12)),1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hllUnpack32(__m256i v) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11,
+        0,1,1,2,3,4,4,5,6,7,7,8,9,10,10,11);
+    __m256i a, b, c, d;
+
+    v = _mm256_shuffle_epi8(v,shuffle);
+    a = _mm256_and_si256(v,_mm256_set1_epi32(0x0000003f));
+    b = _mm256_and_si256(_mm256_slli_epi16(v,2),_mm256_set1_epi32(0x00003f00));
+    c = _mm256_and_si256(_mm256_srli_epi16(v,4),_mm256_set1_epi32(0x003f0000));
+    d = _mm256_and_si256(_mm256_srli_epi16(v,2),_mm256_set1_epi32(0x3f000000));
+    return _mm256_or_si256(_mm256_or_si256(a,b),_mm256_or_si256(c,d));
+}
+
+__attribute__((target("avx2")))
+static void hllUnpackAVX2(uint8_t *raw, uint8_t *dense) {
+    long j;
+
+    for (j = 0; j < HLL_AVX2_BLOCKS; j++) {
+        __m256i v = hllUnpack32(hllLoad24(dense+j*24));
+        _mm256_storeu_si256((__m256i*)(raw+j*32),v);
+    }
+    hllUnpackRange(raw+j*32,dense,j*32,HLL_REGISTERS-j*32);
+}
+
+__attribute__((target("avx2")))
+static void hllPackAVX2(uint8_t *dense, uint8_t *raw) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    long j;
+
+    /* Same as hllPackSSE4(): each store writes 4 zero bytes that are
+     * overwritten by the next one. */
+    for (j = 0; j < HLL_AVX2_BLOCKS; j++) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(raw+j*32));
+        v = _mm256_maddubs_epi16(v,_mm256_set1_epi16(0x4001));
+        v = _mm256_madd_epi16(v,_mm256_set1_epi32(0x10000001));
+        v = _mm256_shuffle_epi8(v,shuffle);
+        _mm_storeu_si128((__m128i*)(dense+j*24),_mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(dense+j*24+12),
+                         _mm256_extracti128_si256(v,1));
+    }
+    hllPackRange(dense,raw+j*32,j*32,HLL_REGISTERS-j*32);
+}
+
+__attribute__((target("avx2")))
+static void hllMergeAVX2(uint8_t *max, uint8_t *dense) {
+    long j;
+
+    for (j = 0; j < HLL_AVX2_BLOCKS; j++) {
+        __m256i v = hllUnpack32(hllLoad24(dense+j*24));
+        __m256i m = _mm256_loadu_si256((__m256i*)(max+j*32));
+        _mm256_storeu_si256((__m256i*)(max+j*32),_mm256_max_epu8(m,v));
+    }
+    hllMergeRange(max+j*32,dense,j*32,HLL_REGISTERS-j*32);
+}
+
+__attribute__((target("avx2")))
+static void hllDenseHistoAVX2(uint8_t *dense, int *reghisto) {
+    uint8_t raw[256];
+    long j = 0, k;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    while (j < HLL_AVX2_BLOCKS) {
+        for (k = 0; k < 8 && j < HLL_AVX2_BLOCKS; k++, j++) {
+            __m256i v = hllUnpack32(hllLoad24(dense+j*24));
+            _mm256_storeu_si256((__m256i*)(raw+k*32),v);
+        }
+        hllHistoBytes(raw,k*32,h);
+    }
+    hllUnpackRange(raw,dense,j*32,HLL_REGISTERS-j*32);
+    hllHistoBytes(raw,HLL_REGISTERS-j*32,h);
+    hllHistoSum(h,reghisto);
+}
+
+__attribute__((target("avx2")))
+static void hllRawHistoAVX2(uint8_t *raw, int *reghisto) {
+    long j, zeroes = 0;
+    hllHisto h;
+
+    memset(h,0,sizeof(h));
+    for (j = 0; j+32 <= HLL_REGISTERS; j += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i*)(raw+j));
+        if (_mm256_testz_si256(v,v)) {
+            zeroes += 32;
+        } else {
+            hllHistoBytes(raw+j,32,h);
+        }
+    }
+    hllHistoBytes(raw+j,HLL_REGISTERS-j,h);
+    reghisto[0] += zeroes;
+    hllHistoSum(h,reghisto);
+}
+#endif
+
+/* Kernels in order of preference, see cpudispatch.h. */
+static struct hllKernel hllKernels[] = {
+#ifdef HLL_SIMD
+    {"avx2",CPU_AVX2,hllUnpackAVX2,hllPackAVX2,hllMergeAVX2,
+     hllDenseHistoAVX2,hllRawHistoAVX2},
+    {"sse4",CPU_SSSE3|CPU_SSE4_1,hllUnpackSSE4,hllPackSSE4,hllMergeSSE4,
+     hllDenseHistoSSE4,hllRawHistoSSE4},
+#endif
+    {"scalar",0,hllUnpackScalar,hllPackScalar,hllMergeScalar,
+     hllDenseHistoScalar,hllRawHistoScalar}
+};
+
+#define HLL_KERNELS (sizeof(hllKernels)/sizeof(hllKernels[0]))
+
+static struct hllKernel *hllGetKernel(void) {
+    static struct hllKernel *kernel = NULL;
+    CPU_DISPATCH(kernel,hllKernels);
+    return kernel;
+}
+
+/* Compute the histogram of the registers in the dense representation. */
+void hllDenseRegHisto(uint8_t *registers, int *reghisto) {
+    hllGetKernel()->densehisto(registers,reghisto);
 }
 
 /* ================== Sparse representation implementation  ================= */
@@ -574,6 +935,7 @@ int hllSparseToDense(robj *o) {
     struct hllhdr *hdr, *oldhdr = (struct hllhdr*)sparse;
     int idx = 0, runlen, regval;
     uint8_t *p = (uint8_t*)sparse, *end = p+sdslen(sparse);
+    uint8_t raw[HLL_REGISTERS];
 
     /* If the representation is already the right one return ASAP. */
     hdr = (struct hllhdr*) sparse;
@@ -587,8 +949,9 @@ int hllSparseToDense(robj *o) {
     *hdr = *oldhdr; /* This will copy the magic and cached cardinality. */
     hdr->encoding = HLL_DENSE;
 
-    /* Now read the sparse representation and set non-zero registers
-     * accordingly. */
+    /* Now read the sparse representation into an array of raw registers,
+     * and pack it into the dense registers at the end. */
+    memset(raw,0,sizeof(raw));
     p += HLL_HDR_SIZE;
     while(p < end) {
         if (HLL_SPARSE_IS_ZERO(p)) {
@@ -602,10 +965,9 @@ int hllSparseToDense(robj *o) {
         } else {
             runlen = HLL_SPARSE_VAL_LEN(p);
             regval = HLL_SPARSE_VAL_VALUE(p);
-            while(runlen--) {
-                HLL_DENSE_SET_REGISTER(hdr->registers,idx,regval);
-                idx++;
-            }
+            if ((runlen + idx) > HLL_REGISTERS) break; /* Overflow. */
+            memset(raw+idx,regval,runlen);
+            idx += runlen;
             p++;
         }
     }
@@ -616,6 +978,7 @@ int hllSparseToDense(robj *o) {
         sdsfree(dense);
         return C_ERR;
     }
+    hllGetKernel()->pack(hdr->registers,raw);
 
     /* Free the old representation and set the new one. */
     sdsfree(o->ptr);
@@ -885,76 +1248,70 @@ promote: /* Promote to dense representation. */
     return dense_retval;
 }
 
-/* Compute SUM(2^-reg) in the sparse representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-double hllSparseSum(uint8_t *sparse, int sparselen, double *PE, int *ezp, int *invalid) {
-    double E = 0;
-    int ez = 0, idx = 0, runlen, regval;
+/* Compute the histogram of the registers in the sparse representation.
+ * If the representation is not valid, the integer pointed by 'invalid' is
+ * set to non-zero. */
+void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int *reghisto) {
+    int idx = 0, runlen, regval;
     uint8_t *end = sparse+sparselen, *p = sparse;
 
     while(p < end) {
         if (HLL_SPARSE_IS_ZERO(p)) {
             runlen = HLL_SPARSE_ZERO_LEN(p);
             idx += runlen;
-            ez += runlen;
-            /* Increment E at the end of the loop. */
+            reghisto[0] += runlen;
             p++;
         } else if (HLL_SPARSE_IS_XZERO(p)) {
             runlen = HLL_SPARSE_XZERO_LEN(p);
             idx += runlen;
-            ez += runlen;
-            /* Increment E at the end of the loop. */
+            reghisto[0] += runlen;
             p += 2;
         } else {
             runlen = HLL_SPARSE_VAL_LEN(p);
             regval = HLL_SPARSE_VAL_VALUE(p);
             idx += runlen;
-            E += PE[regval]*runlen;
+            reghisto[regval] += runlen;
             p++;
         }
     }
     if (idx != HLL_REGISTERS && invalid) *invalid = 1;
-    E += ez; /* Add 2^0 'ez' times. */
-    *ezp = ez;
-    return E;
 }
 
 /* ========================= HyperLogLog Count ==============================
  * This is the core of the algorithm where the approximated count is computed.
- * The function uses the lower level hllDenseSum() and hllSparseSum() functions
- * as helpers to compute the SUM(2^-reg) part of the computation, which is
- * representation-specific, while all the rest is common. */
+ * The function uses the lower level hllDenseRegHisto() and
+ * hllSparseRegHisto() functions as helpers to compute the histogram of the
+ * register values, which is representation-specific, while all the rest is
+ * common. */
+
+/* Implements the register histogram for the uint8_t data type which is
+ * only used internally as speedup for PFCOUNT with multiple keys. */
+void hllRawRegHisto(uint8_t *registers, int *reghisto) {
+    hllGetKernel()->rawhisto(registers,reghisto);
+}
 
-/* Implements the SUM operation for uint8_t data type which is only used
- * internally as speedup for PFCOUNT with multiple keys. */
-double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
-    double E = 0;
-    int j, ez = 0;
-    uint64_t *word = (uint64_t*) registers;
-    uint8_t *bytes;
+/* Return the cardinality estimate given E = SUM(2^-register[0..i]) and
+ * the number of registers equal to 0. */
+static uint64_t hllEstimate(double E, int ez) {
+    double m = HLL_REGISTERS;
+    double alpha = 0.7213/(1+1.079/m);
 
-    for (j = 0; j < HLL_REGISTERS/8; j++) {
-        if (*word == 0) {
-            ez += 8;
-        } else {
-            bytes = (uint8_t*) word;
-            if (bytes[0]) E += PE[bytes[0]]; else ez++;
-            if (bytes[1]) E += PE[bytes[1]]; else ez++;
-            if (bytes[2]) E += PE[bytes[2]]; else ez++;
-            if (bytes[3]) E += PE[bytes[3]]; else ez++;
-            if (bytes[4]) E += PE[bytes[4]]; else ez++;
-            if (bytes[5]) E += PE[bytes[5]]; else ez++;
-            if (bytes[6]) E += PE[bytes[6]]; else ez++;
-            if (bytes[7]) E += PE[bytes[7]]; else ez++;
-        }
-        word++;
-    }
-    E += ez; /* 2^(-reg[j]) is 1 when m is 0, add it 'ez' times for every
-                zero register in the HLL. */
-    *ezp = ez;
-    return E;
+    /* Apply loglog-beta to the raw estimate. See:
+     * "LogLog-Beta and More: A New Algorithm for Cardinality Estimation
+     * Based on LogLog Counting" Jason Qin, Denys Kim, Yumei Tung
+     * arXiv:1612.02284 */
+    double zl = log(ez + 1);
+    double beta = -0.370393911*ez +
+                   0.070471823*zl +
+                   0.17393686*pow(zl,2) +
+                   0.16339839*pow(zl,3) +
+                  -0.09237745*pow(zl,4) +
+                   0.03738027*pow(zl,5) +
+                  -0.005384159*pow(zl,6) +
+                   0.00042419*pow(zl,7);
+
+    E  = llroundl(alpha*m*(m-ez)*(1/(E+beta)));
+    return (uint64_t) E;
 }
 
 /* Return the approximated cardinality of the set based on the harmonic
@@ -969,51 +1326,31 @@ double hllRawSum(uint8_t *registers, double *PE, int *ezp) {
  * This is useful in order to speedup PFCOUNT when called against multiple
  * keys (no need to work with 6-bit integers encoding). */
 uint64_t hllCount(struct hllhdr *hdr, int *invalid) {
-    double m = HLL_REGISTERS;
-    double E, alpha = 0.7213/(1+1.079/m);
-    int j, ez; /* Number of registers equal to 0. */
-
-    /* We precompute 2^(-reg[j]) in a small table in order to
-     * speedup the computation of SUM(2^-register[0..i]). */
-    static int initialized = 0;
-    static double PE[64];
-    if (!initialized) {
-        PE[0] = 1; /* 2^(-reg[j]) is 1 when m is 0. */
-        for (j = 1; j < 64; j++) {
-            /* 2^(-reg[j]) is the same as 1/2^reg[j]. */
-            PE[j] = 1.0/(1ULL << j);
-        }
-        initialized = 1;
-    }
+    double E = 0;
+    int j, reghisto[HLL_REGISTER_MAX+1] = {0};
 
-    /* Compute SUM(2^-register[0..i]). */
+    /* Compute the histogram of the register values. */
     if (hdr->encoding == HLL_DENSE) {
-        E = hllDenseSum(hdr->registers,PE,&ez);
+        hllDenseRegHisto(hdr->registers,reghisto);
     } else if (hdr->encoding == HLL_SPARSE) {
-        E = hllSparseSum(hdr->registers,
-                         sdslen((sds)hdr)-HLL_HDR_SIZE,PE,&ez,invalid);
+        hllSparseRegHisto(hdr->registers,
+                          sdslen((sds)hdr)-HLL_HDR_SIZE,invalid,reghisto);
     } else if (hdr->encoding == HLL_RAW) {
-        E = hllRawSum(hdr->registers,PE,&ez);
+        hllRawRegHisto(hdr->registers,reghisto);
     } else {
         serverPanic("Unknown HyperLogLog encoding in hllCount()");
     }
 
-    /* Apply loglog-beta to the raw estimate. See:
-     * "LogLog-Beta and More: A New Algorithm for Cardinality Estimation
-     * Based on LogLog Counting" Jason Qin, Denys Kim, Yumei Tung
-     * arXiv:1612.02284 */
-    double zl = log(ez + 1);
-    double beta = -0.370393911*ez +
-                   0.070471823*zl +
-                   0.17393686*pow(zl,2) +
-                   0.16339839*pow(zl,3) +
-                  -0.09237745*pow(zl,4) +
-                   0.03738027*pow(zl,5) +
-                  -0.005384159*pow(zl,6) +
-                   0.00042419*pow(zl,7);
+    /* Compute SUM(2^-register[0..i]) from the histogram, smallest terms
+     * first. Every term is a power of two times an integer, so the sum is
+     * exact, and equal to a register by register sum, as long as registers
+     * are below 40: larger values have a probability of 2^-40 per added
+     * element. */
+    for (j = HLL_REGISTER_MAX; j >= 1; j--)
+        E += reghisto[j]*ldexp(1.0,-j);
+    E += reghisto[0]; /* 2^(-reg[j]) is 1 when m is 0. */
 
-    E  = llroundl(alpha*m*(m-ez)*(1/(E+beta)));
-    return (uint64_t) E;
+    return hllEstimate(E,reghisto[0]);
 }
 
 /* Call hllDenseAdd() or hllSparseAdd() according to the HLL encoding. */
@@ -1039,12 +1376,7 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        hllGetKernel()->merge(max,hdr->registers);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1063,6 +1395,7 @@ int hllMerge(uint8_t *max, robj *hll) {
             } else {
                 runlen = HLL_SPARSE_VAL_LEN(p);
                 regval = HLL_SPARSE_VAL_VALUE(p);
+                if ((runlen + i) > HLL_REGISTERS) break; /* Overflow. */
                 while(runlen--) {
                     if (regval > max[i]) max[i] = regval;
                     i++;
@@ -1323,9 +1656,7 @@ void pfmergeCommand(client *c) {
     /* Write the resulting HLL to the destination HLL registers and
      * invalidate the cached value. */
     hdr = o->ptr;
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        HLL_DENSE_SET_REGISTER(hdr->registers,j,max[j]);
-    }
+    hllGetKernel()->pack(hdr->registers,max);
     HLL_INVALIDATE_CACHE(hdr);
 
     signalModifiedKey(c->db,c->argv[1]);
@@ -1376,7 +1707,87 @@ void pfselftestCommand(client *c) {
         }
     }
 
-    /* Test 2: approximation error.
+    /* Test 2: register kernels.
+     * Every kernel the CPU supports must agree with the register access
+     * macros when unpacking, packing and merging registers, and must give
+     * the same histogram. With registers below 32 the cardinality computed
+     * from the histogram must also match a register by register sum. */
+    uint8_t *raw = zmalloc(HLL_REGISTERS), *max = zmalloc(HLL_REGISTERS);
+    uint8_t *dense = zmalloc(HLL_DENSE_SIZE-HLL_HDR_SIZE);
+    int reghisto[HLL_REGISTER_MAX+1], kernelhisto[HLL_REGISTER_MAX+1];
+    for (j = 0; j < HLL_TEST_CYCLES/10; j++) {
+        unsigned int mask = (j & 1) ? HLL_REGISTER_MAX : 31;
+        double E = 0;
+
+        memset(reghisto,0,sizeof(reghisto));
+        for (i = 0; i < HLL_REGISTERS; i++) {
+            /* Mostly small values like in a real HLL. */
+            unsigned int r = (rand() & 3) ? (unsigned int)__builtin_ctz(rand()|1<<20) :
+                                            (unsigned int)rand();
+            r &= mask;
+            bytecounters[i] = r;
+            HLL_DENSE_SET_REGISTER(hdr->registers,i,r);
+            reghisto[r]++;
+            E += ldexp(1.0,-(int)r);
+        }
+        if (mask == 31 &&
+            hllEstimate(E,reghisto[0]) != hllCount(hdr,NULL))
+        {
+            addReplyError(c,"TESTFAILED histogram/sum cardinality disagree");
+            goto kernelcleanup;
+        }
+
+        for (i = 0; i < HLL_KERNELS; i++) {
+            struct hllKernel *k = &hllKernels[i];
+            unsigned int l;
+
+            if (!cpuSupports(k->features)) continue;
+
+            k->unpack(raw,hdr->registers);
+            if (memcmp(raw,bytecounters,HLL_REGISTERS) != 0) {
+                addReplyErrorFormat(c,"TESTFAILED %s unpack",k->name);
+                goto kernelcleanup;
+            }
+
+            for (l = 0; l < HLL_DENSE_SIZE-HLL_HDR_SIZE; l++) dense[l] = rand();
+            k->pack(dense,bytecounters);
+            if (memcmp(dense,hdr->registers,HLL_DENSE_SIZE-HLL_HDR_SIZE)) {
+                addReplyErrorFormat(c,"TESTFAILED %s pack",k->name);
+                goto kernelcleanup;
+            }
+
+            for (l = 0; l < HLL_REGISTERS; l++) raw[l] = rand() & mask;
+            memcpy(max,raw,HLL_REGISTERS);
+            k->merge(max,hdr->registers);
+            for (l = 0; l < HLL_REGISTERS; l++) {
+                uint8_t expected = raw[l] > bytecounters[l] ? raw[l] :
+                                                              bytecounters[l];
+                if (max[l] != expected) {
+                    addReplyErrorFormat(c,"TESTFAILED %s merge",k->name);
+                    goto kernelcleanup;
+                }
+            }
+
+            memset(kernelhisto,0,sizeof(kernelhisto));
+            k->densehisto(hdr->registers,kernelhisto);
+            if (memcmp(kernelhisto,reghisto,sizeof(reghisto)) != 0) {
+                addReplyErrorFormat(c,"TESTFAILED %s dense histogram",
+                    k->name);
+                goto kernelcleanup;
+            }
+            memset(kernelhisto,0,sizeof(kernelhisto));
+            k->rawhisto(bytecounters,kernelhisto);
+            if (memcmp(kernelhisto,reghisto,sizeof(reghisto)) != 0) {
+                addReplyErrorFormat(c,"TESTFAILED %s raw histogram",k->name);
+                goto kernelcleanup;
+            }
+        }
+    }
+    zfree(raw);
+    zfree(max);
+    zfree(dense);
+
+    /* Test 3: approximation error.
      * The test adds unique elements and check that the estimated value
      * is always reasonable bounds.
      *
@@ -1442,6 +1853,13 @@ void pfselftestCommand(client *c) {
 cleanup:
     sdsfree(bitcounters);
     if (o) decrRefCount(o);
+    return;
+
+kernelcleanup:
+    zfree(raw);
+    zfree(max);
+    zfree(dense);
+    sdsfree(bitcounters);
 }
 
 /* PFDEBUG <subcommand> <key> ... args ...
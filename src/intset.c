@@ -34,6 +34,7 @@
 #include "intset.h"
 #include "zmalloc.h"
 #include "endianconv.h"
+#include "cpudispatch.h"
 
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
@@ -108,23 +109,66 @@ static intset *intsetResize(intset *is, uint32_t len) {
     return is;
 }
 
+/* Return the position of the first element >= "value" in the range of
+ * positions [lo,hi) of the intset, or "hi" if there is no such element.
+ * On little endian hosts the encoded array can be accessed directly, so the
+ * search is a branchless binary search on the array of the right type. */
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+#define INTSET_LOWER_BOUND(type) do { \
+    const type *base = ((const type*)is->contents)+lo; \
+    uint32_t n = hi-lo; \
+    if (n == 0) return hi; \
+    while (n > 1) { \
+        uint32_t half = n >> 1; \
+        base = (base[half-1] < value) ? base+half : base; \
+        n -= half; \
+    } \
+    return (base-(const type*)is->contents) + (*base < value); \
+} while(0)
+
+static uint32_t intsetLowerBound(intset *is, uint32_t lo, uint32_t hi,
+                                 int64_t value)
+{
+    uint32_t encoding = intrev32ifbe(is->encoding);
+
+    if (encoding == INTSET_ENC_INT64)
+        INTSET_LOWER_BOUND(int64_t);
+    else if (encoding == INTSET_ENC_INT32)
+        INTSET_LOWER_BOUND(int32_t);
+    else
+        INTSET_LOWER_BOUND(int16_t);
+}
+#else
+static uint32_t intsetLowerBound(intset *is, uint32_t lo, uint32_t hi,
+                                 int64_t value)
+{
+    while (lo < hi) {
+        uint32_t mid = lo+((hi-lo) >> 1);
+        if (_intsetGet(is,mid) < value)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+#endif
+
 /* Search for the position of "value". Return 1 when the value was found and
  * sets "pos" to the position of the value within the intset. Return 0 when
  * the value is not present in the intset and sets "pos" to the position
  * where "value" can be inserted. */
 static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
-    int min = 0, max = intrev32ifbe(is->length)-1, mid = -1;
-    int64_t cur = -1;
+    uint32_t len = intrev32ifbe(is->length), p;
 
     /* The value can never be found when the set is empty */
-    if (intrev32ifbe(is->length) == 0) {
+    if (len == 0) {
         if (pos) *pos = 0;
         return 0;
     } else {
         /* Check for the case where we know we cannot find the value,
          * but do know the insert position. */
-        if (value > _intsetGet(is,intrev32ifbe(is->length)-1)) {
-            if (pos) *pos = intrev32ifbe(is->length);
+        if (value > _intsetGet(is,len-1)) {
+            if (pos) *pos = len;
             return 0;
         } else if (value < _intsetGet(is,0)) {
             if (pos) *pos = 0;
@@ -132,25 +176,9 @@ static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
         }
     }
 
-    while(max >= min) {
-        mid = ((unsigned int)min + (unsigned int)max) >> 1;
-        cur = _intsetGet(is,mid);
-        if (value > cur) {
-            min = mid+1;
-        } else if (value < cur) {
-            max = mid-1;
-        } else {
-            break;
-        }
-    }
-
-    if (value == cur) {
-        if (pos) *pos = mid;
-        return 1;
-    } else {
-        if (pos) *pos = min;
-        return 0;
-    }
+    p = intsetLowerBound(is,0,len,value);
+    if (pos) *pos = p;
+    return p < len && _intsetGet(is,p) == value;
 }
 
 /* Upgrades the intset to a larger encoding and inserts the given integer. */
@@ -256,6 +284,282 @@ uint8_t intsetFind(intset *is, int64_t value) {
     return valenc <= intrev32ifbe(is->encoding) && intsetSearch(is,value,NULL);
 }
 
+/* -----------------------------------------------------------------------------
+ * Intersection of intsets.
+ *
+ * SINTER over intsets is a merge of sorted arrays. When one set is much
+ * smaller than the other, its elements are searched in the larger one
+ * with an exponential search starting at the last match (galloping).
+ * Otherwise the arrays are merged, and when they have the same encoding
+ * a SIMD kernel compares a block of elements of each set against each
+ * other, all pairs at once, and advances the block with the smaller
+ * maximum (or both).
+ * -------------------------------------------------------------------------- */
+
+/* Gallop instead of merging when the larger set is at least this many times
+ * bigger than the smaller one. */
+#define INTSET_GALLOP_RATIO 32
+
+/* Return the position of the first element >= "value" at position "from"
+ * or after it, or the intset length if there is no such element. */
+static uint32_t intsetGallop(intset *is, uint32_t from, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length), lo = from, step = 1;
+
+    while (from+step < len && _intsetGet(is,from+step) < value) {
+        lo = from+step+1;
+        step <<= 1;
+    }
+    return intsetLowerBound(is,lo,from+step < len ? from+step+1 : len,value);
+}
+
+/* Merge the elements of 'a' starting at 'i' with the elements of 'b'
+ * starting at 'j', appending the common ones to 'res' at position 'n'.
+ * Return the new number of elements of 'res'. */
+static uint32_t intsetMergeScalar(intset *a, uint32_t i, intset *b,
+                                  uint32_t j, intset *res, uint32_t n)
+{
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+
+    while (i < la && j < lb) {
+        int64_t va = _intsetGet(a,i), vb = _intsetGet(b,j);
+
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            _intsetSet(res,n++,va);
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+static uint32_t intsetIntersectScalar(intset *a, intset *b, intset *res) {
+    return intsetMergeScalar(a,0,b,0,res,0);
+}
+
+#ifdef HAVE_CPU_DISPATCH
+#include <immintrin.h>
+#define INTSET_SIMD 1
+
+/* Append to 'dst' the elements of the block 'src' selected by 'mask'. */
+#define INTSET_EMIT(dst,n,src,mask) do { \
+    while (mask) { \
+        (dst)[(n)++] = (src)[__builtin_ctz(mask)]; \
+        (mask) &= (mask)-1; \
+    } \
+} while(0)
+
+/* Advance the blocks of the two arrays having the smaller maximum. */
+#define INTSET_ADVANCE(a,i,b,j,block) do { \
+    if ((a)[(i)+(block)-1] <= (b)[(j)+(block)-1]) { \
+        if ((b)[(j)+(block)-1] <= (a)[(i)+(block)-1]) (j) += (block); \
+        (i) += (block); \
+    } else { \
+        (j) += (block); \
+    } \
+} while(0)
+
+__attribute__((target("avx2")))
+static uint32_t intsetIntersect16AVX2(intset *a, intset *b, intset *res) {
+    const int16_t *va = (const int16_t*)a->contents;
+    const int16_t *vb = (const int16_t*)b->contents;
+    int16_t *dst = (int16_t*)res->contents;
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i+8 <= la && j+8 <= lb) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(va+i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(vb+j));
+        __m128i m = _mm_cmpeq_epi16(x,y);
+        unsigned int mask;
+
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,2)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,4)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,6)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,8)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,10)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,12)));
+        m = _mm_or_si128(m,_mm_cmpeq_epi16(x,_mm_alignr_epi8(y,y,14)));
+        mask = _mm_movemask_epi8(_mm_packs_epi16(m,_mm_setzero_si128()));
+        INTSET_EMIT(dst,n,va+i,mask);
+        INTSET_ADVANCE(va,i,vb,j,8);
+    }
+    return intsetMergeScalar(a,i,b,j,res,n);
+}
+
+__attribute__((target("avx2")))
+static uint32_t intsetIntersect32AVX2(intset *a, intset *b, intset *res) {
+    const int32_t *va = (const int32_t*)a->contents;
+    const int32_t *vb = (const int32_t*)b->contents;
+    int32_t *dst = (int32_t*)res->contents;
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, n = 0;
+    const __m256i rot = _mm256_setr_epi32(1,2,3,4,5,6,7,0);
+
+    while (i+8 <= la && j+8 <= lb) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(va+i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(vb+j));
+        __m256i m = _mm256_cmpeq_epi32(x,y);
+        unsigned int mask;
+        int k;
+
+        for (k = 1; k < 8; k++) {
+            y = _mm256_permutevar8x32_epi32(y,rot);
+            m = _mm256_or_si256(m,_mm256_cmpeq_epi32(x,y));
+        }
+        mask = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+        INTSET_EMIT(dst,n,va+i,mask);
+        INTSET_ADVANCE(va,i,vb,j,8);
+    }
+    return intsetMergeScalar(a,i,b,j,res,n);
+}
+
+__attribute__((target("avx2")))
+static uint32_t intsetIntersect64AVX2(intset *a, intset *b, intset *res) {
+    const int64_t *va = (const int64_t*)a->contents;
+    const int64_t *vb = (const int64_t*)b->contents;
+    int64_t *dst = (int64_t*)res->contents;
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, n = 0;
+
+    while (i+4 <= la && j+4 <= lb) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(va+i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(vb+j));
+        __m256i m = _mm256_cmpeq_epi64(x,y);
+        unsigned int mask;
+
+        y = _mm256_permute4x64_epi64(y,_MM_SHUFFLE(0,3,2,1));
+        m = _mm256_or_si256(m,_mm256_cmpeq_epi64(x,y));
+        y = _mm256_permute4x64_epi64(y,_MM_SHUFFLE(0,3,2,1));
+        m = _mm256_or_si256(m,_mm256_cmpeq_epi64(x,y));
+        y = _mm256_permute4x64_epi64(y,_MM_SHUFFLE(0,3,2,1));
+        m = _mm256_or_si256(m,_mm256_cmpeq_epi64(x,y));
+        mask = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+        INTSET_EMIT(dst,n,va+i,mask);
+        INTSET_ADVANCE(va,i,vb,j,4);
+    }
+    return intsetMergeScalar(a,i,b,j,res,n);
+}
+
+static uint32_t intsetIntersectAVX2(intset *a, intset *b, intset *res) {
+    uint32_t encoding = intrev32ifbe(a->encoding);
+
+    if (encoding == INTSET_ENC_INT64)
+        return intsetIntersect64AVX2(a,b,res);
+    else if (encoding == INTSET_ENC_INT32)
+        return intsetIntersect32AVX2(a,b,res);
+    else
+        return intsetIntersect16AVX2(a,b,res);
+}
+#endif
+
+struct intsetKernel {
+    char *name;
+    unsigned int features;  /* CPU_* features the kernel needs. */
+    /* Store the elements both in 'a' and 'b' into 'res', that have the
+     * same encoding, and 'res' enough room for all of them. Return the
+     * number of elements stored. */
+    uint32_t (*intersect)(intset *a, intset *b, intset *res);
+};
+
+/* Kernels in order of preference, see cpudispatch.h. */
+static struct intsetKernel intsetKernels[] = {
+#ifdef INTSET_SIMD
+    {"avx2",CPU_AVX2,intsetIntersectAVX2},
+#endif
+    {"scalar",0,intsetIntersectScalar}
+};
+
+#define INTSET_KERNELS (sizeof(intsetKernels)/sizeof(intsetKernels[0]))
+
+static struct intsetKernel *intsetGetKernel(void) {
+    static struct intsetKernel *kernel = NULL;
+    CPU_DISPATCH(kernel,intsetKernels);
+    return kernel;
+}
+
+/* Use the smallest encoding able to represent the elements of the intset,
+ * that is the one an intset would have if it was created adding them. */
+static intset *intsetShrinkEncoding(intset *is) {
+    uint32_t len = intrev32ifbe(is->length), curenc, newenc, j;
+
+    curenc = intrev32ifbe(is->encoding);
+    if (len == 0) {
+        newenc = INTSET_ENC_INT16;
+    } else {
+        uint8_t first = _intsetValueEncoding(_intsetGet(is,0));
+        uint8_t last = _intsetValueEncoding(_intsetGet(is,len-1));
+        newenc = first > last ? first : last;
+    }
+    if (newenc < curenc) {
+        /* Downgrade front-to-back so we don't overwrite values. */
+        is->encoding = intrev32ifbe(newenc);
+        for (j = 0; j < len; j++)
+            _intsetSet(is,j,_intsetGetEncoded(is,j,curenc));
+    }
+    return intsetResize(is,len);
+}
+
+/* Return a copy of the intset using the larger encoding 'enc'. */
+static intset *intsetUpgradeCopy(intset *is, uint32_t enc) {
+    uint32_t len = intrev32ifbe(is->length), j;
+    intset *copy = intsetNew();
+
+    copy->encoding = intrev32ifbe(enc);
+    copy = intsetResize(copy,len);
+    copy->length = is->length;
+    for (j = 0; j < len; j++) _intsetSet(copy,j,_intsetGet(is,j));
+    return copy;
+}
+
+/* Return a new intset with the elements that are both in 'a' and 'b'. The
+ * result is the same intset, encoding included, that is obtained adding
+ * the common elements to an empty intset one after the other. */
+intset *intsetIntersect(intset *a, intset *b) {
+    intset *res = intsetNew(), *tmp = NULL;
+    uint32_t la, lb, enca, encb, n = 0;
+
+    /* Make 'a' the smaller intset. */
+    if (intrev32ifbe(a->length) > intrev32ifbe(b->length)) {
+        intset *swap = a; a = b; b = swap;
+    }
+    la = intrev32ifbe(a->length);
+    lb = intrev32ifbe(b->length);
+    enca = intrev32ifbe(a->encoding);
+    encb = intrev32ifbe(b->encoding);
+    if (la && lb/la >= INTSET_GALLOP_RATIO) {
+        uint32_t i, j = 0;
+
+        /* Every common element fits the smaller of the two encodings. */
+        res->encoding = intrev32ifbe(enca < encb ? enca : encb);
+        res = intsetResize(res,la);
+        for (i = 0; i < la && j < lb; i++) {
+            int64_t value = _intsetGet(a,i);
+
+            j = intsetGallop(b,j,value);
+            if (j < lb && _intsetGet(b,j) == value)
+                _intsetSet(res,n++,value);
+        }
+    } else if (la) {
+        /* The kernels merge intsets with the same encoding: upgrade a copy
+         * of the one with the smaller encoding, and shrink the result. */
+        if (enca < encb) {
+            a = tmp = intsetUpgradeCopy(a,encb);
+        } else if (encb < enca) {
+            b = tmp = intsetUpgradeCopy(b,enca);
+        }
+        res->encoding = a->encoding;
+        res = intsetResize(res,la);
+        n = intsetGetKernel()->intersect(a,b,res);
+        zfree(tmp);
+    }
+    res->length = intrev32ifbe(n);
+    return intsetShrinkEncoding(res);
+}
+
 /* Return random member */
 int64_t intsetRandom(intset *is) {
     return _intsetGet(is,rand()%intrev32ifbe(is->length));
@@ -331,6 +635,31 @@ static intset *createSet(int bits, int size) {
     return is;
 }
 
+/* Create a set of 'size' random values in [-range,range], plus a value
+ * forcing the intset to the specified encoding. */
+static intset *createEncodedSet(uint8_t enc, int range, int size) {
+    intset *is = intsetNew();
+
+    for (int i = 0; i < size; i++)
+        is = intsetAdd(is,(rand() % (2*range+1))-range,NULL);
+    if (enc == INTSET_ENC_INT32)
+        is = intsetAdd(is,INT16_MAX+1+rand()%1000,NULL);
+    else if (enc == INTSET_ENC_INT64)
+        is = intsetAdd(is,-(int64_t)INT32_MAX-2-rand()%1000,NULL);
+    return is;
+}
+
+/* Reference implementation of intsetIntersect(): add to an empty intset
+ * the elements of 'a' that intsetFind() finds in 'b'. */
+static intset *intersectReference(intset *a, intset *b) {
+    intset *res = intsetNew();
+    int64_t value;
+
+    for (uint32_t i = 0; intsetGet(a,i,&value); i++)
+        if (intsetFind(b,value)) res = intsetAdd(res,value,NULL);
+    return res;
+}
+
 static void checkConsistency(intset *is) {
     for (uint32_t i = 0; i < (intrev32ifbe(is->length)-1); i++) {
         uint32_t encoding = intrev32ifbe(is->encoding);
@@ -471,6 +800,82 @@ int intsetTest(int argc, char **argv) {
                num,size,usec()-start);
     }
 
+    printf("Intersection matches intsetFind(): "); {
+        uint8_t encs[] = {INTSET_ENC_INT16,INTSET_ENC_INT32,INTSET_ENC_INT64};
+        int sizes[] = {0,1,7,8,9,31,100,512,5000};
+        int ranges[] = {10,1000,100000};
+
+        for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++)
+        for (int x = 0; x < 9; x++) for (int y = 0; y < 9; y++)
+        for (int r = 0; r < 3; r++) {
+            intset *a = createEncodedSet(encs[i],ranges[r],sizes[x]);
+            intset *b = createEncodedSet(encs[j],ranges[r],sizes[y]);
+            intset *ref = intersectReference(a,b);
+            intset *res = intsetIntersect(a,b);
+
+            assert(intsetBlobLen(res) == intsetBlobLen(ref));
+            assert(!memcmp(res,ref,intsetBlobLen(ref)));
+            zfree(res);
+            for (unsigned long k = 0; k < INTSET_KERNELS; k++) {
+                struct intsetKernel *kernel = &intsetKernels[k];
+                uint32_t la = intrev32ifbe(a->length);
+                uint32_t lb = intrev32ifbe(b->length);
+                uint32_t enca = intrev32ifbe(a->encoding);
+                uint32_t encb = intrev32ifbe(b->encoding);
+                intset *ua, *ub;
+
+                /* The kernels merge intsets with the same encoding. */
+                if (!cpuSupports(kernel->features)) continue;
+                ua = enca < encb ? intsetUpgradeCopy(a,encb) : a;
+                ub = encb < enca ? intsetUpgradeCopy(b,enca) : b;
+                res = intsetNew();
+                res->encoding = ua->encoding;
+                res = intsetResize(res,la < lb ? la : lb);
+                res->length = intrev32ifbe(kernel->intersect(ua,ub,res));
+                res = intsetShrinkEncoding(res);
+                if (ua != a) zfree(ua);
+                if (ub != b) zfree(ub);
+                assert(intsetBlobLen(res) == intsetBlobLen(ref));
+                assert(!memcmp(res,ref,intsetBlobLen(ref)));
+                zfree(res);
+            }
+            zfree(a);
+            zfree(b);
+            zfree(ref);
+        }
+        ok();
+    }
+
+    printf("Stress intersections: "); {
+        uint8_t encs[] = {INTSET_ENC_INT16,INTSET_ENC_INT32,INTSET_ENC_INT64};
+        char *names[] = {"int16","int32","int64"};
+        long num = 100000;
+        long long start;
+
+        printf("\n");
+        for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) {
+            intset *a = createEncodedSet(encs[i],1000,512);
+            intset *b = createEncodedSet(encs[j],1000,512);
+            long long reference, elapsed;
+
+            start = usec();
+            for (long k = 0; k < num; k++) {
+                int64_t value;
+                for (uint32_t p = 0; intsetGet(a,p,&value); p++)
+                    intsetFind(b,value);
+            }
+            reference = usec()-start;
+            start = usec();
+            for (long k = 0; k < num; k++) zfree(intsetIntersect(a,b));
+            elapsed = usec()-start;
+            printf("  %ld intersections, %s with %s, 512 elements: "
+                   "%lldusec (intsetFind() loop: %lldusec)\n",
+                   num,names[i],names[j],elapsed,reference);
+            zfree(a);
+            zfree(b);
+        }
+    }
+
     printf("Stress add+delete: "); {
         int i, v1, v2;
         is = intsetNew();
@@ -144,6 +144,7 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zbtreeIter zbtcurrent;  /* Storage pointed by zcurrent for B+trees. */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
 };
@@ -1419,7 +1420,8 @@ int RM_StringSet(RedisModuleKey *key, RedisModuleString *str) {
     if (!(key->mode & REDISMODULE_WRITE) || key->iter) return REDISMODULE_ERR;
     RM_DeleteKey(key);
     setKey(key->db,key->key,str);
-    key->value = str;
+    /* Small strings are stored as a copy, see setKey(). */
+    key->value = lookupKeyWrite(key->db,key->key);
     return REDISMODULE_OK;
 }
 
@@ -1750,6 +1752,11 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInRange(zsl,zrs) :
                                 zslLastInRange(zsl,zrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        int found = first ? zbtFirstInRange(zs->zbt,zrs,&key->zbtcurrent) :
+                            zbtLastInRange(zs->zbt,zrs,&key->zbtcurrent);
+        key->zcurrent = found ? &key->zbtcurrent : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1814,6 +1821,11 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
         zskiplist *zsl = zs->zsl;
         key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs) :
                                 zslLastInLexRange(zsl,zlrs);
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = key->value->ptr;
+        int found = first ? zbtFirstInLexRange(zs->zbt,zlrs,&key->zbtcurrent) :
+                            zbtLastInLexRange(zs->zbt,zlrs,&key->zbtcurrent);
+        key->zcurrent = found ? &key->zbtcurrent : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1864,6 +1876,11 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
         zskiplistNode *ln = key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter *it = key->zcurrent;
+        sds ele = zbtIterEle(it);
+        if (score) *score = zbtIterScore(it);
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1929,6 +1946,27 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->zcurrent = next;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter next = key->zbtcurrent;
+        if (!zbtNext(&next)) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueLteMax(zbtIterScore(&next),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueLteMax(zbtIterEle(&next),&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zbtcurrent = next;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -1992,6 +2030,27 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->zcurrent = prev;
             return 1;
         }
+    } else if (key->value->encoding == OBJ_ENCODING_BTREE) {
+        zbtreeIter prev = key->zbtcurrent;
+        if (!zbtPrev(&prev)) {
+            key->zer = 1;
+            return 0;
+        } else {
+            /* Are we still within the range? */
+            if (key->ztype == REDISMODULE_ZSET_RANGE_SCORE &&
+                !zslValueGteMin(zbtIterScore(&prev),&key->zrs))
+            {
+                key->zer = 1;
+                return 0;
+            } else if (key->ztype == REDISMODULE_ZSET_RANGE_LEX) {
+                if (!zslLexValueGteMin(zbtIterEle(&prev),&key->zlrs)) {
+                    key->zer = 1;
+                    return 0;
+                }
+            }
+            key->zbtcurrent = prev;
+            return 1;
+        }
     } else {
         serverPanic("Unsupported zset encoding");
     }
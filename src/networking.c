@@ -31,10 +31,46 @@
 #include "server.h"
 #include "atomicvar.h"
 #include <sys/uio.h>
+#include <sched.h>
 #include <math.h>
 #include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static void setProtocolError(const char *errstr, client *c, int pos);
+static void setProtocolError(const char *errstr, client *c);
+
+/* Threaded I/O state, see the "Threaded I/O" section at the end of this
+ * file. The per thread byte counters are only touched by the owning thread
+ * while it has pending clients, and are flushed into the server stats by the
+ * main thread once all the threads are done. */
+#define IO_THREADS_OP_IDLE 0
+#define IO_THREADS_OP_READ 1
+#define IO_THREADS_OP_WRITE 2
+#define IO_THREADS_SPIN_LOOPS 10000 /* Busy wait before sleeping/yielding. */
+
+typedef struct ioThread {
+    pthread_t tid;
+    pthread_mutex_t mutex;          /* Protects the sleep on 'cond'. */
+    pthread_cond_t cond;            /* Signaled when a batch is handed over. */
+    unsigned long pending;          /* Clients left to process. */
+    pthread_mutex_t pending_mutex;  /* Used by atomicvar.h if needed. */
+    list *clients;                  /* Clients assigned for this batch. */
+    long long bytes_read;           /* Not yet added to the server stats. */
+    long long bytes_written;
+    long long output_syscalls;
+    list *released_refs;            /* Zero-copy reply objects to release. */
+    sds free_chunks;                /* Reply chunks sent, see replyChunkFree(). */
+    unsigned long free_chunks_len;
+} ioThread;
+
+static ioThread io_threads[IO_THREADS_MAX_NUM];
+static int io_threads_op = IO_THREADS_OP_IDLE;
+static __thread int io_thread_id = 0; /* 0 is the main thread. */
+static int processing_events_while_blocked = 0;
+static pthread_mutex_t async_free_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void releaseReplyRef(robj *o);
 
 /* Return the size consumed from the allocator, for the specified SDS string,
  * including internal fragmentation. This function is used in order to compute
@@ -55,13 +91,153 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* Reply chunks. The nodes of the reply lists are filled with small replies
+ * up to REPLY_CHUNK_SIZE bytes, sized to fill an allocator size class of
+ * PROTO_REPLY_CHUNK_BYTES. Once sent, the chunks are linked in a free list
+ * (through their first bytes) instead of being freed, so that pipelining
+ * clients don't hit the allocator for every chunk of replies. The pool is
+ * bounded by PROTO_REPLY_CHUNK_POOL_MAX and trimmed by serverCron() when
+ * the chunks are not needed, see trimReplyChunkPool(). */
+#define REPLY_CHUNK_SIZE (PROTO_REPLY_CHUNK_BYTES-sizeof(struct sdshdr16)-1)
+
+static sds reply_chunk_pool = NULL;
+static unsigned long reply_chunk_pool_len = 0;
+static unsigned long reply_chunk_pool_low = 0; /* Min len since last trim. */
+
+static sds replyChunkNew(void) {
+    /* The I/O threads may only need a chunk for protocol errors, and
+     * allocate it instead of touching the pool. */
+    sds chunk = io_thread_id ? NULL : reply_chunk_pool;
+
+    if (chunk == NULL) {
+        chunk = sdsnewlen(SDS_NOINIT,REPLY_CHUNK_SIZE);
+        if (!io_thread_id) server.stat_reply_chunks_allocated++;
+    } else {
+        memcpy(&reply_chunk_pool,chunk,sizeof(sds));
+        reply_chunk_pool_len--;
+        if (reply_chunk_pool_low > reply_chunk_pool_len)
+            reply_chunk_pool_low = reply_chunk_pool_len;
+        server.stat_reply_chunks_reused++;
+    }
+    sdsclear(chunk);
+    return chunk;
+}
+
+/* Push a chunk in the given free list. */
+static void replyChunkPush(sds *pool, unsigned long *len, sds chunk) {
+    memcpy(chunk,pool,sizeof(sds));
+    *pool = chunk;
+    (*len)++;
+}
+
+/* Release a sent node of a reply list: chunks go back to the pool, other
+ * strings are freed. The I/O threads don't touch the global pool, their
+ * chunks are collected by the main thread at the end of the batch. */
+static void replyChunkFree(sds s) {
+    if (sdsalloc(s) != REPLY_CHUNK_SIZE) {
+        sdsfree(s);
+    } else if (io_thread_id) {
+        ioThread *t = io_threads+io_thread_id;
+        replyChunkPush(&t->free_chunks,&t->free_chunks_len,s);
+    } else if (reply_chunk_pool_len < PROTO_REPLY_CHUNK_POOL_MAX) {
+        replyChunkPush(&reply_chunk_pool,&reply_chunk_pool_len,s);
+    } else {
+        sdsfree(s);
+    }
+}
+
+/* Called by serverCron() every 10 seconds: free half of the pooled chunks
+ * that were not needed since the previous call. A shorter period would free
+ * the chunks of pipelines arriving in bursts between two bursts. */
+void trimReplyChunkPool(void) {
+    unsigned long unused = (reply_chunk_pool_low+1)/2;
+
+    while(unused--) {
+        sds chunk = reply_chunk_pool;
+        memcpy(&reply_chunk_pool,chunk,sizeof(sds));
+        reply_chunk_pool_len--;
+        sdsfree(chunk);
+    }
+    reply_chunk_pool_low = reply_chunk_pool_len;
+}
+
+size_t replyChunkPoolMemory(void) {
+    return reply_chunk_pool_len*PROTO_REPLY_CHUNK_BYTES;
+}
+
+/* Zero-copy replies. String objects larger than a reply chunk would get a
+ * node of their own in the reply list anyway: instead of copying them, we
+ * queue a small sds flagged with SDS_REF that holds a reference to the
+ * object, and writeToClient() sends the object straight from its buffer.
+ * This is safe since string values are never modified in place while they
+ * are shared (see dbUnshareStringValue()). */
+static sds createReplyRef(robj *o) {
+    sds ref = sdscatlen(sdsempty(),&o,sizeof(o));
+
+    ref[-1] |= SDS_REF;
+    incrRefCount(o);
+    return ref;
+}
+
+static robj *replyRefObject(sds ref) {
+    robj *o;
+
+    memcpy(&o,ref,sizeof(o));
+    return o;
+}
+
+/* Replace the zero-copy reply nodes of all the clients with copies of the
+ * objects they reference. The lazy free thread decrements the refcount of
+ * the values without synchronization with the main thread, so no value it
+ * is going to release may still be referenced by a pending reply: called
+ * before a database is handed to it, see emptyDb(). */
+void copyReplyRefs(void) {
+    listIter li, ri;
+    listNode *ln, *rn;
+
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        listRewind(c->reply,&ri);
+        while((rn = listNext(&ri))) {
+            sds ref = listNodeValue(rn);
+            robj *o;
+
+            if (ref == NULL || !sdsIsRef(ref)) continue;
+            o = replyRefObject(ref);
+            listNodeValue(rn) = sdsnewlen(o->ptr,sdslen(o->ptr));
+            decrRefCount(o);
+            sdsfree(ref);
+        }
+    }
+}
+
+/* Return the bytes to send for a node of the reply list. */
+static char *replyNodePayload(sds node, size_t *len) {
+    if (sdsIsRef(node)) {
+        robj *o = replyRefObject(node);
+        *len = sdslen(o->ptr);
+        return o->ptr;
+    }
+    *len = sdslen(node);
+    return node;
+}
+
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
+    if (sdsIsRef(o)) return createReplyRef(replyRefObject(o));
     return sdsdup(o);
 }
 
 void freeClientReplyValue(void *o) {
-    sdsfree(o);
+    if (o == NULL) return; /* addDeferredMultiBulkLength() placeholder. */
+    if (sdsIsRef(o)) {
+        releaseReplyRef(replyRefObject(o));
+        sdsfree(o);
+    } else {
+        replyChunkFree(o);
+    }
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -97,11 +273,14 @@ client *createClient(int fd) {
     c->name = NULL;
     c->bufpos = 0;
     c->querybuf = sdsempty();
+    c->qb_pos = 0;
     c->pending_querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len = 0;
+    memset(c->argv_cache,0,sizeof(c->argv_cache));
     c->cmd = c->lastcmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
@@ -184,6 +363,7 @@ int prepareClientToWrite(client *c) {
      * receive writes at this stage. */
     if (!clientHasPendingReplies(c) &&
         !(c->flags & CLIENT_PENDING_WRITE) &&
+        !(c->flags & CLIENT_PENDING_READ) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_put_online_on_ack)))
     {
@@ -222,29 +402,32 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     return C_OK;
 }
 
-void _addReplyObjectToList(client *c, robj *o) {
-    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
-
-    if (listLength(c->reply) == 0) {
-        sds s = sdsdup(o->ptr);
-        listAddNodeTail(c->reply,s);
-        c->reply_bytes += sdslen(s);
+/* Append the protocol to the reply list. The bytes go in the tail node if
+ * there is room for them, otherwise in a new chunk, or in a string of their
+ * own if they don't fit a chunk. */
+static void _addReplyProtoToList(client *c, const char *s, size_t len) {
+    listNode *ln = listLast(c->reply);
+    sds tail = ln ? listNodeValue(ln) : NULL;
+
+    /* Append to this object when possible. If tail == NULL it was
+     * set via addDeferredMultiBulkLength(). */
+    if (tail && !sdsIsRef(tail) && sdsavail(tail) >= len) {
+        memcpy(tail+sdslen(tail),s,len);
+        sdsIncrLen(tail,len);
+    } else if (len <= REPLY_CHUNK_SIZE) {
+        sds chunk = replyChunkNew();
+        memcpy(chunk,s,len);
+        sdsIncrLen(chunk,len);
+        listAddNodeTail(c->reply,chunk);
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,o->ptr);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(o->ptr);
-        } else {
-            sds s = sdsdup(o->ptr);
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
+        listAddNodeTail(c->reply,sdsnewlen(s,len));
     }
+    c->reply_bytes += len;
+}
+
+void _addReplyObjectToList(client *c, robj *o) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+    _addReplyProtoToList(c,o->ptr,sdslen(o->ptr));
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
@@ -256,51 +439,21 @@ void _addReplySdsToList(client *c, sds s) {
         return;
     }
 
-    if (listLength(c->reply) == 0) {
+    /* Strings too big for a chunk become a node of their own, the others
+     * are copied, since the chunk will be recycled once sent. */
+    if (sdslen(s) > REPLY_CHUNK_SIZE) {
         listAddNodeTail(c->reply,s);
         c->reply_bytes += sdslen(s);
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatsds(tail,s);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += sdslen(s);
-            sdsfree(s);
-        } else {
-            listAddNodeTail(c->reply,s);
-            c->reply_bytes += sdslen(s);
-        }
+        _addReplyProtoToList(c,s,sdslen(s));
+        sdsfree(s);
     }
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
 void _addReplyStringToList(client *c, const char *s, size_t len) {
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
-
-    if (listLength(c->reply) == 0) {
-        sds node = sdsnewlen(s,len);
-        listAddNodeTail(c->reply,node);
-        c->reply_bytes += len;
-    } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_CHUNK_BYTES) {
-            tail = sdscatlen(tail,s,len);
-            listNodeValue(ln) = tail;
-            c->reply_bytes += len;
-        } else {
-            sds node = sdsnewlen(s,len);
-            listAddNodeTail(c->reply,node);
-            c->reply_bytes += len;
-        }
-    }
+    _addReplyProtoToList(c,s,len);
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
@@ -432,20 +585,32 @@ void *addDeferredMultiBulkLength(client *c) {
 /* Populate the length object and try gluing it to the next chunk. */
 void setDeferredMultiBulkLength(client *c, void *node, long length) {
     listNode *ln = (listNode*)node;
+    char lenstr[LONG_STR_SIZE+3];
+    size_t lenlen;
     sds len, next;
 
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addDeferredMultiBulkLength() */
     if (node == NULL) return;
 
-    len = sdscatprintf(sdsnewlen("*",1),"%ld\r\n",length);
-    listNodeValue(ln) = len;
-    c->reply_bytes += sdslen(len);
-    if (ln->next != NULL) {
-        next = listNodeValue(ln->next);
-
-        /* Only glue when the next node is non-NULL (an sds in this case) */
-        if (next != NULL) {
+    lenlen = snprintf(lenstr,sizeof(lenstr),"*%ld\r\n",length);
+    c->reply_bytes += lenlen;
+    next = ln->next ? listNodeValue(ln->next) : NULL;
+
+    /* Only glue when the next node is non-NULL (an sds in this case),
+     * and not a reference to an object. If the next node has room, the
+     * length is just prepended to it, and the placeholder removed. */
+    if (next != NULL && !sdsIsRef(next) && sdsavail(next) >= lenlen) {
+        memmove(next+lenlen,next,sdslen(next));
+        memcpy(next,lenstr,lenlen);
+        sdsIncrLen(next,lenlen);
+        listNodeValue(ln->next) = NULL;
+        listDelNode(c->reply,ln->next);
+        listNodeValue(ln) = next;
+    } else {
+        len = sdsnewlen(lenstr,lenlen);
+        listNodeValue(ln) = len;
+        if (next != NULL && !sdsIsRef(next)) {
             len = sdscatsds(len,next);
             listDelNode(c->reply,ln->next);
             listNodeValue(ln) = len;
@@ -547,9 +712,31 @@ void addReplyBulkLen(client *c, robj *obj) {
 }
 
 /* Add a Redis Object as a bulk reply */
+/* Queue a large string object in the reply list by reference, see
+ * createReplyRef(). Returns 0 if the object should be copied instead.
+ * Clients whose replies are consumed from the reply list by other code
+ * (Lua, modules, fake clients) and replication streams always get copies. */
+static int addReplyObjectRef(client *c, robj *obj) {
+    size_t len;
+
+    if (obj->type != OBJ_STRING || obj->encoding != OBJ_ENCODING_RAW ||
+        sdslen(obj->ptr) <= PROTO_REPLY_CHUNK_BYTES || c->fd <= 0 ||
+        c->flags & (CLIENT_LUA|CLIENT_MODULE|CLIENT_SLAVE|CLIENT_MASTER|
+                    CLIENT_CLOSE_AFTER_REPLY)) return 0;
+
+    if (prepareClientToWrite(c) != C_OK) return 1;
+    len = sdslen(obj->ptr);
+    listAddNodeTail(c->reply,createReplyRef(obj));
+    c->reply_bytes += len;
+    server.stat_zero_copy_replies++;
+    server.stat_zero_copy_reply_bytes += len;
+    asyncCloseClientOnOutputBufferLimitReached(c);
+    return 1;
+}
+
 void addReplyBulk(client *c, robj *obj) {
     addReplyBulkLen(c,obj);
-    addReply(c,obj);
+    if (!addReplyObjectRef(c,obj)) addReply(c,obj);
     addReply(c,shared.crlf);
 }
 
@@ -714,8 +901,25 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
 static void freeClientArgv(client *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        /* Keep the small arguments of connected clients in the argv_cache
+         * array, so that the parser can reuse them for the next command.
+         * The object must be an EMBSTR string with refcount = 1 (we must
+         * be the only owner) for us to cache it. */
+        if (j < PROTO_ARGV_CACHE_SIZE &&
+            c->fd != -1 &&
+            o->refcount == 1 &&
+            o->encoding == OBJ_ENCODING_EMBSTR &&
+            !o->keyed)
+        {
+            if (c->argv_cache[j]) decrRefCount(c->argv_cache[j]);
+            c->argv_cache[j] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
 }
@@ -763,6 +967,14 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of pending reads if needed. */
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        serverAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+    }
+
     /* When client was just unblocked because of a blocking operation,
      * remove it from the list of unblocked clients. */
     if (c->flags & CLIENT_UNBLOCKED) {
@@ -862,6 +1074,8 @@ void freeClient(client *c) {
      * and finally release the client structure itself. */
     if (c->name) decrRefCount(c->name);
     zfree(c->argv);
+    for (int j = 0; j < PROTO_ARGV_CACHE_SIZE; j++)
+        if (c->argv_cache[j]) decrRefCount(c->argv_cache[j]);
     freeClientMultiState(c);
     sdsfree(c->peerid);
     zfree(c);
@@ -874,7 +1088,24 @@ void freeClient(client *c) {
 void freeClientAsync(client *c) {
     if (c->flags & CLIENT_CLOSE_ASAP || c->flags & CLIENT_LUA) return;
     c->flags |= CLIENT_CLOSE_ASAP;
+    /* With threaded I/O the clients may be scheduled for closing by
+     * different threads at the same time. */
+    if (server.io_threads_num == 1) {
+        listAddNodeTail(server.clients_to_close,c);
+        return;
+    }
+    pthread_mutex_lock(&async_free_queue_mutex);
     listAddNodeTail(server.clients_to_close,c);
+    pthread_mutex_unlock(&async_free_queue_mutex);
+}
+
+/* While a batch of clients is handled by the I/O threads, the clients are
+ * referenced by the per thread lists, so they can only be freed later. */
+static void freeClientFromIO(client *c) {
+    if (io_threads_op != IO_THREADS_OP_IDLE)
+        freeClientAsync(c);
+    else
+        freeClient(c);
 }
 
 void freeClientsInAsyncFreeQueue(void) {
@@ -889,41 +1120,83 @@ void freeClientsInAsyncFreeQueue(void) {
 }
 
 /* Write data in output buffers to client. Return C_OK if the client
- * is still valid after the call, C_ERR if it was freed. */
+ * is still valid after the call, C_ERR if it was freed.
+ *
+ * The static buffer and the nodes of the reply list are gathered into a
+ * single writev(2) call, of up to NET_MAX_WRITES_IOV buffers. Note that
+ * c->sentlen refers to the static buffer while it is not empty, and to the
+ * head of the reply list otherwise. */
 int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    sds o;
+    long long syscalls = 0;
+    size_t objlen, left;
+    struct iovec iov[NET_MAX_WRITES_IOV];
+    listIter li;
+    listNode *ln;
 
     while(clientHasPendingReplies(c)) {
+        int iovcnt = 0;
+        size_t iovbytes = 0, offset;
+
+        /* Gather the buffers to send. There is no point in collecting more
+         * than NET_MAX_WRITES_PER_EVENT bytes, see the fairness check at
+         * the end of the loop. */
         if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
+            iov[iovcnt].iov_base = c->buf+c->sentlen;
+            iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+            iovbytes += iov[iovcnt++].iov_len;
+        }
+        offset = (c->bufpos > 0) ? 0 : c->sentlen;
+        listRewind(c->reply,&li);
+        while(iovcnt < NET_MAX_WRITES_IOV &&
+              iovbytes < NET_MAX_WRITES_PER_EVENT &&
+              (ln = listNext(&li)))
+        {
+            char *payload = replyNodePayload(listNodeValue(ln),&objlen);
+            if (objlen == 0) continue;
+            iov[iovcnt].iov_base = payload+offset;
+            iov[iovcnt].iov_len = objlen-offset;
+            iovbytes += iov[iovcnt++].iov_len;
+            offset = 0;
+        }
+
+        /* Only empty objects in the list: the loop below will drop them. */
+        nwritten = 0;
+        if (iovcnt) {
+            if (iovcnt == 1)
+                nwritten = write(fd,iov[0].iov_base,iov[0].iov_len);
+            else
+                nwritten = writev(fd,iov,iovcnt);
+            syscalls++;
             if (nwritten <= 0) break;
-            c->sentlen += nwritten;
             totwritten += nwritten;
+        }
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
+        /* Consume what was sent: the static buffer first, then the list. */
+        left = nwritten;
+        if (c->bufpos > 0) {
+            if (left >= c->bufpos-c->sentlen) {
+                /* The buffer was sent, set bufpos to zero to continue with
+                 * the remainder of the reply. */
+                left -= c->bufpos-c->sentlen;
                 c->bufpos = 0;
                 c->sentlen = 0;
+            } else {
+                c->sentlen += left;
+                left = 0;
             }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o);
-
+        }
+        while(c->bufpos == 0 && listLength(c->reply)) {
+            replyNodePayload(listNodeValue(listFirst(c->reply)),&objlen);
             if (objlen == 0) {
                 listDelNode(c->reply,listFirst(c->reply));
                 continue;
             }
-
-            nwritten = write(fd, o + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
+            if (left == 0) break;
 
             /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
+            if (left >= objlen-c->sentlen) {
+                left -= objlen-c->sentlen;
                 listDelNode(c->reply,listFirst(c->reply));
                 c->sentlen = 0;
                 c->reply_bytes -= objlen;
@@ -931,8 +1204,12 @@ int writeToClient(int fd, client *c, int handler_installed) {
                  * the count of reply bytes to be exactly zero. */
                 if (listLength(c->reply) == 0)
                     serverAssert(c->reply_bytes == 0);
+            } else {
+                c->sentlen += left;
+                left = 0;
             }
         }
+
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -945,14 +1222,20 @@ int writeToClient(int fd, client *c, int handler_installed) {
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
-    server.stat_net_output_bytes += totwritten;
+    if (io_thread_id) {
+        io_threads[io_thread_id].bytes_written += totwritten;
+        io_threads[io_thread_id].output_syscalls += syscalls;
+    } else {
+        server.stat_net_output_bytes += totwritten;
+        server.stat_net_output_syscalls += syscalls;
+    }
     if (nwritten == -1) {
         if (errno == EAGAIN) {
             nwritten = 0;
         } else {
             serverLog(LL_VERBOSE,
                 "Error writing to client: %s", strerror(errno));
-            freeClient(c);
+            freeClientFromIO(c);
             return C_ERR;
         }
     }
@@ -969,7 +1252,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
         /* Close connection after entire reply has been sent. */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
-            freeClient(c);
+            freeClientFromIO(c);
             return C_ERR;
         }
     }
@@ -1037,6 +1320,55 @@ void resetClient(client *c) {
     }
 }
 
+/* Return a pointer to the first '\r' in the 'len' bytes at 'p', or NULL.
+ * The protocol lines are short, so the first 16 bytes block usually has it. */
+static inline char *protoFindCR(char *p, size_t len) {
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+
+    for (; len >= 16; p += 16, len -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v,cr));
+        if (mask) return p+__builtin_ctz(mask);
+    }
+#endif
+    return memchr(p,'\r',len);
+}
+
+/* Make sure the argv array of the client can hold 'argc' arguments. The
+ * array is kept across commands, unless it is very large. */
+static void clientArgvMakeRoom(client *c, int argc) {
+    if (c->argv_len >= argc && c->argv_len <= PROTO_ARGV_REUSE_MAX) return;
+    zfree(c->argv);
+    c->argv = zmalloc(sizeof(robj*)*argc);
+    c->argv_len = argc;
+}
+
+/* Create the object for the argument 'j' of the command being parsed,
+ * reusing the object of the same argument of the previous command when it
+ * is large enough, see freeClientArgv(). */
+static robj *createClientArgument(client *c, int j, const char *p, size_t len) {
+    robj *o;
+
+    if (j < PROTO_ARGV_CACHE_SIZE && (o = c->argv_cache[j]) != NULL &&
+        sdsalloc(o->ptr) >= len)
+    {
+        sds s = o->ptr;
+
+        c->argv_cache[j] = NULL;
+        memcpy(s,p,len);
+        s[len] = '\0';
+        sdssetlen(s,len);
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+            o->lru = (LFUGetTimeInMinutes()<<8) | LFU_INIT_VAL;
+        } else {
+            o->lru = LRU_CLOCK();
+        }
+        return o;
+    }
+    return createStringObject(p,len);
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1046,34 +1378,36 @@ void resetClient(client *c) {
  * with the error and close the connection. */
 int processInlineBuffer(client *c) {
     char *newline;
-    int argc, j;
+    int argc, j, linefeed_chars = 1;
     sds *argv, aux;
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->querybuf,'\n');
+    newline = memchr(c->querybuf+c->qb_pos,'\n',sdslen(c->querybuf)-c->qb_pos);
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
-        if (sdslen(c->querybuf) > PROTO_INLINE_MAX_SIZE) {
+        if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
             addReplyError(c,"Protocol error: too big inline request");
-            setProtocolError("too big inline request",c,0);
+            setProtocolError("too big inline request",c);
         }
         return C_ERR;
     }
 
     /* Handle the \r\n case. */
-    if (newline && newline != c->querybuf && *(newline-1) == '\r')
+    if (newline != c->querybuf+c->qb_pos && *(newline-1) == '\r') {
         newline--;
+        linefeed_chars++;
+    }
 
     /* Split the input buffer up to the \r\n */
-    querylen = newline-(c->querybuf);
-    aux = sdsnewlen(c->querybuf,querylen);
+    querylen = newline-(c->querybuf+c->qb_pos);
+    aux = sdsnewlen(c->querybuf+c->qb_pos,querylen);
     argv = sdssplitargs(aux,&argc);
     sdsfree(aux);
     if (argv == NULL) {
         addReplyError(c,"Protocol error: unbalanced quotes in request");
-        setProtocolError("unbalanced quotes in inline request",c,0);
+        setProtocolError("unbalanced quotes in inline request",c);
         return C_ERR;
     }
 
@@ -1083,14 +1417,11 @@ int processInlineBuffer(client *c) {
     if (querylen == 0 && c->flags & CLIENT_SLAVE)
         c->repl_ack_time = server.unixtime;
 
-    /* Leave data after the first line of the query in the buffer */
-    sdsrange(c->querybuf,querylen+2,-1);
+    /* Move querybuffer position to the next query in the buffer. */
+    c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*argc);
-    }
+    if (argc) clientArgvMakeRoom(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1105,10 +1436,10 @@ int processInlineBuffer(client *c) {
     return C_OK;
 }
 
-/* Helper function. Trims query buffer to make the function that processes
- * multi bulk requests idempotent. */
+/* Helper function. Logs the protocol error and sets the client to be closed
+ * once the error reply is sent, so that no more commands are parsed. */
 #define PROTO_DUMP_LEN 128
-static void setProtocolError(const char *errstr, client *c, int pos) {
+static void setProtocolError(const char *errstr, client *c) {
     if (server.verbosity <= LL_VERBOSE) {
         sds client = catClientInfoString(sdsempty(),c);
 
@@ -1133,7 +1464,6 @@ static void setProtocolError(const char *errstr, client *c, int pos) {
         sdsfree(client);
     }
     c->flags |= CLIENT_CLOSE_AFTER_REPLY;
-    sdsrange(c->querybuf,pos,-1);
 }
 
 /* Process the query buffer for client 'c', setting up the client argument
@@ -1149,7 +1479,7 @@ static void setProtocolError(const char *errstr, client *c, int pos) {
  * to be '*'. Otherwise for inline commands processInlineBuffer() is called. */
 int processMultibulkBuffer(client *c) {
     char *newline = NULL;
-    int pos = 0, ok;
+    int ok;
     long long ll;
 
     if (c->multibulklen == 0) {
@@ -1157,11 +1487,12 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf,'\r');
+        newline = protoFindCR(c->querybuf+c->qb_pos,
+                              sdslen(c->querybuf)-c->qb_pos);
         if (newline == NULL) {
-            if (sdslen(c->querybuf) > PROTO_INLINE_MAX_SIZE) {
+            if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
-                setProtocolError("too big mbulk count string",c,0);
+                setProtocolError("too big mbulk count string",c);
             }
             return C_ERR;
         }
@@ -1172,37 +1503,35 @@ int processMultibulkBuffer(client *c) {
 
         /* We know for sure there is a whole line since newline != NULL,
          * so go ahead and find out the multi bulk length. */
-        serverAssertWithInfo(c,NULL,c->querybuf[0] == '*');
-        ok = string2ll(c->querybuf+1,newline-(c->querybuf+1),&ll);
+        serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
+        ok = string2ll(c->querybuf+1+c->qb_pos,
+                       newline-(c->querybuf+1+c->qb_pos),&ll);
         if (!ok || ll > 1024*1024) {
             addReplyError(c,"Protocol error: invalid multibulk length");
-            setProtocolError("invalid mbulk count",c,pos);
+            setProtocolError("invalid mbulk count",c);
             return C_ERR;
         }
 
-        pos = (newline-c->querybuf)+2;
-        if (ll <= 0) {
-            sdsrange(c->querybuf,pos,-1);
-            return C_OK;
-        }
+        c->qb_pos = (newline-c->querybuf)+2;
+        if (ll <= 0) return C_OK;
 
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
+        clientArgvMakeRoom(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+pos,'\r');
+            newline = protoFindCR(c->querybuf+c->qb_pos,
+                                  sdslen(c->querybuf)-c->qb_pos);
             if (newline == NULL) {
-                if (sdslen(c->querybuf) > PROTO_INLINE_MAX_SIZE) {
+                if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
                         "Protocol error: too big bulk count string");
-                    setProtocolError("too big bulk count string",c,0);
+                    setProtocolError("too big bulk count string",c);
                     return C_ERR;
                 }
                 break;
@@ -1212,22 +1541,23 @@ int processMultibulkBuffer(client *c) {
             if (newline-(c->querybuf) > ((signed)sdslen(c->querybuf)-2))
                 break;
 
-            if (c->querybuf[pos] != '$') {
+            if (c->querybuf[c->qb_pos] != '$') {
                 addReplyErrorFormat(c,
                     "Protocol error: expected '$', got '%c'",
-                    c->querybuf[pos]);
-                setProtocolError("expected $ but got something else",c,pos);
+                    c->querybuf[c->qb_pos]);
+                setProtocolError("expected $ but got something else",c);
                 return C_ERR;
             }
 
-            ok = string2ll(c->querybuf+pos+1,newline-(c->querybuf+pos+1),&ll);
+            ok = string2ll(c->querybuf+c->qb_pos+1,
+                           newline-(c->querybuf+c->qb_pos+1),&ll);
             if (!ok || ll < 0 || ll > 512*1024*1024) {
                 addReplyError(c,"Protocol error: invalid bulk length");
-                setProtocolError("invalid bulk length",c,pos);
+                setProtocolError("invalid bulk length",c);
                 return C_ERR;
             }
 
-            pos += newline-(c->querybuf+pos)+2;
+            c->qb_pos = newline-c->querybuf+2;
             if (ll >= PROTO_MBULK_BIG_ARG) {
                 size_t qblen;
 
@@ -1235,8 +1565,8 @@ int processMultibulkBuffer(client *c) {
                  * try to make it likely that it will start at c->querybuf
                  * boundary so that we can optimize object creation
                  * avoiding a large copy of data. */
-                sdsrange(c->querybuf,pos,-1);
-                pos = 0;
+                sdsrange(c->querybuf,c->qb_pos,-1);
+                c->qb_pos = 0;
                 qblen = sdslen(c->querybuf);
                 /* Hint the sds library about the amount of bytes this string is
                  * going to contain. */
@@ -1247,16 +1577,16 @@ int processMultibulkBuffer(client *c) {
         }
 
         /* Read bulk argument */
-        if (sdslen(c->querybuf)-pos < (unsigned)(c->bulklen+2)) {
+        if (sdslen(c->querybuf)-c->qb_pos < (size_t)(c->bulklen+2)) {
             /* Not enough data (+2 == trailing \r\n) */
             break;
         } else {
             /* Optimization: if the buffer contains JUST our bulk element
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
-            if (pos == 0 &&
+            if (c->qb_pos == 0 &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
-                (signed) sdslen(c->querybuf) == c->bulklen+2)
+                sdslen(c->querybuf) == (size_t)(c->bulklen+2))
             {
                 c->argv[c->argc++] = createObject(OBJ_STRING,c->querybuf);
                 sdsIncrLen(c->querybuf,-2); /* remove CRLF */
@@ -1264,20 +1594,17 @@ int processMultibulkBuffer(client *c) {
                  * likely... */
                 c->querybuf = sdsnewlen(NULL,c->bulklen+2);
                 sdsclear(c->querybuf);
-                pos = 0;
             } else {
-                c->argv[c->argc++] =
-                    createStringObject(c->querybuf+pos,c->bulklen);
-                pos += c->bulklen+2;
+                c->argv[c->argc] = createClientArgument(c,c->argc,
+                    c->querybuf+c->qb_pos,c->bulklen);
+                c->argc++;
+                c->qb_pos += c->bulklen+2;
             }
             c->bulklen = -1;
             c->multibulklen--;
         }
     }
 
-    /* Trim to pos */
-    if (pos) sdsrange(c->querybuf,pos,-1);
-
     /* We're done when c->multibulk == 0 */
     if (c->multibulklen == 0) return C_OK;
 
@@ -1289,10 +1616,36 @@ int processMultibulkBuffer(client *c) {
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process. */
+/* Parse the next command in the query buffer, populating the client
+ * argument vector. Returns C_OK if a full command (or an empty multi bulk)
+ * was parsed, C_ERR if more data is needed or a protocol error occurred. */
+static int parseClientCommand(client *c) {
+    /* Determine request type when unknown. */
+    if (!c->reqtype) {
+        if (c->querybuf[c->qb_pos] == '*') {
+            c->reqtype = PROTO_REQ_MULTIBULK;
+        } else {
+            c->reqtype = PROTO_REQ_INLINE;
+        }
+    }
+
+    if (c->reqtype == PROTO_REQ_INLINE) {
+        return processInlineBuffer(c);
+    } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+        return processMultibulkBuffer(c);
+    } else {
+        serverPanic("Unknown request type");
+    }
+    return C_ERR; /* Not reached. */
+}
+
 void processInputBuffer(client *c) {
     server.current_client = c;
-    /* Keep processing while there is something in the input buffer */
-    while(sdslen(c->querybuf)) {
+    /* Keep processing while there is something in the input buffer, or a
+     * command that was already parsed by an I/O thread. */
+    while(c->qb_pos < sdslen(c->querybuf) ||
+          (c->flags & CLIENT_PENDING_COMMAND))
+    {
         /* Return if clients are paused. */
         if (!(c->flags & CLIENT_SLAVE) && clientsArePaused()) break;
 
@@ -1306,21 +1659,11 @@ void processInputBuffer(client *c) {
          * The same applies for clients we want to terminate ASAP. */
         if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
 
-        /* Determine request type when unknown. */
-        if (!c->reqtype) {
-            if (c->querybuf[0] == '*') {
-                c->reqtype = PROTO_REQ_MULTIBULK;
-            } else {
-                c->reqtype = PROTO_REQ_INLINE;
-            }
-        }
-
-        if (c->reqtype == PROTO_REQ_INLINE) {
-            if (processInlineBuffer(c) != C_OK) break;
-        } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
-            if (processMultibulkBuffer(c) != C_OK) break;
-        } else {
-            serverPanic("Unknown request type");
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            /* The argument vector is already populated. */
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+        } else if (parseClientCommand(c) != C_OK) {
+            break;
         }
 
         /* Multibulk processing could see a <= 0 length. */
@@ -1331,7 +1674,8 @@ void processInputBuffer(client *c) {
             if (processCommand(c) == C_OK) {
                 if (c->flags & CLIENT_MASTER && !(c->flags & CLIENT_MULTI)) {
                     /* Update the applied replication offset of our master. */
-                    c->reploff = c->read_reploff - sdslen(c->querybuf);
+                    c->reploff = c->read_reploff - sdslen(c->querybuf) +
+                                 c->qb_pos;
                 }
 
                 /* Don't reset the client structure for clients blocked in a
@@ -1347,15 +1691,23 @@ void processInputBuffer(client *c) {
             if (server.current_client == NULL) break;
         }
     }
+
+    /* Trim the query buffer once, up to the position of the first command
+     * not yet processed, instead of after every command. */
+    if (server.current_client != NULL && c->qb_pos) {
+        sdsrange(c->querybuf,c->qb_pos,-1);
+        c->qb_pos = 0;
+    }
     server.current_client = NULL;
 }
 
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    client *c = (client*) privdata;
+/* Read from the client socket appending to the query buffer. This is also
+ * called by the I/O threads, so the client is never freed synchronously
+ * while a threaded batch is running. Returns C_ERR if there is nothing to
+ * process, because no data was available or the client is going away. */
+static int readClientSocket(client *c) {
     int nread, readlen;
     size_t qblen;
-    UNUSED(el);
-    UNUSED(mask);
 
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
@@ -1375,19 +1727,19 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
-    nread = read(fd, c->querybuf+qblen, readlen);
+    nread = read(c->fd, c->querybuf+qblen, readlen);
     if (nread == -1) {
         if (errno == EAGAIN) {
-            return;
+            return C_ERR;
         } else {
             serverLog(LL_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
-            return;
+            freeClientFromIO(c);
+            return C_ERR;
         }
     } else if (nread == 0) {
         serverLog(LL_VERBOSE, "Client closed connection");
-        freeClient(c);
-        return;
+        freeClientFromIO(c);
+        return C_ERR;
     } else if (c->flags & CLIENT_MASTER) {
         /* Append the query buffer to the pending (not applied) buffer
          * of the master. We'll use this buffer later in order to have a
@@ -1399,7 +1751,10 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     sdsIncrLen(c->querybuf,nread);
     c->lastinteraction = server.unixtime;
     if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
-    server.stat_net_input_bytes += nread;
+    if (io_thread_id)
+        io_threads[io_thread_id].bytes_read += nread;
+    else
+        server.stat_net_input_bytes += nread;
     if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
@@ -1407,9 +1762,24 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
-        freeClient(c);
-        return;
+        freeClientFromIO(c);
+        return C_ERR;
     }
+    return C_OK;
+}
+
+static int postponeClientRead(client *c);
+
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *c = (client*) privdata;
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+
+    /* With threaded I/O active the read is deferred to beforeSleep(), where
+     * the clients are split among the I/O threads. */
+    if (postponeClientRead(c)) return;
+    if (readClientSocket(c) == C_ERR) return;
 
     /* Time to process the buffer. If the client is a master we need to
      * compute the difference between the applied offset before and after
@@ -1528,7 +1898,7 @@ sds catClientInfoString(sds s, client *client) {
         (int) dictSize(client->pubsub_channels),
         (int) listLength(client->pubsub_patterns),
         (client->flags & CLIENT_MULTI) ? client->mstate.count : -1,
-        (unsigned long long) sdslen(client->querybuf),
+        (unsigned long long) sdslen(client->querybuf)-client->qb_pos,
         (unsigned long long) sdsavail(client->querybuf),
         (unsigned long long) client->bufpos,
         (unsigned long long) listLength(client->reply),
@@ -1751,6 +2121,7 @@ void rewriteClientCommandVector(client *c, int argc, ...) {
     zfree(c->argv);
     /* Replace argv and argc with our new versions. */
     c->argv = argv;
+    c->argv_len = argc;
     c->argc = argc;
 
 #ifdef USE_NVM
@@ -1772,6 +2143,7 @@ void replaceClientCommandVector(client *c, int argc, robj **argv) {
     freeClientArgv(c);
     zfree(c->argv);
     c->argv = argv;
+    c->argv_len = argc;
     c->argc = argc;
     c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
     serverAssertWithInfo(c,NULL,c->cmd != NULL);
@@ -1793,6 +2165,7 @@ void rewriteClientCommandArgument(client *c, int i, robj *newval) {
 
     if (i >= c->argc) {
         c->argv = zrealloc(c->argv,sizeof(robj*)*(i+1));
+        c->argv_len = i+1;
         c->argc = i+1;
         c->argv[i] = NULL;
     }
@@ -2024,10 +2397,353 @@ int processEventsWhileBlocked(void) {
     int count = 0;
     while (iterations--) {
         int events = 0;
+        processing_events_while_blocked = 1;
         events += aeProcessEvents(server.el, AE_FILE_EVENTS|AE_DONT_WAIT);
+        processing_events_while_blocked = 0;
         events += handleClientsWithPendingWrites();
         if (!events) break;
         count += events;
     }
     return count;
 }
+
+/* ==========================================================================
+ * Threaded I/O
+ * ========================================================================== */
+
+/* When "io-threads" is greater than one, reading the query buffers and
+ * writing the replies of the clients served in a given event loop iteration
+ * is split among the main thread and io_threads_num-1 I/O threads, while the
+ * commands are still executed by the main thread alone. Reads are only
+ * deferred while the threads are active, that is, when enough clients have
+ * pending writes for the threads to be worth it: otherwise the threads just
+ * sleep on their condition variable.
+ *
+ * The threads only touch the clients assigned to them, and only while the
+ * main thread waits for all of them to finish the batch, so no further
+ * locking is needed. */
+
+/* Release the object referenced by a zero-copy reply node. While a batch is
+ * processed by the I/O threads the refcounts can't be touched, since the same
+ * object may be referenced by clients served by different threads: the
+ * release is deferred to the main thread at the end of the batch. */
+static void releaseReplyRef(robj *o) {
+    if (io_threads_op == IO_THREADS_OP_IDLE)
+        decrRefCount(o);
+    else
+        listAddNodeTail(io_threads[io_thread_id].released_refs,o);
+}
+
+/* Read from the client socket and parse the first command, if any, that
+ * will be executed by the main thread. Only one command is parsed, since
+ * the next ones may depend on the execution of the previous ones (for
+ * instance the client could get blocked). */
+static void readClientFromIO(client *c) {
+    if (readClientSocket(c) == C_ERR) return;
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP|
+                    CLIENT_PENDING_COMMAND)) return;
+    if (parseClientCommand(c) == C_OK) c->flags |= CLIENT_PENDING_COMMAND;
+}
+
+static void *IOThreadMain(void *myid) {
+    long id = (long)myid;
+    ioThread *t = io_threads+id;
+
+    io_thread_id = id;
+
+    while(1) {
+        unsigned long pending = 0;
+        listIter li;
+        listNode *ln;
+
+        /* Wait for work: spin for a short while, since under load the
+         * batches are handed over at every event loop iteration, then
+         * sleep so that idle threads don't steal CPU from the main thread. */
+        for (int j = 0; j < IO_THREADS_SPIN_LOOPS; j++) {
+            atomicGetWithSync(t->pending,pending);
+            if (pending != 0) break;
+        }
+        if (pending == 0) {
+            pthread_mutex_lock(&t->mutex);
+            while(1) {
+                atomicGetWithSync(t->pending,pending);
+                if (pending != 0) break;
+                pthread_cond_wait(&t->cond,&t->mutex);
+            }
+            pthread_mutex_unlock(&t->mutex);
+        }
+
+        listRewind(t->clients,&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (io_threads_op == IO_THREADS_OP_WRITE) {
+                writeToClient(c->fd,c,0);
+            } else if (io_threads_op == IO_THREADS_OP_READ) {
+                readClientFromIO(c);
+            } else {
+                serverPanic("io_threads_op value is unknown");
+            }
+        }
+        listEmpty(t->clients);
+        atomicSetWithSync(t->pending,0);
+    }
+    return NULL;
+}
+
+/* Initialize the data structures needed for threaded I/O and spawn the
+ * threads, that start idle. */
+void initThreadedIO(void) {
+    server.io_threads_active = 0;
+
+    /* The share of the batches served by the main thread. */
+    io_threads[0].clients = listCreate();
+    io_threads[0].released_refs = listCreate();
+    if (server.io_threads_num == 1) return;
+
+    if (server.io_threads_num > IO_THREADS_MAX_NUM) {
+        serverLog(LL_WARNING,"Fatal: too many I/O threads configured. "
+                             "The maximum number is %d.", IO_THREADS_MAX_NUM);
+        exit(1);
+    }
+
+    for (int i = 1; i < server.io_threads_num; i++) {
+        ioThread *t = io_threads+i;
+
+        t->clients = listCreate();
+        t->released_refs = listCreate();
+        pthread_mutex_init(&t->mutex,NULL);
+        pthread_cond_init(&t->cond,NULL);
+        pthread_mutex_init(&t->pending_mutex,NULL);
+        t->pending = 0;
+        t->bytes_read = t->bytes_written = 0;
+        t->output_syscalls = 0;
+        if (pthread_create(&t->tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
+            serverLog(LL_WARNING,"Fatal: can't initialize I/O threads.");
+            exit(1);
+        }
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > 0 && server.io_threads_num > cores) {
+        serverLog(LL_WARNING,"WARNING: io-threads is set to %d but only %ld "
+            "cores are available: the I/O threads will compete for the CPU "
+            "with the main thread.", server.io_threads_num, cores);
+    }
+}
+
+static void startThreadedIO(void) {
+    serverAssert(server.io_threads_active == 0);
+    server.io_threads_active = 1;
+}
+
+static void stopThreadedIO(void) {
+    /* Serve the reads that were deferred while the threads were active. */
+    handleClientsWithPendingReadsUsingThreads();
+    serverAssert(server.io_threads_active == 1);
+    server.io_threads_active = 0;
+}
+
+/* Return 1 if the pending writes are too few to use the threads (stopping
+ * them if active), 0 otherwise. */
+static int stopThreadedIOIfNeeded(void) {
+    int pending = listLength(server.clients_pending_write);
+
+    if (server.io_threads_num == 1) return 1;
+    if (pending < server.io_threads_num*2) {
+        if (server.io_threads_active) stopThreadedIO();
+        return 1;
+    }
+    return 0;
+}
+
+/* Hand over the clients in io_threads[].clients to the threads, process the
+ * main thread share, and wait for all the threads to finish. */
+static void runIOThreadsBatch(int op) {
+    long long main_bytes;
+    listIter li;
+    listNode *ln;
+
+    io_threads_op = op;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        unsigned long count = listLength(io_threads[j].clients);
+        if (op == IO_THREADS_OP_READ)
+            server.stat_io_reads_processed[j] += count;
+        else
+            server.stat_io_writes_processed[j] += count;
+        if (count == 0) continue;
+        pthread_mutex_lock(&io_threads[j].mutex);
+        atomicSetWithSync(io_threads[j].pending,count);
+        pthread_cond_signal(&io_threads[j].cond);
+        pthread_mutex_unlock(&io_threads[j].mutex);
+    }
+
+    /* The main thread processes its own share too. */
+    main_bytes = (op == IO_THREADS_OP_READ) ? server.stat_net_input_bytes :
+                                              server.stat_net_output_bytes;
+    listRewind(io_threads[0].clients,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (op == IO_THREADS_OP_WRITE)
+            writeToClient(c->fd,c,0);
+        else
+            readClientFromIO(c);
+    }
+    if (op == IO_THREADS_OP_READ) {
+        server.stat_io_reads_processed[0] += listLength(io_threads[0].clients);
+        server.stat_io_bytes_read[0] +=
+            server.stat_net_input_bytes - main_bytes;
+    } else {
+        server.stat_io_writes_processed[0] += listLength(io_threads[0].clients);
+        server.stat_io_bytes_written[0] +=
+            server.stat_net_output_bytes - main_bytes;
+    }
+    listEmpty(io_threads[0].clients);
+
+    /* Wait for all the other threads to end their work, yielding the CPU
+     * after a while in case the threads outnumber the cores. */
+    for (int spins = 0; ; spins++) {
+        unsigned long pending = 0, count;
+        for (int j = 1; j < server.io_threads_num; j++) {
+            atomicGetWithSync(io_threads[j].pending,count);
+            pending += count;
+        }
+        if (pending == 0) break;
+        if (spins >= IO_THREADS_SPIN_LOOPS) sched_yield();
+    }
+    io_threads_op = IO_THREADS_OP_IDLE;
+
+    /* Now that the threads are idle, release the objects of the zero-copy
+     * replies that were sent, and move their byte counters into the global
+     * stats. */
+    for (int j = 0; j < server.io_threads_num; j++) {
+        list *refs = io_threads[j].released_refs;
+        while(listLength(refs)) {
+            decrRefCount(listNodeValue(listFirst(refs)));
+            listDelNode(refs,listFirst(refs));
+        }
+    }
+    for (int j = 1; j < server.io_threads_num; j++) {
+        ioThread *t = io_threads+j;
+        while(t->free_chunks) {
+            sds chunk = t->free_chunks;
+            memcpy(&t->free_chunks,chunk,sizeof(sds));
+            replyChunkFree(chunk);
+        }
+        t->free_chunks_len = 0;
+        server.stat_net_input_bytes += t->bytes_read;
+        server.stat_net_output_bytes += t->bytes_written;
+        server.stat_net_output_syscalls += t->output_syscalls;
+        server.stat_io_bytes_read[j] += t->bytes_read;
+        server.stat_io_bytes_written[j] += t->bytes_written;
+        t->bytes_read = t->bytes_written = 0;
+        t->output_syscalls = 0;
+    }
+}
+
+/* Threaded version of handleClientsWithPendingWrites(), that falls back to
+ * the latter when the threads are disabled or there are few clients. */
+int handleClientsWithPendingWritesUsingThreads(void) {
+    listIter li;
+    listNode *ln;
+    int processed = listLength(server.clients_pending_write);
+    int item_id = 0;
+
+    if (processed == 0) return 0;
+    if (stopThreadedIOIfNeeded()) return handleClientsWithPendingWrites();
+    if (!server.io_threads_active) startThreadedIO();
+
+    /* Distribute the clients across the threads. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+
+        /* Clients that are going to be closed don't need the reply. */
+        if (c->flags & CLIENT_CLOSE_ASAP) {
+            listDelNode(server.clients_pending_write,ln);
+            continue;
+        }
+        listAddNodeTail(io_threads[item_id % server.io_threads_num].clients,c);
+        item_id++;
+    }
+    runIOThreadsBatch(IO_THREADS_OP_WRITE);
+
+    /* Install the write handler where the reply was not fully sent. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        if (c->flags & CLIENT_CLOSE_ASAP) continue;
+        if (clientHasPendingReplies(c) &&
+            aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
+                sendReplyToClient, c) == AE_ERR)
+        {
+            freeClientAsync(c);
+        }
+    }
+    listEmpty(server.clients_pending_write);
+
+    /* Release the clients whose connection failed or that asked to be
+     * closed after the reply. */
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
+
+/* Defer the read of the client query buffer to the I/O threads if they are
+ * active. Returns 1 if the read was deferred. Masters and slaves are always
+ * served synchronously, since they are handled by the replication code. */
+static int postponeClientRead(client *c) {
+    if (server.io_threads_active &&
+        !processing_events_while_blocked &&
+        !(c->flags & (CLIENT_MASTER|CLIENT_SLAVE|CLIENT_PENDING_READ|
+                      CLIENT_BLOCKED)))
+    {
+        c->flags |= CLIENT_PENDING_READ;
+        listAddNodeHead(server.clients_pending_read,c);
+        return 1;
+    }
+    return 0;
+}
+
+/* Read and parse the first command of the clients with deferred reads
+ * using the I/O threads, then execute the commands. Called from
+ * beforeSleep(). */
+int handleClientsWithPendingReadsUsingThreads(void) {
+    listIter li;
+    listNode *ln;
+    int processed = listLength(server.clients_pending_read);
+    int item_id = 0;
+
+    if (!server.io_threads_active || processed == 0) return 0;
+
+    /* Distribute the clients across the threads. */
+    listRewind(server.clients_pending_read,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+        listAddNodeTail(io_threads[item_id % server.io_threads_num].clients,c);
+        item_id++;
+    }
+    runIOThreadsBatch(IO_THREADS_OP_READ);
+
+    /* Execute the commands. The list is consumed from the head since the
+     * commands may free other clients in the list. */
+    while(listLength(server.clients_pending_read)) {
+        ln = listFirst(server.clients_pending_read);
+        client *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+
+        processInputBuffer(c);
+
+        /* The replies produced while the client was flagged, including
+         * protocol errors emitted by the threads, were not scheduled for
+         * writing. */
+        if (!(c->flags & (CLIENT_PENDING_WRITE|CLIENT_CLOSE_ASAP)) &&
+            clientHasPendingReplies(c))
+        {
+            c->flags |= CLIENT_PENDING_WRITE;
+            listAddNodeHead(server.clients_pending_write,c);
+        }
+    }
+    freeClientsInAsyncFreeQueue();
+    return processed;
+}
@@ -37,23 +37,13 @@
 #endif
 #include "atomicvar.h"
 #include "nvm.h"
+#include "libpmem.h"
 
-#define update_nvm_stat_alloc(__n) do { \
-    size_t _n = (__n); \
-    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_nvm,__n); \
-    atomicIncr(alloc_count, 1); \
-} while(0)
-
-#define update_nvm_stat_free(__n) do { \
-    size_t _n = (__n); \
-    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_nvm,__n); \
-    atomicDecr(alloc_count, 1); \
-} while(0)
-
-static size_t used_nvm = 0;
-static size_t alloc_count = 0;
+/* NVM usage is accounted in the per thread zmalloc statistics, so that the
+ * main thread and the bio threads freeing NVM objects don't contend on
+ * shared counters. */
+#define update_nvm_stat_alloc(__n) zmalloc_stat_tier_alloc(ZMALLOC_TIER_NVM,(__n))
+#define update_nvm_stat_free(__n) zmalloc_stat_tier_free(ZMALLOC_TIER_NVM,(__n))
 
 int is_nvm_addr(const void* ptr) {
     if(!server.nvm_base)
@@ -65,6 +55,16 @@ int is_nvm_addr(const void* ptr) {
     return 1;
 }
 
+/* Offsets from the pool base, used to reference NVM memory from structures
+ * that must stay valid if the pool is mapped at another address. */
+uint64_t nvm_offset(const void* ptr) {
+    return (const char*)ptr - server.nvm_base;
+}
+
+void* nvm_addr(uint64_t offset) {
+    return server.nvm_base + offset;
+}
+
 void* nvm_malloc(size_t size) {
 #ifdef SUPPORT_PBA
     if(server.pba.loading)
@@ -77,9 +77,8 @@ void* nvm_malloc(size_t size) {
         if (ptr)
             update_nvm_stat_alloc(jemk_malloc_usable_size(ptr));
 #ifdef AEP_COW
-        if(server.rdb_child_pid != -1) {
-            cow_addaddressindict(server.forked_dict, ptr);
-        }
+        if(ptr && cow_isactive())
+            cow_addforkedaddr(ptr);
 #endif
     }
     return ptr;
@@ -89,36 +88,184 @@ int nvm_free(void* ptr) {
     /*update_nvm_stat_free(memkind_usable_size(server.pmem_kind, ptr));*/
     size_t size = jemk_malloc_usable_size(ptr);
 #ifdef AEP_COW
-    if(!cow_isnvmaddrindict(server.forked_dict,ptr) && server.rdb_child_pid !=-1) {
-        cow_addaddressindict(server.cow_dict, ptr);
-        server.cow_nvm_size += size;
+    if(cow_deferfree(ptr)) {
+        atomicIncr(server.cow_nvm_size, size);
         return 1;
-    }else if(server.rdb_child_pid != -1) {
-        cow_remaddressindict(server.forked_dict, ptr);
     }
 #endif
-    
+
     update_nvm_stat_free(size);
     memkind_free(server.pmem_kind, ptr);
     return 1;
 }
 
+#ifdef AEP_COW
+static void nvm_free_deferred(void *ptr) {
+    update_nvm_stat_free(jemk_malloc_usable_size(ptr));
+    memkind_free(server.pmem_kind, ptr);
+}
+
+/* Called by the parent right before forking an RDB child. Everything below
+ * the current pool high water mark will be shared with the child. */
+void nvm_cow_prepare(void) {
+    size_t total = 0, free = 0;
+
+    if (!server.nvm_base) return;
+    memkind_pmem_get_size(server.pmem_kind, &total, &free);
+    cow_prepare(server.nvm_base, server.nvm_size,
+                server.nvm_base + (total - free));
+}
+
+/* Called by the parent once the child is forked. */
+void nvm_cow_start(void) {
+    if (!server.nvm_base) return;
+    cow_start();
+}
+
+/* Called when the child exits, or if it could not be forked. */
+void nvm_cow_stop(void) {
+    cow_stop();
+}
+
+/* Incrementally release the frees deferred while the child was running,
+ * so that a big COW backlog never stalls the event loop. */
+void nvm_cow_drain(void) {
+    cow_drainfree(COW_DRAIN_TIME_LIMIT_US, nvm_free_deferred);
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * Bulk writes
+ *
+ * Persisting every value with pmem_memcpy_persist() costs a fence per value,
+ * that dominates the time to load a large dataset. While loading, values are
+ * instead copied to NVM with non-temporal stores and fenced once every
+ * NVM_BULK_BATCH_BYTES, with a last fence when the load ends. Outside bulk
+ * mode nvm_bulk_copy() is just pmem_memcpy_persist().
+ *
+ * Other threads may write in bulk mode as well: fences are tracked per
+ * thread, and every thread calls nvm_bulk_drain() when it is done.
+ * ------------------------------------------------------------------------- */
+
+#define NVM_BULK_BATCH_BYTES (16<<20)
+
+static int nvm_bulk_active;
+static size_t nvm_bulk_written;     /* Bytes written since nvm_bulk_begin(). */
+static pthread_mutex_t nvm_bulk_written_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread size_t nvm_bulk_unfenced; /* Written since the last fence. */
+
+void nvm_bulk_begin(void) {
+    nvm_bulk_active = 1;
+    nvm_bulk_unfenced = 0;
+    nvm_bulk_written = 0;
+}
+
+/* Leave bulk mode, making everything written so far persistent. Returns
+ * the number of bytes written to NVM while in bulk mode. */
+size_t nvm_bulk_end(void) {
+    size_t written;
+
+    if (!nvm_bulk_active) return 0;
+    nvm_bulk_drain();
+    nvm_bulk_active = 0;
+    atomicGet(nvm_bulk_written,written);
+    return written;
+}
+
+/* Make persistent what the calling thread wrote in bulk mode. */
+void nvm_bulk_drain(void) {
+    if (nvm_bulk_unfenced) pmem_drain();
+    nvm_bulk_unfenced = 0;
+}
+
+static void nvm_bulk_account(size_t len) {
+    atomicIncr(nvm_bulk_written,len);
+    nvm_bulk_unfenced += len;
+    if (nvm_bulk_unfenced >= NVM_BULK_BATCH_BYTES) nvm_bulk_drain();
+}
+
+/* Copy 'len' bytes from DRAM to NVM, making them persistent. */
+void nvm_bulk_copy(void *dst, const void *src, size_t len) {
+    if (!nvm_bulk_active) {
+        pmem_memcpy_persist(dst, src, len);
+        return;
+    }
+    pmem_memcpy(dst, src, len, PMEM_F_MEM_NONTEMPORAL|PMEM_F_MEM_NODRAIN);
+    nvm_bulk_account(len);
+}
+
+/* Make persistent 'len' bytes written to NVM with regular stores. */
+void nvm_bulk_flush(const void *addr, size_t len) {
+    if (!nvm_bulk_active) {
+        pmem_persist(addr, len);
+        return;
+    }
+    pmem_flush(addr, len);
+    nvm_bulk_account(len);
+}
+
+static const char *nvm_placement_class_names[NVM_CLASS_COUNT] = {
+    "key", "string", "hash-field", "hash-value", "set-member",
+    "zset-member", "list-element", "list-node", "lzf-node"
+};
+
+static const char *nvm_placement_pin_names[] = {"auto", "dram", "nvm"};
+
+/* Returns 1 if an allocation of 'size' bytes of placement class 'cls'
+ * should go to NVM, 0 if it should stay in DRAM. */
+int nvm_place(int cls, size_t size) {
+    nvmPlacementPolicy *policy = server.nvm_placement+cls;
+    size_t threshold;
+
+    if (!server.nvm_base || policy->pin == NVM_PIN_DRAM) return 0;
+    if (policy->pin == NVM_PIN_NVM) return 1;
+    threshold = policy->threshold == NVM_THRESHOLD_DEFAULT ?
+                server.sdsmv_threshold : (size_t)policy->threshold;
+    return size >= threshold;
+}
+
+/* Account 'size' bytes of class 'cls' placed at 'ptr'. The counters are
+ * cumulative: nothing is subtracted when the memory is freed or moved. */
+void nvm_placed(int cls, const void *ptr, size_t size) {
+    server.stat_nvm_placed_total[cls][is_nvm_addr(ptr) ? 1 : 0] += size;
+}
+
+int nvm_placement_class_by_name(const char *name) {
+    int j;
+
+    for (j = 0; j < NVM_CLASS_COUNT; j++)
+        if (!strcasecmp(name,nvm_placement_class_names[j])) return j;
+    return -1;
+}
+
+const char *nvm_placement_class_name(int cls) {
+    return nvm_placement_class_names[cls];
+}
+
+int nvm_placement_pin_by_name(const char *name) {
+    int j;
+
+    for (j = NVM_PIN_NONE; j <= NVM_PIN_NVM; j++)
+        if (!strcasecmp(name,nvm_placement_pin_names[j])) return j;
+    return -1;
+}
+
+const char *nvm_placement_pin_name(int pin) {
+    return nvm_placement_pin_names[pin];
+}
+
 size_t nvm_usable_size(void* ptr) {
     /*return memkind_usable_size(server.pmem_kind, ptr);*/
     return jemk_malloc_usable_size(ptr);
 }
 
 size_t nvm_get_used(void) {
-    size_t um;
-    atomicGet(used_nvm,um);
-    return um;
+    return zmalloc_tier_used(ZMALLOC_TIER_NVM);
 }
 
 size_t nvm_get_alloc_count(void)
 {
-    size_t ret;
-    atomicGet(alloc_count, ret);
-    return ret;
+    return zmalloc_tier_count(ZMALLOC_TIER_NVM);
 }
 
 size_t nvm_get_rss(void) {
@@ -131,19 +278,141 @@ size_t nvm_get_rss(void) {
     return resident;
 }
 
+/* ---------------------------------------------------------------------------
+ * Pool root
+ * ------------------------------------------------------------------------- */
+
+#define NVM_ROOT_MAGIC      0x4d564e5349444552ULL   /* "REDISNVM" */
+#define NVM_ROOT_VERSION    1
+#define NVM_ROOT_FILE_SIZE  4096
+
+/* One slot fills exactly one cache line, so it is flushed as a unit. */
+typedef struct nvmRootSlot {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t seq;           /* Commit sequence, the newest valid slot wins. */
+    uint64_t pool_size;     /* nvm-maxcapacity the pool was created with. */
+    uint64_t flags;         /* NVM_ROOT_F_* */
+    uint64_t reserved[2];
+    uint64_t crc;           /* crc64 of the fields above. */
+} nvmRootSlot;
+
+static struct {
+    nvmRootSlot *slots;     /* Two slots mapped from the root file. */
+    int is_pmem;
+    int state;
+    uint64_t seq;
+    uint64_t flags;
+    uint64_t pool_size;
+} nvm_root = {NULL, 0, NVM_ROOT_NEW, 0, 0, 0};
+
+static uint64_t nvm_root_slot_crc(const nvmRootSlot *slot) {
+    return crc64(0, (const unsigned char*)slot, offsetof(nvmRootSlot, crc));
+}
+
+static int nvm_root_slot_valid(const nvmRootSlot *slot) {
+    return slot->magic == NVM_ROOT_MAGIC &&
+           slot->version == NVM_ROOT_VERSION &&
+           slot->crc == nvm_root_slot_crc(slot);
+}
+
+/* Without real persistent memory (a plain file or tmpfs) PMDK falls back to
+ * msync(), which is what makes the root testable everywhere. */
+static void nvm_root_persist(const void *addr, size_t len) {
+    if (nvm_root.is_pmem)
+        pmem_persist(addr, len);
+    else
+        pmem_msync(addr, len);
+}
+
+/* Map the root file at 'path' and find out what the previous run left in
+ * the pool. Returns one of the NVM_ROOT_* states, or -1 if the root file
+ * can't be mapped at all. */
+int nvm_root_open(const char *path, size_t pool_size) {
+    size_t mapped_len;
+    nvmRootSlot *slots, *last = NULL;
+
+    slots = pmem_map_file(path, NVM_ROOT_FILE_SIZE, PMEM_FILE_CREATE, 0666,
+                          &mapped_len, &nvm_root.is_pmem);
+    if (slots == NULL) return -1;
+    nvm_root.slots = slots;
+    nvm_root.pool_size = pool_size;
+
+    if (nvm_root_slot_valid(&slots[0])) last = &slots[0];
+    if (nvm_root_slot_valid(&slots[1]) &&
+        (last == NULL || slots[1].seq > last->seq)) last = &slots[1];
+
+    if (last == NULL) {
+        nvm_root.state = NVM_ROOT_NEW;
+    } else {
+        nvm_root.seq = last->seq;
+        if (last->pool_size != pool_size) {
+            nvm_root.state = NVM_ROOT_MISMATCH;
+        } else {
+            nvm_root.flags = last->flags;
+            nvm_root.state = (last->flags & NVM_ROOT_F_CLEAN) ?
+                NVM_ROOT_VALID : NVM_ROOT_VALID_DIRTY;
+        }
+    }
+    return nvm_root.state;
+}
+
+/* Durably record 'flags' for the current pool. The slot not holding the
+ * latest commit is overwritten, so a crash in the middle of this function
+ * leaves the previous commit in place. */
+void nvm_root_commit(uint64_t flags) {
+    nvmRootSlot *slot;
+
+    if (nvm_root.slots == NULL) return;
+    slot = &nvm_root.slots[(nvm_root.seq+1) & 1];
+    slot->magic = NVM_ROOT_MAGIC;
+    slot->version = NVM_ROOT_VERSION;
+    slot->seq = nvm_root.seq+1;
+    slot->pool_size = nvm_root.pool_size;
+    slot->flags = flags;
+    memset(slot->reserved, 0, sizeof(slot->reserved));
+    slot->crc = nvm_root_slot_crc(slot);
+    nvm_root_persist(slot, sizeof(*slot));
+    nvm_root.seq++;
+    nvm_root.flags = flags;
+    nvm_root.state = (flags & NVM_ROOT_F_CLEAN) ?
+        NVM_ROOT_VALID : NVM_ROOT_VALID_DIRTY;
+}
+
+/* State of the latest commit: the one found when the root was opened, then
+ * the one of the last nvm_root_commit(), that is, how the pool would be
+ * found by the next start if the server exited now. */
+int nvm_root_state(void) {
+    return nvm_root.state;
+}
+
+uint64_t nvm_root_flags(void) {
+    return nvm_root.flags;
+}
+
+uint64_t nvm_root_seq(void) {
+    return nvm_root.seq;
+}
+
+const char *nvm_root_state_name(int state) {
+    switch(state) {
+    case NVM_ROOT_NEW: return "new";
+    case NVM_ROOT_VALID: return "valid";
+    case NVM_ROOT_VALID_DIRTY: return "valid-after-crash";
+    case NVM_ROOT_MISMATCH: return "mismatch";
+    default: return "unknown";
+    }
+}
+
 
 #ifdef HAVE_DEFRAG
+/* nvm_malloc() and nvm_free() already do the accounting. */
 void * zmalloc_nvm_no_tcache(size_t size) {
-    void *ptr = nvm_malloc(size);
-    if(ptr)
-        update_nvm_stat_alloc(jemk_malloc_usable_size(ptr));
-    return ptr;
+    return nvm_malloc(size);
 }
 
 void zfree_nvm_no_tcache(void *ptr) {
     if (ptr == NULL) return;
-    size_t size=jemk_malloc_usable_size(ptr);
-    update_nvm_stat_free(size);
     nvm_free(ptr);
 }
 #endif
@@ -40,12 +40,53 @@
 extern "C" {
 #endif
 int is_nvm_addr(const void* ptr);
+uint64_t nvm_offset(const void* ptr);
+void* nvm_addr(uint64_t offset);
 void* nvm_malloc(size_t size);
 int nvm_free(void* ptr);
 size_t nvm_usable_size(void* ptr);
 size_t nvm_get_used(void);
 size_t nvm_get_alloc_count(void);
 size_t nvm_get_rss(void);
+void nvm_bulk_begin(void);
+size_t nvm_bulk_end(void);
+void nvm_bulk_drain(void);
+void nvm_bulk_copy(void *dst, const void *src, size_t len);
+void nvm_bulk_flush(const void *addr, size_t len);
+int nvm_place(int cls, size_t size);
+void nvm_placed(int cls, const void *ptr, size_t size);
+int nvm_placement_class_by_name(const char *name);
+const char *nvm_placement_class_name(int cls);
+int nvm_placement_pin_by_name(const char *name);
+const char *nvm_placement_pin_name(int pin);
+#ifdef AEP_COW
+void nvm_cow_prepare(void);
+void nvm_cow_start(void);
+void nvm_cow_stop(void);
+void nvm_cow_drain(void);
+#endif
+
+/* The pool root is a small side file next to the memkind pool recording
+ * whether the pool content can be trusted on the next start. This is only
+ * about the validity of the pool: the keyspace is always loaded from the
+ * RDB or AOF, and only the references of a pointer based AOF are resolved
+ * into the pool. The root holds two slots updated alternately, so a torn
+ * update always leaves the previous slot readable. */
+#define NVM_ROOT_NEW            0   /* No valid root: pool content is garbage. */
+#define NVM_ROOT_VALID          1   /* Committed by a clean shutdown. */
+#define NVM_ROOT_VALID_DIRTY    2   /* Committed by a running server: usable
+                                       after a crash. */
+#define NVM_ROOT_MISMATCH       3   /* Root belongs to a pool of another size. */
+
+#define NVM_ROOT_F_PBA          (1<<0) /* Pool referenced by a pointer based AOF. */
+#define NVM_ROOT_F_CLEAN        (1<<1) /* Clean shutdown, dataset fully loaded. */
+
+int nvm_root_open(const char *path, size_t pool_size);
+void nvm_root_commit(uint64_t flags);
+int nvm_root_state(void);
+uint64_t nvm_root_flags(void);
+uint64_t nvm_root_seq(void);
+const char *nvm_root_state_name(int state);
 
 #ifdef HAVE_DEFRAG
 void *zmalloc_nvm_no_tcache(size_t size);
@@ -30,71 +30,197 @@
  */
 /***************************************************************************/
 #include "nvm_cow.h"
+#include "zmalloc.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
 
-/*compare the two address*/
-static int dictAddrCompare(void *privdata, const void *addr1, const void * addr2) {
-    DICT_NOTUSED(privdata);
-    return addr1==addr2;
+#define COW_EXTENT_SIZE     ((size_t)1 << COW_EXTENT_SHIFT)
+#define COW_EXTENT_WORDS    ((COW_EXTENT_SIZE >> COW_GRANULE_SHIFT) / 64)
+#define COW_FREELIST_INIT   1024
+
+typedef struct cowFreeList {
+    void **ptrs;
+    size_t len;
+    size_t cap;
+    size_t pos;             /* Drain cursor. */
+} cowFreeList;
+
+static struct {
+    int active;
+    char *base;
+    char *watermark;        /* Pool high water mark at fork time. */
+    size_t numextents;
+    uint64_t **extents;     /* Bitmap per extent below the watermark. */
+    cowFreeList pending;    /* Deferred while the child is running. */
+    cowFreeList draining;   /* Child gone, released by cow_drainfree(). */
+    pthread_mutex_t lock;   /* nvm_free() may run in the lazyfree thread. */
+} cow = {0, NULL, NULL, 0, NULL, {NULL,0,0,0}, {NULL,0,0,0},
+         PTHREAD_MUTEX_INITIALIZER};
+
+static long long cow_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
 }
 
-static void dictAddrDestructor (void *privdata, void *addr) {
-    DICT_NOTUSED(privdata);
-    zfree(addr);
+static void cow_freelistpush(cowFreeList *fl, void *addr) {
+    if (fl->len == fl->cap) {
+        fl->cap = fl->cap ? fl->cap*2 : COW_FREELIST_INIT;
+        fl->ptrs = zrealloc(fl->ptrs, fl->cap*sizeof(void*));
+    }
+    fl->ptrs[fl->len++] = addr;
 }
 
-static uint64_t dictaddrHash(const void *addr) {
-    return dictGenHashFunction((unsigned char*)&addr, sizeof(void *));
+static void cow_freelistreset(cowFreeList *fl) {
+    zfree(fl->ptrs);
+    memset(fl, 0, sizeof(*fl));
 }
 
+/* Return the bitmap word holding 'addr' and set 'bit' to its mask, or NULL
+ * if the extent never saw an allocation after the fork. */
+static uint64_t *cow_bitmapword(char *addr, uint64_t *bit) {
+    size_t offset = addr - cow.base;
+    uint64_t *words = __atomic_load_n(&cow.extents[offset >> COW_EXTENT_SHIFT],
+                                      __ATOMIC_ACQUIRE);
+    size_t granule = (offset & (COW_EXTENT_SIZE-1)) >> COW_GRANULE_SHIFT;
 
-static dictType dbforkType = {
-    dictaddrHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictAddrCompare,            /* key compare */
-    NULL,                       /* key destructor */
-    NULL                        /* val destructor */
-};
-
-/*DB->dict, COW dict in which the NVM adress are freeed or duplicated then 
-after BGSAVE, the object must be freeded.*/
-static dictType dbcowType = {
-    dictaddrHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictAddrCompare,            /* key compare */
-    dictAddrDestructor,         /* key destructor */
-    NULL                        /* val destructor */
-};
+    if (!words) return NULL;
+    *bit = (uint64_t)1 << (granule & 63);
+    return words + (granule >> 6);
+}
 
 /***************************************************************************/
 /*NVM COW APIs*/
 /***************************************************************************/
-int cow_isnvmaddrindict(dict *dict, void * addr) {
-    dictEntry *de;
-    de = dictFind(dict,addr);
-    if (de) {
-        return 1;
+
+/* Prepare tracking for a child about to be forked while the pool spans
+ * 'base' up to 'watermark'. Called by the parent before fork(), so that the
+ * extent table exists before anything can be allocated on behalf of the
+ * parent. */
+void cow_prepare(char *base, size_t size, char *watermark) {
+    if (watermark > base + size) watermark = base + size;
+    cow.base = base;
+    cow.watermark = watermark;
+    cow.numextents = (watermark - base + COW_EXTENT_SIZE - 1) >> COW_EXTENT_SHIFT;
+    cow.extents = zcalloc(cow.numextents*sizeof(uint64_t*) + 1);
+}
+
+/* Start tracking, called by the parent once fork() succeeded. */
+void cow_start(void) {
+    __atomic_store_n(&cow.active, 1, __ATOMIC_RELEASE);
+}
+
+static void cow_freeextents(void) {
+    size_t j;
+
+    for (j = 0; j < cow.numextents; j++) zfree(cow.extents[j]);
+    zfree(cow.extents);
+    cow.extents = NULL;
+    cow.numextents = 0;
+}
+
+/* The child is gone, or fork() failed: drop the bitmaps and hand the
+ * deferred frees over to cow_drainfree(). */
+void cow_stop(void) {
+    size_t j;
+
+    if (!cow_isactive()) {
+        cow_freeextents();
+        return;
     }
-    return 0;
+    pthread_mutex_lock(&cow.lock);
+    __atomic_store_n(&cow.active, 0, __ATOMIC_RELEASE);
+    cow_freeextents();
+
+    if (cow.draining.pos == cow.draining.len) {
+        cow_freelistreset(&cow.draining);
+        cow.draining = cow.pending;
+        memset(&cow.pending, 0, sizeof(cow.pending));
+    } else {
+        for (j = 0; j < cow.pending.len; j++)
+            cow_freelistpush(&cow.draining, cow.pending.ptrs[j]);
+        cow_freelistreset(&cow.pending);
+    }
+    pthread_mutex_unlock(&cow.lock);
+}
+
+int cow_isactive(void) {
+    return __atomic_load_n(&cow.active, __ATOMIC_ACQUIRE);
 }
 
-void * cow_createforknvmdict() {
-    return dictCreate(&dbforkType, NULL);
+/* Remember that 'addr' was allocated after the fork: the child can't see it,
+ * so the parent may write or free it in place. May be called by several
+ * threads: the first one to touch an extent installs its bitmap. */
+void cow_addforkedaddr(void *addr) {
+    char *p = addr;
+    size_t e;
+    uint64_t *word, bit;
+
+    if (!cow_isactive() || p >= cow.watermark) return;
+    e = (size_t)(p - cow.base) >> COW_EXTENT_SHIFT;
+    if (!__atomic_load_n(&cow.extents[e], __ATOMIC_ACQUIRE)) {
+        uint64_t *words = zcalloc(COW_EXTENT_WORDS*sizeof(uint64_t));
+        uint64_t *expected = NULL;
+
+        if (!__atomic_compare_exchange_n(&cow.extents[e], &expected, words,
+                0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) zfree(words);
+    }
+    word = cow_bitmapword(p, &bit);
+    __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
 }
 
-void * cow_createcownvmdict() {
-    return dictCreate(&dbcowType,NULL);
+/* Return 1 if 'addr' was allocated after the fork. No allocation, O(1). */
+int cow_isforkedaddr(void *addr) {
+    char *p = addr;
+    uint64_t *word, bit;
+
+    if (p >= cow.watermark) return 1;
+    word = cow_bitmapword(p, &bit);
+    return word && (__atomic_load_n(word, __ATOMIC_RELAXED) & bit);
 }
 
-/* Low level key lookup API, not actually called directly from commands
- * implementations that should instead rely on lookupKeyRead(),
- * lookupKeyWrite() and lookupKeyReadWithFlags(). */
-void cow_addaddressindict(dict * dict, void *addr) {   
-    dictAddRaw(dict, addr, NULL);
+/* If a child may still read 'addr', park it in the deferred free list and
+ * return 1. Otherwise return 0 and the caller frees it right away. */
+int cow_deferfree(void *addr) {
+    int deferred = 0;
+
+    if (!cow_isactive()) return 0;
+    pthread_mutex_lock(&cow.lock);
+    if (cow_isactive() && !cow_isforkedaddr(addr)) {
+        cow_freelistpush(&cow.pending, addr);
+        deferred = 1;
+    }
+    pthread_mutex_unlock(&cow.lock);
+    return deferred;
 }
 
-void cow_remaddressindict(dict *dict, void *addr) {
-    dictDelete(dict,addr);
+/* Release deferred frees of children that already exited with 'freefn',
+ * spending at most 'time_limit_us'. Returns the number of released
+ * addresses. Main thread only. */
+size_t cow_drainfree(long long time_limit_us, void (*freefn)(void *addr)) {
+    cowFreeList *fl = &cow.draining;
+    long long start;
+    size_t freed = 0;
+
+    if (fl->pos == fl->len) return 0;
+    start = cow_ustime();
+    while (fl->pos < fl->len) {
+        freefn(fl->ptrs[fl->pos++]);
+        freed++;
+        if ((freed & 63) == 0 && cow_ustime()-start > time_limit_us) break;
+    }
+    if (fl->pos == fl->len) cow_freelistreset(fl);
+    return freed;
 }
 
+/* Number of addresses still waiting to be released. */
+size_t cow_pendingfrees(void) {
+    size_t pending;
+
+    pthread_mutex_lock(&cow.lock);
+    pending = cow.pending.len + (cow.draining.len - cow.draining.pos);
+    pthread_mutex_unlock(&cow.lock);
+    return pending;
+}
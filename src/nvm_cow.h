@@ -29,19 +29,34 @@
 
 #ifndef __NVM_COW_H
 #define __NVM_COW_H
-#include "stddef.h"
-#include "dict.h"
-#include "zmalloc.h"
+#include <stddef.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
-int cow_isnvmaddrindict(dict *dict, void * addr);
-void * cow_createforknvmdict();
-void * cow_createcownvmdict();
-void cow_addaddressindict(dict *dict, void *addr);
-void cow_remaddressindict(dict *dict, void *addr);
+
+/* While a child process snapshots the NVM pool, the parent must neither
+ * modify nor reuse NVM memory the child can reach, that is every allocation
+ * that already existed at fork time. The tracker answers "was this address
+ * allocated after the fork?" in O(1): everything above the pool high water
+ * mark recorded at fork time is new, below it a per-extent bitmap (one bit
+ * per 8 bytes, allocated the first time the extent sees a new allocation)
+ * marks the new allocations. Pre-fork addresses freed or duplicated by the
+ * parent are parked in a deferred free list, drained incrementally once the
+ * child is gone. */
+#define COW_EXTENT_SHIFT        21  /* 2MB extents, one jemalloc chunk. */
+#define COW_GRANULE_SHIFT       3   /* Smallest jemalloc size class. */
+#define COW_DRAIN_TIME_LIMIT_US 1000 /* Per call of cow_drainfree(). */
+
+void cow_prepare(char *base, size_t size, char *watermark);
+void cow_start(void);
+void cow_stop(void);
+int cow_isactive(void);
+void cow_addforkedaddr(void *addr);
+int cow_isforkedaddr(void *addr);
+int cow_deferfree(void *addr);
+size_t cow_drainfree(long long time_limit_us, void (*freefn)(void *addr));
+size_t cow_pendingfrees(void);
 #ifdef __cplusplus
 }
 #endif
 #endif
-
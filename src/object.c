@@ -30,6 +30,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <math.h>
 #include <ctype.h>
 #ifdef USE_NVM
@@ -48,6 +49,7 @@ robj *createObject(int type, void *ptr) {
     o->encoding = OBJ_ENCODING_RAW;
     o->ptr = ptr;
     o->refcount = 1;
+    o->keyed = 0;
 
 #ifdef USE_NVM
     o->need_mv_to_nvm = 0;
@@ -88,17 +90,29 @@ robj *createRawStringObject(const char *ptr, size_t len) {
     return createObject(OBJ_STRING, sdsnewlen(ptr,len));
 }
 
+static robj *createEmbeddedStringObjectWithRoom(const char *ptr, size_t len,
+                                                size_t room);
+
 /* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+    return createEmbeddedStringObjectWithRoom(ptr,len,0);
+}
+
+/* Like createEmbeddedStringObject() but leaves 'room' more bytes at the
+ * end of the allocation, after the string null term. */
+static robj *createEmbeddedStringObjectWithRoom(const char *ptr, size_t len,
+                                                size_t room)
+{
+    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1+room);
     struct sdshdr8 *sh = (void*)(o+1);
 
     o->type = OBJ_STRING;
     o->encoding = OBJ_ENCODING_EMBSTR;
     o->ptr = sh+1;
     o->refcount = 1;
+    o->keyed = 0;
 
 #ifdef USE_NVM
     o->need_mv_to_nvm = 0;
@@ -124,6 +138,59 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     return o;
 }
 
+/* Number and allocated bytes of the keyed strings alive. They may be
+ * released by the lazyfree thread, hence the atomic updates. */
+static size_t keyed_objects = 0;
+static size_t keyed_objects_memory = 0;
+pthread_mutex_t keyed_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t keyed_objects_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Create an EMBSTR string object followed, in the same allocation, by a
+ * copy of 'key', the name of the key it is going to be stored at. The
+ * keyspace then uses that copy as its dict key, so a small key and its
+ * value cost a single allocation instead of three:
+ *
+ * +------+---------+------------+---------+----------+
+ * | robj | sdshdr8 | value + \0 | sdshdr8 | key + \0 |
+ * +------+---------+------------+---------+----------+
+ *
+ * The key header has the SDS_HOSTED flag set: the keyspace key destructor
+ * leaves it alone and it goes away with the object. The caller makes sure
+ * both the value and the key fit in a sdshdr8. */
+robj *createKeyedStringObject(sds key, const char *ptr, size_t len) {
+    size_t keylen = sdslen(key);
+    robj *o = createEmbeddedStringObjectWithRoom(ptr,len,
+                sizeof(struct sdshdr8)+keylen+1);
+    struct sdshdr8 *sh = (void*)((char*)o->ptr+len+1);
+
+    sh->len = keylen;
+    sh->alloc = keylen;
+    sh->flags = SDS_TYPE_8|SDS_HOSTED;
+    memcpy(sh->buf,key,keylen+1);
+    o->keyed = 1;
+    atomicIncr(keyed_objects,1);
+    atomicIncr(keyed_objects_memory,zmalloc_size(o));
+    return o;
+}
+
+/* Return the key embedded in a keyed string object. */
+sds keyedObjectKey(robj *o) {
+    struct sdshdr8 *sh = (void*)(o+1);
+    return (char*)(sh+1)+sh->alloc+1+sizeof(struct sdshdr8);
+}
+
+size_t keyedObjectsCount(void) {
+    size_t count;
+    atomicGet(keyed_objects,count);
+    return count;
+}
+
+size_t keyedObjectsMemory(void) {
+    size_t bytes;
+    atomicGet(keyed_objects_memory,bytes);
+    return bytes;
+}
+
 /* Create a string object with EMBSTR encoding if it is smaller than
  * OBJ_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
  * used.
@@ -232,13 +299,11 @@ robj *createHashObject(void) {
 }
 
 robj *createZsetObject(void) {
-    zset *zs = zmalloc(sizeof(*zs));
+    zset *zs = zsetCreate(server.zset_encoding);
     robj *o;
 
-    zs->dict = dictCreate(&zsetDictType,NULL);
-    zs->zsl = zslCreate();
     o = createObject(OBJ_ZSET,zs);
-    o->encoding = OBJ_ENCODING_SKIPLIST;
+    o->encoding = server.zset_encoding;
     return o;
 }
 
@@ -266,6 +331,9 @@ void freeStringObject(robj *o) {
         }
 #endif
         sdsfree(o->ptr);       
+    } else if (o->keyed) {
+        atomicDecr(keyed_objects,1);
+        atomicDecr(keyed_objects_memory,zmalloc_size(o));
     }
 }
 
@@ -299,10 +367,17 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
     case OBJ_ENCODING_ZIPLIST:
 #ifdef USE_NVM
         ziplistFree(o->ptr);
 #else
+        ziplistIndexDrop(o->ptr);
         zfree(o->ptr);
 #endif
         break;
@@ -320,6 +395,7 @@ void freeHashObject(robj *o) {
 #ifdef USE_NVM
         ziplistFree(o->ptr);
 #else
+        ziplistIndexDrop(o->ptr);
         zfree(o->ptr);
 #endif
 
@@ -722,6 +798,7 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_ZIPLIST: return "ziplist";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     default: return "unknown";
     }
@@ -748,6 +825,7 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {
             asize = sdslen(o->ptr)+2+sizeof(*o);
+            if (o->keyed) asize += sdsAllocSize(keyedObjectKey(o));
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -799,6 +877,20 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zbtreeIter it;
+            d = ((zset*)o->ptr)->dict;
+            asize = sizeof(*o)+sizeof(zset)+zbtAllocSize(zbt)+
+                    (sizeof(struct dictEntry*)*dictSlots(d));
+            if (zbtFirst(zbt,&it)) {
+                do {
+                    elesize += sdsAllocSize(zbtIterEle(&it));
+                    elesize += sizeof(struct dictEntry);
+                    samples++;
+                } while(samples < sample_size && zbtNext(&it));
+            }
+            if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -915,14 +1007,12 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictSize(db->dict) * sizeof(dictEntry) +
-              dictSlots(db->dict) * sizeof(dictEntry*) +
+        mem = dictMemUsage(db->dict) +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        mem = dictMemUsage(db->expires);
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
@@ -1107,8 +1197,10 @@ void memoryCommand(client *c) {
         if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
                 == NULL) return;
         size_t usage = objectComputeSize(o,samples);
-        usage += sdsAllocSize(c->argv[1]->ptr);
-        usage += sizeof(dictEntry);
+        sds key = dictGetKey(dictFind(c->db->dict,c->argv[2]->ptr));
+        /* A key embedded in the value was already counted with it. */
+        if (!sdsIsHosted(key)) usage += sdsAllocSize(key);
+        usage += dictEntryMemUsage(c->db->dict);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
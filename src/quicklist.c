@@ -36,6 +36,7 @@
 #include "ziplist.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "lz4.h"
 
 #ifdef USE_NVM
 #include <assert.h>
@@ -153,9 +154,243 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
     node->recompress = 0;
+    node->nvm_refs = 0;
+    node->codec = QUICKLIST_CODEC_LZF;
+    node->cached = 0;
     return node;
 }
 
+/* Node codecs, indexed by QUICKLIST_CODEC_*. The codec used for a node is
+ * kept in node->codec, so changing list-compress-codec only affects the
+ * nodes compressed from then on. */
+typedef unsigned int quicklistCodecFn(const void *in_data, unsigned int in_len,
+                                      void *out_data, unsigned int out_len);
+
+static const struct {
+    quicklistCodecFn *compress;
+    quicklistCodecFn *decompress;
+} quicklistCodecs[] = {
+    {lzf_compress, lzf_decompress},
+    {lz4_compress, lz4_decompress}
+};
+
+/* Decompressed node cache.
+ *
+ * Reading an interior node of a compressed list (LINDEX, LRANGE, ...)
+ * decompresses it, and the node is compressed again as soon as the command
+ * is done with it. The cache keeps up to list-compress-cache-size bytes of
+ * recently read nodes so that repeated reads don't pay for that every time:
+ *
+ * - While a node is decompressed, the cache holds its compressed data
+ *   instead of freeing it. If the node wasn't modified in the meantime,
+ *   compressing it again just puts that data back.
+ * - While a node is compressed, the cache holds its decompressed ziplist,
+ *   so the next read of the node is a pointer swap.
+ *
+ * Any change to the ziplist of a node drops its entry (quicklistNodeUpdateSz
+ * takes care of that). Entries are found by node pointer, node->cached only
+ * tells there may be one: it is only updated by the thread owning the list,
+ * never on eviction. The lock is needed because lists may be released by the
+ * lazyfree thread. Forked children don't use the cache. */
+typedef struct quicklistCacheEntry {
+    quicklistNode *node;
+    unsigned char *zl;  /* Decompressed ziplist, owned by the node while it
+                         * is decompressed. */
+    quicklistLZF *lzf;  /* Compressed data while the node is decompressed,
+                         * NULL while the node is compressed. */
+    size_t sz;
+    struct quicklistCacheEntry *prev, *next;
+} quicklistCacheEntry;
+
+static struct {
+    dict *entries;      /* quicklistNode pointer -> quicklistCacheEntry. */
+    quicklistCacheEntry *head, *tail; /* LRU order, most recent first. */
+    size_t used;
+    long long hits;     /* Reads served without decompressing. */
+    long long misses;   /* Reads that had to decompress. */
+    pthread_mutex_t lock;
+} qlcache;
+
+static uint64_t quicklistCacheHash(const void *key) {
+    return dictGenHashFunction(&key,sizeof(key));
+}
+
+static dictType quicklistCacheDictType = {
+    quicklistCacheHash,         /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static void quicklistCacheAtForkChild(void) {
+    qlcache.entries = NULL;
+}
+
+void quicklistCacheInit(void) {
+    qlcache.entries = dictCreate(&quicklistCacheDictType,NULL);
+    qlcache.head = qlcache.tail = NULL;
+    qlcache.used = 0;
+    qlcache.hits = qlcache.misses = 0;
+    pthread_mutex_init(&qlcache.lock,NULL);
+    pthread_atfork(NULL,NULL,quicklistCacheAtForkChild);
+}
+
+static void quicklistCacheUnlink(quicklistCacheEntry *e) {
+    if (e->prev) e->prev->next = e->next; else qlcache.head = e->next;
+    if (e->next) e->next->prev = e->prev; else qlcache.tail = e->prev;
+}
+
+static void quicklistCacheLinkHead(quicklistCacheEntry *e) {
+    e->prev = NULL;
+    e->next = qlcache.head;
+    if (qlcache.head) qlcache.head->prev = e; else qlcache.tail = e;
+    qlcache.head = e;
+}
+
+/* Remove 'e' and free the buffer it owns. Called with the lock held. */
+static void quicklistCacheRemove(quicklistCacheEntry *e) {
+    dictDelete(qlcache.entries,e->node);
+    quicklistCacheUnlink(e);
+    qlcache.used -= e->sz;
+    if (e->lzf)
+        zfree(e->lzf);
+    else
+        zfree(e->zl);
+    zfree(e);
+}
+
+/* Evict the least recently used entries until 'limit' bytes are used.
+ * Called with the lock held. */
+static void quicklistCacheEvict(size_t limit) {
+    while (qlcache.used > limit && qlcache.tail)
+        quicklistCacheRemove(qlcache.tail);
+}
+
+/* Apply a new list-compress-cache-size. */
+void quicklistCacheTrim(void) {
+    if (!qlcache.entries) return;
+    pthread_mutex_lock(&qlcache.lock);
+    quicklistCacheEvict(server.list_compress_cache_size);
+    pthread_mutex_unlock(&qlcache.lock);
+}
+
+/* Active defrag moved a node with node->cached set. */
+void quicklistCacheNodeMoved(quicklistNode *old, quicklistNode *node) {
+    dictEntry *de;
+
+    if (!qlcache.entries) return;
+    pthread_mutex_lock(&qlcache.lock);
+    if ((de = dictFind(qlcache.entries,old)) != NULL) {
+        quicklistCacheEntry *e = dictGetVal(de);
+        dictDelete(qlcache.entries,old);
+        e->node = node;
+        dictAdd(qlcache.entries,node,e);
+    }
+    pthread_mutex_unlock(&qlcache.lock);
+}
+
+void quicklistCacheGetStats(size_t *used, long long *hits, long long *misses) {
+    *used = qlcache.used;
+    *hits = qlcache.hits;
+    *misses = qlcache.misses;
+}
+
+void quicklistCacheResetStats(void) {
+    qlcache.hits = qlcache.misses = 0;
+}
+
+/* Forget about the entry of 'node', if any, because its ziplist is going to
+ * change or the node is going to be freed. */
+REDIS_STATIC void quicklistCacheDrop(quicklistNode *node) {
+    dictEntry *de;
+
+    if (qlcache.entries) {
+        pthread_mutex_lock(&qlcache.lock);
+        if ((de = dictFind(qlcache.entries,node)) != NULL)
+            quicklistCacheRemove(dictGetVal(de));
+        pthread_mutex_unlock(&qlcache.lock);
+    }
+    node->cached = 0;
+}
+
+/* Decompress the compressed 'node' by swapping in its cached ziplist.
+ * Returns 0 if the node isn't in the cache. */
+REDIS_STATIC int quicklistCacheCheckout(quicklistNode *node) {
+    quicklistCacheEntry *e = NULL;
+    dictEntry *de;
+
+    if (qlcache.entries) {
+        pthread_mutex_lock(&qlcache.lock);
+        if ((de = dictFind(qlcache.entries,node)) != NULL) {
+            e = dictGetVal(de);
+            e->lzf = (quicklistLZF *)node->zl;
+            node->zl = e->zl;
+            node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+            quicklistCacheUnlink(e);
+            quicklistCacheLinkHead(e);
+            qlcache.hits++;
+        }
+        pthread_mutex_unlock(&qlcache.lock);
+    }
+    if (!e) node->cached = 0;
+    return e != NULL;
+}
+
+/* 'node' was just decompressed from 'lzf': keep 'lzf' in the cache.
+ * Returns 0 if the cache doesn't take it and the caller has to free it. */
+REDIS_STATIC int quicklistCacheKeep(quicklistNode *node, quicklistLZF *lzf) {
+    quicklistCacheEntry *e;
+
+    if (!qlcache.entries || node->sz > server.list_compress_cache_size)
+        return 0;
+
+    e = zmalloc(sizeof(*e));
+    e->node = node;
+    e->zl = node->zl;
+    e->lzf = lzf;
+    e->sz = node->sz;
+    pthread_mutex_lock(&qlcache.lock);
+    dictAdd(qlcache.entries,node,e);
+    quicklistCacheLinkHead(e);
+    qlcache.used += e->sz;
+    qlcache.misses++;
+    quicklistCacheEvict(server.list_compress_cache_size);
+    pthread_mutex_unlock(&qlcache.lock);
+    node->cached = 1;
+    return 1;
+}
+
+/* Compress the decompressed 'node' by putting back the data kept by
+ * quicklistCacheKeep(). Returns 0 if there is no such data or if the node
+ * was modified since, in which case the entry is dropped. */
+REDIS_STATIC int quicklistCacheCheckin(quicklistNode *node) {
+    int restored = 0;
+    dictEntry *de;
+
+    if (qlcache.entries) {
+        pthread_mutex_lock(&qlcache.lock);
+        if ((de = dictFind(qlcache.entries,node)) != NULL) {
+            quicklistCacheEntry *e = dictGetVal(de);
+            /* Active defrag may have moved the ziplist. */
+            if (e->zl == node->zl && e->sz == node->sz) {
+                node->zl = (unsigned char *)e->lzf;
+                node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+                e->lzf = NULL;
+                quicklistCacheUnlink(e);
+                quicklistCacheLinkHead(e);
+                restored = 1;
+            } else {
+                quicklistCacheRemove(e);
+            }
+        }
+        pthread_mutex_unlock(&qlcache.lock);
+    }
+    if (!restored) node->cached = 0;
+    return restored;
+}
+
 /* Return cached quicklist count */
 unsigned int quicklistCount(const quicklist *ql) { return ql->count; }
 
@@ -169,8 +404,19 @@ void quicklistRelease(quicklist *quicklist) {
     while (len--) {
         next = current->next;
 
+        if (current->cached)
+            quicklistCacheDrop(current);
 #ifdef USE_NVM
-        if(current->encoding == QUICKLIST_NODE_ENCODING_RAW)
+        if(current->encoding == QUICKLIST_NODE_ENCODING_LZF &&
+           current->nvm_refs) {
+            /* The referenced NVM strings are freed with the ziplist. */
+            unsigned char *zl = zmalloc(current->sz);
+            if (quicklistNodeDecompressTo(current, zl))
+                ziplistFree(zl);
+            else
+                zfree(zl);
+            zfree(current->zl);
+        } else if(current->encoding == QUICKLIST_NODE_ENCODING_RAW)
             ziplistFree(current->zl);
         else
             zfree(current->zl);
@@ -195,40 +441,52 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     node->attempted_compress = 1;
 #endif
 
+    /* Unmodified since it was read: reuse the previous compressed data. */
+    if (node->cached && quicklistCacheCheckin(node)) {
+        node->recompress = 0;
+        return 1;
+    }
+
     /* Don't bother compressing small values */
     if (node->sz < MIN_COMPRESS_BYTES)
         return 0;
 
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
+    int codec = server.list_compress_codec;
 
 #ifdef USE_NVM
-    node->zl = ziplistNVMEntryDecode(node->zl);
-    node->sz = ziplistBlobLen((unsigned char*)node->zl);
+    /* NVM strings are compressed as references, they stay owned by the
+     * node. Whoever reads the LZF data as a plain ziplist checks this. */
+    node->nvm_refs = ziplistHasNVMEntries(node->zl);
 #endif
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = quicklistCodecs[codec].compress(node->zl, node->sz,
+                                lzf->compressed, node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* The codec aborts/rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
 #ifdef USE_NVM
     /* if ziplist node is compressed, only move compressed node from DDR to NVM. */
-    if (lzf && sizeof(*lzf) + lzf->sz >= server.sdsmv_threshold && getpid() == server.pid) {
-        quicklistLZF *lzf_nvm = nvm_malloc(sizeof(*lzf) + lzf->sz);
-        if (lzf_nvm) {
-            pmem_memcpy_persist(lzf_nvm, lzf, sizeof(*lzf) + lzf->sz);
-            zfree(lzf);
-            lzf = lzf_nvm;
+    if (lzf && getpid() == server.pid) {
+        if (nvm_place(NVM_CLASS_LZF_NODE, sizeof(*lzf) + lzf->sz)) {
+            quicklistLZF *lzf_nvm = nvm_malloc(sizeof(*lzf) + lzf->sz);
+            if (lzf_nvm) {
+                nvm_bulk_copy(lzf_nvm, lzf, sizeof(*lzf) + lzf->sz);
+                zfree(lzf);
+                lzf = lzf_nvm;
+            }
         }
+        nvm_placed(NVM_CLASS_LZF_NODE, lzf, sizeof(*lzf) + lzf->sz);
     }
 #endif
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
     node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->codec = codec;
     node->recompress = 0;
     return 1;
 }
@@ -248,16 +506,20 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
     node->attempted_compress = 0;
 #endif
 
+    if (node->cached && quicklistCacheCheckout(node))
+        return 1;
+
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (!quicklistNodeDecompressTo(node, decompressed)) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
     }
-    zfree(lzf);
     node->zl = decompressed;
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    if (!quicklistCacheKeep(node, lzf))
+        zfree(lzf);
     return 1;
 }
 
@@ -278,9 +540,18 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+/* Decompress the data of the compressed 'node' into 'zl', that must have
+ * room for node->sz bytes. Returns 1 on success, 0 on failure to decode. */
+int quicklistNodeDecompressTo(const quicklistNode *node, unsigned char *zl) {
+    quicklistLZF *lzf = (quicklistLZF *)node->zl;
+    return quicklistCodecs[node->codec].decompress(lzf->compressed, lzf->sz,
+                                                   zl, node->sz) != 0;
+}
+
+/* Extract the raw compressed data from this quicklistNode.
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data, in the format of
+ * node->codec. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
     *data = lzf->compressed;
@@ -300,13 +571,17 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     if (!quicklistAllowsCompression(quicklist)) {
 #ifdef USE_NVM
         /* if list-compress-depth is 0, move raw ziplist node from DDR to NVM. */
-        if (node && node->sz >= server.sdsmv_threshold && getpid() == server.pid) {
-            unsigned char *zl_nvm = nvm_malloc(node->sz);
-            if(zl_nvm) {
-                pmem_memcpy_persist(zl_nvm, node->zl, node->sz);
-                zfree(node->zl);
-                node->zl = zl_nvm;
+        if (node && getpid() == server.pid) {
+            int was_nvm = is_nvm_addr(node->zl);
+            if (nvm_place(NVM_CLASS_LIST_NODE, node->sz)) {
+                unsigned char *zl_nvm = nvm_malloc(node->sz);
+                if(zl_nvm) {
+                    nvm_bulk_copy(zl_nvm, node->zl, node->sz);
+                    zfree(node->zl);
+                    node->zl = zl_nvm;
+                }
             }
+            if (!was_nvm) nvm_placed(NVM_CLASS_LIST_NODE, node->zl, node->sz);
         }
 #endif
         return;
@@ -354,6 +629,10 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     while (depth++ < quicklist->compress) {
         quicklistDecompressNode(forward);
         quicklistDecompressNode(reverse);
+        /* A node read while it was in the middle of the list may have
+         * become one of the ends since: it must stay uncompressed. */
+        forward->recompress = 0;
+        reverse->recompress = 0;
 
         if (forward == node || reverse == node)
             in_depth = 1;
@@ -516,6 +795,8 @@ REDIS_STATIC int _quicklistNodeAllowMerge(const quicklistNode *a,
 #define quicklistNodeUpdateSz(node)                                            \
     do {                                                                       \
         (node)->sz = ziplistBlobLen((node)->zl);                               \
+        if ((node)->cached)                                                    \
+            quicklistCacheDrop(node);                                          \
     } while (0)
 
 /* Add new entry to head node of quicklist.
@@ -652,6 +933,8 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
     if(node->zl) {
         zfree(node->zl);
     }
+    if (node->cached)
+        quicklistCacheDrop(node);
     zfree(node);
     quicklist->len--;
 }
@@ -1290,6 +1573,7 @@ quicklist *quicklistDup(quicklist *orig) {
         copy->count += node->count;
         node->sz = current->sz;
         node->encoding = current->encoding;
+        node->codec = current->codec;
 
         _quicklistInsertNodeAfter(copy, copy->tail, node);
     }
@@ -40,7 +40,10 @@
  * container: 2 bits, NONE=1, ZIPLIST=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 12 bits, free for future use; pads out the remainder of 32 bits */
+ * nvm_refs: 1 bit, boolean, the compressed ziplist references NVM strings.
+ * codec: 1 bit, QUICKLIST_CODEC_* the compressed data was produced with.
+ * cached: 1 bit, boolean, the node may have an entry in the node cache.
+ * extra: 7 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     struct quicklistNode *prev;
     struct quicklistNode *next;
@@ -51,12 +54,16 @@ typedef struct quicklistNode {
     unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+    unsigned int nvm_refs : 1;   /* LZF data references NVM strings */
+    unsigned int codec : 1;      /* LZF or LZ4 */
+    unsigned int cached : 1;     /* may be in the decompressed node cache */
+    unsigned int extra : 7; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF data with total (compressed) length 'sz', or LZ4
+ * block data if quicklistNode->codec is QUICKLIST_CODEC_LZ4.
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
 typedef struct quicklistLZF {
@@ -104,6 +111,10 @@ typedef struct quicklistEntry {
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
 
+/* quicklist node codecs, selected with list-compress-codec */
+#define QUICKLIST_CODEC_LZF 0
+#define QUICKLIST_CODEC_LZ4 1
+
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
 
@@ -157,6 +168,12 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
 unsigned int quicklistCount(const quicklist *ql);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+int quicklistNodeDecompressTo(const quicklistNode *node, unsigned char *zl);
+void quicklistCacheInit(void);
+void quicklistCacheTrim(void);
+void quicklistCacheNodeMoved(quicklistNode *old, quicklistNode *node);
+void quicklistCacheGetStats(size_t *used, long long *hits, long long *misses);
+void quicklistCacheResetStats(void);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
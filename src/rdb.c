@@ -41,8 +41,9 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/param.h>
-#ifdef AEP_COW
 #include "bio.h"
+#include "atomicvar.h"
+#if defined(USE_NVM) || defined(AEP_COW)
 #include "nvm.h"
 #endif
 
@@ -331,6 +332,37 @@ ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
+#ifdef USE_NVM
+/* Flush the header and terminator of an sds string allocated on NVM, that
+ * the allocation wrote with regular stores. */
+static void rdbFlushNvmSdsHeader(sds s) {
+    size_t hdrlen = sdsheadersize(s);
+
+    nvm_bulk_flush(s-hdrlen,hdrlen);
+    nvm_bulk_flush(s+sdslen(s),1);
+}
+
+/* Like rioRead() but for a destination on NVM: the payload is staged in
+ * DRAM and reaches NVM with non-temporal stores, instead of read(2) doing
+ * regular stores (each one reading the NVM line first) that are never
+ * flushed. */
+static int rdbReadToNvm(rio *rdb, void *dst, size_t len, int is_sds) {
+    static unsigned char staging[RDB_NVM_STAGING_SIZE];
+    char *p = dst;
+
+    while (len) {
+        size_t chunk = len < sizeof(staging) ? len : sizeof(staging);
+
+        if (rioRead(rdb,staging,chunk) == 0) return 0;
+        nvm_bulk_copy(p,staging,chunk);
+        p += chunk;
+        len -= chunk;
+    }
+    if (is_sds) rdbFlushNvmSdsHeader(dst);
+    return 1;
+}
+#endif
+
 /* Load an LZF compressed string in RDB format. The returned value
  * changes according to 'flags'. For more info check the
  * rdbGenericLoadStringObject() function. */
@@ -359,7 +391,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
         if (lenptr) *lenptr = len;
     } else {
 #ifdef USE_NVM
-        val = sdsnewlennvm(NULL,len);
+        val = sdsnewlennvm(SDS_NOINIT,len);
 #else
         val = sdsnewlen(NULL,len);
 #endif
@@ -367,6 +399,20 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
+#ifdef USE_NVM
+    if (is_nvm_addr(val)) {
+        /* Decompress in DRAM, then write NVM sequentially. */
+        char *tmp = zmalloc(len);
+        if (lzf_decompress(c,clen,tmp,len) == 0) {
+            zfree(tmp);
+            if (rdbCheckMode) rdbCheckSetError("Invalid LZF compressed string");
+            goto err;
+        }
+        nvm_bulk_copy(val,tmp,len);
+        if (!plain) rdbFlushNvmSdsHeader(val);
+        zfree(tmp);
+    } else
+#endif
     if (lzf_decompress(c,clen,val,len) == 0) {
         if (rdbCheckMode) rdbCheckSetError("Invalid LZF compressed string");
         goto err;
@@ -421,6 +467,30 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
     return nwritten;
 }
 
+#ifdef USE_NVM
+static int rdbWriteZiplistPiece(void *rdb, const void *buf, size_t len) {
+    return rioWrite(rdb,buf,len) != 0;
+}
+
+/* Save a ziplist like rdbSaveRawString() does. When it references NVM
+ * strings they are written straight from NVM into the stream, inside a
+ * ziplist blob saved verbatim, instead of building a DRAM copy of the
+ * ziplist with the strings inlined to compress it. */
+static ssize_t rdbSaveNVMZiplist(rio *rdb, unsigned char *zl) {
+    size_t len, streamed = 0;
+    ssize_t n;
+
+    if (!ziplistHasNVMEntries(zl))
+        return rdbSaveRawString(rdb,zl,ziplistBlobLen(zl));
+    len = ziplistInlinedBlobLen(zl);
+    if ((n = rdbSaveLen(rdb,len)) == -1) return -1;
+    if (!ziplistWriteInlined(zl,rdbWriteZiplistPiece,rdb,&streamed))
+        return -1;
+    atomicIncr(server.stat_rdb_nvm_bytes_streamed,streamed);
+    return n+len;
+}
+#endif
+
 /* Save a long long value as either an encoded string or a string. */
 ssize_t rdbSaveLongLongAsStringObject(rio *rdb, long long value) {
     unsigned char buf[32];
@@ -489,12 +559,15 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
     if (len == RDB_LENERR) return NULL;
     if (plain || sds) {
 #ifdef USE_NVM
-        void *buf = plain ? s_zmalloc(len) : sdsnewlennvm(NULL,len);
+        void *buf = plain ? s_zmalloc(len) : sdsnewlennvm(SDS_NOINIT,len);
+        int ok = is_nvm_addr(buf) ? rdbReadToNvm(rdb,buf,len,!plain) :
+                                    (len == 0 || rioRead(rdb,buf,len));
 #else
         void *buf = plain ? zmalloc(len) : sdsnewlen(NULL,len);
+        int ok = len == 0 || rioRead(rdb,buf,len);
 #endif
         if (lenptr) *lenptr = len;
-        if (len && rioRead(rdb,buf,len) == 0) {
+        if (!ok) {
             if (plain)
                 zfree(buf);
             else
@@ -632,7 +705,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_ZSET:
         if (o->encoding == OBJ_ENCODING_ZIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
@@ -678,27 +752,43 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
             nwritten += n;
 
             do {
-                if (quicklistNodeIsCompressed(node)) {
+                int self_contained_lzf =
+                    node->codec == QUICKLIST_CODEC_LZF
+#ifdef USE_NVM
+                    /* NVM strings referenced by the data are saved by
+                     * value. */
+                    && !node->nvm_refs
+#endif
+                    ;
+
+                if (quicklistNodeIsCompressed(node) && self_contained_lzf) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
-                } else {
+                } else if (quicklistNodeIsCompressed(node)) {
+                    unsigned char *zl = zmalloc(node->sz);
+                    if (!quicklistNodeDecompressTo(node,zl)) {
+                        zfree(zl);
+                        return -1;
+                    }
 #ifdef USE_NVM
-                    unsigned char* old_zl = node->zl;
-                    node->zl = ziplistNVMEntryDecode(node->zl);
-                    unsigned int old_sz = node->sz;
-                    node->sz = ziplistBlobLen((unsigned char*)node->zl);
+                    if (node->nvm_refs)
+                        atomicIncr(server.stat_rdb_nvm_bytes_materialized,node->sz);
+                    n = rdbSaveNVMZiplist(rdb,zl);
+#else
+                    n = rdbSaveRawString(rdb,zl,node->sz);
 #endif
-
-                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
+                    zfree(zl);
+                    if (n == -1) return -1;
                     nwritten += n;
-
+                } else {
 #ifdef USE_NVM
-                    zfree(node->zl);
-                    node->zl = old_zl;
-                    node->sz = old_sz;
+                    if ((n = rdbSaveNVMZiplist(rdb,node->zl)) == -1) return -1;
+#else
+                    if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
 #endif
+                    nwritten += n;
                 }
             } while ((node = node->next));
         } else {
@@ -733,18 +823,13 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         /* Save a sorted set value */
         if (o->encoding == OBJ_ENCODING_ZIPLIST) {
 #ifdef USE_NVM
-            unsigned char* old_ptr = o->ptr;
-            o->ptr = ziplistNVMEntryDecode(o->ptr);
-#endif
+            if ((n = rdbSaveNVMZiplist(rdb,o->ptr)) == -1) return -1;
+#else
             size_t l = ziplistBlobLen((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
-            nwritten += n;
-
-#ifdef USE_NVM
-            zfree(o->ptr);
-            o->ptr = old_ptr;
 #endif
+            nwritten += n;
 
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = o->ptr;
@@ -773,6 +858,30 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
                 nwritten += n;
                 zn = zn->backward;
             }
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = o->ptr;
+            zbtreeIter it;
+
+            if ((n = rdbSaveLen(rdb,zs->zbt->length)) == -1) return -1;
+            nwritten += n;
+
+            /* Same order as skiplists: the file loads fast with both
+             * encodings. */
+            if (zbtLast(zs->zbt,&it)) {
+                do {
+                    sds ele = zbtIterEle(&it);
+                    if ((n = rdbSaveRawString(rdb,
+                        (unsigned char*)ele,sdslen(ele))) == -1)
+                    {
+                        return -1;
+                    }
+                    nwritten += n;
+                    if ((n = rdbSaveBinaryDoubleValue(rdb,
+                        zbtIterScore(&it))) == -1)
+                        return -1;
+                    nwritten += n;
+                } while (zbtPrev(&it));
+            }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -780,19 +889,13 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
         /* Save a hash value */
         if (o->encoding == OBJ_ENCODING_ZIPLIST) {
 #ifdef USE_NVM
-            unsigned char* old_ptr = o->ptr;
-            o->ptr = ziplistNVMEntryDecode(o->ptr);
-#endif
-
+            if ((n = rdbSaveNVMZiplist(rdb,o->ptr)) == -1) return -1;
+#else
             size_t l = ziplistBlobLen((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
-            nwritten += n;
-
-#ifdef USE_NVM
-            zfree(o->ptr);
-            o->ptr = old_ptr;
 #endif
+            nwritten += n;
 
         } else if (o->encoding == OBJ_ENCODING_HT) {
             dictIterator *di = dictGetIterator(o->ptr);
@@ -1110,11 +1213,15 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
     pid_t childpid;
     long long start;
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_threaded_in_progress) return C_ERR;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
     openChildInfoPipe();
+#ifdef AEP_COW
+    nvm_cow_prepare();
+#endif
 
     start = ustime();
     if ((childpid = fork()) == 0) {
@@ -1143,6 +1250,9 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
         server.stat_fork_rate = (double) zmalloc_used_memory() * 1000000 / server.stat_fork_time / (1024*1024*1024); /* GB per second. */
         latencyAddSampleIfNeeded("fork",server.stat_fork_time/1000);
         if (childpid == -1) {
+#ifdef AEP_COW
+            nvm_cow_stop();
+#endif
             closeChildInfoPipe();
             server.lastbgsave_status = C_ERR;
             serverLog(LL_WARNING,"Can't save in background: fork: %s",
@@ -1154,6 +1264,9 @@ int rdbSaveBackground(char *filename, rdbSaveInfo *rsi) {
         server.rdb_child_pid = childpid;
         server.rdb_child_type = RDB_CHILD_TYPE_DISK;
         updateDictResizePolicy();
+#ifdef AEP_COW
+        nvm_cow_start();
+#endif
         return C_OK;
     }
     return C_OK; /* unreached */
@@ -1166,6 +1279,347 @@ void rdbRemoveTempFile(pid_t childpid) {
     unlink(tmpfile);
 }
 
+/* -----------------------------------------------------------------------------
+ * Threaded (fork-less) BGSAVE
+ *
+ * BGSAVE THREADED snapshots the keyspace without fork(). When the save
+ * starts the hash tables of every DB are frozen: rehashing is paused, so
+ * every key alive at that point stays in the bucket it was found in. The
+ * main thread serializes buckets incrementally from serverCron(), and every
+ * write path calls rdbThreadedSaveTouchKey() first, which serializes the
+ * buckets the key may live in before the key is modified, deleted or a new
+ * key is chained to them. Each frozen bucket is therefore written exactly
+ * once, as it was when the save started, whatever happens to it later.
+ *
+ * Serialized buckets are accumulated in chunks handed to a bio.c thread,
+ * which computes the checksum and performs the write(2) and fsync(2) calls.
+ * No data structure is ever read outside the main thread, so DRAM and NVM
+ * values need no copy-on-write at all.
+ * -------------------------------------------------------------------------- */
+
+typedef struct rdbThreadedDb {
+    dictEntry **table[2];       /* Hash tables of db->dict at start. */
+    unsigned long size[2];
+    unsigned char *saved[2];    /* One bit per bucket already serialized. */
+} rdbThreadedDb;
+
+static struct {
+    int state;                  /* RDB_THREADED_* */
+    long long now;              /* Expire reference time of the snapshot. */
+    rdbThreadedDb *dbs;
+    int cur_db;                 /* Scan cursor: db, table, bucket. */
+    int cur_table;
+    unsigned long cur_bucket;
+    sds buf;                    /* Chunk being filled by the main thread. */
+    int buf_dbid;
+    char *filename;
+    char tmpfile[256];
+    /* Owned by the bio thread once the header is written. */
+    FILE *fp;
+    rio rdb;
+    int last_dbid;
+    int error;                  /* errno of the first write error. */
+    int aborted;
+} rdbts = {RDB_THREADED_NONE};
+
+static size_t rdbts_pending_bytes = 0;  /* Queued, not yet written. */
+
+static int rdbThreadedBucketSaved(rdbThreadedDb *tdb, int t, unsigned long b) {
+    return tdb->saved[t][b>>3] & (1<<(b&7));
+}
+
+/* Hand the current chunk to the bio thread. */
+static void rdbThreadedSaveFlush(void) {
+    if (sdslen(rdbts.buf) == 0) return;
+    atomicIncr(rdbts_pending_bytes,sdslen(rdbts.buf));
+    bioCreateBackgroundJob(BIO_RDB_SAVE,rdbts.buf,
+                           (void*)(long)rdbts.buf_dbid,NULL);
+    rdbts.buf = sdsempty();
+}
+
+/* Serialize bucket 'b' of frozen table 't' of DB 'dbid' into the current
+ * chunk. Returns the number of bytes produced. */
+static size_t rdbThreadedSaveBucket(int dbid, int t, unsigned long b) {
+    rdbThreadedDb *tdb = rdbts.dbs+dbid;
+    redisDb *db = server.db+dbid;
+    dictEntry *de = tdb->table[t][b];
+    size_t len;
+    rio r;
+
+    tdb->saved[t][b>>3] |= 1<<(b&7);
+    server.rdb_threaded_buckets_saved++;
+    if (de == NULL) return 0;
+
+    if (rdbts.buf_dbid != dbid) {
+        rdbThreadedSaveFlush();
+        rdbts.buf_dbid = dbid;
+    }
+    len = sdslen(rdbts.buf);
+    rioInitWithBuffer(&r,rdbts.buf);
+    while (de) {
+        sds keystr = dictGetKey(de);
+        robj key, *o = dictGetVal(de);
+
+        initStaticStringObject(key,keystr);
+        rdbSaveKeyValuePair(&r,&key,o,getExpire(db,&key),rdbts.now);
+        de = de->next;
+    }
+    rdbts.buf = r.io.buffer.ptr;
+    len = sdslen(rdbts.buf)-len;
+    if (sdslen(rdbts.buf) >= RDB_THREADED_CHUNK_SIZE) rdbThreadedSaveFlush();
+    return len;
+}
+
+/* Drop the frozen view of the keyspace and let rehashing resume. */
+static void rdbThreadedSaveRelease(void) {
+    int j, t;
+
+    for (j = 0; j < server.dbnum; j++) {
+        dictResumeRehashing(server.db[j].dict);
+        for (t = 0; t < 2; t++) zfree(rdbts.dbs[j].saved[t]);
+    }
+    zfree(rdbts.dbs);
+    rdbts.dbs = NULL;
+}
+
+/* Called by the bio thread for every chunk, and with a NULL chunk once the
+ * main thread produced everything. */
+void rdbThreadedSaveFromBioThread(sds chunk, long dbid) {
+    int aborted;
+    uint64_t cksum;
+
+    atomicGet(rdbts.aborted,aborted);
+    if (chunk) {
+        if (!aborted && !rdbts.error) {
+            if (dbid != rdbts.last_dbid) {
+                if (rdbSaveType(&rdbts.rdb,RDB_OPCODE_SELECTDB) == -1 ||
+                    rdbSaveLen(&rdbts.rdb,dbid) == -1) rdbts.error = errno;
+                rdbts.last_dbid = dbid;
+            }
+            if (!rdbts.error &&
+                rioWrite(&rdbts.rdb,chunk,sdslen(chunk)) == 0)
+                rdbts.error = errno;
+        }
+        atomicDecr(rdbts_pending_bytes,sdslen(chunk));
+        sdsfree(chunk);
+        return;
+    }
+
+    if (!aborted && !rdbts.error) {
+        if (rdbSaveType(&rdbts.rdb,RDB_OPCODE_EOF) == -1) rdbts.error = errno;
+        cksum = rdbts.rdb.cksum;
+        memrev64ifbe(&cksum);
+        if (rdbts.error ||
+            rioWrite(&rdbts.rdb,&cksum,8) == 0 ||
+            fflush(rdbts.fp) == EOF ||
+            fsync(fileno(rdbts.fp)) == -1)
+        {
+            if (!rdbts.error) rdbts.error = errno;
+        }
+    }
+    if (fclose(rdbts.fp) == EOF && !rdbts.error) rdbts.error = errno;
+    rdbts.fp = NULL;
+    if (aborted || rdbts.error) unlink(rdbts.tmpfile);
+}
+
+int rdbSaveThreaded(char *filename) {
+    char magic[10];
+    int j, t;
+
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_threaded_in_progress) return C_ERR;
+
+    server.dirty_before_bgsave = server.dirty;
+    server.lastbgsave_try = time(NULL);
+
+    snprintf(rdbts.tmpfile,sizeof(rdbts.tmpfile),"temp-threaded-%d.rdb",
+        (int) getpid());
+    rdbts.fp = fopen(rdbts.tmpfile,"w");
+    if (!rdbts.fp) {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Can't save in background: fopen: %s",
+            strerror(errno));
+        return C_ERR;
+    }
+    rioInitWithFile(&rdbts.rdb,rdbts.fp);
+    if (server.rdb_checksum)
+        rdbts.rdb.update_cksum = rioGenericUpdateChecksum;
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    if (rdbWriteRaw(&rdbts.rdb,magic,9) == -1 ||
+        rdbSaveInfoAuxFields(&rdbts.rdb,RDB_SAVE_NONE,NULL) == -1)
+    {
+        server.lastbgsave_status = C_ERR;
+        serverLog(LL_WARNING,"Can't save in background: write: %s",
+            strerror(errno));
+        fclose(rdbts.fp);
+        unlink(rdbts.tmpfile);
+        return C_ERR;
+    }
+    rdbts.filename = zstrdup(filename);
+    rdbts.last_dbid = -1;
+    rdbts.error = 0;
+    rdbts.aborted = 0;
+
+    /* Freeze the keyspace. */
+    rdbts.now = mstime();
+    rdbts.dbs = zcalloc(sizeof(rdbThreadedDb)*server.dbnum);
+    server.rdb_threaded_buckets = 0;
+    server.rdb_threaded_buckets_saved = 0;
+    for (j = 0; j < server.dbnum; j++) {
+        dict *d = server.db[j].dict;
+
+        dictPauseRehashing(d);
+        for (t = 0; t < 2; t++) {
+            if (d->ht[t].table == NULL) continue;
+            rdbts.dbs[j].table[t] = d->ht[t].table;
+            rdbts.dbs[j].size[t] = d->ht[t].size;
+            rdbts.dbs[j].saved[t] = zcalloc((d->ht[t].size+7)/8);
+            server.rdb_threaded_buckets += d->ht[t].size;
+        }
+    }
+    rdbts.cur_db = rdbts.cur_table = 0;
+    rdbts.cur_bucket = 0;
+    rdbts.buf = sdsempty();
+    rdbts.buf_dbid = -1;
+    rdbts.state = RDB_THREADED_SCANNING;
+
+    server.stat_rdb_threaded_cow_bytes = 0;
+    server.rdb_threaded_in_progress = 1;
+    server.rdb_save_time_start = time(NULL);
+    updateDictResizePolicy();
+    serverLog(LL_NOTICE,"Background threaded saving started");
+    return C_OK;
+}
+
+/* Write hook: make sure the frozen buckets 'key' may live in (or be added
+ * to) are serialized before the caller changes them. */
+void rdbThreadedSaveTouchKey(redisDb *db, robj *key) {
+    rdbThreadedDb *tdb;
+    uint64_t h;
+    int t;
+
+    if (rdbts.state != RDB_THREADED_SCANNING) return;
+    tdb = rdbts.dbs+db->id;
+    h = dictHashKey(db->dict,key->ptr);
+    for (t = 0; t < 2; t++) {
+        unsigned long b;
+
+        if (tdb->size[t] == 0) continue;
+        b = h & (tdb->size[t]-1);
+        if (!rdbThreadedBucketSaved(tdb,t,b))
+            server.stat_rdb_threaded_cow_bytes +=
+                rdbThreadedSaveBucket(db->id,t,b);
+    }
+}
+
+/* Serialize frozen buckets for up to 'timelimit' microseconds. Returns 1
+ * once the whole keyspace was serialized. */
+static int rdbThreadedSaveScan(long long timelimit) {
+    long long start = ustime();
+    unsigned long iterations = 0;
+    size_t pending;
+
+    while (rdbts.cur_db < server.dbnum) {
+        rdbThreadedDb *tdb = rdbts.dbs+rdbts.cur_db;
+
+        if (rdbts.cur_table > 1) {
+            rdbts.cur_db++;
+            rdbts.cur_table = 0;
+            continue;
+        }
+        if (rdbts.cur_bucket >= tdb->size[rdbts.cur_table]) {
+            rdbts.cur_table++;
+            rdbts.cur_bucket = 0;
+            continue;
+        }
+        if (!rdbThreadedBucketSaved(tdb,rdbts.cur_table,rdbts.cur_bucket))
+            rdbThreadedSaveBucket(rdbts.cur_db,rdbts.cur_table,
+                                  rdbts.cur_bucket);
+        rdbts.cur_bucket++;
+
+        /* Don't run past the time limit, and don't queue more than the
+         * bio thread can keep up with. */
+        if ((++iterations & 0xff) == 0) {
+            atomicGet(rdbts_pending_bytes,pending);
+            if (ustime()-start > timelimit ||
+                pending > RDB_THREADED_MAX_PENDING) break;
+        }
+    }
+    rdbThreadedSaveFlush();
+    return rdbts.cur_db == server.dbnum;
+}
+
+/* Called by serverCron(): advance the scan, and once the bio thread wrote
+ * everything move the file in place. */
+void rdbThreadedSaveCron(void) {
+    if (rdbts.state == RDB_THREADED_SCANNING) {
+        long long timelimit =
+            RDB_THREADED_CYCLE_PERC*1000000/server.hz/100;
+
+        if (!rdbThreadedSaveScan(timelimit)) return;
+        rdbThreadedSaveRelease();
+        sdsfree(rdbts.buf);
+        rdbts.buf = NULL;
+        bioCreateBackgroundJob(BIO_RDB_SAVE,NULL,NULL,NULL);
+        rdbts.state = RDB_THREADED_WRITING;
+        updateDictResizePolicy();
+    }
+    if (rdbts.state != RDB_THREADED_WRITING ||
+        bioPendingJobsOfType(BIO_RDB_SAVE)) return;
+
+    if (rdbts.error) {
+        serverLog(LL_WARNING,"Background threaded saving error: %s",
+            strerror(rdbts.error));
+        server.lastbgsave_status = C_ERR;
+    } else if (rename(rdbts.tmpfile,rdbts.filename) == -1) {
+        serverLog(LL_WARNING,
+            "Error moving temp DB file %s on the final destination %s: %s",
+            rdbts.tmpfile, rdbts.filename, strerror(errno));
+        unlink(rdbts.tmpfile);
+        server.lastbgsave_status = C_ERR;
+    } else {
+        serverLog(LL_NOTICE,
+            "Background threaded saving terminated with success "
+            "(%zu bytes saved ahead of writes)",
+            server.stat_rdb_threaded_cow_bytes);
+        server.dirty = server.dirty - server.dirty_before_bgsave;
+        server.lastsave = time(NULL);
+        server.lastbgsave_status = C_OK;
+    }
+    zfree(rdbts.filename);
+    rdbts.filename = NULL;
+    rdbts.state = RDB_THREADED_NONE;
+    server.rdb_threaded_in_progress = 0;
+    server.rdb_save_time_last = time(NULL)-server.rdb_save_time_start;
+    server.rdb_save_time_start = -1;
+}
+
+/* Stop a threaded save, for instance because the keyspace is about to be
+ * emptied or swapped. Like killing a saving child this is not an error.
+ * Returns once the bio thread discarded the queued chunks. */
+void rdbThreadedSaveAbort(void) {
+    if (rdbts.state == RDB_THREADED_NONE) return;
+    if (rdbts.state == RDB_THREADED_SCANNING) {
+        rdbThreadedSaveRelease();
+        sdsfree(rdbts.buf);
+        rdbts.buf = NULL;
+        atomicSet(rdbts.aborted,1);
+        bioCreateBackgroundJob(BIO_RDB_SAVE,NULL,NULL,NULL);
+    } else {
+        atomicSet(rdbts.aborted,1);
+    }
+    while (bioPendingJobsOfType(BIO_RDB_SAVE))
+        bioWaitStepOfType(BIO_RDB_SAVE);
+    unlink(rdbts.tmpfile);
+    serverLog(LL_NOTICE,"Background threaded saving aborted");
+    zfree(rdbts.filename);
+    rdbts.filename = NULL;
+    rdbts.state = RDB_THREADED_NONE;
+    server.rdb_threaded_in_progress = 0;
+    server.rdb_save_time_start = -1;
+    updateDictResizePolicy();
+}
+
 /* This function is called by rdbLoadObject() when the code is in RDB-check
  * mode and we find a module value of type 2 that can be parsed without
  * the need of the actual module. The value is parsed for errors, finally
@@ -1288,7 +1742,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL))
                 == NULL) return NULL;
@@ -1302,8 +1755,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetInsertElement(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
@@ -1456,7 +1908,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb) {
                 o->type = OBJ_ZSET;
                 o->encoding = OBJ_ENCODING_ZIPLIST;
                 if (zsetLength(o) > server.zset_max_ziplist_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,server.zset_encoding);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
                 o->type = OBJ_HASH;
@@ -1521,7 +1973,14 @@ void startLoading(FILE *fp) {
     /* Load the DB */
     server.loading = 1;
     server.loading_start_time = time(NULL);
+    server.loading_start_ms = mstime();
     server.loading_loaded_bytes = 0;
+    server.loading_start_keys = 0;
+    for (int j = 0; j < server.dbnum; j++)
+        server.loading_start_keys += dictSize(server.db[j].dict);
+#ifdef USE_NVM
+    nvm_bulk_begin();
+#endif
     if (fstat(fileno(fp), &sb) == -1) {
         server.loading_total_bytes = 0;
     } else {
@@ -1538,6 +1997,15 @@ void loadingProgress(off_t pos) {
 
 /* Loading finished */
 void stopLoading(void) {
+    long long keys = 0;
+
+    for (int j = 0; j < server.dbnum; j++)
+        keys += dictSize(server.db[j].dict);
+    server.stat_last_load_keys = keys-server.loading_start_keys;
+    server.stat_last_load_time_ms = mstime()-server.loading_start_ms;
+#ifdef USE_NVM
+    server.stat_last_load_nvm_bytes = nvm_bulk_end();
+#endif
     server.loading = 0;
 }
 
@@ -1688,7 +2156,13 @@ int rdbLoadRio(rio *rdb, rdbSaveInfo *rsi) {
             decrRefCount(val);
             continue;
         }
-        /* Add the new object in the hash table */
+        /* Add the new object in the hash table, small strings along with
+         * their key as setKey() does. */
+        robj *keyed = dbKeyedValue(key,val);
+        if (keyed) {
+            decrRefCount(val);
+            val = keyed;
+        }
         dbAdd(db,key,val);
 
         /* Set the expire time if needed */
@@ -1774,9 +2248,7 @@ void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
 #ifdef AEP_COW
     serverLog(LL_NOTICE, "RDB BGSAVE duplicate nvm_size=%ld, memorysize=%ld",server.cow_nvm_size,server.cow_mem_size);
     serverLog(LL_NOTICE, "RDB BGSAVE before lazy release, memory_used=%ld, nvm_used=%ld",zmalloc_used_memory(),nvm_get_used());
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,server.forked_dict,server.cow_dict); 
-    server.forked_dict=cow_createforknvmdict();
-    server.cow_dict = cow_createcownvmdict();
+    nvm_cow_stop();
     server.last_nvm_cow_size=server.cow_nvm_size + server.cow_mem_size;
     server.cow_nvm_size=0;
     server.cow_mem_size=0;
@@ -1801,6 +2273,12 @@ void backgroundSaveDoneHandlerSocket(int exitcode, int bysignal) {
     server.rdb_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_save_time_start = -1;
+#ifdef AEP_COW
+    nvm_cow_stop();
+    server.last_nvm_cow_size=server.cow_nvm_size + server.cow_mem_size;
+    server.cow_nvm_size=0;
+    server.cow_mem_size=0;
+#endif
 
     /* If the child returns an OK exit code, read the set of slave client
      * IDs and the associated status code. We'll terminate all the slaves
@@ -1905,7 +2383,8 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
     long long start;
     int pipefds[2];
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1 ||
+        server.rdb_threaded_in_progress) return C_ERR;
 
     /* Before to fork, create a pipe that will be used in order to
      * send back to the parent the IDs of the slaves that successfully
@@ -1941,6 +2420,9 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 
     /* Create the child process. */
     openChildInfoPipe();
+#ifdef AEP_COW
+    nvm_cow_prepare();
+#endif
     start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
@@ -2016,6 +2498,9 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
         if (childpid == -1) {
             serverLog(LL_WARNING,"Can't save in background: fork: %s",
                 strerror(errno));
+#ifdef AEP_COW
+            nvm_cow_stop();
+#endif
 
             /* Undo the state change. The caller will perform cleanup on
              * all the slaves in BGSAVE_START state, but an early call to
@@ -2046,6 +2531,9 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
             server.rdb_child_pid = childpid;
             server.rdb_child_type = RDB_CHILD_TYPE_SOCKET;
             updateDictResizePolicy();
+#ifdef AEP_COW
+            nvm_cow_start();
+#endif
         }
         zfree(clientids);
         zfree(fds);
@@ -2055,7 +2543,7 @@ int rdbSaveToSlavesSockets(rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_threaded_in_progress) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -2066,22 +2554,25 @@ void saveCommand(client *c) {
     }
 }
 
-/* BGSAVE [SCHEDULE] */
+/* BGSAVE [SCHEDULE|THREADED] */
 void bgsaveCommand(client *c) {
-    int schedule = 0;
+    int schedule = 0, threaded = 0;
 
     /* The SCHEDULE option changes the behavior of BGSAVE when an AOF rewrite
-     * is in progress. Instead of returning an error a BGSAVE gets scheduled. */
+     * is in progress. Instead of returning an error a BGSAVE gets scheduled.
+     * The THREADED option saves without forking, see rdbSaveThreaded(). */
     if (c->argc > 1) {
         if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"schedule")) {
             schedule = 1;
+        } else if (c->argc == 2 && !strcasecmp(c->argv[1]->ptr,"threaded")) {
+            threaded = 1;
         } else {
             addReply(c,shared.syntaxerr);
             return;
         }
     }
 
-    if (server.rdb_child_pid != -1) {
+    if (server.rdb_child_pid != -1 || server.rdb_threaded_in_progress) {
         addReplyError(c,"Background save already in progress");
     } else if (server.aof_child_pid != -1) {
         if (schedule) {
@@ -2093,6 +2584,18 @@ void bgsaveCommand(client *c) {
                 "Use BGSAVE SCHEDULE in order to schedule a BGSAVE whenever "
                 "possible.");
         }
+    } else if (threaded) {
+#ifdef USE_OA_KEYSPACE
+        /* The threaded save freezes the buckets of the keyspace: open
+         * addressing tables have none. */
+        addReplyError(c,"BGSAVE THREADED is not supported with an open "
+                        "addressing keyspace");
+#else
+        if (rdbSaveThreaded(server.rdb_filename) == C_OK)
+            addReplyStatus(c,"Background threaded saving started");
+        else
+            addReply(c,shared.err);
+#endif
     } else if (rdbSaveBackground(server.rdb_filename,NULL) == C_OK) {
         addReplyStatus(c,"Background saving started");
     } else {
@@ -119,6 +119,16 @@
 #define RDB_SAVE_NONE 0
 #define RDB_SAVE_AOF_PREAMBLE (1<<0)
 
+/* BGSAVE THREADED states and tunables. */
+#define RDB_THREADED_NONE 0
+#define RDB_THREADED_SCANNING 1     /* Keyspace frozen, buckets being saved. */
+#define RDB_THREADED_WRITING 2      /* Waiting for the bio thread. */
+#define RDB_THREADED_CHUNK_SIZE (1024*1024)
+#define RDB_THREADED_MAX_PENDING (64*1024*1024) /* Queued bytes limit. */
+#define RDB_THREADED_CYCLE_PERC 25  /* Max CPU percentage of serverCron. */
+
+#define RDB_NVM_STAGING_SIZE (64*1024) /* DRAM staging of values loaded to NVM. */
+
 int rdbSaveType(rio *rdb, unsigned char type);
 int rdbLoadType(rio *rdb);
 int rdbSaveTime(rio *rdb, time_t t);
@@ -132,6 +142,11 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi);
 int rdbSaveBackground(char *filename, rdbSaveInfo *rsi);
 int rdbSaveToSlavesSockets(rdbSaveInfo *rsi);
 void rdbRemoveTempFile(pid_t childpid);
+int rdbSaveThreaded(char *filename);
+void rdbThreadedSaveTouchKey(redisDb *db, robj *key);
+void rdbThreadedSaveCron(void);
+void rdbThreadedSaveAbort(void);
+void rdbThreadedSaveFromBioThread(sds chunk, long dbid);
 int rdbSave(char *filename, rdbSaveInfo *rsi);
 ssize_t rdbSaveObject(rio *rdb, robj *o);
 size_t rdbSavedObjectLen(robj *o);
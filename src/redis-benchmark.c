@@ -80,6 +80,7 @@ static struct config {
     int idlemode;
     int dbnum;
     sds dbnumstr;
+    long long bitmapsize;
     char *tests;
     char *auth;
 } config;
@@ -585,6 +586,11 @@ int parseOptions(int argc, const char **argv) {
             if (lastarg) goto invalid;
             config.dbnum = atoi(argv[++i]);
             config.dbnumstr = sdsfromlonglong(config.dbnum);
+        } else if (!strcmp(argv[i],"--bitmap-size")) {
+            if (lastarg) goto invalid;
+            config.bitmapsize = atoll(argv[++i]);
+            if (config.bitmapsize < 1) config.bitmapsize = 1;
+            if (config.bitmapsize > 512*1024*1024) config.bitmapsize = 512*1024*1024;
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -620,7 +626,8 @@ usage:
 "  from 0 to keyspacelen-1. The substitution changes every time a command\n"
 "  is executed. Default tests use this to hit random keys in the\n"
 "  specified range.\n"
-" -f <fieldspacelen> Use random field value for SADD/HSET\n"
+" -f <fieldspacelen> Use random field value for SADD/HSET/ZADD/ZRANK and\n"
+"                    random scores for ZADD/ZRANGEBYSCORE\n"
 " -P <numreq>        Pipeline <numreq> requests. Default 1 (no pipeline).\n"
 " -e                 If server replies with errors, show them on stdout.\n"
 "                    (no more than 1 error per second is displayed)\n"
@@ -629,7 +636,10 @@ usage:
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
-" -I                 Idle mode. Just open N idle connections and wait.\n\n"
+" -I                 Idle mode. Just open N idle connections and wait.\n"
+" --bitmap-size <size> Size in bytes of the bitmaps used by the bitcount,\n"
+"                    bitpos and bitop tests (default 4194304). These tests\n"
+"                    scan whole bitmaps and only run when selected with -t.\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ redis-benchmark\n\n"
@@ -641,6 +651,12 @@ usage:
 "   $ redis-benchmark -t ping,set,get -n 100000 --csv\n\n"
 " Benchmark a specific command line:\n"
 "   $ redis-benchmark -r 10000 -n 10000 eval 'return redis.call(\"ping\")' 0\n\n"
+" Compare the zset-encoding options on 100k elements sorted sets:\n"
+"   $ redis-benchmark -t zadd,zrank,zrangebyscore -d 24 -n 1000000 -f 100000\n\n"
+" Benchmark BITCOUNT, BITPOS and BITOP on 16 MB bitmaps:\n"
+"   $ redis-benchmark -t bitcount,bitpos,bitop -n 10000 --bitmap-size 16777216\n\n"
+" Benchmark a large multi bulk reply (10000 elements, only run if selected):\n"
+"   $ redis-benchmark -t lrange_big -n 10000 -d 100\n\n"
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist __rand_int__\n\n"
 " On user specified command lines __rand_int__ is replaced with a random integer\n"
@@ -685,6 +701,12 @@ int test_is_selected(char *name) {
     return strstr(config.tests,buf) != NULL;
 }
 
+/* Like test_is_selected() but for the tests that are too slow to run by
+ * default: they run only if named using the -t command line switch. */
+int test_is_explicitly_selected(char *name) {
+    return config.tests != NULL && test_is_selected(name);
+}
+
 int main(int argc, const char **argv) {
     int i;
     char *data, *cmd;
@@ -718,6 +740,7 @@ int main(int argc, const char **argv) {
     config.hostsocket = NULL;
     config.tests = NULL;
     config.dbnum = 0;
+    config.bitmapsize = 4*1024*1024;
     config.auth = NULL;
 
     i = parseOptions(argc,argv);
@@ -763,7 +786,7 @@ int main(int argc, const char **argv) {
 
         if (test_is_selected("sadd") || test_is_selected("lpush") ||
             test_is_selected("rpush") || test_is_selected("zadd") ||
-            test_is_selected("zrem")) {
+            test_is_selected("zrem") || test_is_selected("zrank")) {
             int min_size = strlen("field:__rand_field__");
             if (config.datasize - min_size < 0) {
                 printf("Minimum datasize should be %d\n", min_size);
@@ -859,6 +882,22 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        if (test_is_selected("zrank")) {
+            len = redisFormatCommand(&cmd,
+                "ZRANK zset:__rand_int__ %sfield:__rand_field__",data);
+            benchmark("ZRANK",cmd,len);
+            free(cmd);
+        }
+
+        if (test_is_selected("zrangebyscore")) {
+            config.randomscore_spacelen = config.randomfields_fieldspacelen;
+            len = redisFormatCommand(&cmd,
+                "ZRANGEBYSCORE zset:__rand_int__ __rand_score__ +inf LIMIT 0 10");
+            benchmark("ZRANGEBYSCORE (first 10 elements)",cmd,len);
+            free(cmd);
+            config.randomscore_spacelen = 0;
+        }
+
         if (test_is_selected("hset")) {
             len = redisFormatCommand(&cmd,
                 "HSET myhash:__rand_int__ field:__rand_field__ %s",data);
@@ -914,6 +953,164 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        if (test_is_explicitly_selected("lrange_big")) {
+            int requests = config.requests;
+            char title[64];
+
+            /* A multi bulk reply large enough to span many nodes of the
+             * client reply list. */
+            config.requests = 1;
+            len = redisFormatCommand(&cmd,"EVAL %s 1 biglist %s",
+                "redis.call('del',KEYS[1]) "
+                "for i=1,10000 do redis.call('rpush',KEYS[1],ARGV[1]) end",
+                data);
+            benchmark("RPUSH (needed to benchmark LRANGE_BIG)",cmd,len);
+            free(cmd);
+            config.requests = requests;
+
+            len = redisFormatCommand(&cmd,"LRANGE biglist 0 -1");
+            snprintf(title,sizeof(title),
+                "LRANGE_BIG (10000 elements of %d bytes)",config.datasize);
+            benchmark(title,cmd,len);
+            free(cmd);
+        }
+
+        if (test_is_selected("sinter")) {
+            int requests = config.requests;
+
+            /* Populate intsets of every encoding and a hash table set of
+             * 512 elements, sharing part of their elements. */
+            config.requests = 1;
+            len = redisFormatCommand(&cmd,"EVAL %s 0",
+                "for i=0,510 do "
+                "redis.call('sadd','set:int16',i*2) "
+                "redis.call('sadd','set:int32',i*3) "
+                "redis.call('sadd','set:int64',i*4) "
+                "redis.call('sadd','set:hashtable',i*5) end "
+                "redis.call('sadd','set:int16',1022) "
+                "redis.call('sadd','set:int32',100000) "
+                "redis.call('sadd','set:int64',1099511627776) "
+                "redis.call('sadd','set:hashtable','x')");
+            benchmark("SADD (needed to benchmark SINTER)",cmd,len);
+            free(cmd);
+            config.requests = requests;
+
+            len = redisFormatCommand(&cmd,"SINTER set:int16 set:int32");
+            benchmark("SINTER (2 intsets of 512 elements)",cmd,len);
+            free(cmd);
+            len = redisFormatCommand(&cmd,
+                "SINTERSTORE set:dest set:int16 set:int32 set:int64");
+            benchmark("SINTERSTORE (3 intsets of mixed encodings)",cmd,len);
+            free(cmd);
+            len = redisFormatCommand(&cmd,
+                "SINTERSTORE set:dest set:int16 set:hashtable");
+            benchmark("SINTERSTORE (intset and hashtable)",cmd,len);
+            free(cmd);
+        }
+
+        if (test_is_selected("hget") || test_is_selected("zscore")) {
+            int requests = config.requests;
+
+            /* Populate a hash and a sorted set as big as they can get while
+             * still ziplist encoded with the default configuration. */
+            config.requests = 1;
+            len = redisFormatCommand(&cmd,"EVAL %s 0",
+                "for i=0,255 do "
+                "redis.call('hset','hash:ziplist','field:'..i,i) end "
+                "for i=0,63 do "
+                "redis.call('zadd','zset:ziplist',i,'member:'..i) end");
+            benchmark("HSET (needed to benchmark HGET and ZSCORE)",cmd,len);
+            free(cmd);
+            config.requests = requests;
+
+            if (test_is_selected("hget")) {
+                len = redisFormatCommand(&cmd,
+                    "HGET hash:ziplist field:255");
+                benchmark("HGET (last field of a 256 fields ziplist)",cmd,len);
+                free(cmd);
+            }
+            if (test_is_selected("zscore")) {
+                len = redisFormatCommand(&cmd,
+                    "ZSCORE zset:ziplist member:63");
+                benchmark("ZSCORE (last member of a 64 members ziplist)",
+                    cmd,len);
+                free(cmd);
+            }
+        }
+
+        if (test_is_selected("pfcount")) {
+            const char *argv[11];
+            int requests = config.requests;
+
+            /* Populate 10 dense HyperLogLogs once. */
+            config.requests = 1;
+            len = redisFormatCommand(&cmd,"EVAL %s 0",
+                "for k=0,9 do for i=1,20000,1000 do local t={} "
+                "for j=i,i+999 do t[#t+1]=k..':'..j end "
+                "redis.call('pfadd','hll:'..k,unpack(t)) end end");
+            benchmark("PFADD (needed to benchmark PFCOUNT)",cmd,len);
+            free(cmd);
+            config.requests = requests;
+
+            argv[0] = "PFCOUNT";
+            for (i = 1; i < 11; i++) {
+                static char keys[10][8];
+                snprintf(keys[i-1],sizeof(keys[i-1]),"hll:%d",i-1);
+                argv[i] = keys[i-1];
+            }
+            len = redisFormatCommandArgv(&cmd,11,argv,NULL);
+            benchmark("PFCOUNT (10 keys)",cmd,len);
+            free(cmd);
+        }
+
+        if (test_is_explicitly_selected("bitcount") ||
+            test_is_explicitly_selected("bitpos") ||
+            test_is_explicitly_selected("bitop"))
+        {
+            int requests = config.requests;
+            char title[64];
+
+            /* Create two bitmaps of the configured size: bitmap:rand
+             * repeats a random 1k pattern, bitmap:last only has the last
+             * bit set, so that BITPOS has to scan it all. */
+            config.requests = 1;
+            len = redisFormatCommand(&cmd,"EVAL %s 1 bitmap:rand %lld",
+                "local t={} for i=1,1024 do t[i]=string.char(math.random(0,255)) end "
+                "local p=table.concat(t) local n=tonumber(ARGV[1]) "
+                "local s=string.rep(p,math.floor(n/1024))..string.sub(p,1,n%1024) "
+                "return redis.call('set',KEYS[1],s)",config.bitmapsize);
+            benchmark("SET (needed to benchmark bitmaps)",cmd,len);
+            free(cmd);
+            len = redisFormatCommand(&cmd,"SETBIT bitmap:last %lld 1",
+                config.bitmapsize*8-1);
+            benchmark("SETBIT (needed to benchmark bitmaps)",cmd,len);
+            free(cmd);
+            config.requests = requests;
+
+            if (test_is_selected("bitcount")) {
+                len = redisFormatCommand(&cmd,"BITCOUNT bitmap:rand");
+                snprintf(title,sizeof(title),"BITCOUNT (%lld bytes)",
+                    config.bitmapsize);
+                benchmark(title,cmd,len);
+                free(cmd);
+            }
+            if (test_is_selected("bitpos")) {
+                len = redisFormatCommand(&cmd,"BITPOS bitmap:last 1");
+                snprintf(title,sizeof(title),"BITPOS (%lld bytes)",
+                    config.bitmapsize);
+                benchmark(title,cmd,len);
+                free(cmd);
+            }
+            if (test_is_selected("bitop")) {
+                len = redisFormatCommand(&cmd,
+                    "BITOP AND bitmap:dest bitmap:rand bitmap:last");
+                snprintf(title,sizeof(title),"BITOP AND (%lld bytes)",
+                    config.bitmapsize);
+                benchmark(title,cmd,len);
+                free(cmd);
+            }
+        }
+
         if (test_is_selected("mset")) {
             const char *argv[21];
             argv[0] = "MSET";
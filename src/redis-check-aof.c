@@ -98,14 +98,51 @@ int readArgc(FILE *fp, long *target) {
     return readLong(fp,'*',target);
 }
 
+/* Check a binary record of the pointer based AOF, the record type byte
+ * being already consumed. */
+int readPBARecord(FILE *fp, int *multi) {
+    int dbid, argc, ret, ok = 1;
+    sds *argv;
+
+    epos = ftello(fp)-1;
+    ret = aofReadPBARecord(fp,&dbid,&argc,&argv);
+    if (ret == 0) {
+        ERROR("Truncated binary record");
+        return 0;
+    } else if (ret == -1) {
+        ERROR("Malformed binary record");
+        return 0;
+    }
+    if (strcasecmp(argv[0], "multi") == 0) {
+        if ((*multi)++) {
+            ERROR("Unexpected MULTI");
+            ok = 0;
+        }
+    } else if (strcasecmp(argv[0], "exec") == 0) {
+        if (--(*multi)) {
+            ERROR("Unexpected EXEC");
+            ok = 0;
+        }
+    }
+    while (argc--) sdsfree(argv[argc]);
+    zfree(argv);
+    return ok;
+}
+
 off_t process(FILE *fp) {
     long argc;
     off_t pos = 0;
-    int i, multi = 0;
+    int i, c, multi = 0;
     char *str;
 
     while(1) {
         if (!multi) pos = ftello(fp);
+        if ((c = getc(fp)) == EOF) break;
+        if (c == AOF_PBA_RECORD) {
+            if (!readPBARecord(fp,&multi)) break;
+            continue;
+        }
+        ungetc(c,fp);
         if (!readArgc(fp, &argc)) break;
 
         for (i = 0; i < argc; i++) {
@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "ff93a8ae"
+#define REDIS_GIT_DIRTY "143"
+#define REDIS_BUILD_ID "vm-1792231255"
@@ -48,6 +48,10 @@
 #include "sds.h"
 #include "sdsalloc.h"
 
+/* Passed as 'init' to the sdsnewlen() family, leaves the content
+ * uninitialized for callers that are going to overwrite it anyway. */
+const char *SDS_NOINIT = "SDS_NOINIT";
+
 
 static inline int sdsHdrSize(char type) {
     switch(type&SDS_TYPE_MASK) {
@@ -104,12 +108,19 @@ size_t sdsheadersize(const sds s)
 }
 
 sds sdsmvtonvm(const sds s)
+{
+    return sdsmvtonvmwiththreshold(s, server.sdsmv_threshold);
+}
+
+/* Like sdsmvtonvm() but with an explicit minimum allocation size, used by
+ * the tiering engine to demote cold values whatever their size. */
+sds sdsmvtonvmwiththreshold(const sds s, size_t threshold)
 {
     if(server.nvm_base && !is_nvm_addr(s))
     {
         size_t header_size = sdsheadersize(s);
         size_t total_size = header_size + sdsalloc(s) + 1;
-        if(total_size >= server.sdsmv_threshold)
+        if(total_size >= threshold)
         {
             void* new_sh = nvm_malloc(total_size);
             if(!new_sh)
@@ -119,7 +130,7 @@ sds sdsmvtonvm(const sds s)
             }
             void* sh = s - header_size;
             size_t used_size = header_size + sdslen(s) + 1;
-            pmem_memcpy_persist(new_sh, sh, used_size);
+            nvm_bulk_copy(new_sh, sh, used_size);
             zfree(sh);
             return (char*)new_sh + header_size;
         }
@@ -148,7 +159,43 @@ sds sdsmvtodram(const sds s)
     return s;
 }
 
-sds sdsnewlennvm(const void *init, size_t initlen) {
+/* Move 's' to NVM if the placement policy of 'cls' asks for it. */
+sds sdsmvtonvmplaced(const sds s, int cls)
+{
+    sds d;
+    size_t total_size;
+
+    if(is_nvm_addr(s))
+        return s;
+    total_size = sdsheadersize(s) + sdsalloc(s) + 1;
+    d = nvm_place(cls, total_size) ? sdsmvtonvmwiththreshold(s, 0) : s;
+    nvm_placed(cls, d, total_size);
+    return d;
+}
+
+/* Return a copy of 's' on NVM if the placement policy of 'cls' asks for it,
+ * or 's' itself. Ziplists can only reference strings living on NVM, so the
+ * callers store 's' inline when they get it back. */
+sds sdsplacezlentry(const sds s, int cls)
+{
+    size_t len = sdslen(s);
+
+    if(nvm_place(cls, len))
+    {
+        sds e = sdsnewlenplaced(s, len, cls);
+        if(is_nvm_addr(e))
+            return e;
+        sdsfree(e); /* NVM is full, already accounted as DRAM. */
+        return s;
+    }
+    nvm_placed(cls, s, len);
+    return s;
+}
+
+/* Create a new sds string on NVM when 'cls' is a placement class whose
+ * policy asks for it, or when 'cls' is -1 and the allocation is larger than
+ * nvm-threshold. Falls back to DRAM when NVM is full. */
+static sds _sdsnewlennvm(const void *init, size_t initlen, int cls) {
     void *sh;
     sds s;
     char type = sdsReqType(initlen);
@@ -158,12 +205,21 @@ sds sdsnewlennvm(const void *init, size_t initlen) {
     int hdrlen = sdsHdrSize(type);
     unsigned char *fp; /* flags pointer. */
 
-    sh = s_malloc_nvm(hdrlen+initlen+1);
+    if (cls == -1) {
+        sh = s_malloc_nvm(hdrlen+initlen+1);
+    } else {
+        sh = nvm_place(cls, hdrlen+initlen+1) ?
+             nvm_malloc(hdrlen+initlen+1) : NULL;
+        if (sh == NULL) sh = s_malloc(hdrlen+initlen+1);
+        if (sh != NULL) nvm_placed(cls, sh, hdrlen+initlen+1);
+    }
     if (sh == NULL) return NULL;
 #ifdef FAST_SDSFREE
     serverAssert(((size_t)sh & 7) == 0);
 #endif
-    if (!init)
+    if (init == SDS_NOINIT)
+        init = NULL;
+    else if (!init)
         memset(sh, 0, hdrlen+initlen+1);
     s = (char*)sh+hdrlen;
     fp = ((unsigned char*)s)-1;
@@ -207,11 +263,24 @@ sds sdsnewlennvm(const void *init, size_t initlen) {
     return s;
 }
 
+sds sdsnewlennvm(const void *init, size_t initlen) {
+    return _sdsnewlennvm(init, initlen, -1);
+}
+
+sds sdsnewlenplaced(const void *init, size_t initlen, int cls) {
+    return _sdsnewlennvm(init, initlen, cls);
+}
+
 /* Duplicate an sds string. */
 sds sdsdupnvm(const sds s) {
     return sdsnewlennvm(s, sdslen(s));
 }
 
+/* Duplicate an sds string on the tier asked by placement class 'cls'. */
+sds sdsdupplaced(const sds s, int cls) {
+    return sdsnewlenplaced(s, sdslen(s), cls);
+}
+
 #endif
 
 /* Create a new sds string with the content specified by the 'init' pointer
@@ -237,7 +306,9 @@ sds sdsnewlen(const void *init, size_t initlen) {
     unsigned char *fp; /* flags pointer. */
 
     sh = s_malloc(hdrlen+initlen+1);
-    if (!init)
+    if (init == SDS_NOINIT)
+        init = NULL;
+    else if (!init)
         memset(sh, 0, hdrlen+initlen+1);
     if (sh == NULL) return NULL;
     s = (char*)sh+hdrlen;
@@ -35,6 +35,7 @@
 #define __SDS_H
 
 #define SDS_MAX_PREALLOC (1024*1024)
+extern const char *SDS_NOINIT;
 
 #include <sys/types.h>
 #include <stdarg.h>
@@ -89,6 +90,24 @@ struct __attribute__ ((__packed__)) sdshdr64 {
 #define SDS_HDR_VAR(T,s) struct sdshdr##T *sh = (void*)((s)-(sizeof(struct sdshdr##T)));
 #define SDS_HDR(T,s) ((struct sdshdr##T *)((s)-(sizeof(struct sdshdr##T))))
 #define SDS_TYPE_5_LEN(f) ((f)>>SDS_TYPE_BITS)
+/* Flag of the non type 5 headers: the string is part of a bigger allocation
+ * it doesn't own (see createKeyedStringObject()) and is never freed alone. */
+#define SDS_HOSTED (1<<SDS_TYPE_BITS)
+
+/* Flag of the non type 5 headers: the string holds a reference to an object
+ * queued in a client reply list in place of a copy of it (see
+ * createReplyRef()), and should not be sent or modified as it is. */
+#define SDS_REF (2<<SDS_TYPE_BITS)
+
+static inline int sdsIsHosted(const sds s) {
+    unsigned char flags = s[-1];
+    return (flags&SDS_TYPE_MASK) != SDS_TYPE_5 && (flags&SDS_HOSTED);
+}
+
+static inline int sdsIsRef(const sds s) {
+    unsigned char flags = s[-1];
+    return (flags&SDS_TYPE_MASK) != SDS_TYPE_5 && (flags&SDS_REF);
+}
 
 static inline size_t sdslen(const sds s) {
     unsigned char flags = s[-1];
@@ -224,10 +243,15 @@ static inline void sdssetalloc(sds s, size_t newlen) {
 #ifdef USE_NVM
 size_t sdsheadersize(const sds s);
 sds sdsmvtonvm(const sds s);
+sds sdsmvtonvmwiththreshold(const sds s, size_t threshold);
 sds sdsmvtodram(const sds s);
 
 sds sdsnewlennvm(const void *init, size_t initlen);
 sds sdsdupnvm(const sds s);
+sds sdsnewlenplaced(const void *init, size_t initlen, int cls);
+sds sdsdupplaced(const sds s, int cls);
+sds sdsmvtonvmplaced(const sds s, int cls);
+sds sdsplacezlentry(const sds s, int cls);
 #endif
 
 sds sdsnewlen(const void *init, size_t initlen);
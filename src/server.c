@@ -487,6 +487,15 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+/* Keyspace keys may be embedded in their value, that owns them. */
+void dictDbKeyDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if (sdsIsHosted(val)) return;
+    sdsfree(val);
+}
+
 int dictObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
@@ -585,8 +594,11 @@ dictType dbDictType = {
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    dictDbKeyDestructor,        /* key destructor */
+    dictObjectDestructor,       /* val destructor */
+#ifdef USE_OA_KEYSPACE
+    1                           /* open addressing */
+#endif
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -744,7 +756,8 @@ int incrementallyRehash(int dbid) {
  * for dict.c to resize the hash tables accordingly to the fact we have o not
  * running childs. */
 void updateDictResizePolicy(void) {
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        !server.rdb_threaded_in_progress)
         dictEnableResize();
     else
         dictDisableResize();
@@ -892,10 +905,18 @@ void databasesCron(void) {
     if (server.active_defrag_enabled)
         activeDefragCycle();
 
+#ifdef USE_NVM
+    /* Move values between DRAM and NVM according to their hotness. */
+    nvmTieringCycle();
+#endif
+
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
-     * as will cause a lot of copy-on-write of memory pages. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+     * as will cause a lot of copy-on-write of memory pages. A threaded save
+     * needs keys to stay in their buckets as well. */
+    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
+        !server.rdb_threaded_in_progress)
+    {
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1036,6 +1057,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* We need to do a few operations on clients asynchronously. */
     clientsCron();
 
+    /* Give back to the allocator the reply chunks that were not needed in
+     * the last 10 seconds. */
+    run_with_period(10000) trimReplyChunkPool();
+
     /* Handle background operations on Redis databases. */
     databasesCron();
 
@@ -1047,6 +1072,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         rewriteAppendOnlyFileBackground();
     }
 
+    /* A threaded BGSAVE is served by the main thread in small steps. */
+    if (server.rdb_threaded_in_progress) rdbThreadedSaveCron();
+
     /* Check if a background saving or AOF rewrite in progress terminated. */
     if (server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
         ldbPendingChildren())
@@ -1082,7 +1110,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             updateDictResizePolicy();
             closeChildInfoPipe();
         }
-    } else {
+    } else if (!server.rdb_threaded_in_progress) {
         /* If there is not a background saving/rewrite in progress check if
          * we have to save/rewrite now */
          for (j = 0; j < server.saveparamslen; j++) {
@@ -1168,7 +1196,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * make sure when refactoring this file to keep this order. This is useful
      * because we want to give priority to RDB savings for replication. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-        server.rdb_bgsave_scheduled &&
+        !server.rdb_threaded_in_progress && server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
     {
@@ -1195,6 +1223,11 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     }
 #endif
 
+#ifdef AEP_COW
+    /* Release NVM blocks the last RDB child could still have been reading. */
+    nvm_cow_drain();
+#endif
+
     server.cronloops++;
     return 1000/server.hz;
 }
@@ -1205,6 +1238,10 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 void beforeSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    /* Read and execute the commands of the clients whose reads were deferred
+     * to the I/O threads during the last event loop iteration. */
+    handleClientsWithPendingReadsUsingThreads();
+
     /* Call the Redis Cluster before sleep function. Note that this function
      * may change the state of Redis Cluster (from ok to fail or vice versa),
      * so it's a good idea to call it before serving the unblocked clients
@@ -1248,7 +1285,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
-    handleClientsWithPendingWrites();
+    handleClientsWithPendingWritesUsingThreads();
 
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
@@ -1381,6 +1418,7 @@ void initServerConfig(void) {
     server.ipfd_count = 0;
     server.sofd = -1;
     server.protected_mode = CONFIG_DEFAULT_PROTECTED_MODE;
+    server.io_threads_num = CONFIG_DEFAULT_IO_THREADS_NUM;
     server.dbnum = CONFIG_DEFAULT_DBNUM;
     server.verbosity = CONFIG_DEFAULT_VERBOSITY;
     server.maxidletime = CONFIG_DEFAULT_CLIENT_TIMEOUT;
@@ -1441,9 +1479,15 @@ void initServerConfig(void) {
     server.hash_max_ziplist_value = OBJ_HASH_MAX_ZIPLIST_VALUE;
     server.list_max_ziplist_size = OBJ_LIST_MAX_ZIPLIST_SIZE;
     server.list_compress_depth = OBJ_LIST_COMPRESS_DEPTH;
+    server.list_compress_codec = OBJ_LIST_COMPRESS_CODEC;
+    server.list_compress_cache_size = OBJ_LIST_COMPRESS_CACHE_SIZE;
     server.set_max_intset_entries = OBJ_SET_MAX_INTSET_ENTRIES;
     server.zset_max_ziplist_entries = OBJ_ZSET_MAX_ZIPLIST_ENTRIES;
     server.zset_max_ziplist_value = OBJ_ZSET_MAX_ZIPLIST_VALUE;
+    server.zset_encoding = OBJ_ZSET_ENCODING;
+    server.ziplist_index_cache_size = OBJ_ZIPLIST_INDEX_CACHE_SIZE;
+    server.ziplist_index_min_entries = OBJ_ZIPLIST_INDEX_MIN_ENTRIES;
+    server.embed_string_keys = OBJ_EMBED_STRING_KEYS;
     server.hll_sparse_max_bytes = CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES;
     server.shutdown_asap = 0;
     server.cluster_enabled = 0;
@@ -1531,6 +1575,7 @@ void initServerConfig(void) {
     server.execCommand = lookupCommandByCString("exec");
     server.expireCommand = lookupCommandByCString("expire");
     server.pexpireCommand = lookupCommandByCString("pexpire");
+    aofCheckPBACommands();
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -1552,6 +1597,15 @@ void initServerConfig(void) {
     server.nvm_size = 0;
     server.pmem_kind = NULL;
     server.sdsmv_threshold = 0;
+    for (j = 0; j < NVM_CLASS_COUNT; j++) {
+        server.nvm_placement[j].threshold = NVM_THRESHOLD_DEFAULT;
+        server.nvm_placement[j].pin = NVM_PIN_NONE;
+    }
+    server.nvm_tiering_enabled = CONFIG_DEFAULT_NVM_TIERING;
+    server.nvm_tiering_dram_budget = CONFIG_DEFAULT_NVM_TIERING_DRAM_BUDGET;
+    server.nvm_tiering_max_bandwidth = CONFIG_DEFAULT_NVM_TIERING_MAX_BANDWIDTH;
+    server.nvm_tiering_promote_freq = CONFIG_DEFAULT_NVM_TIERING_PROMOTE_FREQ;
+    server.nvm_tiering_demote_freq = CONFIG_DEFAULT_NVM_TIERING_DEMOTE_FREQ;
 #endif
 
 #ifdef FAST_SDSFREE
@@ -1570,6 +1624,7 @@ void initServerConfig(void) {
 #ifdef SUPPORT_PBA
     server.pba.enable = 0;
     server.pba.loading = 0;
+    server.pba.pool_valid = 0;
     server.pba.setCommand = lookupCommandByCString("SET");
     server.pba.saddCommand = lookupCommandByCString("SADD");
     server.pba.hsetCommand = lookupCommandByCString("HSET");
@@ -1581,12 +1636,17 @@ void initServerConfig(void) {
     server.pba.free_head = 0;
     server.pba.free_tail = 0;
     server.pba.jemallocat = 0;
-    server.pba.move_list = 0;
     server.pba.defrag_debug = 0;
+    server.pba.resolve_threads = CONFIG_DEFAULT_PBA_RESOLVE_THREADS;
+    server.pba.resolve_phase = PBA_RESOLVE_NONE;
+    server.pba.resolve_done = 0;
+    server.pba.resolve_total = 0;
+    pthread_mutex_init(&server.pba.resolve_done_mutex,NULL);
 #endif
 
 #ifdef USE_AOFGUARD
     server.aofguard.enable = 0;
+    server.aofguard.block_size = CONFIG_DEFAULT_AOFGUARD_BLOCK_SIZE;
 #endif
 }
 
@@ -1834,6 +1894,16 @@ void resetServerStats(void) {
     server.stat_active_defrag_misses = 0;
     server.stat_active_defrag_key_hits = 0;
     server.stat_active_defrag_key_misses = 0;
+    quicklistCacheResetStats();
+    ziplistIndexResetStats();
+#ifdef USE_NVM
+    memset(server.stat_nvm_placed_total,0,sizeof(server.stat_nvm_placed_total));
+    server.stat_nvm_tiering_promotions = 0;
+    server.stat_nvm_tiering_promoted_bytes = 0;
+    server.stat_nvm_tiering_demotions = 0;
+    server.stat_nvm_tiering_demoted_bytes = 0;
+    server.stat_nvm_tiering_throttled = 0;
+#endif
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
@@ -1849,6 +1919,18 @@ void resetServerStats(void) {
     }
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
+    server.stat_net_output_syscalls = 0;
+    server.stat_zero_copy_replies = 0;
+    server.stat_zero_copy_reply_bytes = 0;
+    server.stat_reply_chunks_reused = 0;
+    server.stat_reply_chunks_allocated = 0;
+    memset(server.stat_io_reads_processed,0,
+        sizeof(server.stat_io_reads_processed));
+    memset(server.stat_io_writes_processed,0,
+        sizeof(server.stat_io_writes_processed));
+    memset(server.stat_io_bytes_read,0,sizeof(server.stat_io_bytes_read));
+    memset(server.stat_io_bytes_written,0,
+        sizeof(server.stat_io_bytes_written));
     server.aof_delayed_fsync = 0;
 }
 
@@ -1866,7 +1948,40 @@ void allocateNVMSpace(void) {
         exit(1);
     }
     server.nvm_base = memkind_base_addr(server.pmem_kind);
-    zmalloc_get_nvm_config(server.sdsmv_threshold,server.pmem_kind); 
+    zmalloc_get_nvm_config(server.sdsmv_threshold,server.pmem_kind);
+
+    /* The pool file survives restarts: its root tells us whether what the
+     * previous run left there can be referenced again. */
+    char rootpath[PATH_MAX];
+    snprintf(rootpath, sizeof(rootpath), "%s/%s.root", server.nvm_dir, filename);
+    int state = nvm_root_open(rootpath, server.nvm_size);
+    if (state == -1) {
+        serverLog(LL_WARNING, "Can't map the NVM pool root '%s': %s",
+            rootpath, strerror(errno));
+        exit(1);
+    }
+    serverLog(LL_NOTICE, "NVM pool %s/%s: %s (commit %llu)", server.nvm_dir,
+        filename, nvm_root_state_name(state),
+        (unsigned long long)nvm_root_seq());
+}
+
+/* Record in the pool root how the pool may be referenced from now on. This
+ * is called once the dataset is loaded, and again with NVM_ROOT_F_CLEAN on
+ * shutdown. A shutdown before the load, and the PBA references resolution
+ * that is part of it, completed is not clean: the pool is in the middle of
+ * being rebuilt. */
+void commitNVMRoot(int clean) {
+    uint64_t flags = 0;
+
+    if (!server.nvm_base) return;
+    if (server.loading) clean = 0;
+#ifdef SUPPORT_PBA
+    if (server.pba.enable) flags |= NVM_ROOT_F_PBA;
+    if (server.pba.loading || server.pba.resolve_phase != PBA_RESOLVE_NONE)
+        clean = 0;
+#endif
+    if (clean) flags |= NVM_ROOT_F_CLEAN;
+    nvm_root_commit(flags);
 }
 #endif
 
@@ -1875,23 +1990,21 @@ void allocateNVMSpace(void) {
 void * redisduplicatenvmaddr(void *addr) {
     void * nvm_addr=addr;
     size_t size;
-    if(server.rdb_child_pid != -1 && 
-    is_nvm_addr(addr) && !cow_isnvmaddrindict(server.forked_dict,addr)) {
+    if(cow_isactive() && is_nvm_addr(addr) && !cow_isforkedaddr(addr)) {
         void * dupaddr=NULL;    
         size= jemk_malloc_usable_size(addr);
         dupaddr = nvm_malloc(size);
         if(!dupaddr) {
             dupaddr=zmalloc(size);  
             memcpy(dupaddr,addr, size);
-            server.cow_mem_size +=size;
+            atomicIncr(server.cow_mem_size,size);
         }else {
             //pmem_memcpy_persist(dupaddr, addr, size);
             pmem_memcpy(dupaddr, addr, size,PMEM_F_MEM_NOFLUSH);
-            cow_addaddressindict(server.forked_dict, dupaddr);
-            server.cow_nvm_size +=size;
+            atomicIncr(server.cow_nvm_size,size);
         }
         assert(dupaddr != NULL);
-        cow_addaddressindict(server.cow_dict,addr);
+        cow_deferfree(addr);
         nvm_addr=dupaddr;
     }
     return nvm_addr;
@@ -1917,6 +2030,7 @@ void initServer(void) {
     server.slaves = listCreate();
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
+    server.clients_pending_read = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
@@ -1970,11 +2084,6 @@ void initServer(void) {
         server.db[j].avg_ttl = 0;
     }
 
-#ifdef AEP_COW
-    server.forked_dict = cow_createforknvmdict();
-    server.cow_dict = cow_createcownvmdict();
-#endif
-
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
@@ -1982,6 +2091,7 @@ void initServer(void) {
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
     server.cronloops = 0;
     server.rdb_child_pid = -1;
+    server.rdb_threaded_in_progress = 0;
     server.aof_child_pid = -1;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_bgsave_scheduled = 0;
@@ -2000,7 +2110,14 @@ void initServer(void) {
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
     server.stat_rdb_cow_bytes = 0;
+    server.stat_rdb_threaded_cow_bytes = 0;
     server.stat_aof_cow_bytes = 0;
+#ifdef USE_NVM
+    server.stat_rdb_nvm_bytes_streamed = 0;
+    server.stat_rdb_nvm_bytes_materialized = 0;
+    pthread_mutex_init(&server.stat_rdb_nvm_bytes_streamed_mutex,NULL);
+    pthread_mutex_init(&server.stat_rdb_nvm_bytes_materialized_mutex,NULL);
+#endif
     server.resident_set_size = 0;
     server.lastbgsave_status = C_OK;
     server.aof_last_write_status = C_OK;
@@ -2053,7 +2170,7 @@ void initServer(void) {
         {
             server.aofguard.aofguard = zmalloc(sizeof(struct aofguard));
             if(!aofguard_init(server.aofguard.aofguard, server.aof_fd, server.aofguard.nvm_dir_fd,
-                server.aofguard.nvm_file_name, AOFGUARD_NVM_SIZE, 0))
+                server.aofguard.nvm_file_name, AOFGUARD_NVM_SIZE, server.aofguard.block_size, 0))
             {
                 serverLog(LL_WARNING, "aofguard_init() for '%s/%s' failed!", server.nvm_dir, server.aofguard.nvm_file_name);
                 exit(1);
@@ -2077,7 +2194,12 @@ void initServer(void) {
     scriptingInit(1);
     slowlogInit();
     latencyMonitorInit();
+    quicklistCacheInit();
+    ziplistIndexInit();
+    ziplistIndexSetLimits(server.ziplist_index_cache_size,
+                          server.ziplist_index_min_entries);
     bioInit();
+    initThreadedIO();
     server.initial_memory_usage = zmalloc_used_memory();
 #ifdef USE_NVM
     allocateNVMSpace();
@@ -2658,6 +2780,7 @@ int prepareForShutdown(int flags) {
         kill(server.rdb_child_pid,SIGUSR1);
         rdbRemoveTempFile(server.rdb_child_pid);
     }
+    rdbThreadedSaveAbort();
 
     if (server.aof_state != AOF_OFF) {
         /* Kill the AOF saving child as the AOF we already have may be longer
@@ -2675,6 +2798,11 @@ int prepareForShutdown(int flags) {
         }
         /* Append only file: fsync() the AOF and exit */
         serverLog(LL_NOTICE,"Calling fsync() on the AOF file.");
+#ifdef USE_AOFGUARD
+        /* Leave the file complete, not just the NVM ring. */
+        if(server.aofguard.enable && !aofguard_flush(server.aofguard.aofguard))
+            serverLog(LL_WARNING, "aofguard_flush() failed!");
+#endif
         aof_fsync(server.aof_fd);
     }
 
@@ -2705,6 +2833,9 @@ int prepareForShutdown(int flags) {
 
     /* Close the listening sockets. Apparently this allows faster restarts. */
     closeListeningSockets(1);
+#ifdef USE_NVM
+    commitNVMRoot(1);
+#endif
     serverLog(LL_WARNING,"%s is now ready to exit, bye bye...",
         server.sentinel_mode ? "Sentinel" : "Redis");
     return C_OK;
@@ -2928,6 +3059,19 @@ void bytesToHuman(char *s, unsigned long long n) {
     }
 }
 
+/* Append to 'info' the number of live allocations on 'tier' by size class,
+ * as <upper bound in bytes>=<count> pairs. */
+sds genAllocHistogramInfoString(sds info, const char *tier_name, int tier) {
+    size_t hist[ZMALLOC_HIST_BUCKETS];
+    int j;
+
+    zmalloc_tier_histogram(tier,hist);
+    info = sdscatprintf(info,"alloc_size_hist_%s:",tier_name);
+    for (j = 0; j < ZMALLOC_HIST_BUCKETS-1; j++)
+        info = sdscatprintf(info,"%llu=%zu,",8ULL<<j,hist[j]);
+    return sdscatprintf(info,"inf=%zu\r\n",hist[j]);
+}
+
 /* Create the string returned by the INFO command. This is decoupled
  * by the INFO command itself as we need to report the same information
  * on memory corruption problems. */
@@ -3116,7 +3260,10 @@ sds genRedisInfoString(char *section) {
             "mem_fragmentation_ratio:%.2f\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "keyed_objects:%zu\r\n"
+            "keyed_objects_memory:%zu\r\n"
+            "reply_chunk_pool_bytes:%zu\r\n",
 #ifdef USE_NVM
             nvm_used,
             nvm_used_hmem,
@@ -3150,8 +3297,33 @@ sds genRedisInfoString(char *section) {
             mh->fragmentation,
             ZMALLOC_LIB,
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            keyedObjectsCount(),
+            keyedObjectsMemory(),
+            replyChunkPoolMemory()
         );
+#ifdef USE_NVM
+        /* Bytes ever placed on each tier by placement class. */
+        if (server.nvm_base) {
+            int class;
+
+            for (class = 0; class < NVM_CLASS_COUNT; class++) {
+                char name[32], *p;
+
+                snprintf(name,sizeof(name),"%s",nvm_placement_class_name(class));
+                for (p = name; *p; p++) if (*p == '-') *p = '_';
+                info = sdscatprintf(info,
+                    "nvm_%s_placed_total:dram=%llu,nvm=%llu\r\n", name,
+                    server.stat_nvm_placed_total[class][0],
+                    server.stat_nvm_placed_total[class][1]);
+            }
+        }
+#endif
+        info = genAllocHistogramInfoString(info,"dram",ZMALLOC_TIER_DRAM);
+#ifdef USE_NVM
+        if (server.nvm_base)
+            info = genAllocHistogramInfoString(info,"nvm",ZMALLOC_TIER_NVM);
+#endif
         freeMemoryOverheadData(mh);
     }
 
@@ -3168,8 +3340,12 @@ sds genRedisInfoString(char *section) {
             "rdb_last_bgsave_time_sec:%jd\r\n"
             "rdb_current_bgsave_time_sec:%jd\r\n"
             "rdb_last_cow_size:%zu\r\n"
+            "rdb_threaded_bgsave_in_progress:%d\r\n"
+            "rdb_threaded_saved_perc:%.2f\r\n"
+            "rdb_threaded_cow_bytes:%zu\r\n"
 #ifdef AEP_COW            
 	    "rdb_last_nvm_cow_size:%zu\r\n"
+            "rdb_nvm_cow_pending_frees:%zu\r\n"
 #endif            
 	    "aof_enabled:%d\r\n"
             "aof_rewrite_in_progress:%d\r\n"
@@ -3178,18 +3354,28 @@ sds genRedisInfoString(char *section) {
             "aof_current_rewrite_time_sec:%jd\r\n"
             "aof_last_bgrewrite_status:%s\r\n"
             "aof_last_write_status:%s\r\n"
-            "aof_last_cow_size:%zu\r\n",
+            "aof_last_cow_size:%zu\r\n"
+            "last_load_keys:%lld\r\n"
+            "last_load_time_ms:%lld\r\n"
+            "last_load_keys_per_sec:%lld\r\n",
             server.loading,
             server.dirty,
-            server.rdb_child_pid != -1,
+            server.rdb_child_pid != -1 || server.rdb_threaded_in_progress,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.rdb_child_pid == -1) ?
+            (intmax_t)((server.rdb_child_pid == -1 &&
+                        !server.rdb_threaded_in_progress) ?
                 -1 : time(NULL)-server.rdb_save_time_start),
             server.stat_rdb_cow_bytes,
+            server.rdb_threaded_in_progress,
+            (server.rdb_threaded_in_progress && server.rdb_threaded_buckets) ?
+                (double)server.rdb_threaded_buckets_saved*100/
+                        server.rdb_threaded_buckets : 100.0,
+            server.stat_rdb_threaded_cow_bytes,
 #ifdef AEP_COW      
       	    server.last_nvm_cow_size,
+            cow_pendingfrees(),
 #endif            
 	    server.aof_state != AOF_OFF,
             server.aof_child_pid != -1,
@@ -3199,7 +3385,11 @@ sds genRedisInfoString(char *section) {
                 -1 : time(NULL)-server.aof_rewrite_time_start),
             (server.aof_lastbgrewrite_status == C_OK) ? "ok" : "err",
             (server.aof_last_write_status == C_OK) ? "ok" : "err",
-            server.stat_aof_cow_bytes);
+            server.stat_aof_cow_bytes,
+            server.stat_last_load_keys,
+            server.stat_last_load_time_ms,
+            server.stat_last_load_keys*1000/
+                (server.stat_last_load_time_ms ? server.stat_last_load_time_ms : 1));
 
         if (server.aof_state != AOF_OFF) {
             info = sdscatprintf(info,
@@ -3219,6 +3409,30 @@ sds genRedisInfoString(char *section) {
                 server.aof_delayed_fsync);
         }
 
+#ifdef USE_NVM
+        if (server.nvm_base) {
+            size_t streamed, materialized;
+
+            atomicGet(server.stat_rdb_nvm_bytes_streamed,streamed);
+            atomicGet(server.stat_rdb_nvm_bytes_materialized,materialized);
+            info = sdscatprintf(info,
+                "nvm_pool_validity:%s\r\n"
+                "nvm_pool_commit_seq:%llu\r\n"
+                "last_load_nvm_bytes:%zu\r\n"
+                "last_load_nvm_mb_per_sec:%.2f\r\n"
+                "rdb_nvm_bytes_streamed:%zu\r\n"
+                "rdb_nvm_bytes_materialized:%zu\r\n",
+                nvm_root_state_name(nvm_root_state()),
+                (unsigned long long)nvm_root_seq(),
+                server.stat_last_load_nvm_bytes,
+                (double)server.stat_last_load_nvm_bytes/(1024*1024)*1000/
+                    (server.stat_last_load_time_ms ?
+                     server.stat_last_load_time_ms : 1),
+                streamed,
+                materialized);
+        }
+#endif
+
         if (server.loading) {
             double perc;
             time_t eta, elapsed;
@@ -3249,10 +3463,33 @@ sds genRedisInfoString(char *section) {
                 (intmax_t)eta
             );
         }
+#ifdef SUPPORT_PBA
+        if (server.loading && server.pba.resolve_phase != PBA_RESOLVE_NONE) {
+            unsigned long long done;
+
+            atomicGet(server.pba.resolve_done,done);
+            info = sdscatprintf(info,
+                "loading_pba_phase:%s\r\n"
+                "loading_pba_done:%llu\r\n"
+                "loading_pba_total:%llu\r\n"
+                "loading_pba_perc:%.2f\r\n",
+                server.pba.resolve_phase == PBA_RESOLVE_KEYS ?
+                    "resolve" : "move",
+                done,
+                server.pba.resolve_total,
+                server.pba.resolve_total ?
+                    (double)done*100/server.pba.resolve_total : 100.0);
+        }
+#endif
     }
 
     /* Stats */
     if (allsections || defsections || !strcasecmp(section,"stats")) {
+        size_t qlcache_used, zlindex_used;
+        long long qlcache_hits, qlcache_misses, zlindex_hits, zlindex_misses;
+
+        quicklistCacheGetStats(&qlcache_used,&qlcache_hits,&qlcache_misses);
+        ziplistIndexGetStats(&zlindex_used,&zlindex_hits,&zlindex_misses);
         if (sections++) info = sdscat(info,"\r\n");
         info = sdscatprintf(info,
             "# Stats\r\n"
@@ -3261,6 +3498,12 @@ sds genRedisInfoString(char *section) {
             "instantaneous_ops_per_sec:%lld\r\n"
             "total_net_input_bytes:%lld\r\n"
             "total_net_output_bytes:%lld\r\n"
+            "total_net_output_syscalls:%lld\r\n"
+            "net_output_syscalls_per_byte:%.6f\r\n"
+            "zero_copy_replies:%lld\r\n"
+            "zero_copy_reply_bytes:%lld\r\n"
+            "reply_chunks_reused:%lld\r\n"
+            "reply_chunks_allocated:%lld\r\n"
             "instantaneous_input_kbps:%.2f\r\n"
             "instantaneous_output_kbps:%.2f\r\n"
             "rejected_connections:%lld\r\n"
@@ -3279,12 +3522,26 @@ sds genRedisInfoString(char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "list_compress_cache_bytes:%zu\r\n"
+            "list_compress_cache_hits:%lld\r\n"
+            "list_compress_cache_misses:%lld\r\n"
+            "ziplist_index_bytes:%zu\r\n"
+            "ziplist_index_hits:%lld\r\n"
+            "ziplist_index_misses:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
             server.stat_net_input_bytes,
             server.stat_net_output_bytes,
+            server.stat_net_output_syscalls,
+            server.stat_net_output_bytes ?
+                (double)server.stat_net_output_syscalls/
+                        server.stat_net_output_bytes : 0,
+            server.stat_zero_copy_replies,
+            server.stat_zero_copy_reply_bytes,
+            server.stat_reply_chunks_reused,
+            server.stat_reply_chunks_allocated,
             (float)getInstantaneousMetric(STATS_METRIC_NET_INPUT)/1024,
             (float)getInstantaneousMetric(STATS_METRIC_NET_OUTPUT)/1024,
             server.stat_rejected_conn,
@@ -3303,7 +3560,56 @@ sds genRedisInfoString(char *section) {
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            qlcache_used,
+            qlcache_hits,
+            qlcache_misses,
+            zlindex_used,
+            zlindex_hits,
+            zlindex_misses);
+        {
+            long long reads = 0, writes = 0;
+            for (j = 0; j < server.io_threads_num; j++) {
+                reads += server.stat_io_reads_processed[j];
+                writes += server.stat_io_writes_processed[j];
+            }
+            info = sdscatprintf(info,
+                "io_threads_active:%d\r\n"
+                "io_threaded_reads_processed:%lld\r\n"
+                "io_threaded_writes_processed:%lld\r\n",
+                server.io_threads_active, reads, writes);
+            for (j = 0; server.io_threads_num > 1 &&
+                        j < server.io_threads_num; j++)
+            {
+                info = sdscatprintf(info,
+                    "io_thread_%d:reads_processed=%lld,"
+                    "writes_processed=%lld,bytes_read=%lld,"
+                    "bytes_written=%lld\r\n",
+                    j,
+                    server.stat_io_reads_processed[j],
+                    server.stat_io_writes_processed[j],
+                    server.stat_io_bytes_read[j],
+                    server.stat_io_bytes_written[j]);
+            }
+        }
+#ifdef USE_NVM
+        if (server.nvm_base) {
+            info = sdscatprintf(info,
+                "nvm_tiering_active:%d\r\n"
+                "nvm_tiering_promotions:%lld\r\n"
+                "nvm_tiering_promoted_bytes:%lld\r\n"
+                "nvm_tiering_demotions:%lld\r\n"
+                "nvm_tiering_demoted_bytes:%lld\r\n"
+                "nvm_tiering_throttled_cycles:%lld\r\n",
+                server.nvm_tiering_enabled &&
+                    (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) ? 1 : 0,
+                server.stat_nvm_tiering_promotions,
+                server.stat_nvm_tiering_promoted_bytes,
+                server.stat_nvm_tiering_demotions,
+                server.stat_nvm_tiering_demoted_bytes,
+                server.stat_nvm_tiering_throttled);
+        }
+#endif
     }
 
     /* Replication */
@@ -3869,6 +4175,8 @@ int main(int argc, char **argv) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
             return crc64Test(argc, argv);
+        } else if (!strcasecmp(argv[2], "dict")) {
+            return dictTest(argc, argv);
         }
 
         return -1; /* test not found */
@@ -4016,6 +4324,9 @@ int main(int argc, char **argv) {
     #endif
         moduleLoadFromQueue();
         loadDataFromDisk();
+#ifdef USE_NVM
+        commitNVMRoot(0);
+#endif
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -79,6 +79,30 @@ typedef long long mstime_t; /* millisecond time type. */
 #include <memkind.h>
 
 #define IS_EMBED_IN_ZIPLIST(p, zl) ((char*)(zl) < (char*)(p) && (char*)(p) < (char*)(zl) + ziplistBlobLen(zl))
+
+/* NVM placement classes. Every kind of allocation that may be moved to NVM
+ * has its own placement policy (nvm-placement), see nvm_place(). */
+#define NVM_CLASS_KEY           0
+#define NVM_CLASS_STRING        1
+#define NVM_CLASS_HASH_FIELD    2
+#define NVM_CLASS_HASH_VALUE    3
+#define NVM_CLASS_SET_MEMBER    4
+#define NVM_CLASS_ZSET_MEMBER   5
+#define NVM_CLASS_LIST_ELEMENT  6
+#define NVM_CLASS_LIST_NODE     7   /* Plain quicklist ziplist. */
+#define NVM_CLASS_LZF_NODE      8   /* Compressed quicklist ziplist. */
+#define NVM_CLASS_COUNT         9
+
+#define NVM_PIN_NONE            0   /* Place by size. */
+#define NVM_PIN_DRAM            1
+#define NVM_PIN_NVM             2
+
+#define NVM_THRESHOLD_DEFAULT   -1  /* Follow nvm-threshold. */
+
+typedef struct nvmPlacementPolicy {
+    long long threshold;    /* Min size to go to NVM or NVM_THRESHOLD_DEFAULT. */
+    int pin;                /* NVM_PIN_* */
+} nvmPlacementPolicy;
 #endif
 
 #ifdef AEP_COW
@@ -95,12 +119,28 @@ typedef long long mstime_t; /* millisecond time type. */
 #define FREE_LIST_DELAY_MS      1000
 
 #define IS_PBA() (server.aof_state == AOF_ON && server.pba.enable)
+
+/* Steps of resolvePBA(), reported in INFO while loading. */
+#define PBA_RESOLVE_NONE        0
+#define PBA_RESOLVE_KEYS        1   /* Resolving '@' references. */
+#define PBA_RESOLVE_MOVE        2   /* Moving big values to NVM. */
+
+#define CONFIG_DEFAULT_PBA_RESOLVE_THREADS 4
+
+/* A DRAM value resolvePBA() moves to NVM once the pool is rebuilt. */
+struct move_list
+{
+    void* ptr;
+    size_t offset;
+    struct move_list* next;
+};
 #endif
 
 #ifdef USE_AOFGUARD
 #include <aofguard.h>
 
 #define AOFGUARD_NVM_SIZE       (512 << 20)
+#define CONFIG_DEFAULT_AOFGUARD_BLOCK_SIZE AOFGUARD_DEFAULT_BLOCK_SIZE
 #endif
 
 /* Error codes */
@@ -118,6 +158,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MAX_LINE    1024
 #define CRON_DBS_PER_CALL 16
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#ifdef IOV_MAX
+#define NET_MAX_WRITES_IOV IOV_MAX /* Reply buffers gathered per writev(2). */
+#else
+#define NET_MAX_WRITES_IOV 1024
+#endif
 #define PROTO_SHARED_SELECT_CMDS 10
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
@@ -190,6 +235,15 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_DEFRAG_IGNORE_BYTES (100<<20) /* don't defrag if frag overhead is below 100mb */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MIN 25 /* 25% CPU min (at lower threshold) */
 #define CONFIG_DEFAULT_DEFRAG_CYCLE_MAX 75 /* 75% CPU max (at upper threshold) */
+#define CONFIG_DEFAULT_IO_THREADS_NUM 1 /* Single threaded I/O by default. */
+#define IO_THREADS_MAX_NUM 128
+#define CONFIG_DEFAULT_NVM_TIERING 0
+#define CONFIG_DEFAULT_NVM_TIERING_DRAM_BUDGET 0 /* No DRAM limit for promotions. */
+#define CONFIG_DEFAULT_NVM_TIERING_MAX_BANDWIDTH (64<<20) /* Bytes moved per second. */
+#define CONFIG_DEFAULT_NVM_TIERING_PROMOTE_FREQ 20 /* LFU counter to promote. */
+#define CONFIG_DEFAULT_NVM_TIERING_DEMOTE_FREQ 2 /* LFU counter to demote. */
+
+#define NVM_TIERING_CYCLE_TIME_PERC 10 /* CPU max % of serverCron for tiering. */
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -208,8 +262,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PROTO_REPLY_CHUNK_POOL_MAX 256 /* Sent reply chunks kept for reuse. */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
+#define PROTO_ARGV_REUSE_MAX    1024 /* Max argv slots kept between commands. */
+#define PROTO_ARGV_CACHE_SIZE   8 /* Argument objects kept for reuse. */
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
 #define AOF_AUTOSYNC_BYTES (1024*1024*32) /* fdatasync every 32MB */
 
@@ -246,6 +303,25 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_ON 1              /* AOF is on */
 #define AOF_WAIT_REWRITE 2    /* AOF waits rewrite to start appending */
 
+/* Binary records of the pointer based AOF. A record is the AOF_PBA_RECORD
+ * byte followed by varints for the command id (an index in the table of
+ * aof.c, 0 when the command name follows as a string), the db and the
+ * number of arguments. Every argument is an AOF_PBA_ARG_* type byte then:
+ *
+ *   AOF_PBA_ARG_BYTES: varint length, bytes.
+ *   AOF_PBA_ARG_NVM:   8 bytes little endian offset in the NVM pool, varint
+ *                      length of the referenced sds.
+ *
+ * NVM references are loaded as AOF_PBA_REF_LEN bytes strings, "@\0" then
+ * the offset and the length as 8 bytes little endian integers, that are
+ * resolved by resolvePBA(). */
+#define AOF_PBA_RECORD '!'
+#define AOF_PBA_ARG_BYTES 0
+#define AOF_PBA_ARG_NVM 1
+#define AOF_PBA_REF_LEN 18
+#define AOF_PBA_MAX_ARGC (1024*1024)
+#define AOF_PBA_MAX_ARG_LEN (512LL*1024*1024)
+
 /* Client flags */
 #define CLIENT_SLAVE (1<<0)   /* This client is a slave server */
 #define CLIENT_MASTER (1<<1)  /* This client is a master server */
@@ -278,6 +354,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG (1<<25)  /* Run EVAL in debug mode. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
+#define CLIENT_PENDING_READ (1<<28) /* The client has pending reads and was put
+                                       in the list of clients we can read
+                                       from, see threaded I/O. */
+#define CLIENT_PENDING_COMMAND (1<<29) /* An I/O thread parsed a command that
+                                          is yet to be executed. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -377,10 +458,17 @@ typedef long long mstime_t; /* millisecond time type. */
 #define OBJ_SET_MAX_INTSET_ENTRIES 512
 #define OBJ_ZSET_MAX_ZIPLIST_ENTRIES 128
 #define OBJ_ZSET_MAX_ZIPLIST_VALUE 64
+#define OBJ_ZSET_ENCODING OBJ_ENCODING_SKIPLIST
+#define OBJ_ZIPLIST_INDEX_CACHE_SIZE (8*1024*1024)
+#define OBJ_ZIPLIST_INDEX_MIN_ENTRIES 64
+#define OBJ_EMBED_STRING_KEYS 1
+#define OBJ_KEYED_SIZE_LIMIT 128 /* Max allocation of a keyed string. */
 
 /* List defaults */
 #define OBJ_LIST_MAX_ZIPLIST_SIZE -2
 #define OBJ_LIST_COMPRESS_DEPTH 0
+#define OBJ_LIST_COMPRESS_CODEC QUICKLIST_CODEC_LZF
+#define OBJ_LIST_COMPRESS_CACHE_SIZE (1024*1024)
 
 /* HyperLogLog defines */
 #define CONFIG_DEFAULT_HLL_SPARSE_MAX_BYTES 3000
@@ -605,19 +693,25 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+#define OBJ_ENCODING_BTREE 10  /* Encoded as B+tree */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
 #define LRU_CLOCK_RESOLUTION 1000 /* LRU clock resolution in ms */
 
-#define OBJ_SHARED_REFCOUNT INT_MAX
+/* The refcount shares its 32 bits with the object flags below, so that
+ * the flags don't make the object bigger than 16 bytes. */
+#define OBJ_REFCOUNT_BITS 29
+#define OBJ_SHARED_REFCOUNT ((1<<(OBJ_REFCOUNT_BITS-1))-1)
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
     unsigned lru:LRU_BITS; /* LRU time (relative to global lru_clock) or
                             * LFU data (least significant 8 bits frequency
                             * and most significant 16 bits decreas time). */
-    int refcount;
+    int refcount:OBJ_REFCOUNT_BITS;
+    unsigned keyed:1;   /* EMBSTR followed by its own key, see
+                           createKeyedStringObject(). */
 #ifdef USE_NVM
     unsigned need_mv_to_nvm: 1;
 #endif
@@ -634,6 +728,7 @@ typedef struct redisObject {
  * bug #85 introduced exactly in this way. */
 #define initStaticStringObject(_var,_ptr) do { \
     _var.refcount = 1; \
+    _var.keyed = 0; \
     _var.type = OBJ_STRING; \
     _var.encoding = OBJ_ENCODING_RAW; \
     _var.ptr = _ptr; \
@@ -715,12 +810,16 @@ typedef struct client {
     redisDb *db;            /* Pointer to currently SELECTed DB. */
     robj *name;             /* As set by CLIENT SETNAME. */
     sds querybuf;           /* Buffer we use to accumulate client queries. */
+    size_t qb_pos;          /* The position we have read in querybuf. */
     sds pending_querybuf;   /* If this is a master, this buffer represents the
                                yet not applied replication stream that we
                                are receiving from the master. */
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    int argv_len;           /* Size of the argv array, may be > argc. */
+    robj *argv_cache[PROTO_ARGV_CACHE_SIZE]; /* Small argument objects of the
+                                                previous command, to reuse. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
@@ -809,11 +908,66 @@ typedef struct zskiplist {
     int level;
 } zskiplist;
 
+/* Large ZSETs can also use a B+tree instead of the skiplist (see zbtree.c).
+ * Every node keeps scores, 8 bytes member prefixes and member pointers in
+ * three separate arrays, so that searching a node scans contiguous memory
+ * and a member, that may live in NVM, is only read when both the score and
+ * the prefix are equal. Inner nodes store the lowest element of every child
+ * and the number of elements below it, used to compute ranks. */
+#define ZBTREE_LEAF_ENTRIES 40
+#define ZBTREE_INNER_ENTRIES 24
+#define ZBTREE_MAX_HEIGHT 16
+
+typedef struct zbtreeNode {
+    unsigned int leaf;      /* Node is a zbtreeLeaf, otherwise zbtreeInner. */
+    unsigned int count;     /* Number of elements or children. */
+} zbtreeNode;
+
+typedef struct zbtreeLeaf {
+    zbtreeNode hdr;
+    double score[ZBTREE_LEAF_ENTRIES];
+    uint64_t prefix[ZBTREE_LEAF_ENTRIES];
+    sds ele[ZBTREE_LEAF_ENTRIES];
+    struct zbtreeLeaf *prev, *next;
+} zbtreeLeaf;
+
+typedef struct zbtreeInner {
+    zbtreeNode hdr;
+    double score[ZBTREE_INNER_ENTRIES];     /* Lowest element of each child. */
+    uint64_t prefix[ZBTREE_INNER_ENTRIES];
+    sds ele[ZBTREE_INNER_ENTRIES];
+    zbtreeNode *child[ZBTREE_INNER_ENTRIES];
+    unsigned long size[ZBTREE_INNER_ENTRIES]; /* Elements under each child. */
+} zbtreeInner;
+
+typedef struct zbtree {
+    zbtreeNode *root;
+    zbtreeLeaf *head, *tail;
+    unsigned long length;
+    unsigned long leaves, inners;   /* Allocated nodes. */
+    int height;
+} zbtree;
+
+/* Position of an element inside a zbtree. */
+typedef struct zbtreeIter {
+    zbtreeLeaf *leaf;
+    int pos;
+} zbtreeIter;
+
+#define zbtIterScore(it) ((it)->leaf->score[(it)->pos])
+#define zbtIterEle(it) ((it)->leaf->ele[(it)->pos])
+
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    zbtree *zbt;    /* Used instead of zsl by OBJ_ENCODING_BTREE. */
 } zset;
 
+/* Skiplist dict entries point to the score stored in the skiplist node,
+ * B+tree elements move between nodes so the score is kept in the entry. */
+#define zsetDictGetScore(zobj,de) ((zobj)->encoding == OBJ_ENCODING_BTREE ? \
+    dictGetDoubleVal(de) : *(double*)dictGetVal(de))
+
 typedef struct clientBufferLimitsConfig {
     unsigned long long hard_limit_bytes;
     unsigned long long soft_limit_bytes;
@@ -951,6 +1105,7 @@ struct redisServer {
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
     list *clients_pending_write; /* There is to write or install handler. */
+    list *clients_pending_read;  /* Client has pending read socket buffers. */
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client; /* Current client, only used on crash report */
     int clients_paused;         /* True if clients are currently paused */
@@ -959,12 +1114,28 @@ struct redisServer {
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
     uint64_t next_client_id;    /* Next client unique ID. Incremental. */
     int protected_mode;         /* Don't accept external connections. */
+    int io_threads_num;         /* Number of I/O threads to use. */
+    int io_threads_active;      /* Are the I/O threads currently spinning? */
     /* RDB / AOF loading information */
     int loading;                /* We are loading data from disk if true */
     off_t loading_total_bytes;
     off_t loading_loaded_bytes;
     time_t loading_start_time;
     off_t loading_process_events_interval_bytes;
+    mstime_t loading_start_ms;  /* Same as loading_start_time, in ms. */
+    long long loading_start_keys; /* Keys in the dataset when loading started. */
+    long long stat_last_load_keys;    /* Keys added by the last load. */
+    mstime_t stat_last_load_time_ms;  /* Duration of the last load. */
+#ifdef USE_NVM
+    size_t stat_last_load_nvm_bytes;  /* Bytes written to NVM by the last load. */
+    /* NVM strings referenced by ziplists written to RDB payloads straight
+     * from NVM, and ziplists copied to DRAM to be saved (compressed nodes).
+     * Updated by save threads and children too. */
+    size_t stat_rdb_nvm_bytes_streamed;
+    pthread_mutex_t stat_rdb_nvm_bytes_streamed_mutex;
+    size_t stat_rdb_nvm_bytes_materialized;
+    pthread_mutex_t stat_rdb_nvm_bytes_materialized_mutex;
+#endif
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
                         *rpopCommand, *sremCommand, *execCommand, *expireCommand,
@@ -998,7 +1169,19 @@ struct redisServer {
     size_t resident_set_size;       /* RSS sampled in serverCron(). */
     long long stat_net_input_bytes; /* Bytes read from network. */
     long long stat_net_output_bytes; /* Bytes written to network. */
+    long long stat_net_output_syscalls; /* write(2)/writev(2) calls for replies. */
+    long long stat_zero_copy_replies; /* Replies queued by reference. */
+    long long stat_zero_copy_reply_bytes; /* Bytes of the above, not copied. */
+    long long stat_reply_chunks_reused; /* Reply chunks taken from the pool. */
+    long long stat_reply_chunks_allocated; /* Reply chunks the pool lacked. */
+    long long stat_io_reads_processed[IO_THREADS_MAX_NUM]; /* Per I/O thread
+                                     clients read, 0 is the main thread. */
+    long long stat_io_writes_processed[IO_THREADS_MAX_NUM]; /* Per I/O thread
+                                     clients written. */
+    long long stat_io_bytes_read[IO_THREADS_MAX_NUM];
+    long long stat_io_bytes_written[IO_THREADS_MAX_NUM];
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
+    size_t stat_rdb_threaded_cow_bytes; /* Saved ahead of writes by BGSAVE THREADED. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     /* The following two are used to track instantaneous metrics, like
      * number of operations per second, network traffic. */
@@ -1076,6 +1259,9 @@ struct redisServer {
     time_t rdb_save_time_start;     /* Current RDB save start time. */
     int rdb_bgsave_scheduled;       /* BGSAVE when possible if true. */
     int rdb_child_type;             /* Type of save by active child. */
+    int rdb_threaded_in_progress;   /* BGSAVE THREADED running. */
+    unsigned long rdb_threaded_buckets;       /* Buckets of the frozen keyspace. */
+    unsigned long rdb_threaded_buckets_saved; /* Buckets already serialized. */
     int lastbgsave_status;          /* C_OK or C_ERR */
     int stop_writes_on_bgsave_err;  /* Don't allow writes if can't BGSAVE */
     int rdb_pipe_write_result_to_parent; /* RDB pipes used to return the state */
@@ -1085,6 +1271,10 @@ struct redisServer {
     struct {
         int process_type;           /* AOF or RDB child? */
         size_t cow_size;            /* Copy on write size. */
+#ifdef USE_NVM
+        size_t nvm_bytes_streamed;  /* Counters at fork, then the child share. */
+        size_t nvm_bytes_materialized;
+#endif
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
     /* Propagation of commands in AOF / replication */
@@ -1176,10 +1366,17 @@ struct redisServer {
     size_t set_max_intset_entries;
     size_t zset_max_ziplist_entries;
     size_t zset_max_ziplist_value;
+    int zset_encoding;              /* Encoding of zsets too big for ziplists. */
+    size_t ziplist_index_cache_size; /* Ziplist lookup indexes, in bytes. */
+    size_t ziplist_index_min_entries;
+    int embed_string_keys;          /* Store small strings and their key
+                                       in a single allocation. */
     size_t hll_sparse_max_bytes;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    int list_compress_codec;        /* QUICKLIST_CODEC_* for new nodes. */
+    size_t list_compress_cache_size; /* Decompressed node cache, in bytes. */
     /* time cache */
     time_t unixtime;    /* Unix time sampled every cron cycle. */
     long long mstime;   /* Like 'unixtime' but with milliseconds resolution. */
@@ -1246,12 +1443,23 @@ struct redisServer {
     size_t nvm_size;
     struct memkind *pmem_kind;
     size_t sdsmv_threshold;
+    nvmPlacementPolicy nvm_placement[NVM_CLASS_COUNT];
+    /* Bytes ever placed by class, on DRAM [0] and NVM [1]. */
+    unsigned long long stat_nvm_placed_total[NVM_CLASS_COUNT][2];
+    /* DRAM/NVM tiering, see tiering.c */
+    int nvm_tiering_enabled;        /* Move values by access frequency. */
+    unsigned long long nvm_tiering_dram_budget; /* Max used_memory when promoting. */
+    unsigned long long nvm_tiering_max_bandwidth; /* Max bytes moved per second. */
+    int nvm_tiering_promote_freq;   /* Min LFU counter to move to DRAM. */
+    int nvm_tiering_demote_freq;    /* Max LFU counter to move to NVM. */
+    long long stat_nvm_tiering_promotions;  /* Values moved to DRAM. */
+    long long stat_nvm_tiering_promoted_bytes;
+    long long stat_nvm_tiering_demotions;   /* Values moved to NVM. */
+    long long stat_nvm_tiering_demoted_bytes;
+    long long stat_nvm_tiering_throttled;   /* Cycles stopped by the bandwidth cap. */
 #endif
 
 #ifdef AEP_COW
-    dict *forked_dict;         /*once bgsave, if new nvm address will be put into the forked dict. 
-                                if the address is not in the forked_dict, it means need to duplicate*/
-    dict *cow_dict;             /*duplicate address or the deleted address will be added into the cow_dict*/
     size_t cow_nvm_size;
     size_t cow_mem_size;
     size_t last_nvm_cow_size;   /*cow_nvm_size + cow_mem_size*/
@@ -1262,6 +1470,7 @@ struct redisServer {
     {
         int enable;
         int loading;
+        int pool_valid;     /* NVM pool may be referenced by the loaded AOF. */
         struct redisCommand* setCommand;
         struct redisCommand* saddCommand;
         struct redisCommand* hsetCommand;
@@ -1278,14 +1487,12 @@ struct redisServer {
         }
         *free_head, *free_tail;
         struct jemallocat* jemallocat;
-        struct move_list
-        {
-            void* ptr;
-            size_t offset;
-            struct move_list* next;
-        }
-        *move_list;
         int defrag_debug;
+        int resolve_threads;    /* Threads used by resolvePBA(). */
+        int resolve_phase;      /* One of PBA_RESOLVE_*. */
+        unsigned long long resolve_done;    /* Keys or values done so far. */
+        pthread_mutex_t resolve_done_mutex;
+        unsigned long long resolve_total;   /* Keys or values to process. */
     }
     pba;
 #endif
@@ -1296,6 +1503,7 @@ struct redisServer {
         int enable;
         int nvm_dir_fd;
         char* nvm_file_name;
+        size_t block_size;  /* Bytes written to the AOF between fsyncs. */
         struct aofguard* aofguard;
     }
     aofguard;
@@ -1400,6 +1608,7 @@ extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
 extern dictType keyptrDictType;
 extern dictType modulesDictType;
+extern dictType commandTableDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -1408,6 +1617,10 @@ extern dictType modulesDictType;
 void * redisduplicatenvmaddr(void *addr);
 #endif
 
+#ifdef USE_NVM
+void commitNVMRoot(int clean);
+#endif
+
 /* Modules */
 void moduleInitModulesSystem(void);
 int moduleLoad(const char *path, void **argv, int argc);
@@ -1486,6 +1699,12 @@ void pauseClients(mstime_t duration);
 int clientsArePaused(void);
 int processEventsWhileBlocked(void);
 int handleClientsWithPendingWrites(void);
+int handleClientsWithPendingWritesUsingThreads(void);
+int handleClientsWithPendingReadsUsingThreads(void);
+void trimReplyChunkPool(void);
+size_t replyChunkPoolMemory(void);
+void copyReplyRefs(void);
+void initThreadedIO(void);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(int fd, client *c, int handler_installed);
@@ -1544,6 +1763,10 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *createKeyedStringObject(sds key, const char *ptr, size_t len);
+sds keyedObjectKey(robj *o);
+size_t keyedObjectsCount(void);
+size_t keyedObjectsMemory(void);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
@@ -1635,6 +1858,8 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal);
 void aofRewriteBufferReset(void);
 unsigned long aofRewriteBufferSize(void);
 ssize_t aofReadDiffFromParent(void);
+int aofReadPBARecord(FILE *fp, int *dbid, int *argc, sds **argv);
+void aofCheckPBACommands(void);
 
 /* Child info */
 void openChildInfoPipe(void);
@@ -1685,6 +1910,8 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned int zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
+zset *zsetCreate(int encoding);
+void zsetInsertElement(zset *zs, double score, sds ele);
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
@@ -1704,6 +1931,31 @@ int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *oldele);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it);
+int zbtFirst(zbtree *zbt, zbtreeIter *it);
+int zbtLast(zbtree *zbt, zbtreeIter *it);
+int zbtNext(zbtreeIter *it);
+int zbtPrev(zbtreeIter *it);
+int zbtSkip(zbtree *zbt, zbtreeIter *it, unsigned long count, int reverse);
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it);
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it);
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict);
+#ifdef SUPPORT_PBA
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict, client *c, robj *key);
+#else
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict);
+#endif
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict);
+int zbtReplaceEle(zbtree *zbt, double score, sds oldele, sds newele);
+long zbtDefragNodes(zbtree *zbt, void *(*defragfn)(void *));
+size_t zbtAllocSize(zbtree *zbt);
 
 /* Core functions */
 int freeMemoryIfNeeded(void);
@@ -1741,6 +1993,9 @@ void resetServerStats(void);
 int defragKey(redisDb *db, dictEntry *de);
 #endif
 void activeDefragCycle(void);
+#ifdef USE_NVM
+void nvmTieringCycle(void);
+#endif
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -1828,9 +2083,11 @@ robj *objectCommandLookup(client *c, robj *key);
 robj *objectCommandLookupOrReply(client *c, robj *key, robj *reply);
 #define LOOKUP_NONE 0
 #define LOOKUP_NOTOUCH (1<<0)
+robj *dbKeyedValue(robj *key, robj *val);
 void dbAdd(redisDb *db, robj *key, robj *val);
 void dbOverwrite(redisDb *db, robj *key, robj *val);
 void setKey(redisDb *db, robj *key, robj *val);
+void dbRehomeKey(redisDb *db, dictEntry *de, robj *val);
 int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbSyncDelete(redisDb *db, robj *key);
@@ -1914,6 +2171,7 @@ void evictionPoolAlloc(void);
 #define LFU_INIT_VAL 5
 unsigned long LFUGetTimeInMinutes(void);
 uint8_t LFULogIncr(uint8_t value);
+unsigned long LFUDecrAndReturn(robj *o);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
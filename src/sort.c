@@ -302,8 +302,8 @@ void sortCommand(client *c) {
     }
 
     /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+    if (sortval->type == OBJ_ZSET && sortval->encoding == OBJ_ENCODING_ZIPLIST)
+        zsetConvert(sortval, server.zset_encoding);
 
     /* Objtain the length of the object to sort. */
     switch(sortval->type) {
@@ -388,6 +388,30 @@ void sortCommand(client *c) {
             j++;
         }
         setTypeReleaseIterator(si);
+    } else if (sortval->type == OBJ_ZSET && dontsort &&
+               sortval->encoding == OBJ_ENCODING_BTREE) {
+        /* Same as below for B+tree encoded sorted sets. */
+        zset *zs = sortval->ptr;
+        zbtreeIter it;
+        sds sdsele;
+        int rangelen = vectorlen;
+
+        it.leaf = NULL;
+        if (rangelen > 0)
+            zbtGetElementByRank(zs->zbt,desc ? dictSize(zs->dict)-start :
+                                               (unsigned long)start+1,&it);
+        while(rangelen--) {
+            serverAssertWithInfo(c,sortval,it.leaf != NULL);
+            sdsele = zbtIterEle(&it);
+            vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+            if (desc) zbtPrev(&it); else zbtNext(&it);
+        }
+        /* Fix start/end: output code is not aware of this optimization. */
+        end -= start;
+        start = 0;
     } else if (sortval->type == OBJ_ZSET && dontsort) {
         /* Special handling for a sorted set, if 'dontsort' is true.
          * This makes sure we return elements in the sorted set original
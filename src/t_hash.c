@@ -69,14 +69,11 @@ int hashTypeGetFromZiplist(robj *o, sds field,
     serverAssert(o->encoding == OBJ_ENCODING_ZIPLIST);
 
     zl = o->ptr;
-    fptr = ziplistIndex(zl, ZIPLIST_HEAD);
+    fptr = ziplistFindKey(zl, (unsigned char*)field, sdslen(field));
     if (fptr != NULL) {
-        fptr = ziplistFind(fptr, (unsigned char*)field, sdslen(field), 1);
-        if (fptr != NULL) {
-            /* Grab pointer to the value (fptr points to the field) */
-            vptr = ziplistNext(zl, fptr);
-            serverAssert(vptr != NULL);
-        }
+        /* Grab pointer to the value (fptr points to the field) */
+        vptr = ziplistNext(zl, fptr);
+        serverAssert(vptr != NULL);
     }
 
     if (vptr != NULL) {
@@ -224,14 +221,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
                 /*only update the value and only duplicate the value to NVM*/
                 sds ele = value;
 #ifdef USE_NVM
-                if(sdslen(ele)>= server.sdsmv_threshold)
-                {
-                    sds e = sdsdupnvm(ele);
-                    if(!is_nvm_addr(e))
-                        sdsfree(e);
-                    else
-                        ele = e;
-                }
+                ele = sdsplacezlentry(ele, NVM_CLASS_HASH_VALUE);
 #endif
 #ifdef SUPPORT_PBA
                 setArgPBA(ele);
@@ -247,23 +237,8 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
            sds vele = value;
            sds fele = field;
 #ifdef USE_NVM
-            if(sdslen(vele)>= server.sdsmv_threshold)
-            {
-                sds e = sdsdupnvm(vele);
-                if(!is_nvm_addr(e))
-                    sdsfree(e);
-                else
-                    vele = e;
-            }
-
-            if(sdslen(fele)>= server.sdsmv_threshold)
-            {
-                sds e = sdsdupnvm(fele);
-                if(!is_nvm_addr(e))
-                    sdsfree(e);
-                else
-                    fele = e;
-            }
+            vele = sdsplacezlentry(vele, NVM_CLASS_HASH_VALUE);
+            fele = sdsplacezlentry(fele, NVM_CLASS_HASH_FIELD);
 #endif
 #ifdef SUPPORT_PBA
             setArgPBA(vele);
@@ -288,7 +263,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
                 value = NULL;
             } else {
 #ifdef USE_NVM
-                dictGetVal(de) = sdsdupnvm(value);
+                dictGetVal(de) = sdsdupplaced(value,NVM_CLASS_HASH_VALUE);
 #else
                 dictGetVal(de) = sdsdup(value);
 #endif
@@ -304,7 +279,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
                 field = NULL;
             } else {
 #ifdef USE_NVM
-                f = sdsdupnvm(field);
+                f = sdsdupplaced(field,NVM_CLASS_HASH_FIELD);
 #else
                 f = sdsdup(field);
 #endif
@@ -314,7 +289,7 @@ int hashTypeSet(robj *o, sds field, sds value, int flags) {
                 value = NULL;
             } else {
 #ifdef USE_NVM
-                v = sdsdupnvm(value);
+                v = sdsdupplaced(value,NVM_CLASS_HASH_VALUE);
 #else
                 v = sdsdup(value);
 #endif
@@ -576,6 +551,7 @@ void hashTypeConvertZiplist(robj *o, int enc) {
         }
         hashTypeReleaseIterator(hi);
         // needn't to ziplistFree(), because all the NVM sds pointer has been added to dict
+        ziplistIndexDrop(o->ptr);
         zfree(o->ptr);
         o->encoding = OBJ_ENCODING_HT;
         o->ptr = dict;
@@ -48,14 +48,7 @@ void listTypePush(robj *subject, robj *value, int where) {
         size_t len = sdslen(value->ptr);
         sds ele = value->ptr;
 #ifdef USE_NVM
-        if(server.nvm_base && len >= server.sdsmv_threshold)
-        {
-            sds e = sdsdupnvm(ele);
-            if(!is_nvm_addr(e))
-                sdsfree(e);
-            else
-                ele = e;
-        }
+        ele = sdsplacezlentry(ele, NVM_CLASS_LIST_ELEMENT);
 #endif
 #ifdef SUPPORT_PBA
         setArgPBA(ele);
@@ -161,14 +154,7 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
         sds str = value->ptr;
         size_t len = sdslen(str);
 #ifdef USE_NVM
-        if(server.nvm_base && len >= server.sdsmv_threshold)
-        {
-            sds e = sdsdupnvm(str);
-            if(!is_nvm_addr(e))
-                sdsfree(e);
-            else
-                str = e;
-        }
+        str = sdsplacezlentry(str, NVM_CLASS_LIST_ELEMENT);
 #endif
 #ifdef SUPPORT_PBA
         setArgPBA(str);
@@ -396,14 +382,7 @@ void lsetCommand(client *c) {
 #ifdef USE_NVM
         sds str = value->ptr;
         size_t len = sdslen(str);
-        if(server.nvm_base && len >= server.sdsmv_threshold)
-        {
-            sds e = sdsdupnvm(str);
-            if(!is_nvm_addr(e))
-                sdsfree(e);
-            else
-                str = e;
-        }
+        str = sdsplacezlentry(str, NVM_CLASS_LIST_ELEMENT);
         int replaced = quicklistReplaceAtIndex(ql, index, str, len);
         if(!replaced && is_nvm_addr(str))
             sdsfree(str);
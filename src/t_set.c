@@ -61,7 +61,7 @@ int setTypeAdd(robj *subject, sds value) {
         dictEntry *de = dictAddRaw(ht,value,NULL);
         if (de) {
 #ifdef USE_NVM
-            sds s = sdsdupnvm(value);
+            sds s = sdsdupplaced(value,NVM_CLASS_SET_MEMBER);
             dictSetKey(ht,de,s);
 #ifdef SUPPORT_PBA
             setArgPBA(s);
@@ -87,7 +87,7 @@ int setTypeAdd(robj *subject, sds value) {
             /* Failed to get integer from object, convert to regular set. */
             setTypeConvert(subject,OBJ_ENCODING_HT);
 #ifdef USE_NVM
-            sds s = sdsdupnvm(value);
+            sds s = sdsdupplaced(value,NVM_CLASS_SET_MEMBER);
             serverAssert(dictAdd(subject->ptr,s,NULL) == DICT_OK);
 #ifdef SUPPORT_PBA
             setArgPBA(s);
@@ -214,11 +214,7 @@ sds setTypeNextObject(setTypeIterator *si) {
         case OBJ_ENCODING_INTSET:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
-#ifdef USE_NVM
-            return sdsdupnvm(sdsele);
-#else
             return sdsdup(sdsele);
-#endif 
         default:
             serverPanic("Unsupported encoding");
     }
@@ -1005,6 +1001,39 @@ void sinterGenericCommand(client *c, robj **setkeys,
         dstset = createIntsetObject();
     }
 
+    /* When all the sets are intsets, merge them: the intersection is
+     * computed by intsetIntersect() against one set at a time, starting
+     * from the smallest ones. */
+    for (j = 0; j < setnum; j++)
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) break;
+    if (j == setnum) {
+        intset *is = intsetIntersect(sets[0]->ptr,setnum > 1 ?
+                                     sets[1]->ptr : sets[0]->ptr);
+
+        for (j = 2; j < setnum && intsetLen(is); j++) {
+            intset *tmp = intsetIntersect(is,sets[j]->ptr);
+            zfree(is);
+            is = tmp;
+        }
+        cardinality = intsetLen(is);
+        if (!dstkey) {
+            for (j = 0; j < cardinality; j++) {
+                intsetGet(is,j,&intobj);
+                addReplyBulkLongLong(c,intobj);
+            }
+            zfree(is);
+        } else {
+            zfree(dstset->ptr);
+            dstset->ptr = is;
+            /* The result can't be larger than the smallest source, but the
+             * sources may exceed set-max-intset-entries if it was lowered
+             * after they were created. */
+            if (cardinality > server.set_max_intset_entries)
+                setTypeConvert(dstset,OBJ_ENCODING_HT);
+        }
+        goto done;
+    }
+
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
      * not include the element it is discarded */
@@ -1057,6 +1086,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
     }
     setTypeReleaseIterator(si);
 
+done:
     if (dstkey) {
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
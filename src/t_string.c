@@ -93,10 +93,10 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
 
 #ifdef USE_NVM
     if(val->encoding == OBJ_ENCODING_RAW) {
-        val->ptr = sdsmvtonvm(val->ptr);
+        val->ptr = sdsmvtonvmplaced(val->ptr,NVM_CLASS_STRING);
         size_t header_size = sdsheadersize(val->ptr);
         size_t total_size = header_size + sdsalloc(val->ptr) + 1;
-        if(total_size >= server.sdsmv_threshold && !is_nvm_addr(val->ptr))
+        if(nvm_place(NVM_CLASS_STRING,total_size) && !is_nvm_addr(val->ptr))
             val->need_mv_to_nvm = 1;
     }
 #endif
@@ -196,10 +196,10 @@ void getsetCommand(client *c) {
 #ifdef USE_NVM
     robj* val = c->argv[2];
     if(val->encoding == OBJ_ENCODING_RAW) {
-        val->ptr = sdsmvtonvm(val->ptr);
+        val->ptr = sdsmvtonvmplaced(val->ptr,NVM_CLASS_STRING);
         size_t header_size = sdsheadersize(val->ptr);
         size_t total_size = header_size + sdsalloc(val->ptr) + 1;
-        if(total_size >= server.sdsmv_threshold && !is_nvm_addr(val->ptr))
+        if(nvm_place(NVM_CLASS_STRING,total_size) && !is_nvm_addr(val->ptr))
             val->need_mv_to_nvm = 1;
     }
 #endif
@@ -267,7 +267,7 @@ void setrangeCommand(client *c) {
         memcpy((char*)o->ptr+offset,value,sdslen(value));
 #ifdef USE_NVM
         if(o->encoding == OBJ_ENCODING_RAW && !is_nvm_addr(o->ptr)) {
-            o->ptr = sdsmvtonvm(o->ptr);
+            o->ptr = sdsmvtonvmplaced(o->ptr,NVM_CLASS_STRING);
         }
 #endif
 #ifdef SUPPORT_PBA
@@ -371,10 +371,10 @@ void msetGenericCommand(client *c, int nx) {
 #ifdef USE_NVM
         robj* val = c->argv[j+1];
         if(val->encoding == OBJ_ENCODING_RAW) {
-            val->ptr = sdsmvtonvm(val->ptr);
+            val->ptr = sdsmvtonvmplaced(val->ptr,NVM_CLASS_STRING);
             size_t header_size = sdsheadersize(val->ptr);
             size_t total_size = header_size + sdsalloc(val->ptr) + 1;
-            if(total_size >= server.sdsmv_threshold && !is_nvm_addr(val->ptr))
+            if(nvm_place(NVM_CLASS_STRING,total_size) && !is_nvm_addr(val->ptr))
                 val->need_mv_to_nvm = 1;
         }
 #endif
@@ -498,7 +498,7 @@ void appendCommand(client *c) {
 #ifdef USE_NVM
         robj* val = c->argv[2];
         if(val->encoding == OBJ_ENCODING_RAW) {
-            val->ptr = sdsmvtonvm(val->ptr);
+            val->ptr = sdsmvtonvmplaced(val->ptr,NVM_CLASS_STRING);
             decrRefCount(c->argv[0]);
             c->argv[0] = createStringObject("SET", 3);
         }
@@ -537,7 +537,7 @@ void appendCommand(client *c) {
         // the above two lines can be optimized, it is the write->flush->read mode
 #ifdef USE_NVM
         if(o->encoding == OBJ_ENCODING_RAW && !is_nvm_addr(o->ptr)) {
-            o->ptr = sdsmvtonvm(o->ptr);
+            o->ptr = sdsmvtonvmplaced(o->ptr,NVM_CLASS_STRING);
         }
 #endif
 #ifdef SUPPORT_PBA
@@ -998,6 +998,16 @@ unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
     return NULL;
 }
 
+/* Like zzlFind(), for lookups that don't modify the ziplist: these go
+ * through the ziplist lookup index, see ziplistFindKey(). */
+unsigned char *zzlLookup(unsigned char *zl, sds ele, double *score) {
+    unsigned char *eptr = ziplistFindKey(zl,(unsigned char*)ele,sdslen(ele));
+
+    if (eptr != NULL && score != NULL)
+        *score = zzlGetScore(ziplistNext(zl,eptr));
+    return eptr;
+}
+
 /* Delete (element,score) pair from ziplist. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
@@ -1182,12 +1192,44 @@ unsigned int zsetLength(const robj *zobj) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
     return length;
 }
 
+/* Create an empty skiplist or B+tree encoded sorted set. */
+zset *zsetCreate(int encoding) {
+    zset *zs = zmalloc(sizeof(*zs));
+
+    zs->dict = dictCreate(&zsetDictType,NULL);
+    zs->zsl = NULL;
+    zs->zbt = NULL;
+    if (encoding == OBJ_ENCODING_SKIPLIST)
+        zs->zsl = zslCreate();
+    else if (encoding == OBJ_ENCODING_BTREE)
+        zs->zbt = zbtCreate();
+    else
+        serverPanic("Unknown sorted set encoding");
+    return zs;
+}
+
+/* Add a new element to a skiplist or B+tree encoded sorted set. Assumes the
+ * element does not already exist. The sorted set takes ownership of 'ele'. */
+void zsetInsertElement(zset *zs, double score, sds ele) {
+    if (zs->zbt) {
+        dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+        serverAssert(de != NULL);
+        dictSetDoubleVal(de,score);
+        zbtInsert(zs->zbt,score,ele);
+    } else {
+        zskiplistNode *node = zslInsert(zs->zsl,score,ele);
+        serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+    }
+}
+
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
     zskiplistNode *node, *next;
@@ -1201,12 +1243,11 @@ void zsetConvert(robj *zobj, int encoding) {
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_SKIPLIST &&
+            encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
-        zs = zmalloc(sizeof(*zs));
-        zs->dict = dictCreate(&zsetDictType,NULL);
-        zs->zsl = zslCreate();
+        zs = zsetCreate(encoding);
 
         eptr = ziplistIndex(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
@@ -1225,15 +1266,15 @@ void zsetConvert(robj *zobj, int encoding) {
             else {
                 ele = sdsnewlen((char*)vstr,vlen);
             }
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zsetInsertElement(zs,score,ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
+        ziplistIndexDrop(zobj->ptr);
         zfree(zobj->ptr);
 
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         unsigned char *zl = ziplistNew();
 
@@ -1260,6 +1301,30 @@ void zsetConvert(robj *zobj, int encoding) {
         zfree(zs);
         zobj->ptr = zl;
         zobj->encoding = OBJ_ENCODING_ZIPLIST;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = ziplistNew();
+        zbtreeIter it;
+
+        if (encoding != OBJ_ENCODING_ZIPLIST)
+            serverPanic("Unknown target encoding");
+
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        if (zbtFirst(zs->zbt,&it)) {
+            do {
+                ele = zbtIterEle(&it);
+                zl = zzlInsertAt(zl,NULL,ele,zbtIterScore(&it));
+#ifdef USE_NVM
+                /* The ziplist references NVM members instead of copying
+                 * them, so they must survive zbtFree(). */
+                if (is_nvm_addr(ele)) zbtIterEle(&it) = NULL;
+#endif
+            } while (zbtNext(&it));
+        }
+        zbtFree(zs->zbt);
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_ZIPLIST;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1270,9 +1335,8 @@ void zsetConvert(robj *zobj, int encoding) {
  * expected ranges. */
 void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
-    zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
+    if (zsetLength(zobj) <= server.zset_max_ziplist_entries &&
         maxelelen <= server.zset_max_ziplist_value)
             zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
 }
@@ -1285,12 +1349,13 @@ int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
     if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
-        if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        if (zzlLookup(zobj->ptr, member, score) == NULL) return C_ERR;
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = zsetDictGetScore(zobj,de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1391,24 +1456,17 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
              * becomes too long *before* executing zzlInsert. */
             /*only update the value and only duplicate the value to NVM*/
              sds zele = ele;
- #ifdef USE_NVM
-             if(sdslen(zele)>= server.sdsmv_threshold)
-             {
-                 sds e = sdsdupnvm(zele);
-                 if(!is_nvm_addr(e))
-                     sdsfree(e);
-                 else
-                     zele = e;
-             }
+#ifdef USE_NVM
+             zele = sdsplacezlentry(zele, NVM_CLASS_ZSET_MEMBER);
 #endif
 #ifdef SUPPORT_PBA
             setArgPBA(zele);
 #endif
             zobj->ptr = zzlInsert(zobj->ptr,zele,score);
             if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,server.zset_encoding);
             if (sdslen(ele) > server.zset_max_ziplist_value)
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,server.zset_encoding);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
             return 1;
@@ -1416,7 +1474,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             *flags |= ZADD_NOP;
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         zskiplistNode *znode;
         dictEntry *de;
@@ -1429,7 +1488,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 ret = 1;
                 goto out;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = zsetDictGetScore(zobj,de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1443,7 +1502,13 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             }
 
             /* Remove and re-insert when score changes. */
-            if (score != curscore) {
+            if (score != curscore && zobj->encoding == OBJ_ENCODING_BTREE) {
+                sds oldele;
+                serverAssert(zbtDelete(zs->zbt,curscore,ele,&oldele));
+                zbtInsert(zs->zbt,score,oldele);
+                dictSetDoubleVal(de,score);
+                *flags |= ZADD_UPDATED;
+            } else if (score != curscore) {
                 zskiplistNode *node;
                 serverAssert(zslDelete(zs->zsl,curscore,ele,&node));
                 znode = zslInsert(zs->zsl,score,node->ele);
@@ -1460,15 +1525,14 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             return 1;
         } else if (!xx) {
 #ifdef USE_NVM
-            ele = sdsdupnvm(ele);
+            ele = sdsdupplaced(ele,NVM_CLASS_ZSET_MEMBER);
 #else
             ele = sdsdup(ele);
 #endif
 #ifdef SUPPORT_PBA
             setArgPBA(ele);
 #endif
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zsetInsertElement(zs,score,ele);
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1505,7 +1569,8 @@ int zsetDel(robj *zobj, sds ele) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
         dictEntry *de;
         double score;
@@ -1513,7 +1578,7 @@ int zsetDel(robj *zobj, sds ele) {
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
             /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            score = zsetDictGetScore(zobj,de);
 
 #ifdef SUPPORT_PBA
             sds ele = dictGetKey(de);
@@ -1527,7 +1592,8 @@ int zsetDel(robj *zobj, sds ele) {
             dictFreeUnlinkedEntry(zs->dict,de);
 
             /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            int retval = zs->zbt ? zbtDelete(zs->zbt,score,ele,NULL) :
+                                   zslDelete(zs->zsl,score,ele,NULL);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1581,16 +1647,17 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE) {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = zsetDictGetScore(zobj,de);
+            rank = zs->zbt ? zbtGetRank(zs->zbt,score,ele) :
+                             zslGetRank(zs->zsl,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (reverse)
@@ -1857,6 +1924,28 @@ void zremrangeGenericCommand(client *c, int rangetype) {
             deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict, c, key);
 #else
             deleted = zslDeleteRangeByLex(zs->zsl,&lexrange,zs->dict);
+#endif
+            break;
+        }
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        switch(rangetype) {
+        case ZRANGE_RANK:
+            deleted = zbtDeleteRangeByRank(zs->zbt,start+1,end+1,zs->dict);
+            break;
+        case ZRANGE_SCORE:
+            deleted = zbtDeleteRangeByScore(zs->zbt,&range,zs->dict);
+            break;
+        case ZRANGE_LEX:
+#ifdef SUPPORT_PBA
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict, c, key);
+#else
+            deleted = zbtDeleteRangeByLex(zs->zbt,&lexrange,zs->dict);
 #endif
             break;
         }
@@ -1926,6 +2015,10 @@ typedef struct {
                 zset *zs;
                 zskiplistNode *node;
             } sl;
+            struct {
+                zbtreeIter it;
+                int valid;
+            } bt;
         } zset;
     } iter;
 } zsetopsrc;
@@ -1983,6 +2076,9 @@ void zuiInitIterator(zsetopsrc *op) {
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
             it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            zset *zs = op->subject->ptr;
+            it->bt.valid = zbtFirst(zs->zbt,&it->bt.it);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2008,7 +2104,8 @@ void zuiClearIterator(zsetopsrc *op) {
         iterzset *it = &op->iter.zset;
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE) {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -2034,9 +2131,9 @@ int zuiLength(zsetopsrc *op) {
     } else if (op->type == OBJ_ZSET) {
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE) {
+            return zsetLength(op->subject);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2099,6 +2196,14 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->sl.node = it->sl.node->level[0].forward;
+        } else if (op->encoding == OBJ_ENCODING_BTREE) {
+            if (!it->bt.valid)
+                return 0;
+            val->ele = zbtIterEle(&it->bt.it);
+            val->score = zbtIterScore(&it->bt.it);
+
+            /* Move to next element. */
+            it->bt.valid = zbtNext(&it->bt.it);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2148,17 +2253,9 @@ sds zuiNewSdsFromValue(zsetopval *val) {
         val->ele = NULL;
         return ele;
     } else if (val->ele) {
-#ifdef USE_NVM
-        return sdsdupnvm(val->ele);
-#else
         return sdsdup(val->ele);
-#endif
     } else if (val->estr) {
-#ifdef USE_NVM
-        return sdsnewlennvm((char*)val->estr,val->elen);
-#else
         return sdsnewlen((char*)val->estr,val->elen);
-#endif
     } else {
         return sdsfromlonglong(val->ell);
     }
@@ -2209,17 +2306,18 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
         zuiSdsFromValue(val);
 
         if (op->encoding == OBJ_ENCODING_ZIPLIST) {
-            if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
-                /* Score is already set by zzlFind. */
+            if (zzlLookup(op->subject->ptr,val->ele,score) != NULL) {
+                /* Score is already set by zzlLookup. */
                 return 1;
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = zsetDictGetScore(op->subject,de);
                 return 1;
             } else {
                 return 0;
@@ -2276,7 +2374,8 @@ void propagateZsetWithZADD(client* c, robj* zset, int deleted)
             zzlNext(zl,&eptr,&sptr);
         }
     }
-    else if(zset->encoding == OBJ_ENCODING_SKIPLIST)
+    else if(zset->encoding == OBJ_ENCODING_SKIPLIST ||
+            zset->encoding == OBJ_ENCODING_BTREE)
     {
         struct zset* z = zset->ptr;
         dictIterator* iter = dictGetIterator(z->dict);
@@ -2284,7 +2383,7 @@ void propagateZsetWithZADD(client* c, robj* zset, int deleted)
         while((entry = dictNext(iter)))
         {
             sds ele = dictGetKey(entry);
-            double score = (*((double*)dictGetVal(entry)));
+            double score = zsetDictGetScore(zset,entry);
             propargv[2] = createStringObjectFromLongDouble(score, 0);
             if(is_nvm_addr(ele))
             {
@@ -2347,7 +2446,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     unsigned int maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
     int touched = 0;
 
     /* expect setnum input keys to be given */
@@ -2467,11 +2565,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
 #ifdef USE_NVM
-                    if(!is_nvm_addr(tmp))
-                        tmp = sdsmvtonvm(tmp);
+                    tmp = sdsmvtonvmplaced(tmp,NVM_CLASS_ZSET_MEMBER);
 #endif
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    zsetInsertElement(dstzset,score,tmp);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
@@ -2506,8 +2602,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
 #ifdef USE_NVM
-                    if(!is_nvm_addr(tmp))
-                        tmp = sdsmvtonvm(tmp);
+                    tmp = sdsmvtonvmplaced(tmp,NVM_CLASS_ZSET_MEMBER);
 #endif
                     /* Remember the longest single element encountered,
                      * to understand if it's possible to convert to ziplist
@@ -2540,8 +2635,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            zsetInsertElement(dstzset,score,ele);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2551,7 +2645,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
 
     if (dbDelete(c->db,dstkey))
         touched = 1;
-    if (dstzset->zsl->length) {
+    if (dictSize(dstzset->dict)) {
         zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
         dbAdd(c->db,dstkey,dstobj);
 #ifdef SUPPORT_PBA
@@ -2681,6 +2775,21 @@ void zrangeGenericCommand(client *c, int reverse) {
                 addReplyDouble(c,ln->score);
             ln = reverse ? ln->backward : ln->level[0].forward;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        sds ele;
+
+        serverAssertWithInfo(c,zobj,zbtGetElementByRank(zs->zbt,
+            reverse ? llen-start : start+1,&it));
+        while(rangelen--) {
+            serverAssertWithInfo(c,zobj,it.leaf != NULL);
+            ele = zbtIterEle(&it);
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores)
+                addReplyDouble(c,zbtIterScore(&it));
+            if (reverse) zbtPrev(&it); else zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2875,6 +2984,51 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int valid;
+
+        /* If reversed, get the last element in range as starting point. */
+        if (reverse) {
+            valid = zbtLastInRange(zs->zbt,&range,&it);
+        } else {
+            valid = zbtFirstInRange(zs->zbt,&range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            addReply(c, shared.emptymultibulk);
+            return;
+        }
+
+        replylen = addDeferredMultiBulkLength(c);
+
+        /* If there is an offset, just skip the number of elements without
+         * checking the score because that is done in the next loop. */
+        if (offset > 0)
+            valid = zbtSkip(zs->zbt,&it,offset,reverse);
+
+        while (valid && limit--) {
+            double score = zbtIterScore(&it);
+            sds ele = zbtIterEle(&it);
+
+            /* Abort when the element is no longer in range. */
+            if (reverse) {
+                if (!zslValueGteMin(score,&range)) break;
+            } else {
+                if (!zslValueLteMax(score,&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+
+            if (withscores) {
+                addReplyDouble(c,score);
+            }
+
+            valid = reverse ? zbtPrev(&it) : zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -2964,6 +3118,18 @@ void zcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+        zbtreeIter first, last;
+
+        /* The count is the difference of the ranks of the first and the
+         * last element in range. */
+        if (zbtFirstInRange(zbt, &range, &first) &&
+            zbtLastInRange(zbt, &range, &last))
+        {
+            count = zbtGetRank(zbt, zbtIterScore(&last), zbtIterEle(&last)) -
+                    zbtGetRank(zbt, zbtIterScore(&first), zbtIterEle(&first)) + 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3042,6 +3208,20 @@ void zlexcountCommand(client *c) {
                 count -= (zsl->length - rank);
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zbtree *zbt = ((zset*)zobj->ptr)->zbt;
+        zbtreeIter first, last;
+
+        /* The count is the difference of the ranks of the first and the
+         * last element in range. */
+        if (zbtFirstInLexRange(zbt, &range, &first) &&
+            zbtLastInLexRange(zbt, &range, &last))
+        {
+            count = zbtGetRank(zbt, zbtIterScore(&last), zbtIterEle(&last)) -
+                    zbtGetRank(zbt, zbtIterScore(&first), zbtIterEle(&first)) + 1;
+            /* Mixed scores don't give a meaningful lex order. */
+            if (count < 0) count = 0;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -3219,6 +3399,44 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 ln = ln->level[0].forward;
             }
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zbtreeIter it;
+        int valid;
+
+        /* If reversed, get the last element in range as starting point. */
+        if (reverse) {
+            valid = zbtLastInLexRange(zs->zbt,&range,&it);
+        } else {
+            valid = zbtFirstInLexRange(zs->zbt,&range,&it);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (!valid) {
+            addReply(c, shared.emptymultibulk);
+            zslFreeLexRange(&range);
+            return;
+        }
+
+        replylen = addDeferredMultiBulkLength(c);
+
+        if (offset > 0)
+            valid = zbtSkip(zs->zbt,&it,offset,reverse);
+
+        while (valid && limit--) {
+            sds ele = zbtIterEle(&it);
+
+            /* Abort when the element is no longer in range. */
+            if (reverse) {
+                if (!zslLexValueGteMin(ele,&range)) break;
+            } else {
+                if (!zslLexValueLteMax(ele,&range)) break;
+            }
+
+            rangelen++;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            valid = reverse ? zbtPrev(&it) : zbtNext(&it);
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
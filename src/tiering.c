@@ -0,0 +1,207 @@
+/* DRAM/NVM tiering.
+ *
+ * Values are placed on NVM at write time according to their size only
+ * (nvm-threshold). This file implements a background migrator that
+ * corrects the placement afterwards, using the LFU counters kept in
+ * robj->lru: frequently accessed values living on NVM are promoted to DRAM,
+ * and rarely accessed values living in DRAM are demoted to NVM whatever
+ * their size. The keyspace is walked with dictScan() from serverCron(),
+ * with a CPU time limit and a cap on the number of bytes moved per second.
+ *
+ * Only strings are moved. The sds of raw encoded strings is relocated by
+ * sdsmvtodram() / sdsmvtonvm() without touching the rest of the object,
+ * while embedded strings are demoted by replacing them with a raw object
+ * whose sds lives on NVM. A value larger than the per cycle budget is moved
+ * alone at the start of a cycle. A string placement policy pinning values
+ * to one tier (nvm-placement string ... dram|nvm) disables moves out of
+ * that tier.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2018, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#ifdef USE_NVM
+#include "nvm.h"
+
+typedef struct tieringCycleState {
+    redisDb *db;            /* Database being scanned. */
+    size_t budget;          /* Bytes we can move in this cycle. */
+    size_t bytes_left;      /* Bytes we can still move in this cycle. */
+    int over_budget;        /* used_memory is above nvm-tiering-dram-budget. */
+    int throttled;          /* A value didn't fit what is left of the budget. */
+} tieringCycleState;
+
+/* Demote the EMBSTR value of 'de', that lives in the same allocation of its
+ * object, to a RAW object with the string on NVM. The key is moved out of
+ * the value first if it lives inside it (see dbKeyedValue()). Returns the
+ * new object, or NULL if NVM is full. */
+static robj *tieringDemoteEmbedded(redisDb *db, dictEntry *de, robj *o) {
+    sds s = sdsmvtonvmwiththreshold(sdsnewlen(o->ptr,sdslen(o->ptr)),0);
+    robj *raw;
+
+    if (!is_nvm_addr(s)) {
+        sdsfree(s);
+        return NULL;
+    }
+    raw = createObject(OBJ_STRING,s);
+    raw->lru = o->lru;
+    if (o->keyed) dbRehomeKey(db,de,raw);
+    dictSetVal(db->dict,de,raw);
+    decrRefCount(o);
+    return raw;
+}
+
+/* Return 1, ending the cycle, if moving 'size' more bytes would exceed the
+ * bandwidth budget of the cycle. A value larger than the whole budget is
+ * moved alone, at the start of a cycle. */
+static int tieringThrottle(tieringCycleState *st, size_t size) {
+    if (size > st->bytes_left && st->bytes_left != st->budget) {
+        st->throttled = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Move 'o' to the tier its access frequency asks for, if any. */
+static void tieringScanCallback(void *privdata, const dictEntry *cde) {
+    tieringCycleState *st = privdata;
+    dictEntry *de = (dictEntry*)cde;
+    robj *o = dictGetVal(de), keyobj;
+    unsigned long counter;
+    size_t size;
+    int pin;
+    sds s;
+
+    /* Objects referenced elsewhere, for instance by a reply still being
+     * written, must keep their string where it is. */
+    if (st->throttled || o == NULL || o->type != OBJ_STRING ||
+        !sdsEncodedObject(o) || o->refcount != 1) return;
+    pin = server.nvm_placement[NVM_CLASS_STRING].pin;
+    s = o->ptr;
+    size = sdsAllocSize(s);
+    counter = LFUDecrAndReturn(o);
+
+    if (is_nvm_addr(s)) {
+#ifdef SUPPORT_PBA
+        /* The AOF may reference this very NVM block. */
+        if (server.pba.enable) return;
+#endif
+        if (pin == NVM_PIN_NVM ||
+            (int)counter < server.nvm_tiering_promote_freq) return;
+        if (server.nvm_tiering_dram_budget &&
+            zmalloc_used_memory()+size > server.nvm_tiering_dram_budget)
+        {
+            st->over_budget = 1;
+            return;
+        }
+        if (tieringThrottle(st,size)) return;
+        initStaticStringObject(keyobj,dictGetKey(de));
+        rdbThreadedSaveTouchKey(st->db,&keyobj);
+        o->ptr = sdsmvtodram(s);
+        server.stat_nvm_tiering_promotions++;
+        server.stat_nvm_tiering_promoted_bytes += size;
+    } else {
+        /* Under DRAM pressure everything that isn't hot goes to NVM. */
+        if (pin == NVM_PIN_DRAM) return;
+        if ((int)counter > server.nvm_tiering_demote_freq &&
+            !(st->over_budget &&
+              (int)counter < server.nvm_tiering_promote_freq)) return;
+        if (tieringThrottle(st,size)) return;
+        initStaticStringObject(keyobj,dictGetKey(de));
+        rdbThreadedSaveTouchKey(st->db,&keyobj);
+        if (o->encoding == OBJ_ENCODING_EMBSTR) {
+            if ((o = tieringDemoteEmbedded(st->db,de,o)) == NULL) return;
+        } else {
+            o->ptr = sdsmvtonvmwiththreshold(s,0);
+            if (!is_nvm_addr(o->ptr)) return; /* NVM is full. */
+        }
+        o->need_mv_to_nvm = 0;
+        server.stat_nvm_tiering_demotions++;
+        server.stat_nvm_tiering_demoted_bytes += size;
+    }
+    st->bytes_left -= size > st->bytes_left ? st->bytes_left : size;
+}
+
+/* Called from serverCron(). Scans a slice of the keyspace moving values
+ * between DRAM and NVM, for at most NVM_TIERING_CYCLE_TIME_PERC percent of
+ * the cron period and at most nvm-tiering-max-bandwidth bytes per second. */
+void nvmTieringCycle(void) {
+    static int current_db = 0;
+    static unsigned long cursor = 0;
+    unsigned int iterations = 0;
+    int dbs_scanned = 0;
+    long long start, timelimit;
+    tieringCycleState st;
+
+    if (!server.nvm_tiering_enabled || !server.nvm_base) return;
+    /* The counters are only maintained by the LFU policies. */
+    if (!(server.maxmemory_policy & MAXMEMORY_FLAG_LFU)) return;
+    /* Moving values around while there is a child just makes copy-on-write
+     * of pages and NVM blocks. */
+    if (server.rdb_child_pid != -1 || server.aof_child_pid != -1) return;
+
+    start = ustime();
+    timelimit = 1000000*NVM_TIERING_CYCLE_TIME_PERC/server.hz/100;
+    if (timelimit <= 0) timelimit = 1;
+    st.budget = st.bytes_left = server.nvm_tiering_max_bandwidth/server.hz;
+    st.over_budget = server.nvm_tiering_dram_budget &&
+                     zmalloc_used_memory() > server.nvm_tiering_dram_budget;
+    st.throttled = 0;
+
+    while (dbs_scanned < server.dbnum) {
+        redisDb *db = server.db+current_db;
+        unsigned long next = 0;
+
+        st.db = db;
+        if (dictSize(db->dict) != 0)
+            next = dictScan(db->dict,cursor,tieringScanCallback,NULL,&st);
+
+        /* A value didn't fit the rest of the budget: scan its bucket again
+         * in the next cycle, that can move it even if it is larger than
+         * the whole budget. */
+        if (st.throttled) {
+            server.stat_nvm_tiering_throttled++;
+            break;
+        }
+        cursor = next;
+        if (cursor == 0) {
+            current_db = (current_db+1) % server.dbnum;
+            dbs_scanned++;
+        }
+
+        if (st.bytes_left == 0) {
+            server.stat_nvm_tiering_throttled++;
+            break;
+        }
+        if ((++iterations & 15) == 0 && ustime()-start > timelimit) break;
+    }
+}
+#endif
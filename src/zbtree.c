@@ -0,0 +1,868 @@
+/* B+tree used by the OBJ_ENCODING_BTREE sorted set encoding.
+ *
+ * This is an alternative to the skiplist for large sorted sets: like the
+ * skiplist it is paired with a dict mapping members to scores, and it owns
+ * the member SDS strings (the dict entries reference the same strings).
+ *
+ * Elements are ordered by score and then by member, exactly like in the
+ * skiplist. Every node stores the scores, the first 8 bytes of the members
+ * (big endian, zero padded, so that comparing two prefixes gives the same
+ * result as sdscmp() unless they are equal) and the member pointers in three
+ * separate arrays. A lookup touches a few contiguous cache lines per level
+ * and only follows a member pointer, that may point to NVM, when both score
+ * and prefix are equal.
+ *
+ * Inner nodes store, for every child, a copy of the lowest element below it
+ * and the number of elements below it. The lowest element is always kept
+ * exact, so the member pointers it contains are never dangling, and the
+ * counts are used to compute ranks in O(log n) like the skiplist spans.
+ *
+ * Insertion splits full nodes on the way down, so it never has to walk back
+ * up. Deletion walks back up the recorded path, merging nodes that become
+ * too small with one of their siblings when the result fits in one node.
+ *
+ * Copyright (c) 2018, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+#ifdef USE_NVM
+#include "nvm.h"
+#endif
+
+int sdscmplex(sds a, sds b);
+
+/* Path from the root to a node: the inner node and the child taken. */
+typedef struct zbtreePath {
+    zbtreeInner *node;
+    int idx;
+} zbtreePath;
+
+#define zbtNodeMax(n) ((n)->leaf ? ZBTREE_LEAF_ENTRIES : ZBTREE_INNER_ENTRIES)
+#define zbtNodeFull(n) ((n)->count == (unsigned int)zbtNodeMax(n))
+/* Nodes with less entries than this are merged with a sibling if possible. */
+#define zbtNodeMin(n) (zbtNodeMax(n)/4)
+
+/*-----------------------------------------------------------------------------
+ * Keys
+ *----------------------------------------------------------------------------*/
+
+static inline uint64_t zbtPrefix(sds ele) {
+    unsigned char buf[8] = {0};
+    size_t len = sdslen(ele);
+    uint64_t prefix;
+
+    memcpy(buf,ele,len < sizeof(buf) ? len : sizeof(buf));
+    memcpy(&prefix,buf,sizeof(prefix));
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    prefix = __builtin_bswap64(prefix);
+#endif
+    return prefix;
+}
+
+static inline int zbtCompare(double s1, uint64_t p1, sds e1,
+                             double s2, uint64_t p2, sds e2)
+{
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    if (p1 < p2) return -1;
+    if (p1 > p2) return 1;
+    if (e1 == e2) return 0;
+    return sdscmp(e1,e2);
+}
+
+/* Return the index of the first of the 'count' keys greater than the
+ * specified one, or 'count' if there is none. */
+static int zbtUpperBound(double *sv, uint64_t *pv, sds *ev, int count,
+                         double score, uint64_t prefix, sds ele)
+{
+    int lo = 0, hi = count;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(sv[mid],pv[mid],ev[mid],score,prefix,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the child of 'in' that contains, or would contain, the key. */
+static inline int zbtChildIndex(zbtreeInner *in, double score, uint64_t prefix,
+                                sds ele)
+{
+    int i = zbtUpperBound(in->score,in->prefix,in->ele,in->hdr.count,
+                          score,prefix,ele);
+    return i ? i-1 : 0;
+}
+
+/* Copy the lowest element of 'child' as the key of slot 'i' of 'in'. */
+static void zbtSetKeyFromChild(zbtreeInner *in, int i, zbtreeNode *child) {
+    if (child->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)child;
+        in->score[i] = l->score[0];
+        in->prefix[i] = l->prefix[0];
+        in->ele[i] = l->ele[0];
+    } else {
+        zbtreeInner *c = (zbtreeInner*)child;
+        in->score[i] = c->score[0];
+        in->prefix[i] = c->prefix[0];
+        in->ele[i] = c->ele[0];
+    }
+}
+
+/* The lowest element of the node at the end of 'path' changed: update the
+ * copies stored in its ancestors. */
+static void zbtUpdateLowKey(zbtreePath *path, int depth, double score,
+                            uint64_t prefix, sds ele)
+{
+    while (depth--) {
+        zbtreeInner *in = path[depth].node;
+        int i = path[depth].idx;
+        in->score[i] = score;
+        in->prefix[i] = prefix;
+        in->ele[i] = ele;
+        if (i != 0) break;
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * Nodes
+ *----------------------------------------------------------------------------*/
+
+static zbtreeLeaf *zbtCreateLeaf(zbtree *zbt) {
+    zbtreeLeaf *l = zmalloc(sizeof(*l));
+    l->hdr.leaf = 1;
+    l->hdr.count = 0;
+    l->prev = l->next = NULL;
+    zbt->leaves++;
+    return l;
+}
+
+static zbtreeInner *zbtCreateInner(zbtree *zbt) {
+    zbtreeInner *in = zmalloc(sizeof(*in));
+    in->hdr.leaf = 0;
+    in->hdr.count = 0;
+    zbt->inners++;
+    return in;
+}
+
+static void zbtFreeNode(zbtree *zbt, zbtreeNode *n) {
+    if (n->leaf)
+        zbt->leaves--;
+    else
+        zbt->inners--;
+    zfree(n);
+}
+
+/* Move 'count' entries of the key arrays from 'src' to 'dst'. */
+#define zbtMoveKeys(dst, dpos, src, spos, count) do { \
+    memmove((dst)->score+(dpos),(src)->score+(spos),(count)*sizeof(double)); \
+    memmove((dst)->prefix+(dpos),(src)->prefix+(spos),(count)*sizeof(uint64_t)); \
+    memmove((dst)->ele+(dpos),(src)->ele+(spos),(count)*sizeof(sds)); \
+} while(0)
+
+#define zbtMoveChildren(dst, dpos, src, spos, count) do { \
+    zbtMoveKeys(dst,dpos,src,spos,count); \
+    memmove((dst)->child+(dpos),(src)->child+(spos),(count)*sizeof(zbtreeNode*)); \
+    memmove((dst)->size+(dpos),(src)->size+(spos),(count)*sizeof(unsigned long)); \
+} while(0)
+
+/* Split the full child 'i' of 'parent' in two nodes. When 'edge' is 1 the
+ * element being inserted is greater than every element of the tree and only
+ * one entry is moved to the new node, when it is -1 the element is smaller
+ * than every element and only one entry is kept. This way sets filled in
+ * order, like timestamps or a skiplist saved from the tail by RDB, end up
+ * with full nodes instead of half full ones. */
+static void zbtSplitChild(zbtree *zbt, zbtreeInner *parent, int i, int edge) {
+    zbtreeNode *child = parent->child[i], *right;
+    unsigned long rsize = 0;
+    int keep = edge > 0 ? (int)child->count-1 :
+               edge < 0 ? 1 : (int)child->count/2;
+    int move = child->count-keep;
+
+    if (child->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)child, *r = zbtCreateLeaf(zbt);
+        zbtMoveKeys(r,0,l,keep,move);
+        r->next = l->next;
+        r->prev = l;
+        if (l->next)
+            l->next->prev = r;
+        else
+            zbt->tail = r;
+        l->next = r;
+        rsize = move;
+        right = (zbtreeNode*)r;
+    } else {
+        zbtreeInner *in = (zbtreeInner*)child, *r = zbtCreateInner(zbt);
+        int j;
+        zbtMoveChildren(r,0,in,keep,move);
+        for (j = 0; j < move; j++) rsize += r->size[j];
+        right = (zbtreeNode*)r;
+    }
+    child->count = keep;
+    right->count = move;
+
+    zbtMoveChildren(parent,i+2,parent,i+1,parent->hdr.count-(i+1));
+    parent->child[i+1] = right;
+    parent->size[i+1] = rsize;
+    parent->size[i] -= rsize;
+    zbtSetKeyFromChild(parent,i+1,right);
+    parent->hdr.count++;
+}
+
+/* Remove child 'i' from 'parent', freeing it. The child must be empty. */
+static void zbtRemoveChild(zbtree *zbt, zbtreeInner *parent, int i) {
+    zbtreeNode *child = parent->child[i];
+
+    if (child->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)child;
+        if (l->prev) l->prev->next = l->next; else zbt->head = l->next;
+        if (l->next) l->next->prev = l->prev; else zbt->tail = l->prev;
+    }
+    zbtFreeNode(zbt,child);
+    zbtMoveChildren(parent,i,parent,i+1,parent->hdr.count-(i+1));
+    parent->hdr.count--;
+}
+
+/* Append child 'i+1' of 'parent' to child 'i' and remove it. */
+static void zbtMergeChildren(zbtree *zbt, zbtreeInner *parent, int i) {
+    zbtreeNode *left = parent->child[i], *right = parent->child[i+1];
+
+    if (left->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)left, *r = (zbtreeLeaf*)right;
+        zbtMoveKeys(l,l->hdr.count,r,0,r->hdr.count);
+    } else {
+        zbtreeInner *l = (zbtreeInner*)left, *r = (zbtreeInner*)right;
+        zbtMoveChildren(l,l->hdr.count,r,0,r->hdr.count);
+    }
+    left->count += right->count;
+    right->count = 0;
+    parent->size[i] += parent->size[i+1];
+    zbtRemoveChild(zbt,parent,i+1);
+}
+
+/* Called after elements were removed below the node at the end of 'path':
+ * free empty nodes, merge small nodes with a sibling, and shrink the tree
+ * when the root is left with a single child. */
+static void zbtRebalance(zbtree *zbt, zbtreePath *path, int depth,
+                         zbtreeNode *x)
+{
+    while (depth > 0) {
+        zbtreeInner *parent = path[depth-1].node;
+        int i = path[depth-1].idx;
+        unsigned int max = zbtNodeMax(x);
+
+        if (x->count >= (unsigned int)zbtNodeMin(x)) break;
+        if (x->count == 0) {
+            zbtRemoveChild(zbt,parent,i);
+            if (i == 0 && parent->hdr.count)
+                zbtUpdateLowKey(path,depth-1,parent->score[0],
+                                parent->prefix[0],parent->ele[0]);
+        } else if (i > 0 && parent->child[i-1]->count+x->count <= max) {
+            zbtMergeChildren(zbt,parent,i-1);
+        } else if (i+1 < (int)parent->hdr.count &&
+                   x->count+parent->child[i+1]->count <= max) {
+            zbtMergeChildren(zbt,parent,i);
+        } else {
+            break;
+        }
+        x = (zbtreeNode*)parent;
+        depth--;
+    }
+
+    while (!zbt->root->leaf && zbt->root->count <= 1) {
+        zbtreeInner *root = (zbtreeInner*)zbt->root;
+        if (root->hdr.count == 1) {
+            zbt->root = root->child[0];
+        } else {
+            zbtreeLeaf *l = zbtCreateLeaf(zbt);
+            zbt->root = (zbtreeNode*)l;
+            zbt->head = zbt->tail = l;
+        }
+        zbtFreeNode(zbt,(zbtreeNode*)root);
+        zbt->height--;
+    }
+}
+
+/*-----------------------------------------------------------------------------
+ * API
+ *----------------------------------------------------------------------------*/
+
+/* Create a new empty B+tree. */
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbtreeLeaf *l;
+
+    zbt->length = 0;
+    zbt->leaves = zbt->inners = 0;
+    zbt->height = 1;
+    l = zbtCreateLeaf(zbt);
+    zbt->root = (zbtreeNode*)l;
+    zbt->head = zbt->tail = l;
+    return zbt;
+}
+
+static void zbtFreeSubtree(zbtree *zbt, zbtreeNode *n) {
+    unsigned int j;
+
+    if (n->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)n;
+        for (j = 0; j < l->hdr.count; j++) sdsfree(l->ele[j]);
+    } else {
+        zbtreeInner *in = (zbtreeInner*)n;
+        for (j = 0; j < in->hdr.count; j++) zbtFreeSubtree(zbt,in->child[j]);
+    }
+    zbtFreeNode(zbt,n);
+}
+
+/* Free a whole B+tree, including the member strings. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeSubtree(zbt,zbt->root);
+    zfree(zbt);
+}
+
+/* Insert a new element. Assumes the element does not already exist (up to
+ * the caller to enforce that). The tree takes ownership of the passed SDS
+ * string 'ele'. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    uint64_t prefix = zbtPrefix(ele);
+    zbtreeNode *x;
+    zbtreeLeaf *l;
+    int edge = 0, pos;
+
+    if (zbt->length) {
+        l = zbt->tail;
+        pos = l->hdr.count-1;
+        if (zbtCompare(score,prefix,ele,
+                       l->score[pos],l->prefix[pos],l->ele[pos]) > 0)
+            edge = 1;
+        else if (zbtCompare(score,prefix,ele,zbt->head->score[0],
+                            zbt->head->prefix[0],zbt->head->ele[0]) < 0)
+            edge = -1;
+    }
+
+    if (zbtNodeFull(zbt->root)) {
+        zbtreeInner *root = zbtCreateInner(zbt);
+        root->child[0] = zbt->root;
+        root->size[0] = zbt->length;
+        zbtSetKeyFromChild(root,0,zbt->root);
+        root->hdr.count = 1;
+        zbt->root = (zbtreeNode*)root;
+        zbt->height++;
+        serverAssert(zbt->height <= ZBTREE_MAX_HEIGHT);
+    }
+
+    x = zbt->root;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        int i = zbtChildIndex(in,score,prefix,ele);
+
+        if (zbtNodeFull(in->child[i])) {
+            zbtSplitChild(zbt,in,i,edge);
+            if (zbtCompare(in->score[i+1],in->prefix[i+1],in->ele[i+1],
+                           score,prefix,ele) <= 0) i++;
+        }
+        /* The new element becomes the lowest of the leftmost child. */
+        if (i == 0 && zbtCompare(score,prefix,ele,
+                                 in->score[0],in->prefix[0],in->ele[0]) < 0)
+        {
+            in->score[0] = score;
+            in->prefix[0] = prefix;
+            in->ele[0] = ele;
+        }
+        in->size[i]++;
+        x = in->child[i];
+    }
+
+    l = (zbtreeLeaf*)x;
+    pos = zbtUpperBound(l->score,l->prefix,l->ele,l->hdr.count,
+                        score,prefix,ele);
+    zbtMoveKeys(l,pos+1,l,pos,l->hdr.count-pos);
+    l->score[pos] = score;
+    l->prefix[pos] = prefix;
+    l->ele[pos] = ele;
+    l->hdr.count++;
+    zbt->length++;
+}
+
+/* Delete an element with matching score/element from the tree. The function
+ * returns 1 if the element was found and deleted, otherwise 0 is returned.
+ *
+ * If 'oldele' is NULL the element SDS string is freed, otherwise it is not
+ * freed and *oldele is set to it, so that the caller can reuse it. */
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *oldele) {
+    zbtreePath path[ZBTREE_MAX_HEIGHT];
+    uint64_t prefix = zbtPrefix(ele);
+    zbtreeNode *x = zbt->root;
+    zbtreeLeaf *l;
+    int depth = 0, pos, j;
+
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        path[depth].node = in;
+        path[depth].idx = zbtChildIndex(in,score,prefix,ele);
+        x = in->child[path[depth].idx];
+        depth++;
+    }
+
+    l = (zbtreeLeaf*)x;
+    pos = zbtUpperBound(l->score,l->prefix,l->ele,l->hdr.count,
+                        score,prefix,ele)-1;
+    if (pos < 0 || zbtCompare(l->score[pos],l->prefix[pos],l->ele[pos],
+                              score,prefix,ele) != 0)
+        return 0; /* not found */
+
+    if (oldele)
+        *oldele = l->ele[pos];
+    else
+        sdsfree(l->ele[pos]);
+    zbtMoveKeys(l,pos,l,pos+1,l->hdr.count-(pos+1));
+    l->hdr.count--;
+    zbt->length--;
+    for (j = 0; j < depth; j++) path[j].node->size[path[j].idx]--;
+
+    if (pos == 0 && l->hdr.count)
+        zbtUpdateLowKey(path,depth,l->score[0],l->prefix[0],l->ele[0]);
+    zbtRebalance(zbt,path,depth,x);
+    return 1;
+}
+
+/* Find the rank for an element by both score and member.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Like zslGetRank() the rank is 1-based. */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    uint64_t prefix = zbtPrefix(ele);
+    zbtreeNode *x = zbt->root;
+    zbtreeLeaf *l;
+    unsigned long rank = 0;
+    int pos, j;
+
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        int i = zbtChildIndex(in,score,prefix,ele);
+        for (j = 0; j < i; j++) rank += in->size[j];
+        x = in->child[i];
+    }
+
+    l = (zbtreeLeaf*)x;
+    pos = zbtUpperBound(l->score,l->prefix,l->ele,l->hdr.count,
+                        score,prefix,ele)-1;
+    if (pos < 0 || zbtCompare(l->score[pos],l->prefix[pos],l->ele[pos],
+                              score,prefix,ele) != 0)
+        return 0;
+    return rank+pos+1;
+}
+
+/* Find an element by its 1-based rank. Returns 0 if the rank is out of
+ * range, otherwise 1 with 'it' positioned on the element. */
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtreeIter *it) {
+    zbtreeNode *x = zbt->root;
+
+    if (rank < 1 || rank > zbt->length) return 0;
+    rank--;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        int i = 0;
+        while (rank >= in->size[i]) rank -= in->size[i++];
+        x = in->child[i];
+    }
+    it->leaf = (zbtreeLeaf*)x;
+    it->pos = rank;
+    return 1;
+}
+
+/* Position 'it' on the first / last element. Return 0 if the tree is
+ * empty. */
+int zbtFirst(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->length ? zbt->head : NULL;
+    it->pos = 0;
+    return it->leaf != NULL;
+}
+
+int zbtLast(zbtree *zbt, zbtreeIter *it) {
+    it->leaf = zbt->length ? zbt->tail : NULL;
+    it->pos = it->leaf ? (int)it->leaf->hdr.count-1 : 0;
+    return it->leaf != NULL;
+}
+
+/* Move 'it' to the next / previous element. Return 0 once the end is
+ * reached. */
+int zbtNext(zbtreeIter *it) {
+    if (++it->pos >= (int)it->leaf->hdr.count) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+    return it->leaf != NULL;
+}
+
+int zbtPrev(zbtreeIter *it) {
+    if (--it->pos < 0) {
+        it->leaf = it->leaf->prev;
+        it->pos = it->leaf ? (int)it->leaf->hdr.count-1 : 0;
+    }
+    return it->leaf != NULL;
+}
+
+/* Move 'it' forward, or backward if 'reverse' is true, by 'count' elements
+ * using the ranks, so that the elements in between are not visited. Return
+ * 0 if the end is reached. */
+int zbtSkip(zbtree *zbt, zbtreeIter *it, unsigned long count, int reverse) {
+    unsigned long rank = zbtGetRank(zbt,zbtIterScore(it),zbtIterEle(it));
+
+    if (reverse) {
+        if (count >= rank) return 0;
+        return zbtGetElementByRank(zbt,rank-count,it);
+    }
+    return zbtGetElementByRank(zbt,rank+count,it);
+}
+
+/*-----------------------------------------------------------------------------
+ * Ranges
+ *----------------------------------------------------------------------------*/
+
+/* Number of leading scores not satisfying 'min' (first index in range). */
+static inline int zbtScoresBelowMin(double *sv, int count, zrangespec *range) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (!zslValueGteMin(sv[mid],range)) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Number of leading scores satisfying 'max'. */
+static inline int zbtScoresLteMax(double *sv, int count, zrangespec *range) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslValueLteMax(sv[mid],range)) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+static inline int zbtElesBelowLexMin(sds *ev, int count, zlexrangespec *range) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (!zslLexValueGteMin(ev[mid],range)) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+static inline int zbtElesLteLexMax(sds *ev, int count, zlexrangespec *range) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zslLexValueLteMax(ev[mid],range)) lo = mid+1; else hi = mid;
+    }
+    return lo;
+}
+
+/* Returns if there is a part of the tree in range. */
+static int zbtIsInRange(zbtree *zbt, zrangespec *range) {
+    /* Test for ranges that will always be empty. */
+    if (range->min > range->max ||
+            (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslValueGteMin(zbt->tail->score[zbt->tail->hdr.count-1],range))
+        return 0;
+    if (!zslValueLteMax(zbt->head->score[0],range))
+        return 0;
+    return 1;
+}
+
+static int zbtIsInLexRange(zbtree *zbt, zlexrangespec *range) {
+    /* Test for ranges that will always be empty. */
+    if (sdscmplex(range->min,range->max) > 1 ||
+            (sdscmp(range->min,range->max) == 0 &&
+            (range->minex || range->maxex)))
+        return 0;
+    if (zbt->length == 0) return 0;
+    if (!zslLexValueGteMin(zbt->tail->ele[zbt->tail->hdr.count-1],range))
+        return 0;
+    if (!zslLexValueLteMax(zbt->head->ele[0],range))
+        return 0;
+    return 1;
+}
+
+/* Position 'it' on the first element in the specified range. Returns 0 when
+ * no element is contained in the range. */
+int zbtFirstInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    zbtreeNode *x;
+    zbtreeLeaf *l;
+    int i;
+
+    if (!zbtIsInRange(zbt,range)) return 0;
+
+    /* Go to the last child whose lowest element is *OUT* of range: the
+     * first element in range is there or is the lowest of the next child. */
+    x = zbt->root;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        i = zbtScoresBelowMin(in->score,in->hdr.count,range);
+        x = in->child[i ? i-1 : 0];
+    }
+    l = (zbtreeLeaf*)x;
+    i = zbtScoresBelowMin(l->score,l->hdr.count,range);
+    if (i == (int)l->hdr.count) {
+        l = l->next;
+        i = 0;
+    }
+    /* This is an inner range, so the next element cannot be missing. */
+    serverAssert(l != NULL);
+
+    if (!zslValueLteMax(l->score[i],range)) return 0;
+    it->leaf = l;
+    it->pos = i;
+    return 1;
+}
+
+/* Position 'it' on the last element in the specified range. Returns 0 when
+ * no element is contained in the range. */
+int zbtLastInRange(zbtree *zbt, zrangespec *range, zbtreeIter *it) {
+    zbtreeNode *x;
+    zbtreeLeaf *l;
+    int i;
+
+    if (!zbtIsInRange(zbt,range)) return 0;
+
+    /* Go to the last child whose lowest element is *IN* range. */
+    x = zbt->root;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        i = zbtScoresLteMax(in->score,in->hdr.count,range);
+        x = in->child[i ? i-1 : 0];
+    }
+    l = (zbtreeLeaf*)x;
+    i = zbtScoresLteMax(l->score,l->hdr.count,range)-1;
+    if (i < 0 || !zslValueGteMin(l->score[i],range)) return 0;
+    it->leaf = l;
+    it->pos = i;
+    return 1;
+}
+
+int zbtFirstInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    zbtreeNode *x;
+    zbtreeLeaf *l;
+    int i;
+
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+
+    x = zbt->root;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        i = zbtElesBelowLexMin(in->ele,in->hdr.count,range);
+        x = in->child[i ? i-1 : 0];
+    }
+    l = (zbtreeLeaf*)x;
+    i = zbtElesBelowLexMin(l->ele,l->hdr.count,range);
+    if (i == (int)l->hdr.count) {
+        l = l->next;
+        i = 0;
+    }
+    serverAssert(l != NULL);
+
+    if (!zslLexValueLteMax(l->ele[i],range)) return 0;
+    it->leaf = l;
+    it->pos = i;
+    return 1;
+}
+
+int zbtLastInLexRange(zbtree *zbt, zlexrangespec *range, zbtreeIter *it) {
+    zbtreeNode *x;
+    zbtreeLeaf *l;
+    int i;
+
+    if (!zbtIsInLexRange(zbt,range)) return 0;
+
+    x = zbt->root;
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        i = zbtElesLteLexMax(in->ele,in->hdr.count,range);
+        x = in->child[i ? i-1 : 0];
+    }
+    l = (zbtreeLeaf*)x;
+    i = zbtElesLteLexMax(l->ele,l->hdr.count,range)-1;
+    if (i < 0 || !zslLexValueGteMin(l->ele[i],range)) return 0;
+    it->leaf = l;
+    it->pos = i;
+    return 1;
+}
+
+/* Delete all the elements with score in range from the tree, and from the
+ * dict of the sorted set. Every element costs a lookup from the root, that
+ * is a few nodes since the tree is wide. */
+unsigned long zbtDeleteRangeByScore(zbtree *zbt, zrangespec *range, dict *dict) {
+    unsigned long removed = 0;
+    zbtreeIter it;
+
+    while (zbtFirstInRange(zbt,range,&it)) {
+        sds ele = zbtIterEle(&it);
+        double score = zbtIterScore(&it);
+        dictDelete(dict,ele);
+        zbtDelete(zbt,score,ele,NULL);
+        removed++;
+    }
+    return removed;
+}
+
+#ifdef SUPPORT_PBA
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict, client *c, robj *key) {
+#else
+unsigned long zbtDeleteRangeByLex(zbtree *zbt, zlexrangespec *range, dict *dict) {
+#endif
+    unsigned long removed = 0;
+    zbtreeIter it;
+
+#ifdef SUPPORT_PBA
+    int is_pba = IS_PBA();
+    robj* propargv[3];
+    if(is_pba)
+    {
+        propargv[0] = createStringObject("ZREM", 4);
+        propargv[1] = key;
+    }
+#endif
+
+    while (zbtFirstInLexRange(zbt,range,&it)) {
+        sds ele = zbtIterEle(&it);
+        double score = zbtIterScore(&it);
+        dictDelete(dict,ele);
+#ifdef SUPPORT_PBA
+        if(is_pba)
+        {
+            if(is_nvm_addr(ele))
+            {
+                propargv[2] = createObject(OBJ_STRING, ele);
+                propargv[2]->no_free_val = 1;
+            }
+            else
+                propargv[2] = createObject(OBJ_STRING, sdsdup(ele));
+            alsoPropagate(server.pba.zremCommand, c->db->id, propargv, 3, PROPAGATE_AOF);
+            decrRefCount(propargv[2]);
+        }
+#endif
+        zbtDelete(zbt,score,ele,NULL);
+        removed++;
+    }
+
+#ifdef SUPPORT_PBA
+    if(is_pba)
+    {
+        decrRefCount(propargv[0]);
+        preventCommandAOF(c);
+    }
+#endif
+    return removed;
+}
+
+/* Delete all the elements with rank between start and end from the tree.
+ * Start and end are inclusive and 1-based. */
+unsigned long zbtDeleteRangeByRank(zbtree *zbt, unsigned long start, unsigned long end, dict *dict) {
+    unsigned long removed = 0;
+    zbtreeIter it;
+
+    while (start+removed <= end && zbtGetElementByRank(zbt,start,&it)) {
+        sds ele = zbtIterEle(&it);
+        double score = zbtIterScore(&it);
+        dictDelete(dict,ele);
+        zbtDelete(zbt,score,ele,NULL);
+        removed++;
+    }
+    return removed;
+}
+
+/*-----------------------------------------------------------------------------
+ * Defragmentation
+ *----------------------------------------------------------------------------*/
+
+/* The member string 'oldele' was moved to 'newele' (with the same content):
+ * update the pointers to it. Like in zslDefrag() 'oldele' was already freed
+ * and may not be accessed, every node on the path is checked for the old
+ * pointer before comparing members. Returns 1 if the element was found. */
+int zbtReplaceEle(zbtree *zbt, double score, sds oldele, sds newele) {
+    uint64_t prefix = zbtPrefix(newele);
+    zbtreeNode *x = zbt->root;
+    zbtreeLeaf *l;
+    unsigned int j;
+
+    while (!x->leaf) {
+        zbtreeInner *in = (zbtreeInner*)x;
+        for (j = 0; j < in->hdr.count; j++)
+            if (in->ele[j] == oldele) in->ele[j] = newele;
+        x = in->child[zbtChildIndex(in,score,prefix,newele)];
+    }
+    l = (zbtreeLeaf*)x;
+    for (j = 0; j < l->hdr.count; j++) {
+        if (l->ele[j] == oldele) {
+            l->ele[j] = newele;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static long zbtDefragSubtree(zbtree *zbt, zbtreeNode **ref,
+                             void *(*defragfn)(void *))
+{
+    zbtreeNode *n = *ref, *newn;
+    long defragged = 0;
+    unsigned int j;
+
+    if (!n->leaf) {
+        zbtreeInner *in = (zbtreeInner*)n;
+        for (j = 0; j < in->hdr.count; j++)
+            defragged += zbtDefragSubtree(zbt,&in->child[j],defragfn);
+    }
+    if ((newn = defragfn(n)) == NULL) return defragged;
+
+    defragged++;
+    *ref = newn;
+    if (newn->leaf) {
+        zbtreeLeaf *l = (zbtreeLeaf*)newn;
+        if (l->prev) l->prev->next = l; else zbt->head = l;
+        if (l->next) l->next->prev = l; else zbt->tail = l;
+    }
+    return defragged;
+}
+
+/* Try to move every node of the tree with 'defragfn', that returns the new
+ * allocation or NULL if the node was not moved. Returns the number of moved
+ * nodes. */
+long zbtDefragNodes(zbtree *zbt, void *(*defragfn)(void *)) {
+    return zbtDefragSubtree(zbt,&zbt->root,defragfn);
+}
+
+/* Memory used by the tree structure, members excluded. */
+size_t zbtAllocSize(zbtree *zbt) {
+    return sizeof(*zbt)+zbt->leaves*sizeof(zbtreeLeaf)+
+           zbt->inners*sizeof(zbtreeInner);
+}
@@ -105,6 +105,22 @@
  *      subtracted from the encoded 4 bit value to obtain the right value.
  * |11111111| - End of ziplist special entry.
  *
+ * When compiled with USE_NVM, strings stored out of line on NVM are
+ * referenced by the entry instead of being copied into the ziplist:
+ * |11000001| - 9 bytes
+ *      Raw pointer to the sds (8 bytes). Only read, no longer written.
+ * |11000010|llllllll|llllllll| - 8 bytes
+ *      Reference to an sds of length up to 65535 bytes: the 16 bit length
+ *      is cached in the header, followed by the 40 bit offset of the sds
+ *      from the NVM pool base.
+ * |11000011|llllllll|llllllll|llllllll|llllllll| - 10 bytes
+ *      Same with a 32 bit length.
+ *      IMPORTANT: the cached lengths are stored in big endian like string
+ *      lengths, the offset in little endian.
+ * References stay valid if the pool is mapped at another address, and the
+ * cached length lets comparisons skip the entries of another length
+ * without reading NVM.
+ *
  * Like for the ziplist header, all the integers are represented in little
  * endian byte order, even when this code is compiled in big endian systems.
  *
@@ -185,14 +201,19 @@
 #include <string.h>
 #include <stdint.h>
 #include <limits.h>
+#include <pthread.h>
 #include "zmalloc.h"
 #include "util.h"
+#include "dict.h"
 #include "ziplist.h"
 #include "endianconv.h"
 #include "redisassert.h"
 #ifdef USE_NVM
 #include "nvm.h"
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define ZIP_END 255         /* Special "end of ziplist" entry. */
 #define ZIP_BIG_PREVLEN 254 /* Max number of bytes of the previous entry, for
@@ -211,6 +232,11 @@
 
 #ifdef USE_NVM
 #define ZIP_NVM_PTR 0xc1
+#define ZIP_NVM_REF_16B 0xc2
+#define ZIP_NVM_REF_32B 0xc3
+#define ZIP_NVM_REF_SIZE 5
+#define ZIP_NVM_REF_MAX_OFFSET (1ULL << (ZIP_NVM_REF_SIZE*8))
+#define ZIP_IS_NVM_REF(enc) ((enc) == ZIP_NVM_REF_16B || (enc) == ZIP_NVM_REF_32B)
 #endif
 
 #define ZIP_INT_16B (0xc0 | 0<<4)
@@ -369,6 +395,27 @@ unsigned int zipStoreEntryEncoding(unsigned char *p, unsigned char encoding, uns
             return len;
         buf[0] = ZIP_NVM_PTR;
     }
+    else if(encoding == ZIP_NVM_REF_16B)
+    {
+        /* 'rawlen' is the length of the referenced string. */
+        len += 2;
+        if(!p)
+            return len;
+        buf[0] = ZIP_NVM_REF_16B;
+        buf[1] = (rawlen >> 8) & 0xff;
+        buf[2] = rawlen & 0xff;
+    }
+    else if(encoding == ZIP_NVM_REF_32B)
+    {
+        len += 4;
+        if(!p)
+            return len;
+        buf[0] = ZIP_NVM_REF_32B;
+        buf[1] = (rawlen >> 24) & 0xff;
+        buf[2] = (rawlen >> 16) & 0xff;
+        buf[3] = (rawlen >> 8) & 0xff;
+        buf[4] = rawlen & 0xff;
+    }
 #endif
     else {
         /* Implies integer encoding, so length is always 1. */
@@ -408,6 +455,12 @@ unsigned int zipStoreEntryEncoding(unsigned char *p, unsigned char encoding, uns
     } else if((encoding) == ZIP_NVM_PTR) {                                     \
         (lensize) = 1;                                                         \
         (len) = sizeof(void*);                                                 \
+    } else if((encoding) == ZIP_NVM_REF_16B) {                                 \
+        (lensize) = 3;                                                         \
+        (len) = ZIP_NVM_REF_SIZE;                                              \
+    } else if((encoding) == ZIP_NVM_REF_32B) {                                 \
+        (lensize) = 5;                                                         \
+        (len) = ZIP_NVM_REF_SIZE;                                              \
     } else {                                                                   \
         (lensize) = 1;                                                         \
         (len) = zipIntSize(encoding);                                          \
@@ -623,6 +676,40 @@ void zipEntry(unsigned char *p, zlentry *e) {
     e->p = p;
 }
 
+#ifdef USE_NVM
+/* Return the length of the string referenced by a ZIP_NVM_REF_* entry, that
+ * is cached in the encoding header pointed by 'enc'. */
+static unsigned int zipNVMRefLength(unsigned char *enc) {
+    if (enc[0] == ZIP_NVM_REF_16B)
+        return (enc[1] << 8) | enc[2];
+    return ((unsigned int)enc[1] << 24) | (enc[2] << 16) | (enc[3] << 8) | enc[4];
+}
+
+static void zipStoreNVMRef(unsigned char *p, sds s) {
+    uint64_t offset = nvm_offset(s);
+    for (int j = 0; j < ZIP_NVM_REF_SIZE; j++)
+        p[j] = (offset >> (j*8)) & 0xff;
+}
+
+static sds zipLoadNVMRef(unsigned char *p) {
+    uint64_t offset = 0;
+    for (int j = ZIP_NVM_REF_SIZE-1; j >= 0; j--)
+        offset = (offset << 8) | p[j];
+    return nvm_addr(offset);
+}
+
+/* Return the NVM string referenced by the entry, or NULL if the value of
+ * the entry is stored in the ziplist itself. */
+static sds zipEntryNVMString(zlentry *e) {
+    unsigned char *q = e->p + e->headersize;
+    if (e->encoding == ZIP_NVM_PTR)
+        return *((sds*)q);
+    if (ZIP_IS_NVM_REF(e->encoding))
+        return zipLoadNVMRef(q);
+    return NULL;
+}
+#endif
+
 /* Create a new empty ziplist. */
 unsigned char *ziplistNew(void) {
     unsigned int bytes = ZIPLIST_HEADER_SIZE+1;
@@ -635,40 +722,125 @@ unsigned char *ziplistNew(void) {
 }
 
 #ifdef USE_NVM
-/* update item at "p". */
-unsigned char* ziplistNVMEntryDecode(unsigned char* zl)
-{
-    if(!zl)
-        return zl;
-    unsigned char* new_zl = ziplistNew();
-    unsigned char* fptr = ziplistIndex(zl, ZIPLIST_HEAD);
-    while(fptr)
-    {
-        unsigned char* vstr = NULL;
-        unsigned int vlen = UINT_MAX;
-        long long vll = LLONG_MAX;
-        ziplistGet(fptr, &vstr, &vlen, &vll);
-        if(vstr)
-        {
-            if(is_nvm_addr(vstr))
-            {
-                void* ptr = zmalloc(vlen);
-                memcpy(ptr, vstr, vlen);
-                new_zl = ziplistPush(new_zl, ptr, vlen, ZIPLIST_TAIL);
-                zfree(ptr);
-            }
-            else
-                new_zl = ziplistPush(new_zl, vstr, vlen, ZIPLIST_TAIL);
+/* Return 1 if some entry of the ziplist references an NVM string. */
+int ziplistHasNVMEntries(unsigned char *zl) {
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl);
+    while (p[0] != ZIP_END) {
+        zlentry entry;
+        zipEntry(p, &entry);
+        if (entry.encoding == ZIP_NVM_PTR || ZIP_IS_NVM_REF(entry.encoding))
+            return 1;
+        p += entry.headersize+entry.len;
+    }
+    return 0;
+}
+
+/* Return the length of the NVM string referenced by the entry. */
+static unsigned int zipEntryNVMLength(zlentry *e) {
+    if (e->encoding == ZIP_NVM_PTR)
+        return sdslen(zipEntryNVMString(e));
+    return zipNVMRefLength(e->p + e->prevrawlensize);
+}
+
+/* Bytes of the entry, without its prevlen field, once its NVM string (if
+ * any) is stored inline as a plain string entry. */
+static unsigned int zipInlinedBodySize(zlentry *e) {
+    unsigned int slen;
+    if (!zipEntryNVMString(e)) return e->lensize+e->len;
+    slen = zipEntryNVMLength(e);
+    return zipStoreEntryEncoding(NULL,ZIP_STR_06B,slen)+slen;
+}
+
+/* Bytes of the prevlen field of the entry once inlined, when the previous
+ * entry takes 'prevlen' bytes. An unchanged prevlen keeps its encoding so
+ * that runs of unchanged entries can be copied as they are. */
+static unsigned int zipInlinedPrevlenSize(zlentry *e, unsigned int prevlen) {
+    if (prevlen == e->prevrawlen) return e->prevrawlensize;
+    return zipStorePrevEntryLength(NULL,prevlen);
+}
+
+/* Return the size of the ziplist blob with every NVM string stored inline,
+ * and the offset of its tail entry in '*tail'. */
+static size_t zipInlinedLayout(unsigned char *zl, size_t *tail) {
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl);
+    size_t offset = ZIPLIST_HEADER_SIZE;
+    unsigned int prevlen = 0;
+
+    *tail = offset;
+    while (p[0] != ZIP_END) {
+        zlentry entry;
+        zipEntry(p, &entry);
+        *tail = offset;
+        prevlen = zipInlinedPrevlenSize(&entry,prevlen)+zipInlinedBodySize(&entry);
+        offset += prevlen;
+        p += entry.headersize+entry.len;
+    }
+    return offset+1;
+}
+
+/* Return the size of the blob ziplistWriteInlined() writes. */
+size_t ziplistInlinedBlobLen(unsigned char *zl) {
+    size_t tail;
+    return zipInlinedLayout(zl,&tail);
+}
+
+/* Write the ziplist with the NVM strings it references stored inline, as
+ * a plain ziplist that can be loaded anywhere, calling 'write' for each
+ * piece: NVM strings are written straight from NVM and no copy of the
+ * ziplist is built. Unchanged entries are written in runs. The bytes of NVM
+ * strings written are added to '*nvm_bytes'. Returns 0 if 'write' failed. */
+int ziplistWriteInlined(unsigned char *zl, ziplistWriteFn *write, void *ctx,
+                        size_t *nvm_bytes) {
+    unsigned char hdr[ZIPLIST_HEADER_SIZE], buf[10], end = ZIP_END;
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl), *run = p;
+    unsigned int prevlen = 0;
+    uint32_t u32;
+    size_t tail, bytes = zipInlinedLayout(zl,&tail);
+
+    u32 = intrev32ifbe(bytes);
+    memcpy(hdr,&u32,4);
+    u32 = intrev32ifbe(tail);
+    memcpy(hdr+4,&u32,4);
+    memcpy(hdr+8,zl+8,2); /* The entries count is unchanged. */
+    if (!write(ctx,hdr,sizeof(hdr))) return 0;
+
+    while (p[0] != ZIP_END) {
+        zlentry entry;
+        sds s;
+        unsigned int n, slen;
+
+        zipEntry(p, &entry);
+        s = zipEntryNVMString(&entry);
+        if (!s && prevlen == entry.prevrawlen) {
+            /* Unchanged: extend the current run. */
+            prevlen = entry.headersize+entry.len;
+            p += prevlen;
+            continue;
         }
-        else
-        {
-            char buffer[32];
-            int len = ll2string(buffer, 32, vll);
-            new_zl = ziplistPush(new_zl, (unsigned char*)buffer, len, ZIPLIST_TAIL);
+        if (p > run && !write(ctx,run,p-run)) return 0;
+        if (prevlen == entry.prevrawlen) {
+            n = entry.prevrawlensize;
+            memcpy(buf,p,n);
+        } else {
+            n = zipStorePrevEntryLength(buf,prevlen);
+        }
+        if (!s) {
+            if (!write(ctx,buf,n) ||
+                !write(ctx,p+entry.prevrawlensize,entry.lensize+entry.len))
+                return 0;
+            prevlen = n+entry.lensize+entry.len;
+        } else {
+            slen = zipEntryNVMLength(&entry);
+            n += zipStoreEntryEncoding(buf+n,ZIP_STR_06B,slen);
+            if (!write(ctx,buf,n) || !write(ctx,s,slen)) return 0;
+            prevlen = n+slen;
+            if (nvm_bytes) *nvm_bytes += slen;
         }
-        fptr = ziplistNext(zl, fptr);
+        p += entry.headersize+entry.len;
+        run = p;
     }
-    return new_zl;
+    if (p > run && !write(ctx,run,p-run)) return 0;
+    return write(ctx,&end,1);
 }
 
 #endif
@@ -676,6 +848,7 @@ unsigned char* ziplistNVMEntryDecode(unsigned char* zl)
 
 /* Resize the ziplist. */
 unsigned char *ziplistResize(unsigned char *zl, unsigned int len) {
+    ziplistIndexDrop(zl);
     zl = zrealloc(zl,len);
     ZIPLIST_BYTES(zl) = intrev32ifbe(len);
     zl[len-1] = ZIP_END;
@@ -782,11 +955,9 @@ unsigned char *__ziplistDelete(unsigned char *zl, unsigned char *p, unsigned int
         {
             zlentry entry;
             zipEntry(p, &entry);
-            if(entry.encoding == ZIP_NVM_PTR) {
-                assert(entry.len == sizeof(sds*));
-                sds s = *((sds*)(p+entry.headersize));
+            sds s = zipEntryNVMString(&entry);
+            if(s)
                 sdsfree(s);
-            }
         }
 #endif
         p += zipRawEntryLength(p);
@@ -874,8 +1045,13 @@ unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned cha
     }
 #ifdef USE_NVM
     else if(is_nvm_addr(s)) {
-        encoding = ZIP_NVM_PTR;
-        reqlen = sizeof(void*);
+        if(nvm_offset(s) < ZIP_NVM_REF_MAX_OFFSET) {
+            encoding = slen <= 0xffff ? ZIP_NVM_REF_16B : ZIP_NVM_REF_32B;
+            reqlen = ZIP_NVM_REF_SIZE;
+        } else {
+            encoding = ZIP_NVM_PTR;
+            reqlen = sizeof(void*);
+        }
     }
 #endif
     else {
@@ -949,6 +1125,9 @@ unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned cha
     else if(encoding == ZIP_NVM_PTR) {
         (*((void**)p)) = s;
     }
+    else if(ZIP_IS_NVM_REF(encoding)) {
+        zipStoreNVMRef(p,(sds)s);
+    }
 #endif
     else {
         zipSaveInteger(p,value,encoding);
@@ -1022,6 +1201,8 @@ unsigned char *ziplistMerge(unsigned char **first, unsigned char **second) {
     size_t second_offset = intrev32ifbe(ZIPLIST_TAIL_OFFSET(*second));
 
     /* Extend target to new zlbytes then append or prepend source. */
+    ziplistIndexDrop(*first);
+    ziplistIndexDrop(*second);
     target = zrealloc(target, zlbytes);
     if (append) {
         /* append == appending to target */
@@ -1172,6 +1353,13 @@ unsigned int ziplistGet(unsigned char *p, unsigned char **sstr, unsigned int *sl
             (*sstr) = (unsigned char*)s;
         }
     }
+    else if(ZIP_IS_NVM_REF(entry.encoding)) {
+        if(sstr)
+        {
+            (*slen) = zipNVMRefLength(p + entry.prevrawlensize);
+            (*sstr) = (unsigned char*)zipLoadNVMRef(p + entry.headersize);
+        }
+    }
 #endif
     else {
         if (sval) {
@@ -1244,6 +1432,11 @@ unsigned int ziplistCompare(unsigned char *p, unsigned char *sstr, unsigned int
         sds s = (*((void**)(p + entry.headersize)));
         return sdslen(s) == slen && memcmp(s, sstr, slen) == 0;
     }
+    else if(ZIP_IS_NVM_REF(entry.encoding)) {
+        /* The cached length avoids reading NVM for most mismatches. */
+        if (zipNVMRefLength(p + entry.prevrawlensize) != slen) return 0;
+        return memcmp(zipLoadNVMRef(p + entry.headersize), sstr, slen) == 0;
+    }
 #endif
     else {
         /* Try to compare encoded values. Don't compare encoding because
@@ -1285,6 +1478,11 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
                 if(sdslen(s) == vlen && memcmp(s, vstr, vlen) == 0)
                     return p;
             }
+            else if(ZIP_IS_NVM_REF(encoding)) {
+                if(zipNVMRefLength(p + prevlensize) == vlen &&
+                   memcmp(zipLoadNVMRef(q), vstr, vlen) == 0)
+                    return p;
+            }
 #endif
             else {
                 /* Find out if the searched field can be encoded. Note that
@@ -1326,6 +1524,279 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
     return NULL;
 }
 
+/* Lookup index.
+ *
+ * Hashes and sorted sets encoded as ziplists store their keys (fields,
+ * members) at even positions, and finding one with ziplistFind() decodes
+ * every entry up to it. For ziplists of at least 'min_entries' entries,
+ * ziplistFindKey() keeps a side index instead: the offset of every key and
+ * a 1 byte fingerprint of it, in two parallel arrays. A lookup compares the
+ * fingerprint of the searched key with 16 fingerprints at a time and only
+ * decodes the entries that match, that is about one entry instead of half
+ * of them.
+ *
+ * The index is built on the second lookup of a ziplist that wasn't modified
+ * in between, so that ziplists written as often as they are read don't pay
+ * for building it every time. Any change to a ziplist drops its index
+ * (ziplistResize() and ziplistMerge() take care of that), and code freeing
+ * or moving a ziplist that may have been looked up with ziplistFindKey()
+ * has to call ziplistIndexDrop() first. Indexes are kept up to 'max_bytes'
+ * bytes, least recently used first out.
+ *
+ * Entries are found by ziplist pointer. Since every resize of any ziplist
+ * has to check for an index, a table of counters by pointer hash tells
+ * first if there may be one. The lock is needed because objects may be
+ * released by the lazyfree thread. Forked children don't use the index. */
+#define ZIPLIST_INDEX_FILTER_BITS 14
+
+typedef struct ziplistIndexEntry {
+    unsigned char *zl;
+    unsigned int count;     /* Number of keys, 0 until the index is built. */
+    uint32_t *offsets;      /* Offset of every key from the start of zl. */
+    uint8_t *fps;           /* Fingerprint of every key. */
+    size_t sz;
+    struct ziplistIndexEntry *prev, *next;
+} ziplistIndexEntry;
+
+static struct {
+    dict *entries;          /* Ziplist pointer -> ziplistIndexEntry. */
+    ziplistIndexEntry *head, *tail; /* LRU order, most recent first. */
+    size_t used;
+    size_t max_bytes;       /* 0 disables the index. */
+    unsigned int min_entries;
+    long long hits;         /* Lookups served by an index. */
+    long long misses;       /* Lookups that had to decode the ziplist. */
+    uint16_t filter[1<<ZIPLIST_INDEX_FILTER_BITS]; /* Entries by slot. */
+    pthread_mutex_t lock;
+} zlindex;
+
+static uint64_t ziplistIndexHash(const void *key) {
+    return dictGenHashFunction(&key,sizeof(key));
+}
+
+static dictType ziplistIndexDictType = {
+    ziplistIndexHash,           /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    NULL,                       /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static inline unsigned int zipIndexSlot(unsigned char *zl) {
+    return ((uint64_t)(uintptr_t)zl * 0x9E3779B97F4A7C15ULL) >>
+           (64-ZIPLIST_INDEX_FILTER_BITS);
+}
+
+/* FNV-1a folded to a single byte. Integer entries are fingerprinted by
+ * their string representation, since that is what lookups get. */
+static uint8_t zipFingerprint(const unsigned char *s, unsigned int len) {
+    uint32_t h = 2166136261U;
+    for (unsigned int j = 0; j < len; j++)
+        h = (h ^ s[j]) * 16777619U;
+    h ^= h >> 16;
+    return h ^ (h >> 8);
+}
+
+static uint8_t zipEntryFingerprint(unsigned char *p) {
+    char buf[32];
+    zlentry entry;
+    int len;
+
+    zipEntry(p, &entry);
+    if (ZIP_IS_STR(entry.encoding))
+        return zipFingerprint(p+entry.headersize,entry.len);
+#ifdef USE_NVM
+    sds s = zipEntryNVMString(&entry);
+    if (s) return zipFingerprint((unsigned char*)s,sdslen(s));
+#endif
+    len = ll2string(buf,sizeof(buf),
+                    zipLoadInteger(p+entry.headersize,entry.encoding));
+    return zipFingerprint((unsigned char*)buf,len);
+}
+
+static void ziplistIndexAtForkChild(void) {
+    zlindex.entries = NULL;
+}
+
+void ziplistIndexInit(void) {
+    zlindex.entries = dictCreate(&ziplistIndexDictType,NULL);
+    zlindex.head = zlindex.tail = NULL;
+    zlindex.used = 0;
+    zlindex.hits = zlindex.misses = 0;
+    memset(zlindex.filter,0,sizeof(zlindex.filter));
+    pthread_mutex_init(&zlindex.lock,NULL);
+    pthread_atfork(NULL,NULL,ziplistIndexAtForkChild);
+}
+
+static void ziplistIndexUnlink(ziplistIndexEntry *e) {
+    if (e->prev) e->prev->next = e->next; else zlindex.head = e->next;
+    if (e->next) e->next->prev = e->prev; else zlindex.tail = e->prev;
+}
+
+static void ziplistIndexLinkHead(ziplistIndexEntry *e) {
+    e->prev = NULL;
+    e->next = zlindex.head;
+    if (zlindex.head) zlindex.head->prev = e; else zlindex.tail = e;
+    zlindex.head = e;
+}
+
+/* Called with the lock held. */
+static void ziplistIndexAdd(ziplistIndexEntry *e) {
+    dictAdd(zlindex.entries,e->zl,e);
+    ziplistIndexLinkHead(e);
+    zlindex.used += e->sz;
+    zlindex.filter[zipIndexSlot(e->zl)]++;
+}
+
+/* Called with the lock held. */
+static void ziplistIndexRemove(ziplistIndexEntry *e) {
+    dictDelete(zlindex.entries,e->zl);
+    ziplistIndexUnlink(e);
+    zlindex.used -= e->sz;
+    zlindex.filter[zipIndexSlot(e->zl)]--;
+    zfree(e);
+}
+
+/* Evict the least recently used entries until 'limit' bytes are used.
+ * Called with the lock held. */
+static void ziplistIndexEvict(size_t limit) {
+    while (zlindex.used > limit && zlindex.tail)
+        ziplistIndexRemove(zlindex.tail);
+}
+
+/* Apply new limits: indexes take up to 'max_bytes' bytes and are only
+ * built for ziplists of at least 'min_entries' entries. */
+void ziplistIndexSetLimits(size_t max_bytes, unsigned int min_entries) {
+    zlindex.max_bytes = max_bytes;
+    zlindex.min_entries = min_entries;
+    if (!zlindex.entries) return;
+    pthread_mutex_lock(&zlindex.lock);
+    ziplistIndexEvict(max_bytes);
+    pthread_mutex_unlock(&zlindex.lock);
+}
+
+/* Forget about the index of 'zl', if any, because it is going to change or
+ * to be freed. */
+void ziplistIndexDrop(unsigned char *zl) {
+    dictEntry *de;
+
+    if (!zlindex.entries || !zlindex.filter[zipIndexSlot(zl)]) return;
+    pthread_mutex_lock(&zlindex.lock);
+    if ((de = dictFind(zlindex.entries,zl)) != NULL)
+        ziplistIndexRemove(dictGetVal(de));
+    pthread_mutex_unlock(&zlindex.lock);
+}
+
+void ziplistIndexGetStats(size_t *used, long long *hits, long long *misses) {
+    *used = zlindex.used;
+    *hits = zlindex.hits;
+    *misses = zlindex.misses;
+}
+
+void ziplistIndexResetStats(void) {
+    zlindex.hits = zlindex.misses = 0;
+}
+
+/* Return a new entry for 'zl', that isn't indexed yet if 'build' is 0. */
+static ziplistIndexEntry *ziplistIndexCreate(unsigned char *zl, int build) {
+    unsigned int len = build ? ziplistLen(zl) : 0, count = (len+1)/2, j;
+    ziplistIndexEntry *e;
+    unsigned char *p;
+
+    e = zmalloc(sizeof(*e)+count*(sizeof(uint32_t)+sizeof(uint8_t)));
+    e->zl = zl;
+    e->count = count;
+    e->offsets = (uint32_t*)(e+1);
+    e->fps = (uint8_t*)(e->offsets+count);
+    e->sz = sizeof(*e)+count*(sizeof(uint32_t)+sizeof(uint8_t));
+    p = ZIPLIST_ENTRY_HEAD(zl);
+    for (j = 0; j < count; j++) {
+        e->offsets[j] = p-zl;
+        e->fps[j] = zipEntryFingerprint(p);
+        /* Skip the key and the value. */
+        p += zipRawEntryLength(p);
+        if (p[0] != ZIP_END) p += zipRawEntryLength(p);
+    }
+    return e;
+}
+
+/* Return the key of 'e' equal to 'vstr', or NULL. */
+static unsigned char *ziplistIndexLookup(ziplistIndexEntry *e,
+                                         unsigned char *vstr,
+                                         unsigned int vlen) {
+    unsigned char *zl = e->zl, *p;
+    uint8_t fp = zipFingerprint(vstr,vlen);
+    unsigned int j = 0;
+
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8((char)fp);
+    for (; j+16 <= e->count; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(e->fps+j));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v,needle));
+        while (mask) {
+            p = zl+e->offsets[j+__builtin_ctz(mask)];
+            if (ziplistCompare(p,vstr,vlen)) return p;
+            mask &= mask-1;
+        }
+    }
+#endif
+    for (; j < e->count; j++) {
+        if (e->fps[j] != fp) continue;
+        p = zl+e->offsets[j];
+        if (ziplistCompare(p,vstr,vlen)) return p;
+    }
+    return NULL;
+}
+
+/* Find the key equal to 'vstr' in a ziplist of key-value pairs, that is
+ * like ziplistFind(ziplistIndex(zl,ZIPLIST_HEAD),vstr,vlen,1), using the
+ * lookup index of 'zl' when there is one. The ziplist must not be modified
+ * between lookups without going through the ziplist API. */
+unsigned char *ziplistFindKey(unsigned char *zl, unsigned char *vstr,
+                              unsigned int vlen) {
+    ziplistIndexEntry *e;
+    dictEntry *de;
+    size_t sz;
+
+    if (!zlindex.entries || !zlindex.max_bytes ||
+        intrev16ifbe(ZIPLIST_LENGTH(zl)) < zlindex.min_entries)
+        return ziplistFind(ZIPLIST_ENTRY_HEAD(zl),vstr,vlen,1);
+
+    pthread_mutex_lock(&zlindex.lock);
+    if ((de = dictFind(zlindex.entries,zl)) == NULL) {
+        /* First lookup: just remember about it. */
+        ziplistIndexAdd(ziplistIndexCreate(zl,0));
+        ziplistIndexEvict(zlindex.max_bytes);
+        zlindex.misses++;
+        pthread_mutex_unlock(&zlindex.lock);
+        return ziplistFind(ZIPLIST_ENTRY_HEAD(zl),vstr,vlen,1);
+    }
+
+    e = dictGetVal(de);
+    if (e->count == 0) {
+        /* Second lookup without changes in between: build the index. */
+        ziplistIndexRemove(e);
+        sz = sizeof(*e)+((ziplistLen(zl)+1)/2)*(sizeof(uint32_t)+sizeof(uint8_t));
+        if (sz > zlindex.max_bytes) {
+            zlindex.misses++;
+            pthread_mutex_unlock(&zlindex.lock);
+            return ziplistFind(ZIPLIST_ENTRY_HEAD(zl),vstr,vlen,1);
+        }
+        e = ziplistIndexCreate(zl,1);
+        ziplistIndexAdd(e);
+        ziplistIndexEvict(zlindex.max_bytes);
+        zlindex.misses++;
+    } else {
+        ziplistIndexUnlink(e);
+        ziplistIndexLinkHead(e);
+        zlindex.hits++;
+    }
+    /* Only the thread owning 'zl' can drop its index. */
+    pthread_mutex_unlock(&zlindex.lock);
+    return ziplistIndexLookup(e,vstr,vlen);
+}
+
 /* Return length of ziplist. */
 unsigned int ziplistLen(unsigned char *zl) {
     unsigned int len = 0;
@@ -1397,7 +1868,14 @@ void ziplistRepr(unsigned char *zl) {
                 if (entry.len &&
                     fwrite(p,entry.len,1,stdout) == 0) perror("fwrite");
             }
-        } else {
+        }
+#ifdef USE_NVM
+        else if (entry.encoding == ZIP_NVM_PTR ||
+                 ZIP_IS_NVM_REF(entry.encoding)) {
+            printf("\t[nvm]%p", (void*)zipEntryNVMString(&entry));
+        }
+#endif
+        else {
             printf("\t[int]%lld", (long long) zipLoadInteger(p,entry.encoding));
         }
         printf("\n}\n");
@@ -1412,17 +1890,15 @@ void ziplistFree(unsigned char* zl)
 {
     if(!zl)
         return;
+    ziplistIndexDrop(zl);
     unsigned char* p = ZIPLIST_ENTRY_HEAD(zl);
     while(p[0] != ZIP_END)
     {
         zlentry entry;
         zipEntry(p, &entry);
-        if(entry.encoding == ZIP_NVM_PTR)
-        {
-            assert(entry.len == sizeof(void*));
-            sds s = (*((void**)(p + entry.headersize)));
+        sds s = zipEntryNVMString(&entry);
+        if(s)
             sdsfree(s);
-        }
         p += zipRawEntryLength(p);
     }
     zfree(zl);
@@ -2111,6 +2587,88 @@ int ziplistTest(int argc, char **argv) {
         stress(ZIPLIST_TAIL,100000,16384,256);
     }
 
+    printf("Lookup index matches ziplistFind():\n");
+    {
+        char buf[64];
+        int i, j, len;
+        unsigned char *q, *expected;
+        long long start, scan, indexed;
+
+        ziplistIndexInit();
+        ziplistIndexSetLimits(1024*1024,16);
+        for (i = 0; i < 200; i++) {
+            int pairs = rand() % 256;
+            zl = ziplistNew();
+            for (j = 0; j < pairs; j++) {
+                if (rand() & 1)
+                    len = sprintf(buf,"%d",rand() % 100000 - 50000);
+                else
+                    len = randstring(buf,0,40);
+                zl = ziplistPush(zl,(unsigned char*)buf,len,ZIPLIST_TAIL);
+                zl = ziplistPush(zl,(unsigned char*)"v",1,ZIPLIST_TAIL);
+            }
+            for (j = 0; j < 3*pairs+10; j++) {
+                if (j < 2*pairs) {
+                    /* Every key, twice, so that the index gets built. */
+                    p = ziplistIndex(zl,(j % pairs)*2);
+                    assert(ziplistGet(p,&entry,&elen,&value));
+                    if (entry == NULL) {
+                        elen = sprintf(buf,"%lld",value);
+                        entry = (unsigned char*)buf;
+                    }
+                } else {
+                    /* Probably missing keys, and values. */
+                    if (rand() & 1)
+                        elen = sprintf(buf,"%d",rand() % 100000 - 50000);
+                    else
+                        elen = randstring(buf,0,40);
+                    if (j % 7 == 0) elen = sprintf(buf,"v");
+                    entry = (unsigned char*)buf;
+                }
+                expected = ziplistFind(ZIPLIST_ENTRY_HEAD(zl),entry,elen,1);
+                q = ziplistFindKey(zl,entry,elen);
+                assert(q == expected);
+            }
+            /* Writes drop the index. */
+            zl = ziplistPush(zl,(unsigned char*)"newkey",6,ZIPLIST_HEAD);
+            zl = ziplistPush(zl,(unsigned char*)"v",1,ZIPLIST_TAIL);
+            assert(ziplistFindKey(zl,(unsigned char*)"newkey",6) ==
+                   ZIPLIST_ENTRY_HEAD(zl));
+            ziplistIndexDrop(zl);
+            zfree(zl);
+        }
+
+        /* A 512 entries hash, looking up every field. */
+        zl = ziplistNew();
+        for (j = 0; j < 256; j++) {
+            len = sprintf(buf,"field:%d",j);
+            zl = ziplistPush(zl,(unsigned char*)buf,len,ZIPLIST_TAIL);
+            zl = ziplistPush(zl,(unsigned char*)"value",5,ZIPLIST_TAIL);
+        }
+        start = usec();
+        for (i = 0; i < 100; i++) {
+            for (j = 0; j < 256; j++) {
+                len = sprintf(buf,"field:%d",j);
+                assert(ziplistFind(ZIPLIST_ENTRY_HEAD(zl),
+                                   (unsigned char*)buf,len,1) != NULL);
+            }
+        }
+        scan = usec()-start;
+        start = usec();
+        for (i = 0; i < 100; i++) {
+            for (j = 0; j < 256; j++) {
+                len = sprintf(buf,"field:%d",j);
+                assert(ziplistFindKey(zl,(unsigned char*)buf,len) != NULL);
+            }
+        }
+        indexed = usec()-start;
+        printf("ziplistFind: %lld usec, ziplistFindKey: %lld usec\n",
+               scan, indexed);
+        ziplistIndexDrop(zl);
+        zfree(zl);
+        printf("SUCCESS\n\n");
+    }
+
     return 0;
 }
 #endif
@@ -50,9 +50,19 @@ unsigned char *ziplistFind(unsigned char *p, unsigned char *vstr, unsigned int v
 unsigned int ziplistLen(unsigned char *zl);
 size_t ziplistBlobLen(unsigned char *zl);
 void ziplistRepr(unsigned char *zl);
+unsigned char *ziplistFindKey(unsigned char *zl, unsigned char *vstr, unsigned int vlen);
+void ziplistIndexInit(void);
+void ziplistIndexSetLimits(size_t max_bytes, unsigned int min_entries);
+void ziplistIndexDrop(unsigned char *zl);
+void ziplistIndexGetStats(size_t *used, long long *hits, long long *misses);
+void ziplistIndexResetStats(void);
 
 #ifdef USE_NVM
-unsigned char* ziplistNVMEntryDecode(unsigned char* zl);
+typedef int ziplistWriteFn(void *ctx, const void *buf, size_t len);
+int ziplistHasNVMEntries(unsigned char *zl);
+size_t ziplistInlinedBlobLen(unsigned char *zl);
+int ziplistWriteInlined(unsigned char *zl, ziplistWriteFn *write, void *ctx,
+                        size_t *nvm_bytes);
 void ziplistFree(unsigned char* zl);
 unsigned char *ziplistDeleteRangeNoFreeNVM(unsigned char *zl, int index, unsigned int num);
 #endif
@@ -75,17 +75,150 @@ void zlibc_free(void *ptr) {
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     atomicIncr(used_memory,__n); \
+    zmalloc_stat_dram_alloc(_n); \
 } while(0)
 
 #define update_zmalloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     atomicDecr(used_memory,__n); \
+    zmalloc_stat_dram_free(_n); \
 } while(0)
 
 static size_t used_memory = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Per thread allocation statistics. Every thread only updates its own shard,
+ * without atomic operations, and readers sum all the shards. A thread freeing
+ * memory allocated by another thread makes its own counters wrap around,
+ * which cancels out in the sum. The number of live allocations is the sum of
+ * the histogram, and the DRAM bytes are already in 'used_memory': a DRAM
+ * allocation only costs a histogram update on top of the atomic. When a
+ * thread exits its shard is merged into 'zmalloc_retired', always the last
+ * shard of the list, and released. */
+typedef struct zmallocShard {
+    size_t used[ZMALLOC_TIERS];     /* Not updated for ZMALLOC_TIER_DRAM. */
+    size_t hist[ZMALLOC_TIERS][ZMALLOC_HIST_BUCKETS];
+    struct zmallocShard *next;
+} zmallocShard;
+
+static __thread zmallocShard *zmalloc_shard = NULL;
+static zmallocShard zmalloc_retired;
+static zmallocShard *zmalloc_shards = &zmalloc_retired;
+static pthread_mutex_t zmalloc_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t zmalloc_shard_key;
+static pthread_once_t zmalloc_shard_key_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit destructor of the shard of the exiting thread. */
+static void zmalloc_shard_release(void *ptr) {
+    zmallocShard *shard = ptr, **link;
+    int tier, j;
+
+    pthread_mutex_lock(&zmalloc_shards_mutex);
+    for (tier = 0; tier < ZMALLOC_TIERS; tier++) {
+        zmalloc_retired.used[tier] += shard->used[tier];
+        for (j = 0; j < ZMALLOC_HIST_BUCKETS; j++)
+            zmalloc_retired.hist[tier][j] += shard->hist[tier][j];
+    }
+    for (link = &zmalloc_shards; *link != shard; link = &(*link)->next);
+    *link = shard->next;
+    pthread_mutex_unlock(&zmalloc_shards_mutex);
+    zmalloc_shard = NULL;
+    free(shard);
+}
+
+static void zmalloc_shard_key_create(void) {
+    pthread_key_create(&zmalloc_shard_key,zmalloc_shard_release);
+}
+
+static zmallocShard *zmalloc_shard_create(void) {
+    zmallocShard *shard = calloc(1,sizeof(*shard));
+
+    assert(shard != NULL);
+    pthread_once(&zmalloc_shard_key_once,zmalloc_shard_key_create);
+    pthread_setspecific(zmalloc_shard_key,shard);
+    pthread_mutex_lock(&zmalloc_shards_mutex);
+    shard->next = zmalloc_shards;
+    zmalloc_shards = shard;
+    pthread_mutex_unlock(&zmalloc_shards_mutex);
+    return zmalloc_shard = shard;
+}
+
+/* Histogram bucket of an allocation: bucket 0 holds sizes up to 8 bytes,
+ * bucket N sizes up to 8<<N, the last bucket everything larger. */
+static inline int zmalloc_hist_bucket(size_t size) {
+    int bucket;
+
+    if (size <= 8) return 0;
+    bucket = (int)(sizeof(size_t)*8) - __builtin_clzl(size-1) - 3;
+    return bucket < ZMALLOC_HIST_BUCKETS ? bucket : ZMALLOC_HIST_BUCKETS-1;
+}
+
+static inline zmallocShard *zmalloc_get_shard(void) {
+    zmallocShard *shard = zmalloc_shard;
+
+    return shard ? shard : zmalloc_shard_create();
+}
+
+static inline void zmalloc_stat_dram_alloc(size_t size) {
+    zmalloc_get_shard()->hist[ZMALLOC_TIER_DRAM][zmalloc_hist_bucket(size)]++;
+}
+
+static inline void zmalloc_stat_dram_free(size_t size) {
+    zmalloc_get_shard()->hist[ZMALLOC_TIER_DRAM][zmalloc_hist_bucket(size)]--;
+}
+
+void zmalloc_stat_tier_alloc(int tier, size_t size) {
+    zmallocShard *shard = zmalloc_get_shard();
+
+    shard->used[tier] += size;
+    shard->hist[tier][zmalloc_hist_bucket(size)]++;
+}
+
+void zmalloc_stat_tier_free(int tier, size_t size) {
+    zmallocShard *shard = zmalloc_get_shard();
+
+    shard->used[tier] -= size;
+    shard->hist[tier][zmalloc_hist_bucket(size)]--;
+}
+
+/* Bytes allocated on 'tier', summed over all the threads. */
+size_t zmalloc_tier_used(int tier) {
+    zmallocShard *shard;
+    size_t used = 0;
+
+    if (tier == ZMALLOC_TIER_DRAM) return zmalloc_used_memory();
+    pthread_mutex_lock(&zmalloc_shards_mutex);
+    for (shard = zmalloc_shards; shard; shard = shard->next)
+        used += shard->used[tier];
+    pthread_mutex_unlock(&zmalloc_shards_mutex);
+    return used;
+}
+
+/* Number of live allocations on 'tier', summed over all the threads. */
+size_t zmalloc_tier_count(int tier) {
+    size_t hist[ZMALLOC_HIST_BUCKETS], count = 0;
+    int j;
+
+    zmalloc_tier_histogram(tier,hist);
+    for (j = 0; j < ZMALLOC_HIST_BUCKETS; j++) count += hist[j];
+    return count;
+}
+
+/* Fill 'hist' (ZMALLOC_HIST_BUCKETS entries) with the number of live
+ * allocations on 'tier' by size, see zmalloc_hist_bucket(). */
+void zmalloc_tier_histogram(int tier, size_t *hist) {
+    zmallocShard *shard;
+    int j;
+
+    memset(hist,0,sizeof(size_t)*ZMALLOC_HIST_BUCKETS);
+    pthread_mutex_lock(&zmalloc_shards_mutex);
+    for (shard = zmalloc_shards; shard; shard = shard->next)
+        for (j = 0; j < ZMALLOC_HIST_BUCKETS; j++)
+            hist[j] += shard->hist[tier][j];
+    pthread_mutex_unlock(&zmalloc_shards_mutex);
+}
+
 #ifdef USE_NVM
 static int use_nvm = 0;
 static int (*is_nvm_addr)(const void* ptr) = NULL;
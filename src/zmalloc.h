@@ -76,6 +76,12 @@
 #include "memkind.h"
 #endif
 
+/* Memory tiers of the per thread allocation statistics. */
+#define ZMALLOC_TIER_DRAM 0
+#define ZMALLOC_TIER_NVM 1
+#define ZMALLOC_TIERS 2
+#define ZMALLOC_HIST_BUCKETS 20 /* Up to 8<<18 (2MB) and larger. */
+
 void *zmalloc(size_t size);
 
 #ifdef USE_NVM
@@ -94,6 +100,11 @@ size_t zmalloc_get_private_dirty(long pid);
 size_t zmalloc_get_smap_bytes_by_field(char *field, long pid);
 size_t zmalloc_get_memory_size(void);
 void zlibc_free(void *ptr);
+void zmalloc_stat_tier_alloc(int tier, size_t size);
+void zmalloc_stat_tier_free(int tier, size_t size);
+size_t zmalloc_tier_used(int tier);
+size_t zmalloc_tier_count(int tier);
+void zmalloc_tier_histogram(int tier, size_t *hist);
 
 #ifdef USE_NVM
 void zmalloc_init_nvm(int (*_is_nvm_addr)(const void *),
@@ -251,6 +251,148 @@ tags {"aof"} {
         }
     }
 
+    ## redis-check-aof understands the binary records of the pointer based AOF
+    create_aof {
+        fconfigure $fp -translation binary
+        append_to_aof "!\x01\x00\x02\x00\x03foo\x00\x03bar"
+        append_to_aof "!\x01\x00\x02\x00\x03foo\x00\x03ba"
+    }
+
+    test "Binary records: Utility should confirm the AOF is not valid" {
+        catch {
+            exec src/redis-check-aof $aof_path
+        } result
+        assert_match "*ok_up_to=14*not valid*" $result
+    }
+
+    test "Binary records: Utility should be able to fix the AOF" {
+        set result [exec src/redis-check-aof --fix $aof_path << "y\n"]
+        assert_match "*Successfully truncated AOF*" $result
+        set result [exec src/redis-check-aof $aof_path]
+        assert_match "*AOF is valid*" $result
+        assert_equal 14 [file size $aof_path]
+    }
+
+    ## The server loads back the binary records it writes
+    create_aof {}
+
+    start_server_aof [list dir $server_path pointer-based-aof yes] {
+        test {[NVM] PBA: binary records survive DEBUG LOADAOF} {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            $client set foo bar
+            $client set at @notaref
+            $client set sharp #notescaped
+            $client expire foo 1000
+            $client setbit bits 7 1
+            $client select 9
+            $client rpush list a @b #c
+            $client hset hash @field @value
+            $client multi
+            $client incr counter
+            $client sadd set x y z
+            $client exec
+            $client select 0
+            $client append foo baz
+            set digest [$client debug digest]
+            $client debug loadaof
+            assert_equal $digest [$client debug digest]
+            assert_equal @notaref [$client get at]
+            assert_equal #notescaped [$client get sharp]
+            assert_equal barbaz [$client get foo]
+            assert {[$client ttl foo] > 900}
+            $client select 9
+            assert_equal {a @b #c} [$client lrange list 0 -1]
+        }
+    }
+
+    ## The NVM pool survives restarts: values referenced by the pointer
+    ## based AOF are resolved in place from the pool of the previous run.
+    set nvm_overrides [list nvm-maxcapacity 1 nvm-dir $server_path nvm-threshold 64]
+    create_aof {}
+
+    start_server_aof [concat [list dir $server_path pointer-based-aof yes] $nvm_overrides] {
+        test {[NVM] PBA: pool is created on first start} {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            assert_match {*NVM pool *: new (commit*} \
+                [exec cat [dict get $srv stdout]]
+            # Once loaded, the root is committed for a restart after a crash.
+            assert_match "*nvm_pool_validity:valid-after-crash\r*" \
+                [$client info persistence]
+            $client set bigval [string repeat x 1000]
+        }
+    }
+
+    start_server_aof [concat [list dir $server_path pointer-based-aof yes] $nvm_overrides] {
+        test {[NVM] PBA: pool is valid after a clean shutdown} {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_match {*NVM pool *: valid (commit*} \
+                [exec cat [dict get $srv stdout]]
+            assert_match "*nvm_pool_validity:valid-after-crash\r*" \
+                [$client info persistence]
+            assert_equal [string repeat x 1000] [$client get bigval]
+        }
+    }
+
+    set pba_threads [concat [list dir $server_path pointer-based-aof yes pointer-based-aof-resolve-threads 3] $nvm_overrides]
+    start_server_aof $pba_threads {
+        set client [redis [dict get $srv host] [dict get $srv port]]
+        wait_for_condition 50 100 {
+            [catch {$client ping} e] == 0
+        } else {
+            fail "Loading DB is taking too much time."
+        }
+        for {set j 0} {$j < 5000} {incr j} {
+            $client set key:$j [string repeat $j 200]
+            $client hset hash:[expr {$j%10}] f$j [string repeat $j 100]
+        }
+    }
+
+    start_server_aof $pba_threads {
+        test {[NVM] PBA: references are resolved by several threads} {
+            set client [redis [dict get $srv host] [dict get $srv port]]
+            wait_for_condition 50 100 {
+                [catch {$client ping} e] == 0
+            } else {
+                fail "Loading DB is taking too much time."
+            }
+            assert_equal 5010 [$client dbsize]
+            for {set j 0} {$j < 5000} {incr j} {
+                assert_equal [string repeat $j 200] [$client get key:$j]
+                assert_equal [string repeat $j 100] [$client hget hash:[expr {$j%10}] f$j]
+            }
+        }
+    }
+
+    foreach root [glob -nocomplain $server_path/*.root] {file delete $root}
+
+    start_server_aof [concat [list dir $server_path pointer-based-aof yes] $nvm_overrides] {
+        test {[NVM] PBA: refuse to resolve references into an untrusted pool} {
+            set pattern "*pool root is 'new'*"
+            set retry 10
+            while {$retry} {
+                set result [exec tail -1 < [dict get $srv stdout]]
+                if {[string match $pattern $result]} {
+                    break
+                }
+                incr retry -1
+                after 1000
+            }
+            if {$retry == 0} {
+                error "assertion:expected error not found on config file"
+            }
+        }
+    }
+
     start_server {overrides {appendonly {yes} appendfilename {appendonly.aof}}} {
         test {Redis should not try to convert DEL into EXPIREAT for EXPIRE -1} {
             r set x 10
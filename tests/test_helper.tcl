@@ -18,6 +18,7 @@ set ::all_tests {
     unit/protocol
     unit/keyspace
     unit/scan
+    unit/oa-keyspace
     unit/type/string
     unit/type/incr
     unit/type/list
@@ -57,6 +58,7 @@ set ::all_tests {
     unit/memefficiency
     unit/hyperloglog
     unit/lazyfree
+    unit/threaded-io
     unit/wait
 }
 # Index to the next test to run in the ::all_tests list.
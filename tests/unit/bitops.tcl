@@ -84,6 +84,17 @@ start_server {tags {"bitops"}} {
         }
     }
 
+    test {BITCOUNT fuzzing on large strings with start/end} {
+        for {set j 0} {$j < 20} {incr j} {
+            set str [string repeat [randstring 1000 1000] 300]
+            r set str $str
+            assert {[r bitcount str] == [count_bits $str]}
+            set start [randomInt 1000]
+            set end [expr {[string length $str]-1-[randomInt 1000]}]
+            assert {[r bitcount str $start $end] == [count_bits [string range $str $start $end]]}
+        }
+    }
+
     test {BITCOUNT with start, end} {
         r set s "foobar"
         assert_equal [r bitcount s 0 -1] [count_bits "foobar"]
@@ -192,6 +203,26 @@ start_server {tags {"bitops"}} {
         }
     }
 
+    foreach op {and or xor not} {
+        test "BITOP $op fuzzing on large strings" {
+            for {set i 0} {$i < 10} {incr i} {
+                r flushall
+                set numvec [expr {$op eq {not} ? 1 : [randomInt 4]+2}]
+                set chunks {}
+                set veckeys {}
+                for {set j 0} {$j < $numvec} {incr j} {
+                    set chunk [randstring 1000 1000]
+                    lappend chunks $chunk
+                    lappend veckeys vector_$j
+                    r set vector_$j [string repeat $chunk 300]
+                }
+                r bitop $op target {*}$veckeys
+                assert_equal [r get target] \
+                    [string repeat [simulate_bit_op $op {*}$chunks] 300]
+            }
+        }
+    }
+
     test {BITOP with integer encoded source objects} {
         r set a 1
         r set b 2
@@ -348,4 +379,23 @@ start_server {tags {"bitops"}} {
             }
         }
     }
+
+    test {BITPOS fuzzing on large strings} {
+        set len 300000
+        for {set j 0} {$j < 20} {incr j} {
+            set pos [randomInt [expr {$len*8}]]
+            set start [randomInt 1000]
+            r set zeros [string repeat "\x00" $len]
+            r set ones [string repeat "\xff" $len]
+            r setbit zeros $pos 1
+            r setbit ones $pos 0
+            if {$pos >= $start*8} {
+                assert_equal $pos [r bitpos zeros 1 $start]
+                assert_equal $pos [r bitpos ones 0 $start]
+            } else {
+                assert_equal -1 [r bitpos zeros 1 $start]
+                assert_equal [expr {$len*8}] [r bitpos ones 0 $start]
+            }
+        }
+    }
 }
@@ -166,6 +166,29 @@ start_server {tags {"hll"}} {
         assert {$err < (double($card)/100)*5}
     }
 
+    test {PFMERGE registers are the MAX of sparse and dense sources} {
+        r del hll hll1 hll2 hll3
+        for {set j 0} {$j < 50} {incr j} {r pfadd hll1 [randomInt 100000]}
+        for {set j 0} {$j < 20000} {incr j} {r pfadd hll2 [randomInt 100000]}
+        for {set j 0} {$j < 1000} {incr j} {r pfadd hll3 [randomInt 100000]}
+        r pfdebug todense hll3
+        assert {[r pfdebug encoding hll1] eq {sparse}}
+        assert {[r pfdebug encoding hll2] eq {dense}}
+        set card [r pfcount hll1 hll2 hll3]
+        r pfmerge hll hll1 hll2 hll3
+        assert_equal $card [r pfcount hll]
+
+        set expected {}
+        foreach r1 [r pfdebug getreg hll1] r2 [r pfdebug getreg hll2] \
+                r3 [r pfdebug getreg hll3] {
+            set m $r1
+            if {$r2 > $m} {set m $r2}
+            if {$r3 > $m} {set m $r3}
+            lappend expected $m
+        }
+        assert_equal $expected [r pfdebug getreg hll]
+    }
+
     test {PFDEBUG GETREG returns the HyperLogLog raw registers} {
         r del hll
         r pfadd hll 1 2 3
@@ -36,6 +36,83 @@ start_server {tags {"memefficiency"}} {
     }
 }
 
+proc zset_memory_usage {encoding} {
+    r flushall
+    r config set zset-max-ziplist-entries 0
+    r config set zset-encoding $encoding
+    set base_mem [s used_memory]
+    set rd [redis_deferring_client]
+    for {set j 0} {$j < 20000} {incr j} {
+        $rd zadd z [expr {$j%1000}] member:$j
+    }
+    for {set j 0} {$j < 20000} {incr j} {
+        $rd read ; # Discard replies
+    }
+    $rd close
+    assert_encoding $encoding z
+    return [expr {[s used_memory]-$base_mem}]
+}
+
+start_server {tags {"memefficiency"}} {
+    test "Memory efficiency of the btree zset encoding" {
+        set skiplist [zset_memory_usage skiplist]
+        set btree [zset_memory_usage btree]
+        assert {$btree < $skiplist}
+    }
+}
+
+# Bytes of used memory per key, for 16 bytes keys holding 20 bytes strings.
+proc small_keys_memory_usage {embed} {
+    r flushall
+    r config set embed-string-keys $embed
+    set base_mem [s used_memory]
+    set rd [redis_deferring_client]
+    for {set j 0} {$j < 20000} {incr j} {
+        $rd set [format "key:%012d" $j] [format "value:%014d" $j]
+    }
+    for {set j 0} {$j < 20000} {incr j} {
+        $rd read ; # Discard replies
+    }
+    $rd close
+    return [expr {double([s used_memory]-$base_mem)/20000}]
+}
+
+start_server {tags {"memefficiency"} overrides {pointer-based-aof no}} {
+    test "Memory efficiency of keys embedded in small string values" {
+        set separate [small_keys_memory_usage no]
+        assert_equal 0 [s keyed_objects]
+        set embedded [small_keys_memory_usage yes]
+        assert_equal 20000 [s keyed_objects]
+        if {$::verbose} {
+            puts -nonewline "\n  Bytes per key: $separate separate, $embedded embedded "
+            flush stdout
+        }
+        assert {$embedded < $separate}
+        assert_equal value:00000000000042 [r get key:000000000042]
+    }
+
+    test "Keys embedded in their value survive overwrites, expires and renames" {
+        r flushall
+        r set foo bar
+        r expire foo 100
+        r setrange foo 0 b
+        assert_equal bar [r get foo]
+        assert {[r ttl foo] > 0}
+        r set foo [string repeat x 100]
+        r expire foo 100
+        r set foo baz
+        r rename foo foo2
+        r set foo2 qux
+        assert_equal qux [r get foo2]
+        assert_equal 1 [s keyed_objects]
+        r debug reload
+        assert_equal qux [r get foo2]
+        assert_equal 1 [s keyed_objects]
+        r flushall
+        assert_equal 0 [s keyed_objects]
+    }
+}
+
 if 0 {
     start_server {tags {"defrag"}} {
         if {[string match {*jemalloc*} [s mem_allocator]]} {
@@ -0,0 +1,95 @@
+# The keyspace uses an open addressing dict when the server is built with
+# USE_OA_KEYSPACE=yes: DEBUG HTSTATS then reports the deleted slots of the
+# table. These tests do nothing against other builds.
+start_server {tags {"oa-keyspace"}} {
+    proc scan_all_keys {} {
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [r scan $cur count 10]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        lsort -unique $keys
+    }
+
+    proc main_table_size {} {
+        regexp {table size: ([0-9]+)} [r debug htstats 9] - size
+        return $size
+    }
+
+    r flushdb
+    r set foo bar
+    set oa [string match {*deleted slots*} [r debug htstats 9]]
+    r flushdb
+
+    if {$oa} {
+        test "OA keyspace: SCAN returns every key while the table grows" {
+            r debug populate 1000
+            set size [main_table_size]
+            set cur 0
+            set keys {}
+            set j 0
+            while 1 {
+                set res [r scan $cur count 10]
+                set cur [lindex $res 0]
+                lappend keys {*}[lindex $res 1]
+                if {$cur == 0} break
+                for {set i 0} {$i < 50} {incr i} {
+                    r set new:$j $j
+                    incr j
+                }
+            }
+            assert {[main_table_size] > $size}
+            set found 0
+            foreach k [lsort -unique $keys] {
+                if {[string match key:* $k]} {incr found}
+            }
+            assert_equal 1000 $found
+            assert_equal [r dbsize] [llength [scan_all_keys]]
+        }
+
+        test "OA keyspace: expired keys are reclaimed" {
+            r flushdb
+            r debug populate 10000
+            for {set j 0} {$j < 10000} {incr j 2} {
+                r pexpire key:$j 100
+            }
+            wait_for_condition 50 100 {
+                [r dbsize] == 5000
+            } else {
+                fail "Keys were not expired"
+            }
+            for {set j 0} {$j < 10000} {incr j} {
+                assert_equal [expr {$j % 2}] [r exists key:$j]
+            }
+            r debug populate 5000 new
+            assert_equal 10000 [r dbsize]
+            assert_equal 10000 [llength [scan_all_keys]]
+            set digest [r debug digest]
+            r debug reload
+            assert_equal $digest [r debug digest]
+        }
+
+        test "OA keyspace: the table shrinks and rehashes once emptied" {
+            r flushdb
+            r debug populate 20000
+            set size [main_table_size]
+            for {set j 100} {$j < 20000} {incr j} {
+                r del key:$j
+            }
+            wait_for_condition 50 100 {
+                [main_table_size] < $size/16 &&
+                ![string match {*rehashing target*} [r debug htstats 9]]
+            } else {
+                fail "The table was not shrunk"
+            }
+            assert_equal 100 [llength [scan_all_keys]]
+            for {set j 0} {$j < 100} {incr j} {
+                assert_equal 1 [r exists key:$j]
+            }
+            assert_match {key:*} [r randomkey]
+        }
+    }
+}
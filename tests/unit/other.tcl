@@ -49,6 +49,69 @@ start_server {tags {"other"}} {
         r get x
     } {10}
 
+    test {INFO reports live DRAM allocations by size} {
+        proc hist_128k {} {
+            regexp {alloc_size_hist_dram:[^\r]*,131072=([0-9]+),} [r info memory] - n
+            return $n
+        }
+        set before [hist_128k]
+        for {set j 0} {$j < 10} {incr j} {
+            r set histkey$j [string repeat x 100000]
+        }
+        set after [hist_128k]
+        assert {$after >= $before+10}
+        for {set j 0} {$j < 10} {incr j} {
+            r del histkey$j
+        }
+        assert {[hist_128k] <= $after-10}
+    }
+
+    # Builds with an open addressing keyspace report probe lengths instead
+    # of chain lengths, and have no buckets to freeze for a threaded save.
+    r set htstats:probe 1
+    set htstats [r debug htstats 9]
+    r del htstats:probe
+    if {[string match {*probe length*} $htstats]} {
+        test {BGSAVE THREADED is refused with an open addressing keyspace} {
+            assert_error {*not supported*} {r bgsave threaded}
+        }
+    } else {
+        test {BGSAVE THREADED saves the dataset as it was when started} {
+            waitForBgsave r
+            r flushdb
+            for {set j 0} {$j < 1000} {incr j} {
+                r set key:$j $j
+                r sadd set:[expr {$j%10}] $j
+            }
+            r expire key:1 1000
+            set digest [r debug digest]
+            r bgsave threaded
+            for {set j 0} {$j < 100} {incr j} {
+                r incr key:$j
+                r del key:[expr {$j+500}]
+                r set newkey:$j $j
+                r srem set:[expr {$j%10}] $j
+            }
+            r persist key:1
+            waitForBgsave r
+            assert_equal 0 [status r rdb_threaded_bgsave_in_progress]
+            assert_equal ok [status r rdb_last_bgsave_status]
+            r debug loadrdb
+            assert_equal $digest [r debug digest]
+            assert {[r ttl key:1] > 0}
+        }
+    }
+
+    test {DEBUG RELOAD reports the number of keys loaded} {
+        r flushall
+        for {set j 0} {$j < 100} {incr j} {
+            r set loadkey$j $j
+        }
+        r debug reload
+        assert_equal 100 [s last_load_keys]
+        assert {[s last_load_keys_per_sec] > 0}
+    }
+
     test {SELECT an out of range DB} {
         catch {r select 1000000} err
         set _ $err
@@ -98,6 +98,32 @@ start_server {tags {"protocol"}} {
         } {*Protocol error*}
     }
     unset c
+
+    test "Pipelined inline and multibulk commands in the same read" {
+        reconnect
+        r write "PING\nPING\r\n*1\r\n\$4\r\nPING\r\n"
+        r flush
+        list [r read] [r read] [r read]
+    } {PONG PONG PONG}
+
+    test "Arguments of varying size in pipelined commands" {
+        reconnect
+        set buf {}
+        set sizes {40 1 44 0 3 45 2}
+        foreach size $sizes {
+            set val [string repeat v $size]
+            append buf "*3\r\n\$3\r\nSET\r\n\$[string length key:$size]\r\nkey:$size\r\n"
+            append buf "\$$size\r\n$val\r\n"
+            append buf "*2\r\n\$3\r\nGET\r\n\$[string length key:$size]\r\nkey:$size\r\n"
+        }
+        r write $buf
+        r flush
+        foreach size $sizes {
+            assert_equal OK [r read]
+            assert_equal [string repeat v $size] [r read]
+        }
+        assert_match {*qbuf=0 *} [r client list]
+    }
 }
 
 start_server {tags {"regression"}} {
@@ -115,3 +141,138 @@ start_server {tags {"regression"}} {
         $rd read
     }
 }
+
+start_server {tags {"protocol"}} {
+    test "Large multi bulk replies are delivered intact with vectored writes" {
+        # Mix elements small enough to be glued into the reply chunks with
+        # elements larger than a chunk, that get a reply list node each.
+        set expected {}
+        for {set j 0} {$j < 2000} {incr j} {
+            if {$j % 100 == 0} {
+                set ele [string repeat $j 20000]
+            } else {
+                set ele $j
+            }
+            r rpush biglist $ele
+            lappend expected $ele
+        }
+        set syscalls [s total_net_output_syscalls]
+        assert_equal $expected [r lrange biglist 0 -1]
+        assert {[s total_net_output_syscalls] > $syscalls}
+        assert {[s net_output_syscalls_per_byte] > 0}
+    }
+
+    test "Large values are replied by reference and survive changes" {
+        set val [string repeat abcdefgh 65536]
+        r set bigval $val
+        set copies [s zero_copy_replies]
+        set bytes [s zero_copy_reply_bytes]
+
+        # Queue more replies than the socket buffers can hold, then modify
+        # and delete the key while they are still pending.
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 200} {incr j} {$rd get bigval}
+        $rd flush
+        wait_for_condition 50 100 {
+            [s zero_copy_replies] == $copies+200
+        } else {
+            fail "Large GET replies were not queued by reference"
+        }
+        r append bigval xxx
+        r setrange bigval 0 yyy
+        r del bigval
+        for {set j 0} {$j < 200} {incr j} {
+            assert_equal $val [$rd read]
+        }
+        $rd close
+        assert_equal [expr {$bytes+200*[string length $val]}] \
+                     [s zero_copy_reply_bytes]
+    }
+
+    test "Values replied by reference survive FLUSHALL ASYNC" {
+        set val [string repeat abcdefgh 65536]
+        for {set j 0} {$j < 10} {incr j} {r set bigval:$j $val$j}
+        set copies [s zero_copy_replies]
+
+        set rd [redis_deferring_client]
+        for {set j 0} {$j < 200} {incr j} {$rd get bigval:[expr {$j%10}]}
+        $rd flush
+        wait_for_condition 50 100 {
+            [s zero_copy_replies] == $copies+200
+        } else {
+            fail "Large GET replies were not queued by reference"
+        }
+        r flushall async
+        for {set j 0} {$j < 200} {incr j} {
+            assert_equal $val[expr {$j%10}] [$rd read]
+        }
+        $rd close
+        wait_for_condition 50 100 {
+            [s lazyfree_pending_objects] == 0
+        } else {
+            fail "FLUSHALL ASYNC did not complete"
+        }
+        assert_equal 0 [r dbsize]
+    }
+
+    test "Replies mixing references and small bulks are delivered intact" {
+        set big1 [string repeat x 100000]
+        set big2 [string repeat y 20000]
+        r mset k1 $big1 k2 small k3 $big2 k4 {}
+        assert_equal [list $big1 small $big2 {} {} $big1] \
+                     [r mget k1 k2 k3 k4 nokey k1]
+    }
+
+    test "Replies with deferred length are delivered intact" {
+        r flushall
+        r debug populate 20000
+        llength [r keys *]
+    } {20000}
+
+    test "Sent reply chunks are reused by the following replies" {
+        r del mylist
+        for {set j 0} {$j < 100} {incr j} {r rpush mylist element:$j}
+        set expected [r lrange mylist 0 -1]
+        r config resetstat
+
+        # The first round fills the pool, the next ones must not allocate.
+        set rd [redis_deferring_client]
+        for {set round 0} {$round < 6} {incr round} {
+            if {$round == 1} {set allocated [s reply_chunks_allocated]}
+            $rd write [string repeat "LRANGE mylist 0 -1\r\n" 500]
+            $rd flush
+            for {set j 0} {$j < 500} {incr j} {
+                assert_equal $expected [$rd read]
+            }
+        }
+        $rd close
+        assert_equal $allocated [s reply_chunks_allocated]
+        assert {[s reply_chunks_reused] > 0}
+        assert_equal 0 [expr {[s reply_chunk_pool_bytes] % 16384}]
+    }
+
+    test "Reply chunk pool is capped once clients are gone" {
+        # Many more chunks than the pool can keep are pending when the
+        # clients go away.
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            set rd [redis_deferring_client]
+            $rd write [string repeat "LRANGE mylist 0 -1\r\n" 2000]
+            $rd flush
+            lappend clients $rd
+        }
+        wait_for_condition 50 100 {
+            [s reply_chunks_allocated] > 256
+        } else {
+            fail "Replies not buffered"
+        }
+        foreach rd $clients {$rd close}
+        wait_for_condition 50 100 {
+            [s connected_clients] == 1
+        } else {
+            fail "Clients not freed"
+        }
+        set pool [s reply_chunk_pool_bytes]
+        assert {$pool > 0 && $pool <= 256*16384}
+    }
+}
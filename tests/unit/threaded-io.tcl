@@ -0,0 +1,119 @@
+start_server {tags {"threaded-io"} overrides {io-threads 4}} {
+    # The I/O threads only kick in when enough clients have pending writes
+    # in the same event loop iteration: run a few rounds of pipelines from
+    # many clients at once until they do.
+    proc run_pipelines {numclients numcmds} {
+        set clients {}
+        for {set j 0} {$j < $numclients} {incr j} {
+            lappend clients [redis_deferring_client]
+        }
+        # Queue the whole pipeline of every client before flushing them
+        # all, so that the server sees the clients ready at the same time.
+        set j 0
+        foreach rd $clients {
+            set buf {}
+            for {set i 0} {$i < $numcmds} {incr i} {
+                append buf "SET key:$j:$i val:$j:$i\r\nGET key:$j:$i\r\n"
+            }
+            $rd write $buf
+            incr j
+        }
+        foreach rd $clients {$rd flush}
+        set j 0
+        foreach rd $clients {
+            for {set i 0} {$i < $numcmds} {incr i} {
+                assert_equal OK [$rd read]
+                assert_equal val:$j:$i [$rd read]
+            }
+            $rd close
+            incr j
+        }
+    }
+
+    test {CONFIG GET io-threads} {
+        lindex [r config get io-threads] 1
+    } {4}
+
+    test {Pipelined commands from many clients are served by the I/O threads} {
+        r flushall
+        for {set round 0} {$round < 20} {incr round} {
+            run_pipelines 16 500
+            if {[s io_threaded_writes_processed] > 0 &&
+                [s io_threaded_reads_processed] > 0} break
+        }
+        assert {[s io_threaded_writes_processed] > 0}
+        assert {[s io_threaded_reads_processed] > 0}
+        r dbsize
+    } {8000}
+
+    test {Large replies are fully delivered with threaded writes} {
+        r set bigkey [string repeat x 1000000]
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 5} {incr i} {$rd get bigkey}
+            lappend clients $rd
+        }
+        foreach rd $clients {
+            for {set i 0} {$i < 5} {incr i} {
+                assert_equal 1000000 [string length [$rd read]]
+            }
+            $rd close
+        }
+    }
+
+    test {Protocol errors and QUIT with threaded I/O} {
+        set clients {}
+        for {set j 0} {$j < 16} {incr j} {
+            set rd [redis_deferring_client]
+            for {set i 0} {$i < 100} {incr i} {$rd ping}
+            lappend clients $rd
+        }
+        set bad [redis_deferring_client]
+        $bad write "*1\r\n\$bad\r\n"
+        $bad flush
+        set quit [redis_deferring_client]
+        $quit quit
+        foreach rd $clients {
+            for {set i 0} {$i < 100} {incr i} {
+                assert_equal PONG [$rd read]
+            }
+            $rd close
+        }
+        catch {$bad read} e
+        assert_match {*Protocol error*} $e
+        assert_equal OK [$quit read]
+        $bad close
+        $quit close
+        r ping
+    } {PONG}
+
+    test {INFO reports per I/O thread counters} {
+        set info [r info stats]
+        set reads 0
+        set writes 0
+        set written 0
+        for {set j 0} {$j < 4} {incr j} {
+            assert {[regexp "io_thread_$j:reads_processed=(\\d+),writes_processed=(\\d+),bytes_read=(\\d+),bytes_written=(\\d+)" $info - r_proc w_proc r_bytes w_bytes]}
+            incr reads $r_proc
+            incr writes $w_proc
+            incr written $w_bytes
+        }
+        assert_equal $reads [s io_threaded_reads_processed]
+        assert_equal $writes [s io_threaded_writes_processed]
+        assert {$written > 0 && $written <= [s total_net_output_bytes]}
+    }
+
+    test {CONFIG RESETSTAT clears the I/O threads counters} {
+        r config resetstat
+        list [s io_threaded_reads_processed] [s io_threaded_writes_processed]
+    } {0 0}
+}
+
+start_server {tags {"threaded-io"} overrides {io-threads 1}} {
+    test {No per thread counters with single threaded I/O} {
+        run_pipelines 16 100
+        set info [r info stats]
+        list [s io_threaded_writes_processed] [regexp {io_thread_0:} $info]
+    } {0 0}
+}
@@ -558,6 +558,47 @@ start_server {
         r hget hash kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
     } {b}
 
+    test {HGET, HEXISTS and HMGET against a big ziplist hash} {
+        r config set hash-max-ziplist-entries 512
+        r config resetstat
+        r del myhash
+        catch {unset hash}
+        array set hash {}
+        for {set j 0} {$j < 200} {incr j} {
+            if {$j % 2} {set field [randomInt 100000]} else {set field f$j}
+            set hash($field) [randomInt 1000]
+            r hset myhash $field $hash($field)
+        }
+        assert_encoding ziplist myhash
+
+        foreach round {0 1 2} {
+            # Read twice: the second scan goes through the lookup index.
+            foreach pass {0 1} {
+                foreach field [array names hash] {
+                    assert_equal $hash($field) [r hget myhash $field]
+                    assert_equal 1 [r hexists myhash $field]
+                }
+                assert_equal {} [r hget myhash nosuchfield]
+                assert_equal 0 [r hexists myhash 123456789]
+                set fields [lrange [array names hash] 0 9]
+                set values {}
+                foreach field $fields {lappend values $hash($field)}
+                assert_equal $values [r hmget myhash {*}$fields]
+            }
+            # Writes must not leave a stale index behind.
+            set field [lindex [array names hash] 0]
+            r hdel myhash $field
+            unset hash($field)
+            assert_equal {} [r hget myhash $field]
+            r hset myhash new$round $round
+            set hash(new$round) $round
+            r hincrby myhash new$round 10
+            incr hash(new$round) 10
+        }
+        assert_encoding ziplist myhash
+        assert {[s ziplist_index_hits] > 0}
+    }
+
     foreach size {10 512} {
         test "Hash fuzzing #1 - $size fields" {
             for {set times 0} {$times < 10} {incr times} {
@@ -27,8 +27,118 @@ start_server {
         r flushdb
     }
 
+    test {[NVM] Compressed nodes referencing NVM values survive reload} {
+        r flushdb
+        r config set list-compress-depth 1
+        set vals {}
+        for {set j 0} {$j < 40} {incr j} {
+            set v [string repeat "nvm-$j-" [expr {$j == 20 ? 10000 : 50}]]
+            lappend vals $v
+            r rpush nvmlist $v
+        }
+        assert_equal $vals [r lrange nvmlist 0 -1]
+        assert_equal [lindex $vals 20] [r lindex nvmlist 20]
+        assert_equal 1 [r lrem nvmlist 0 [lindex $vals 10]]
+        set vals [lreplace $vals 10 10]
+        r debug reload
+        assert_equal $vals [r lrange nvmlist 0 -1]
+        r config set list-compress-depth 0
+        r flushdb
+    }
+
+    test {[NVM] NVM values of ziplists are streamed to the RDB} {
+        r flushdb
+        set before [s rdb_nvm_bytes_streamed]
+        set v [string repeat x 200]
+        r rpush nvmlist a $v b
+        r debug reload
+        assert_equal [list a $v b] [r lrange nvmlist 0 -1]
+        set after [s rdb_nvm_bytes_streamed]
+        assert {$after - $before >= 200}
+        r flushdb
+    }
 
 
+
+    foreach codec {lzf lz4} {
+        test "Compressed list nodes are read and modified correctly - $codec" {
+            r flushdb
+            r config set list-compress-depth 1
+            r config set list-compress-codec $codec
+            set vals {}
+            for {set j 0} {$j < 200} {incr j} {
+                set v "element-$j-[string repeat x 20]"
+                lappend vals $v
+                r rpush mylist $v
+            }
+            assert_equal $vals [r lrange mylist 0 -1]
+            for {set j 0} {$j < 50} {incr j} {
+                set idx [randomInt 200]
+                assert_equal [lindex $vals $idx] [r lindex mylist $idx]
+            }
+            r lset mylist 100 foo
+            lset vals 100 foo
+            r linsert mylist before [lindex $vals 50] bar
+            set vals [linsert $vals 50 bar]
+            assert_equal 1 [r lrem mylist 0 [lindex $vals 150]]
+            set vals [lreplace $vals 150 150]
+            assert_equal $vals [r lrange mylist 0 -1]
+            r debug reload
+            assert_equal $vals [r lrange mylist 0 -1]
+            r config set list-compress-codec lzf
+            r config set list-compress-depth 0
+        }
+    }
+
+    test {Lists compressed with different codecs survive reload} {
+        r flushdb
+        r config set list-compress-depth 1
+        set vals {}
+        foreach codec {lz4 lzf lz4} {
+            r config set list-compress-codec $codec
+            for {set j 0} {$j < 50} {incr j} {
+                set v "$codec-$j-[string repeat y 20]"
+                lappend vals $v
+                r rpush mylist $v
+            }
+        }
+        r config set list-compress-codec lzf
+        assert_equal $vals [r lrange mylist 0 -1]
+        r debug reload
+        assert_equal $vals [r lrange mylist 0 -1]
+        r config set list-compress-depth 0
+    }
+
+    test {Repeated reads of compressed nodes are served by the node cache} {
+        r flushdb
+        r config resetstat
+        r config set list-compress-depth 1
+        r config set list-compress-codec lz4
+        for {set j 0} {$j < 100} {incr j} {
+            r rpush mylist "element-$j-[string repeat z 20]"
+        }
+        set range [r lrange mylist 40 60]
+        set misses [s list_compress_cache_misses]
+        assert {$misses > 0}
+        for {set j 0} {$j < 19} {incr j} {
+            assert_equal $range [r lrange mylist 40 60]
+        }
+        assert_equal $misses [s list_compress_cache_misses]
+        assert {[s list_compress_cache_hits] >= 19}
+        assert {[s list_compress_cache_bytes] > 0}
+        # Modified nodes are compressed again, and read back correctly.
+        r lset mylist 50 foo
+        assert_equal foo [r lindex mylist 50]
+        r config set list-compress-cache-size 0
+        assert_equal 0 [s list_compress_cache_bytes]
+        assert_equal foo [r lindex mylist 50]
+        r config set list-compress-cache-size 1mb
+        r del mylist
+        assert_equal 0 [s list_compress_cache_bytes]
+        r config set list-compress-codec lzf
+        r config set list-compress-depth 0
+    }
+
     test {LPUSH, RPUSH, LLENGTH, LINDEX, LPOP - ziplist} {
         # first lpush then rpush
         set buf [string repeat "aa" 100]
@@ -100,6 +210,11 @@ start_server {
         set i [r info persistence]
         regexp {rdb_last_nvm_cow_size:(.*?)\r\n} $i - cowsize
         assert { $cowsize>1 }
+        wait_for_condition 50 100 {
+            [status r rdb_nvm_cow_pending_frees] == 0
+        } else {
+            fail "Deferred NVM frees not released after BGSAVE"
+        }
         #regexp {rdb_last_bgsave_time_sec:(.*?)\r\n} $i - time
         #assert { $time>0 }
 
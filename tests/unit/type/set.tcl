@@ -400,6 +400,52 @@ start_server {
         lsort [r sinter set1 set2]
     } {1 2 3}
 
+    test "SINTER and SINTERSTORE fuzzing with intsets of every encoding" {
+        for {set j 0} {$j < 50} {incr j} {
+            # Values fitting 16, 32 and 64 bits integers.
+            set pool {}
+            for {set i 0} {$i < 400} {incr i} {lappend pool $i}
+            for {set i 0} {$i < 100} {incr i} {
+                lappend pool [expr {[randomInt 2000000]-1000000}]
+            }
+            for {set i 0} {$i < 100} {incr i} {
+                lappend pool [expr {[randomInt 20000000000]-10000000000}]
+            }
+            set intsets {}
+            set hashsets {}
+            set num_sets [expr {[randomInt 4]+2}]
+            for {set i 0} {$i < $num_sets} {incr i} {
+                set range [lindex {400 500 600} [randomInt 3]]
+                r del iset_$i hset_$i
+                for {set k [randomInt 300]} {$k >= 0} {incr k -1} {
+                    set ele [lindex $pool [randomInt $range]]
+                    r sadd iset_$i $ele
+                    r sadd hset_$i $ele
+                }
+                r sadd hset_$i foo
+                r srem hset_$i foo
+                assert_encoding intset iset_$i
+                assert_encoding hashtable hset_$i
+                lappend intsets iset_$i
+                lappend hashsets hset_$i
+            }
+            set expected [lsort -integer [r sinter {*}$hashsets]]
+            assert_equal $expected [r sinter {*}$intsets]
+
+            # The stored intset is the same one SADD would create.
+            r del setres setref
+            assert_equal [llength $expected] [r sinterstore setres {*}$intsets]
+            if {[llength $expected]} {
+                r sadd setref {*}$expected
+                assert_encoding intset setres
+                assert_equal $expected [r smembers setres]
+                regexp {serializedlength:([0-9]+)} [r debug object setres] - l1
+                regexp {serializedlength:([0-9]+)} [r debug object setref] - l2
+                assert_equal $l2 $l1
+            }
+        }
+    }
+
     test "SINTERSTORE against non existing keys should delete dstkey" {
         r set setres xxx
         assert_equal 0 [r sinterstore setres foo111 bar222]
@@ -771,5 +771,109 @@ start_server {
          assert {$cowsize>0}
         }
 
+        test {[NVM] Placement policies are settable per class} {
+            r config set nvm-placement "hash-value 128 nvm zset-member default dram"
+            set policy [lindex [r config get nvm-placement] 1]
+            assert_match {*hash-value 128 nvm*} $policy
+            assert_match {*zset-member default dram*} $policy
+            assert_match {*key default auto*} $policy
+            catch {r config set nvm-placement "no-such-class 0 auto"} e
+            assert_match {*Invalid argument*} $e
+            catch {r config set nvm-placement "key 0 flash"} e
+            assert_match {*Invalid argument*} $e
+        }
+
+        test {[NVM] Placement policies decide the tier of each class} {
+            r flushdb
+            r config resetstat
+            r hset h field [string repeat v 200]
+            r zadd z 1 [string repeat m 200]
+            assert_match {*nvm_hash_value_placed_total:dram=0,nvm=*} [r info memory]
+            assert_match {*nvm_zset_member_placed_total:dram=*,nvm=0*} [r info memory]
+            assert_equal [string repeat v 200] [r hget h field]
+            assert_equal 1 [r zscore z [string repeat m 200]]
+            r config set nvm-placement "hash-value default auto zset-member default auto"
+        }
+
+        test {[NVM] Tiering promotes frequently accessed values to DRAM} {
+            r flushdb
+            r config set maxmemory-policy allkeys-lfu
+            r config set lfu-log-factor 0
+            r config set nvm-tiering yes
+            set val [string repeat x 1000]
+            r set hot $val
+            for {set j 0} {$j < 100} {incr j} {r get hot}
+            wait_for_condition 50 100 {
+                [s nvm_tiering_promotions] > 0
+            } else {
+                fail "Hot value was never promoted to DRAM"
+            }
+            assert_equal $val [r get hot]
+        }
+
+        test {[NVM] Tiering demotes rarely accessed values to NVM} {
+            r flushdb
+            r config set nvm-tiering-promote-freq 255
+            r config set nvm-tiering-demote-freq 254
+            set val [string repeat c 100]
+            # Write in DRAM, then let the tiering engine place the value.
+            r config set nvm-placement "string default dram"
+            r set cold $val
+            assert_match {* nvm:0*} [r debug object cold]
+            r config set nvm-placement "string default auto"
+            wait_for_condition 50 100 {
+                [string match {* nvm:1*} [r debug object cold]]
+            } else {
+                fail "Cold value was never demoted to NVM"
+            }
+            assert_equal $val [r get cold]
+        }
+
+        test {[NVM] Tiering demotes embedded strings to raw strings on NVM} {
+            r flushdb
+            r config set nvm-placement "string default dram"
+            r set cold abcdefghijklmnopqrstuvwxyz
+            r expire cold 1000
+            assert_equal embstr [r object encoding cold]
+            r config set nvm-placement "string default auto"
+            wait_for_condition 50 100 {
+                [r object encoding cold] eq {raw}
+            } else {
+                fail "Embedded value was never demoted to NVM"
+            }
+            assert_match {* nvm:1*} [r debug object cold]
+            assert_equal abcdefghijklmnopqrstuvwxyz [r get cold]
+            assert {[r ttl cold] > 900}
+        }
+
+        test {[NVM] Tiering moves values larger than the bandwidth budget} {
+            r flushdb
+            r config set nvm-tiering-max-bandwidth 1000
+            set val [string repeat b 50000]
+            r config set nvm-placement "string default dram"
+            r set big $val
+            assert_match {* nvm:0*} [r debug object big]
+            r config set nvm-placement "string default auto"
+            wait_for_condition 50 100 {
+                [string match {* nvm:1*} [r debug object big]]
+            } else {
+                fail "Value larger than the budget was never demoted to NVM"
+            }
+            assert_equal $val [r get big]
+            r config set nvm-tiering-max-bandwidth 64mb
+            r config set nvm-tiering no
+            r config set nvm-tiering-demote-freq 2
+            r config set nvm-tiering-promote-freq 20
+            r config set lfu-log-factor 10
+            r config set maxmemory-policy noeviction
+        }
+
+        test {[NVM] Tiering demote frequency must be below the promote one} {
+            assert_error {*must be below*} {r config set nvm-tiering-demote-freq 20}
+            assert_error {*must be above*} {r config set nvm-tiering-promote-freq 2}
+            r config set nvm-tiering-demote-freq 19
+            r config set nvm-tiering-demote-freq 2
+        }
+
 
 }
@@ -19,9 +19,10 @@ start_server {
         if {$encoding == "ziplist"} {
             r config set zset-max-ziplist-entries 128
             r config set zset-max-ziplist-value 64
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "skiplist" || $encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-encoding $encoding
         } else {
             puts "Unknown sorted set encoding"
             exit
@@ -767,6 +768,7 @@ start_server {
 
     basics ziplist
     basics skiplist
+    basics btree
 
     test {ZINTERSTORE regression with two sets, intset+hashtable} {
         r del seta setb setc
@@ -811,15 +813,39 @@ start_server {
         }
     }
 
+    test {ZSET conversion between skiplist and btree on DEBUG RELOAD} {
+        r del zenc
+        r config set zset-max-ziplist-entries 0
+        r config set zset-encoding btree
+        for {set j 0} {$j < 1000} {incr j} {
+            r zadd zenc [randomInt 100] element:[randomInt 5000]
+        }
+        assert_encoding btree zenc
+        set digest [r debug digest]
+        set items [r zrange zenc 0 -1 withscores]
+        r config set zset-encoding skiplist
+        r debug reload
+        assert_encoding skiplist zenc
+        assert_equal $digest [r debug digest]
+        r config set zset-encoding btree
+        r debug reload
+        assert_encoding btree zenc
+        assert_equal $digest [r debug digest]
+        assert_equal $items [r zrange zenc 0 -1 withscores]
+        r config set zset-max-ziplist-entries 128
+        r config set zset-encoding skiplist
+    } {OK}
+
     proc stressers {encoding} {
         if {$encoding == "ziplist"} {
             # Little extra to allow proper fuzzing in the sorting stresser
             r config set zset-max-ziplist-entries 256
             r config set zset-max-ziplist-value 64
             set elements 128
-        } elseif {$encoding == "skiplist"} {
+        } elseif {$encoding == "skiplist" || $encoding == "btree"} {
             r config set zset-max-ziplist-entries 0
             r config set zset-max-ziplist-value 0
+            r config set zset-encoding $encoding
             if {$::accurate} {set elements 1000} else {set elements 100}
         } else {
             puts "Unknown sorted set encoding"
@@ -857,6 +883,44 @@ start_server {
             }
         }
 
+        test "ZSCORE and ZINTERSTORE with interleaved writes - $encoding" {
+            r del zscoretest zscoreother
+            unset -nocomplain scores
+            array set scores {}
+            for {set i 0} {$i < $elements} {incr i} {
+                set scores($i) [expr rand()]
+                r zadd zscoretest $scores($i) $i
+            }
+            r zadd zscoreother 0 0 0 missing
+
+            foreach round {0 1 2 3} {
+                # Read twice: the second scan of a big enough ziplist goes
+                # through its lookup index.
+                foreach pass {0 1} {
+                    for {set i 0} {$i < $elements} {incr i} {
+                        if {[info exists scores($i)]} {
+                            assert_equal $scores($i) [r zscore zscoretest $i]
+                        } else {
+                            assert_equal {} [r zscore zscoretest $i]
+                        }
+                    }
+                    assert_equal {} [r zscore zscoretest member:$round]
+                }
+                r zinterstore zscoredst 2 zscoretest zscoreother
+                if {[info exists scores(0)]} {
+                    assert_equal [list 0 $scores(0)] [r zrange zscoredst 0 -1 withscores]
+                } else {
+                    assert_equal {} [r zrange zscoredst 0 -1 withscores]
+                }
+                # Writes must not leave a stale index behind.
+                r zrem zscoretest $round
+                unset scores($round)
+                r zadd zscoretest 1.5 member:$round
+                assert_equal 1.5 [r zscore zscoretest member:$round]
+            }
+            assert_encoding $encoding zscoretest
+        }
+
         test "ZSET sorting stresser - $encoding" {
             set delta 0
             for {set test 0} {$test < 2} {incr test} {
@@ -1141,5 +1205,6 @@ start_server {
     tags {"slow"} {
         stressers ziplist
         stressers skiplist
+        stressers btree
     }
 }